@@ -0,0 +1,449 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aggregate.h"
+#include "index.h"
+
+struct worker {
+    const char *dir;
+    uint64_t rom;          // 0 for all sensors
+    int64_t from[2];       // the ends of the range the rollups do not cover
+    int64_t to[2];
+    int ranges;
+    uint32_t segments;
+    uint32_t *next;        // shared by the workers, the next segment to take
+    struct pudomat_aggregate partial;
+    int rc;
+};
+
+// the row of a sensor, inserted in rom order on its first sample
+static struct pudomat_rollup *find_row(struct pudomat_aggregate *aggregate,
+                                       uint64_t rom)
+{
+    int lo = 0, hi = aggregate->count;
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(aggregate->rows[mid].rom < rom)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo < aggregate->count && aggregate->rows[lo].rom == rom)
+        return &aggregate->rows[lo];
+
+    if(aggregate->count == aggregate->capacity)
+    {
+        int capacity = aggregate->capacity ? aggregate->capacity * 2 : 16;
+        struct pudomat_rollup *rows = realloc(aggregate->rows, capacity * sizeof(*rows));
+        if(!rows)
+            return NULL;
+        aggregate->rows = rows;
+        aggregate->capacity = capacity;
+    }
+    memmove(&aggregate->rows[lo + 1], &aggregate->rows[lo],
+            (aggregate->count - lo) * sizeof(*aggregate->rows));
+    memset(&aggregate->rows[lo], 0, sizeof(*aggregate->rows));
+    aggregate->rows[lo].rom = rom;
+    aggregate->count++;
+    return &aggregate->rows[lo];
+}
+
+static void add_record(struct pudomat_rollup *row, const struct pudomat_record *r)
+{
+    int16_t temp = r->temperature;
+
+    if(!row->count)
+    {
+        row->start = r->time;
+        row->temp_min = row->temp_max = temp;
+        row->volt_min = row->volt_max = r->voltage;
+        row->current_min = row->current_max = r->current;
+    }
+    if(r->time < row->start)
+        row->start = r->time;
+    row->count++;
+    row->relay_on += r->relay != 0;
+    row->temp_sum += temp;
+    row->volt_sum += r->voltage;
+    row->current_sum += r->current;
+    if(temp < row->temp_min)
+        row->temp_min = temp;
+    if(temp > row->temp_max)
+        row->temp_max = temp;
+    if(r->voltage < row->volt_min)
+        row->volt_min = r->voltage;
+    if(r->voltage > row->volt_max)
+        row->volt_max = r->voltage;
+    if(r->current < row->current_min)
+        row->current_min = r->current;
+    if(r->current > row->current_max)
+        row->current_max = r->current;
+}
+
+static int add_records(struct worker *w, const struct pudomat_record *records,
+                       uint64_t count, int64_t from, int64_t to, int check_time)
+{
+    struct pudomat_rollup *row = NULL;
+
+    w->partial.records_read += count;
+    for(uint64_t i = 0; i < count; i++)
+    {
+        const struct pudomat_record *r = &records[i];
+        if(check_time && (r->time < from || r->time > to))
+            continue;
+        if(w->rom && r->rom != w->rom)
+            continue;
+        // samples of a board come in runs, so the last row usually fits
+        if(!row || row->rom != r->rom)
+        {
+            row = find_row(&w->partial, r->rom);
+            if(!row)
+                return 1;
+        }
+        add_record(row, r);
+    }
+    return 0;
+}
+
+static int aggregate_block(struct worker *w, const struct pudomat_segment *segment,
+                           const struct pudomat_index *index, uint32_t b,
+                           int64_t from, int64_t to)
+{
+    const struct pudomat_index_block *block = &index->blocks[b];
+    if(block->last_time < from || block->first_time > to)
+        return 0;
+
+    uint64_t start = (uint64_t)b * PUDOMAT_INDEX_BLOCK;
+    uint64_t end = start + PUDOMAT_INDEX_BLOCK < index->header->records
+                       ? start + PUDOMAT_INDEX_BLOCK : index->header->records;
+    return add_records(w, &segment->records[start], end - start, from, to,
+                       block->first_time < from || block->last_time > to);
+}
+
+static int aggregate_range(struct worker *w, const struct pudomat_segment *segment,
+                           const struct pudomat_index *index, int64_t from,
+                           int64_t to)
+{
+    const struct pudomat_index_header *h = index->header;
+    int rc = 0;
+
+    if(w->rom)
+    {
+        const struct pudomat_index_rom *r = pudomat_index_find(index, w->rom);
+        for(uint32_t p = 0; r && p < r->block_count && rc == 0; p++)
+            rc = aggregate_block(w, segment, index, index->postings[r->posting + p],
+                                 from, to);
+    }
+    else if(h->first_time >= from && h->last_time <= to)
+        rc = add_records(w, segment->records, h->records, from, to, 0);
+    else
+        for(uint32_t b = 0; b < h->block_count && rc == 0; b++)
+            rc = aggregate_block(w, segment, index, b, from, to);
+    return rc;
+}
+
+// a segment with both ends of the range in it is mapped once
+static int aggregate_segment(struct worker *w, uint32_t number)
+{
+    struct pudomat_segment segment;
+    struct pudomat_index index;
+    int inside[2], read = 0, rc = 0;
+
+    for(int r = 0; r < w->ranges; r++)
+        inside[r] = !pudomat_index_outside(w->dir, number, w->from[r], w->to[r]);
+    if(!inside[0] && (w->ranges < 2 || !inside[1]))
+        return 0;
+    if(pudomat_segment_map(&segment, w->dir, number) != 0)
+        return 1;
+    if(pudomat_index_load(&index, w->dir, &segment) != 0)
+    {
+        pudomat_segment_unmap(&segment);
+        return 1;
+    }
+
+    const struct pudomat_index_header *h = index.header;
+    for(int r = 0; r < w->ranges && rc == 0; r++)
+    {
+        if(!inside[r] || !h->records || h->first_time > w->to[r] ||
+           h->last_time < w->from[r])
+            continue;
+        read = 1;
+        rc = aggregate_range(w, &segment, &index, w->from[r], w->to[r]);
+    }
+    w->partial.segments_read += read;
+
+    pudomat_index_free(&index);
+    pudomat_segment_unmap(&segment);
+    return rc;
+}
+
+// takes segments until none are left, so that uneven ones balance out
+static void *work(void *arg)
+{
+    struct worker *w = arg;
+    uint32_t number;
+
+    while((number = __atomic_fetch_add(w->next, 1, __ATOMIC_RELAXED)) < w->segments)
+        if(aggregate_segment(w, number) != 0)
+            w->rc = 1;
+    return NULL;
+}
+
+// merges the totals of a sensor, keeping its oldest start
+static int merge_rows(struct pudomat_aggregate *aggregate,
+                      const struct pudomat_rollup *from)
+{
+    struct pudomat_rollup *row = find_row(aggregate, from->rom);
+    if(!row)
+        return 1;
+
+    int64_t start = row->count && row->start < from->start ? row->start : from->start;
+    pudomat_rollup_merge(row, from);
+    row->start = start;
+    return 0;
+}
+
+static int add_rollup(const struct pudomat_rollup *row, void *arg)
+{
+    struct pudomat_aggregate *aggregate = arg;
+
+    aggregate->periods_read++;
+    return merge_rows(aggregate, row);
+}
+
+// Aggregates the raw samples of one or two ranges in a single pass over the
+// segments. Every thread keeps partial aggregates of the segments it took,
+// they are merged into aggregate at the end.
+static int aggregate_raw(const char *dir, uint64_t rom, const int64_t *from,
+                         const int64_t *to, int ranges, int threads,
+                         struct pudomat_aggregate *aggregate)
+{
+    uint32_t segments, next = 0;
+    int rc = 0;
+
+    if(!ranges)
+        return 0;
+    pudomat_store_segments(dir, &segments);
+    if(threads < 1)
+        threads = 1;
+    if(threads > segments)
+        threads = segments ? segments : 1;
+
+    pthread_t ids[threads];
+    int started[threads];
+    struct worker *workers = calloc(threads, sizeof(*workers));
+    if(!workers)
+        return 1;
+
+    for(int i = 0; i < threads; i++)
+    {
+        workers[i] = (struct worker){
+            .dir = dir, .rom = rom, .from = { from[0], from[1] },
+            .to = { to[0], to[1] }, .ranges = ranges,
+            .segments = segments, .next = &next
+        };
+        started[i] = i > 0 && pthread_create(&ids[i], NULL, work, &workers[i]) == 0;
+    }
+    // the calling thread works too, and alone if no thread could start
+    work(&workers[0]);
+    for(int i = 1; i < threads; i++)
+        if(started[i])
+            pthread_join(ids[i], NULL);
+
+    for(int i = 0; i < threads; i++)
+    {
+        struct pudomat_aggregate *partial = &workers[i].partial;
+        if(workers[i].rc != 0)
+            rc = 1;
+        aggregate->segments_read += partial->segments_read;
+        aggregate->records_read += partial->records_read;
+        for(int j = 0; j < partial->count; j++)
+            if(merge_rows(aggregate, &partial->rows[j]) != 0)
+                rc = 1;
+        pudomat_aggregate_free(partial);
+    }
+
+    free(workers);
+    return rc;
+}
+
+// Aggregates the samples with from <= time <= to per sensor: whole minutes,
+// hours and days from the rollups, only the partial minutes at the ends from
+// raw samples. Without the rollups, or with rollups missing some of the
+// history, everything is read raw.
+int pudomat_store_aggregate(const char *dir, uint64_t rom, int64_t from,
+                            int64_t to, int threads,
+                            struct pudomat_aggregate *aggregate)
+{
+    struct pudomat_rollups rollups;
+    // far enough from the limits for the period arithmetic
+    int64_t a = from > -(INT64_MAX / 4) ? from : -(INT64_MAX / 4);
+    int64_t b = to < INT64_MAX / 4 ? to + 1 : INT64_MAX / 4;
+    int rc = 0;
+
+    memset(aggregate, 0, sizeof(*aggregate));
+    if(pudomat_rollups_open(&rollups, dir, 0) != 0)
+        a = b;
+    else
+    {
+        if(pudomat_rollups_complete(&rollups, dir))
+            rc = pudomat_rollup_query(&rollups, rom, &a, &b, add_rollup, aggregate);
+        else
+            a = b;
+        pudomat_rollups_close(&rollups);
+    }
+
+    // the raw ends, or the whole range when no rollup period fits
+    int64_t ends_from[2] = { from, 0 }, ends_to[2] = { to, 0 };
+    int ends = 1;
+    if(a != b)
+    {
+        ends = 0;
+        if(from < a)
+        {
+            ends_from[ends] = from;
+            ends_to[ends++] = a - 1;
+        }
+        if(b <= to)
+        {
+            ends_from[ends] = b;
+            ends_to[ends++] = to;
+        }
+    }
+    if(rc == 0)
+        rc = aggregate_raw(dir, rom, ends_from, ends_to, ends, threads, aggregate);
+    if(rc != 0)
+        pudomat_aggregate_free(aggregate);
+    return rc;
+}
+
+void pudomat_aggregate_free(struct pudomat_aggregate *aggregate)
+{
+    free(aggregate->rows);
+    aggregate->rows = NULL;
+    aggregate->count = 0;
+    aggregate->capacity = 0;
+}
+
+static struct pudomat_sketch *find_sketch(struct pudomat_quantiles *quantiles,
+                                          uint64_t rom)
+{
+    int lo = 0, hi = quantiles->count;
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(quantiles->rows[mid].rom < rom)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo < quantiles->count && quantiles->rows[lo].rom == rom)
+        return &quantiles->rows[lo].sketch;
+
+    if(quantiles->count == quantiles->capacity)
+    {
+        int capacity = quantiles->capacity ? quantiles->capacity * 2 : 16;
+        struct pudomat_quantile_row *rows = realloc(quantiles->rows, capacity * sizeof(*rows));
+        if(!rows)
+            return NULL;
+        quantiles->rows = rows;
+        quantiles->capacity = capacity;
+    }
+    memmove(&quantiles->rows[lo + 1], &quantiles->rows[lo],
+            (quantiles->count - lo) * sizeof(*quantiles->rows));
+    memset(&quantiles->rows[lo], 0, sizeof(*quantiles->rows));
+    quantiles->rows[lo].rom = rom;
+    quantiles->count++;
+    return &quantiles->rows[lo].sketch;
+}
+
+static int add_period(const struct pudomat_rollup *row,
+                      const struct pudomat_sketch *sketch, void *arg)
+{
+    struct pudomat_quantiles *quantiles = arg;
+    struct pudomat_sketch *into = find_sketch(quantiles, row->rom);
+
+    if(!into)
+        return 1;
+    quantiles->periods_read++;
+    pudomat_sketch_merge(into, sketch);
+    return 0;
+}
+
+static int add_sample(const struct pudomat_record *record, void *arg)
+{
+    struct pudomat_quantiles *quantiles = arg;
+    struct pudomat_sketch *into = find_sketch(quantiles, record->rom);
+    struct pudomat_sketch sketch;
+
+    if(!into)
+    {
+        quantiles->rc = 1;
+        return 1;
+    }
+    quantiles->records_read++;
+    pudomat_sketch_init(&sketch, record->temperature);
+    pudomat_sketch_merge(into, &sketch);
+    return 0;
+}
+
+static int add_samples(const char *dir, uint64_t rom, int64_t from, int64_t to,
+                       struct pudomat_quantiles *quantiles)
+{
+    struct pudomat_query_stats stats;
+
+    if(from > to)
+        return 0;
+    if(rom)
+        return pudomat_store_query(dir, rom, from, to, add_sample, quantiles, &stats);
+    return pudomat_store_scan(dir, from, to, add_sample, quantiles, &stats);
+}
+
+// Sketches the temperatures with from <= time <= to per sensor: whole hours
+// and days from the sketches kept with the rollups, only the partial hours
+// at the ends from raw samples. Rollups that are missing, or miss some of
+// the history, are passed over for raw samples.
+int pudomat_store_quantiles(const char *dir, uint64_t rom, int64_t from,
+                            int64_t to, struct pudomat_quantiles *quantiles)
+{
+    struct pudomat_rollups rollups;
+    // far enough from the limits for the period arithmetic
+    int64_t a = from > -(INT64_MAX / 4) ? from : -(INT64_MAX / 4);
+    int64_t b = to < INT64_MAX / 4 ? to + 1 : INT64_MAX / 4;
+
+    int rc = 0;
+
+    memset(quantiles, 0, sizeof(*quantiles));
+    if(pudomat_rollups_open(&rollups, dir, 0) != 0)
+        a = b;
+    else
+    {
+        if(pudomat_rollups_complete(&rollups, dir))
+            rc = pudomat_rollup_sketches(&rollups, rom, &a, &b, add_period, quantiles);
+        else
+            a = b;
+        pudomat_rollups_close(&rollups);
+    }
+
+    if(rc == 0 && a == b)
+        rc = add_samples(dir, rom, from, to, quantiles);
+    else if(rc == 0)
+        rc = add_samples(dir, rom, from, a - 1, quantiles) ||
+             add_samples(dir, rom, b, to, quantiles);
+    if(rc != 0 || quantiles->rc != 0)
+    {
+        pudomat_quantiles_free(quantiles);
+        return 1;
+    }
+    return 0;
+}
+
+void pudomat_quantiles_free(struct pudomat_quantiles *quantiles)
+{
+    free(quantiles->rows);
+    quantiles->rows = NULL;
+    quantiles->count = 0;
+    quantiles->capacity = 0;
+}
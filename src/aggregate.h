@@ -0,0 +1,40 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <stdint.h>
+#include "rollup.h"
+
+// per sensor totals over a time range, rows sorted by rom; start holds the
+// oldest sample of the sensor, or the start of its oldest rollup period
+struct pudomat_aggregate {
+    struct pudomat_rollup *rows;
+    int count;
+    int capacity;
+    uint64_t periods_read;  // rollup rows, one per sensor and minute, hour or day
+    uint32_t segments_read;
+    uint64_t records_read;  // raw samples at the ends of the range
+};
+
+int pudomat_store_aggregate(const char *dir, uint64_t rom, int64_t from,
+                            int64_t to, int threads,
+                            struct pudomat_aggregate *aggregate);
+void pudomat_aggregate_free(struct pudomat_aggregate *aggregate);
+
+// temperature distribution per sensor over a time range, rows sorted by rom
+struct pudomat_quantiles {
+    struct pudomat_quantile_row {
+        uint64_t rom;
+        struct pudomat_sketch sketch;
+    } *rows;
+    int count;
+    int capacity;
+    uint64_t periods_read;  // rollup rows, one per sensor and hour or day
+    uint64_t records_read;  // raw samples at the ends of the range
+    int rc;                 // a sample could not be added
+};
+
+int pudomat_store_quantiles(const char *dir, uint64_t rom, int64_t from,
+                            int64_t to, struct pudomat_quantiles *quantiles);
+void pudomat_quantiles_free(struct pudomat_quantiles *quantiles);
+
+#endif
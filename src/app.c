@@ -1,61 +1,26 @@
-#include <libusb-1.0/libusb.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <argp.h>
+#include "aggregate.h"
+#include "columnar.h"
 #include "comm.h"
-
-static int transfer_fail = 0;
-
-const char *translate_error(int status) {
-    const char *message = "Neznamy status";
-
-    switch (status) {
-    case LIBUSB_TRANSFER_COMPLETED:
-        message = NULL;
-        break;
-    case LIBUSB_TRANSFER_ERROR:
-        message = "Chyba";
-        break;
-    case LIBUSB_TRANSFER_TIMED_OUT:
-        message = "Vyprsel cas";
-        break;
-    case LIBUSB_TRANSFER_CANCELLED:
-        message = "Zruseno";
-        break;
-    case LIBUSB_TRANSFER_STALL:
-        message = "Chyba prenosu dat";
-        break;
-    case LIBUSB_TRANSFER_NO_DEVICE:
-        message = "Odpojeno";
-        break;
-    case LIBUSB_TRANSFER_OVERFLOW:
-        message = "Preteceni datoveho bufferu";
-        break;
-    }
-
-    return message;
-}
-void transfer_cb(struct libusb_transfer *transfer) {
-    int *completed = transfer->user_data;
-    if(completed)
-        *completed = 1;
-
-    if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
-        transfer_fail = 1;
-    else
-        transfer_fail = 0;
-}
-
-double convert_temperature(uint16_t t) {
-    return (double)((((int16_t)t) << 4) >> 4) / 16;
-}
-
-double convert_voltage(int t) { return (double)(t >> 3) * 0.004; }
-
-double convert_current(int t) { return (double)(t >> 3) * 0.004 * 100; }
+#include "compress.h"
+#include "daemon.h"
+#include "emulator.h"
+#include "format.h"
+#include "import.h"
+#include "index.h"
+#include "pudomat.h"
+#include "replay.h"
+#include "rollup.h"
+#include "server.h"
+#include "shm.h"
+#include "store.h"
+#include "watch.h"
 
 int comp_temp(const void *a, const void *b) {
     const struct temp_data *t1 = a, *t2 = b;
@@ -79,6 +44,35 @@ int comp_temp(const void *a, const void *b) {
 const char *argp_program_version = "Pudomat (kompilace " __TIMESTAMP__ ")";
 const char *argp_program_bug_address = "Robert Skorpil <robert@skorpil.net>";
 
+enum {
+    OPT_DAEMON = 256,
+    OPT_INTERVAL,
+    OPT_SOCKET,
+    OPT_DEVICE,
+    OPT_SHM,
+    OPT_METRICS,
+    OPT_STORE,
+    OPT_COMPRESS,
+    OPT_REBUILD_ROLLUPS,
+    OPT_QUERY,
+    OPT_SENSOR,
+    OPT_FROM,
+    OPT_TO,
+    OPT_AGGREGATE,
+    OPT_THREADS,
+    OPT_IMPORT,
+    OPT_FORMAT,
+    OPT_EXPORT,
+    OPT_COLUMNAR,
+    OPT_QUANTILES,
+    OPT_WATCH,
+    OPT_RECORD,
+    OPT_REPLAY,
+    OPT_EMULATE,
+};
+
+#define MAX_QUANTILES 16
+
 static struct argp_option options[] = {
     { "verbose", 'v', 0, 0, "Detailni vystup" },
     { "temperature", 't', 0, 0, "Vypsani teplot (vychozi)" },
@@ -86,16 +80,139 @@ static struct argp_option options[] = {
     { "config-read", 'r', 0, 0, "Vypsani konfigurace" },
     { "config-write", 'w', "klic=hodnota[,klic=hodnota,...]", 0, "Zmen konfiguracni parametr <klic> na <hodnota>. Seznam klicu je dostupny ve vystupu config-read." },
     { "debug", 'd', 0, 0, "Vypsani ladicich dat" },
+    { "daemon", OPT_DAEMON, 0, 0, "Beh na pozadi: drzi zarizeni otevrene, periodicky cte data a odpovida ostatnim volanim pres socket" },
+    { "interval", OPT_INTERVAL, "sekundy", 0, "Perioda cteni dat sluzbou (vychozi 10)" },
+    { "socket", OPT_SOCKET, "cesta", 0, "Cesta k socketu sluzby (vychozi " DAEMON_SOCKET ")" },
+    { "metrics", OPT_METRICS, "[adresa:]port", 0, "Sluzba poskytuje metriky ve formatu OpenMetrics/Prometheus na HTTP portu (vychozi adresa 127.0.0.1)" },
+    { "store", OPT_STORE, "adresar", OPTION_ARG_OPTIONAL, "Ukladani teplot a napeti do binarni historie (vychozi adresar " PUDOMAT_STORE ")" },
+    { "compress", OPT_COMPRESS, 0, 0, "Zkomprimuje plne segmenty historie (viz --store) do archivnich souboru .pgc" },
+    { "rebuild-rollups", OPT_REBUILD_ROLLUPS, 0, 0, "Prepocita minutove, hodinove a denni agregace historie (viz --store) paralelne ze vsech segmentu" },
+    { "query", OPT_QUERY, 0, 0, "Vypise ulozena mereni jednoho teplomeru (viz --store, --sensor, --from, --to)" },
+    { "export", OPT_EXPORT, "soubor", 0, "Zapise ulozena mereni vsech teplomeru (nebo --sensor) za obdobi --from, --to do souboru ve formatu --format" },
+    { "columnar", OPT_COLUMNAR, 0, 0, "Export do sloupcoveho souboru: samostatna pole casu, teplomeru (slovnik ID), teplot, napeti a proudu" },
+    { "aggregate", OPT_AGGREGATE, 0, 0, "Vypise pocet, minimum, prumer a maximum ulozenych mereni kazdeho teplomeru za obdobi, cela obdobi z agregaci (viz --store, --from, --to, --sensor)" },
+    { "quantiles", OPT_QUANTILES, "q[,q...]", OPTION_ARG_OPTIONAL, "Vypise kvantily teplot kazdeho teplomeru za obdobi (vychozi 0.01,0.5,0.99), cela obdobi z agregaci (viz --store, --from, --to, --sensor)" },
+    { "import", OPT_IMPORT, 0, 0, "Nacte do historie (viz --store) soubory s vystupem tohoto programu (-t, -t -v, -u, -a)" },
+    { "threads", OPT_THREADS, "pocet", 0, "Pocet vlaken pro --aggregate a --import (vychozi pocet procesoru)" },
+    { "sensor", OPT_SENSOR, "id", 0, "ID teplomeru pro --query, --aggregate, --quantiles a --export (16 hex znaku)" },
+    { "from", OPT_FROM, "cas", 0, "Zacatek obdobi pro --query, --aggregate, --quantiles a --export: RRRR-MM-DD[ HH:MM[:SS]] nebo @sekundy" },
+    { "to", OPT_TO, "cas", 0, "Konec obdobi (vcetne), format jako --from" },
+    { "shm", OPT_SHM, "jmeno", 0, "Jmeno sdilene pameti s poslednimi hodnotami sluzby (vychozi " PUDOMAT_SHM ")" },
+    { "format", OPT_FORMAT, "format", 0, "Format vypisu teplot, napeti a historie: text (vychozi), csv, json nebo ndjson" },
+    { "all", 'a', 0, 0, "Cteni ze vsech pripojenych Pudomatu, radky jsou oznaceny identifikaci zarizeni" },
+    { "device", OPT_DEVICE, "id", 0, "Vyber Pudomatu podle serioveho cisla nebo cesty na sbernici (napr. 1-1.4)" },
+    { "follow", 'f', 0, 0, "Odebirani novych hodnot od sluzby, vypisuje kazde nove mereni" },
+    { "record", OPT_RECORD, "soubor", 0, "Zaznamena vsechny USB prenosy s Pudomatem vcetne odpovedi a doby trvani do souboru, i ve sluzbe" },
+    { "replay", OPT_REPLAY, "soubor", 0, "Misto Pudomatu odpovida zaznamem z --record se zaznamenanou dobou trvani, pro mereni bez pripojeneho zarizeni, i pro sluzbu" },
+    { "emulate", OPT_EMULATE, "pocet", OPTION_ARG_OPTIONAL, "Misto Pudomatu odpovida emulator firmware vcetne casovani USB (vychozi 1 zarizeni), i pro sluzbu" },
+    { "watch", OPT_WATCH, 0, 0, "Cte teploty (a -u napeti) primo z Pudomatu vzdy tesne po jejich obnoveni ve firmware; pri ukonceni vypise pocet usetrenych cteni" },
     { 0 }
 };
 
 struct arguments
 {
-    enum command command;
+    enum command commands[PUDOMAT_CMD_COUNT];
+    int command_count;
     uint8_t verbose;
     char *config_write_arg;
+    uint8_t daemon;
+    unsigned interval;
+    const char *socket_path;
+    const char *shm_name;
+    const char *metrics_address;
+    const char *store_dir;
+    uint8_t compress;
+    uint8_t rebuild_rollups;
+    uint8_t query;
+    uint8_t aggregate;
+    double quantiles[MAX_QUANTILES];
+    int quantile_count;
+    const char *export_path;
+    uint8_t columnar;
+    uint8_t import;
+    char **files;
+    int file_count;
+    int threads;
+    uint64_t sensor;
+    int64_t from;
+    int64_t to;
+    uint8_t all;
+    const char *device;
+    uint8_t follow;
+    uint8_t watch;
+    const char *record_path;
+    const char *replay_path;
+    int emulate;
+    enum pudomat_format format;
+};
+
+struct result
+{
+    char id[PUDOMAT_ID_LEN];
+    time_t time[PUDOMAT_CMD_COUNT];
+    uint64_t data[PUDOMAT_CMD_COUNT][64];
 };
 
+static void
+add_command(struct arguments *arguments, enum command command)
+{
+    for(int i = 0; i < arguments->command_count; i++)
+        if(arguments->commands[i] == command)
+            return;
+    arguments->commands[arguments->command_count++] = command;
+}
+
+static error_t parse_uint64_t(const char *arg, uint64_t *v);
+
+// local time as in the printed samples, or seconds since the epoch after @;
+// a bare date is its first second, or its last one with end set
+static error_t
+parse_time(const char *arg, int64_t *v, int end_of_day)
+{
+    struct tm tm = { 0 };
+    long long seconds;
+    char end;
+
+    if(sscanf(arg, "@%lld%c", &seconds, &end) == 1)
+    {
+        *v = seconds;
+        return 0;
+    }
+
+    int n = sscanf(arg, "%d-%d-%d%*[ T]%d:%d:%d%c", &tm.tm_year, &tm.tm_mon,
+                   &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &end);
+    if(n != 3 && n != 5 && n != 6)
+        return 1;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    // the next midnight, days with a DST change are not 86400 seconds long
+    end_of_day = end_of_day && n == 3;
+    tm.tm_mday += end_of_day;
+    *v = mktime(&tm) - end_of_day;
+    return 0;
+}
+
+// comma separated fractions between 0 and 1
+static error_t
+parse_quantiles(const char *arg, struct arguments *arguments)
+{
+    arguments->quantile_count = 0;
+    for(;;)
+    {
+        char *end;
+        double q = strtod(arg, &end);
+        if(end == arg || q < 0 || q > 1 || arguments->quantile_count == MAX_QUANTILES)
+            return 1;
+        arguments->quantiles[arguments->quantile_count++] = q;
+        if(!*end)
+            return 0;
+        if(*end != ',')
+            return 1;
+        arg = end + 1;
+    }
+}
+
 static error_t
 parse_opt (int key, char *arg, struct argp_state *state)
 {
@@ -106,20 +223,117 @@ parse_opt (int key, char *arg, struct argp_state *state)
         arguments->verbose = 1;
         break;
     case 't':
-        arguments->command = CMD_TEMP;
+        add_command(arguments, CMD_TEMP);
         break;
     case 'u':
-        arguments->command = CMD_VOLT;
+        add_command(arguments, CMD_VOLT);
         break;
     case 'r':
-        arguments->command = CMD_CFG_READ;
+        add_command(arguments, CMD_CFG_READ);
         break;
     case 'w':
-        arguments->command = CMD_CFG_WRITE;
+        add_command(arguments, CMD_CFG_WRITE);
         arguments->config_write_arg = arg;
         break;
     case 'd':
-        arguments->command = CMD_DBG_READ;
+        add_command(arguments, CMD_DBG_READ);
+        break;
+    case OPT_DAEMON:
+        arguments->daemon = 1;
+        break;
+    case OPT_INTERVAL:
+        arguments->interval = atoi(arg);
+        if(arguments->interval == 0)
+            argp_error(state, "Neplatna perioda");
+        break;
+    case OPT_SOCKET:
+        arguments->socket_path = arg;
+        break;
+    case OPT_SHM:
+        arguments->shm_name = arg;
+        break;
+    case OPT_METRICS:
+        arguments->metrics_address = arg;
+        break;
+    case OPT_STORE:
+        arguments->store_dir = arg ? arg : PUDOMAT_STORE;
+        break;
+    case OPT_COMPRESS:
+        arguments->compress = 1;
+        break;
+    case OPT_REBUILD_ROLLUPS:
+        arguments->rebuild_rollups = 1;
+        break;
+    case OPT_QUERY:
+        arguments->query = 1;
+        break;
+    case OPT_EXPORT:
+        arguments->export_path = arg;
+        break;
+    case OPT_COLUMNAR:
+        arguments->columnar = 1;
+        break;
+    case OPT_AGGREGATE:
+        arguments->aggregate = 1;
+        break;
+    case OPT_IMPORT:
+        arguments->import = 1;
+        break;
+    case OPT_QUANTILES:
+        if(parse_quantiles(arg ? arg : "0.01,0.5,0.99", arguments) != 0)
+            argp_error(state, "Neplatne kvantily");
+        break;
+    case ARGP_KEY_ARGS:
+        arguments->files = state->argv + state->next;
+        arguments->file_count = state->argc - state->next;
+        break;
+    case ARGP_KEY_END:
+        if(arguments->file_count && !arguments->import)
+            argp_error(state, "Soubory lze zadat jen s --import");
+        if(arguments->import && !arguments->file_count)
+            argp_error(state, "Chybi soubory pro --import");
+        break;
+    case OPT_THREADS:
+        arguments->threads = atoi(arg);
+        if(arguments->threads <= 0)
+            argp_error(state, "Neplatny pocet vlaken");
+        break;
+    case OPT_SENSOR:
+        if(parse_uint64_t(arg, &arguments->sensor) != 0)
+            argp_error(state, "Neplatne ID teplomeru");
+        break;
+    case OPT_FROM:
+    case OPT_TO:
+        if(parse_time(arg, key == OPT_FROM ? &arguments->from : &arguments->to,
+                      key == OPT_TO) != 0)
+            argp_error(state, "Neplatny cas");
+        break;
+    case 'a':
+        arguments->all = 1;
+        break;
+    case OPT_DEVICE:
+        arguments->device = arg;
+        break;
+    case 'f':
+        arguments->follow = 1;
+        break;
+    case OPT_WATCH:
+        arguments->watch = 1;
+        break;
+    case OPT_RECORD:
+        arguments->record_path = arg;
+        break;
+    case OPT_REPLAY:
+        arguments->replay_path = arg;
+        break;
+    case OPT_EMULATE:
+        arguments->emulate = arg ? atoi(arg) : 1;
+        if(arguments->emulate < 1 || arguments->emulate > PUDOMAT_MAX_DEVICES)
+            argp_error(state, "Neplatny pocet emulovanych zarizeni");
+        break;
+    case OPT_FORMAT:
+        if(pudomat_format_parse(arg, &arguments->format) != 0)
+            argp_error(state, "Neznamy format");
         break;
     default:
         return ARGP_ERR_UNKNOWN;
@@ -128,25 +342,7 @@ parse_opt (int key, char *arg, struct argp_state *state)
 }
 
 static struct argp argp = 
-{ .options = options, .parser = parse_opt, .doc = "Pudomat - ovladaci program\n\n Priklad nastaveni napeti vypnuti rele na 12.0V a sepnuti na 13.5V:\n pudomat -w svlo=120,svhi=135 " };
-
-static inline uint16_t get_response_size(enum command command)
-{
-    switch(command)
-    {
-    case CMD_DBG_READ:
-        return sizeof(struct debug_data);
-    case CMD_VOLT:
-        return sizeof(struct volt_response);
-    case CMD_TEMP:
-        return sizeof(struct temp_response);
-    case CMD_CFG_READ:
-    case CMD_CFG_WRITE:
-        return sizeof(struct config);
-    default:
-        abort();
-    }        
-}
+{ .options = options, .parser = parse_opt, .args_doc = "[soubor...]", .doc = "Pudomat - ovladaci program\n\n Priklad nastaveni napeti vypnuti rele na 12.0V a sepnuti na 13.5V:\n pudomat -w svlo=120,svhi=135 " };
 
 static error_t
 parse_uint8_t(const char *arg, uint8_t *v)
@@ -306,92 +502,120 @@ break_loop:
     return 0;
 }    
 
+// make install leaves the program setuid root for the USB devices only;
+// files and directories the user names are opened with the user's rights,
+// so that they are also created owned by the user
+static uid_t device_uid;
+static gid_t device_gid;
+
 static error_t
-process_usb_command(enum command command, void *data)
+user_rights(void)
 {
-    error_t rc = 0;
-    uint16_t transfer_buffer[256] = { 0 };
-    libusb_context *ctx;
-    libusb_init(&ctx);
-
-    libusb_device_handle *dev_handle =
-        libusb_open_device_with_vid_pid(ctx, 0x16c0, 0x0939);
-
-    if (!dev_handle) {
-        fprintf(stderr,
-                "Pudomat nenalezen (mozna nebezis jako root?)\n");
-        rc = 1;
-        goto err;
+    if(setegid(getgid()) != 0 || seteuid(getuid()) != 0)
+    {
+        perror("seteuid");
+        return 1;
     }
+    return 0;
+}
 
-    struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-    if (!transfer)
+// back to root until the next user path
+static error_t
+device_rights(void)
+{
+    if(seteuid(device_uid) != 0 || setegid(device_gid) != 0)
     {
-        rc = 1;
-        goto err;
+        perror("seteuid");
+        return 1;
     }
+    return 0;
+}
 
-    transfer_fail = 0;
-    int retry;
-    void *response_data = NULL;
-    for (retry = 0; retry < 5; retry++) {
-        libusb_fill_control_setup((void *)transfer_buffer, 
-                                   LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | (command == CMD_CFG_WRITE ? LIBUSB_ENDPOINT_OUT : LIBUSB_ENDPOINT_IN),
-                                   command,
-                                   0,
-                                   0,
-                                   get_response_size(command));
-        if(command == CMD_CFG_WRITE)
-        {
-            struct config *config = (void *)(transfer_buffer + 4);
-            memcpy(config, data, sizeof(struct config));
-            config->signature = CONFIG_SIGNATURE;
-        }
-        libusb_fill_control_transfer(transfer, dev_handle, (void *)transfer_buffer, transfer_cb,
-                                     NULL, 500);
-        
-        libusb_submit_transfer(transfer);
-        int completed = 0;
-        libusb_handle_events_completed(ctx, &completed);
-
-        if (!transfer_fail) {
-            if(transfer->actual_length == get_response_size(command))
-            {
-                response_data = libusb_control_transfer_get_data(transfer);
-                break;
-            }
-        }
+static struct pudomat pudomat;
+static struct pudomat_device devices[PUDOMAT_MAX_DEVICES];
+static int device_count;
+static int daemon_fd = -2; // -2 until the first connection attempt
+
+static error_t
+open_devices(const struct arguments *arguments)
+{
+    if(device_count)
+        return 0;
 
-        if (retry == 3) {
-            libusb_reset_device(dev_handle);
-            usleep(100000);
+    if(!pudomat.transport)
+    {
+        // replayed devices need no root at all
+        if(arguments->replay_path && user_rights() != 0)
+            return 1;
+        if((arguments->emulate ? pudomat_emulator_init(&pudomat, arguments->emulate) :
+            arguments->replay_path ? pudomat_replay_init(&pudomat, arguments->replay_path) :
+            pudomat_init(&pudomat)) != 0)
+            return 1;
+        if(arguments->record_path &&
+           (user_rights() != 0 ||
+            pudomat_record_start(&pudomat, arguments->record_path) != 0 ||
+            device_rights() != 0))
+        {
+            pudomat_exit(&pudomat);
+            return 1;
         }
-        else
-            usleep(80000 * (retry + 1));
     }
-    if (transfer_fail) {
-        const char *msg = translate_error(transfer->status);
-        fprintf(stderr, "%s\n", msg);
-        rc = 1;
-        goto err;
+
+    if(arguments->all)
+        device_count = pudomat_open_all(&pudomat, devices, PUDOMAT_MAX_DEVICES);
+    else if(pudomat_open(&pudomat, &devices[0], arguments->device) == 0)
+        device_count = 1;
+
+    if(!device_count)
+    {
+        fprintf(stderr,
+                "Pudomat nenalezen (mozna nebezis jako root?)\n");
+        return 1;
     }
+    return 0;
+}
 
-    if (!response_data) {
-        fprintf(stderr, "data == NULL\n");
-        rc = 1;
-        goto err;
+// all commands for all devices share a single libusb context and are
+// submitted at once
+static error_t
+process_usb_commands(const struct arguments *arguments,
+                     const enum command *commands, int count,
+                     struct result *results, int *result_count)
+{
+    struct pudomat_request requests[PUDOMAT_MAX_DEVICES * PUDOMAT_CMD_COUNT];
+    error_t rc = 1;
+    int initialized = 0;
+
+    if(open_devices(arguments) != 0)
+        return 1;
+
+    for(int d = 0; d < device_count; d++)
+    {
+        strcpy(results[d].id, devices[d].id);
+        for(int c = 0; c < count; c++, initialized++)
+        {
+            if(pudomat_request_init(&requests[initialized], &devices[d], commands[c], NULL, NULL) != 0)
+                goto err;
+            if(commands[c] == CMD_CFG_WRITE)
+                pudomat_request_config(&requests[initialized], (void *)results[d].data[c]);
+            time(&results[d].time[c]);
+        }
     }
 
-    if(command != CMD_CFG_WRITE)
-        memcpy(data, response_data, get_response_size(command));
-err:
-    if(transfer)
-        libusb_free_transfer(transfer);
+    if(pudomat_run(&pudomat, requests, initialized) != 0)
+        goto err;
 
-    if(dev_handle)
-        libusb_close(dev_handle);
+    for(int d = 0; d < device_count; d++)
+        for(int c = 0; c < count; c++)
+            if(commands[c] != CMD_CFG_WRITE)
+                memcpy(results[d].data[c], pudomat_response(&requests[d * count + c]),
+                       get_response_size(commands[c]));
+    *result_count = device_count;
+    rc = 0;
 
-    libusb_exit(ctx);
+err:
+    for(int i = 0; i < initialized; i++)
+        pudomat_request_free(&requests[i]);
     return rc;
 }
 
@@ -414,85 +638,149 @@ const char *translate_door(int8_t door_action)
     }
 }
 
-int main(int argc, char *argv[]) {
-    struct arguments arguments = { 0 };
-    arguments.command = CMD_TEMP;
+// serves reads from the daemon's shared snapshot when it has every requested
+// sample and the polled ones are recent, leaves everything else to the socket
+static error_t
+read_shared(const struct arguments *arguments, const enum command *commands,
+            int count, struct result *results, int *result_count)
+{
+    static struct pudomat_shm_data data;
+    struct pudomat_shm shm;
+    int found = 0;
 
-    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    for(int c = 0; c < count; c++)
+        if(commands[c] == CMD_CFG_WRITE)
+            return 1;
 
-    time_t current_time;
-    time(&current_time);
+    if(pudomat_shm_attach(&shm, arguments->shm_name) != 0)
+        return 1;
+    int rc = pudomat_shm_read(&shm, &data);
+    pudomat_shm_close(&shm);
+    if(rc != 0)
+        return 1;
 
-    struct tm *tm = localtime(&current_time);
-    if (!tm)
-        abort();
+    // a polled sample missing two polls means the device or the daemon hangs
+    time_t oldest = time(NULL) - 2 * (time_t)data.interval;
 
-    char ts[256];
-    sprintf(ts, "%d-%02d-%02d %02d:%02d", tm->tm_year + 1900, tm->tm_mon + 1,
-            tm->tm_mday, tm->tm_hour, tm->tm_min);
+    for(int i = 0; i < data.device_count; i++)
+    {
+        struct pudomat_shm_device *device = &data.devices[i];
+        const char *id = *result_count ? results[found].id : arguments->device;
 
-    char line[1024] = {0};
-    char t[1024];
-    uint64_t response_data[64];
+        if(*result_count && found == *result_count)
+            break;
+        if(id && strncmp(id, device->id, PUDOMAT_ID_LEN) != 0)
+            continue;
 
-    if(arguments.command == CMD_CFG_WRITE)
-    {
-        if(update_config(arguments.config_write_arg, 0) != 0)
+        for(int c = 0; c < count; c++)
         {
-            fprintf(stderr, "Neplatny argument\n");
-            goto err;
+            if(!device->time[commands[c]])
+                return 1;
+            // the config is read only on demand, the daemon keeps it current
+            if(commands[c] != CMD_CFG_READ && device->time[commands[c]] < oldest)
+                return 1;
+            const void *sample = commands[c] == CMD_TEMP ? (void *)&device->temp
+                               : commands[c] == CMD_VOLT ? (void *)&device->volt
+                               : commands[c] == CMD_DBG_READ ? (void *)&device->debug
+                               : (void *)&device->config;
+            memcpy(results[found].data[c], sample, get_response_size(commands[c]));
+            results[found].time[c] = device->time[commands[c]];
         }
+        strcpy(results[found].id, device->id);
+        found++;
+        if(!arguments->all && !*result_count)
+            break;
+    }
 
-        if(process_usb_command(CMD_CFG_READ, response_data) != 0)
-            goto err;
+    if(!found || (*result_count && found != *result_count))
+        return 1;
+    *result_count = found;
+    return 0;
+}
+
+// asks a running daemon first, talks to the devices directly only without
+// one; devices already listed in results are addressed by their identity
+static error_t
+run_commands(const struct arguments *arguments, const enum command *commands,
+             int count, struct result *results, int *result_count)
+{
+    int known = *result_count;
 
-        if(update_config(arguments.config_write_arg, (struct config *)response_data) != 0)
-            abort();
+    // recorded, replayed and emulated transfers are the device's own
+    if(arguments->record_path || arguments->replay_path || arguments->emulate)
+        return process_usb_commands(arguments, commands, count, results,
+                                    result_count);
+
+    if(read_shared(arguments, commands, count, results, result_count) == 0)
+        return 0;
+
+    if(daemon_fd == -2)
+        daemon_fd = server_connect(arguments->socket_path);
+    if(daemon_fd < 0)
+        return process_usb_commands(arguments, commands, count, results,
+                                    result_count);
+
+    for(int d = 0; d < (known ? known : PUDOMAT_MAX_DEVICES); d++)
+    {
+        if(!known && d > 0 && !arguments->all)
+            break;
+
+        const char *id = known ? results[d].id : arguments->device;
+        for(int c = 0; c < count; c++)
+        {
+            struct server_reading reading = { 0 };
+            int rc = server_request(daemon_fd, id, d, commands[c],
+                                    (void *)results[d].data[c], &reading);
+            if(rc == SERVER_NO_DEVICE && d > 0)
+                return 0;
+            if(rc == SERVER_NO_DEVICE)
+                fprintf(stderr, "Pudomat nenalezen\n");
+            else if(rc != 0)
+                fprintf(stderr, commands[c] == CMD_CFG_WRITE ? "%s: Zapis konfigurace selhal\n"
+                                                             : "%s: Sluzba nema platna data\n",
+                        reading.id);
+            if(rc != 0)
+                return 1;
+
+            if(commands[c] != CMD_CFG_WRITE)
+                memcpy(results[d].data[c], reading.data, get_response_size(commands[c]));
+            results[d].time[c] = reading.time;
+            strcpy(results[d].id, reading.id);
+        }
+        if(!known)
+            *result_count = d + 1;
     }
+    return 0;
+}
 
-    if(process_usb_command(arguments.command, response_data) != 0)
-        goto err;
+static struct pudomat_writer writer;
 
-    switch (arguments.command) {
-    case CMD_VOLT:
+static void
+print_response(const struct arguments *arguments, enum command command,
+               void *data, time_t sample_time, const char *id)
+{
+    if(command == CMD_CFG_READ || command == CMD_DBG_READ)
     {
-        struct volt_response *r = (void *)response_data;
-        strcat(line, ts);
-        sprintf(t, " %.2lf %d", convert_voltage(r->voltage),
-                r->relay ? 14 : 12);
-        strcat(line, t);
-        printf("%s\n", line);
+        pudomat_writer_flush(&writer);
+        if(id)
+            printf("Pudomat %s:\n", id);
     }
-    break;
+
+    switch (command) {
+    case CMD_VOLT:
+        pudomat_writer_sample(&writer, sample_time, id, NULL, data);
+        break;
     case CMD_TEMP:
     {
-        struct temp_response *r = (void *)response_data;
+        struct temp_response *r = data;
         qsort(r->data, sizeof(r->data) / sizeof(r->data[0]),
               sizeof(r->data[0]), comp_temp);
-
-        strcat(line, ts);
-
-        uint64_t last_id = -1;
-        for (int i = 0; i < sizeof(r->data) / sizeof(r->data[0]); i++) {
-            if (!r->data[i].valid)
-                continue;
-            if(r->data[i].id == last_id)
-                continue;
-            last_id = r->data[i].id;
-
-            if(!arguments.verbose)
-                sprintf(t, " %d", (int)convert_temperature(r->data[i].temperature));
-            else
-                sprintf(t, " %0.2lf°C[raw=%04X,age=%d,id=x'%016lX']", convert_temperature(r->data[i].temperature), r->data[i].temperature, r->data[i].age, r->data[i].id);
-
-            strcat(line, t);
-        }
-        printf("%s\n", line);
+        pudomat_writer_sample(&writer, sample_time, id, r, NULL);
     }
     break;
     case CMD_CFG_READ:
     {
-        struct config *r = (void *)response_data;
+        struct config *r = data;
         int configured = r->signature == CONFIG_SIGNATURE;
         printf("Konfigurovano:                  %s\n", configured ? "ANO" : "NE");
         printf("Napeti vypnuti rele solaru:     %.1lfV (svlo=%d)\n", (double)r->solar_relay_decivolt_lo / 10.0, r->solar_relay_decivolt_lo);
@@ -505,7 +793,7 @@ int main(int argc, char *argv[]) {
     break;
     case CMD_DBG_READ:
     {
-        struct debug_data *r = (void *)response_data;
+        struct debug_data *r = data;
         printf("Pocet volani usbPoll():                         %d\n", r->usb_polls);
         printf("Pocet USB prikazu:                              %d\n", r->usb_reqs);
         printf("Pocet chybnych USB prikazu:                     %d\n", r->usb_req_errors);
@@ -518,11 +806,482 @@ int main(int argc, char *argv[]) {
     }
     break;
     }
+}
+
+// prints every new sample the daemon pushes until it goes away
+static error_t
+follow(const struct arguments *arguments)
+{
+    uint8_t mask = 0;
+    for(int i = 0; i < arguments->command_count; i++)
+        if(arguments->commands[i] != CMD_CFG_WRITE)
+            mask |= 1 << arguments->commands[i];
+
+    int fd = server_connect(arguments->socket_path);
+    if(fd < 0)
+    {
+        fprintf(stderr, "Sluzba nebezi\n");
+        return 1;
+    }
+
+    int index = arguments->all ? SERVER_ALL_DEVICES : 0;
+    if(server_subscribe(fd, arguments->all ? NULL : arguments->device, index, mask) != SERVER_OK)
+    {
+        fprintf(stderr, "Pudomat nenalezen\n");
+        close(fd);
+        return 1;
+    }
+
+    struct server_reading reading;
+    while(server_receive(fd, &reading) == 0)
+    {
+        if(!reading.push)
+            continue;
+        print_response(arguments, reading.command, reading.data, reading.time,
+                       arguments->all ? reading.id : NULL);
+        pudomat_writer_flush(&writer);
+    }
+
+    close(fd);
+    return 0;
+}
+
+static void
+print_watched(enum command command, void *data, time_t time, void *arg)
+{
+    print_response(arg, command, data, time, NULL);
+    pudomat_writer_flush(&writer);
+}
+
+// reads the device right after each of its own updates until interrupted
+static error_t
+watch(const struct arguments *arguments)
+{
+    enum command commands[PUDOMAT_CMD_COUNT];
+    struct watch_stats stats;
+    int count = 0;
+
+    if(arguments->all)
+    {
+        fprintf(stderr, "--watch sleduje jen jeden Pudomat (viz --device)\n");
+        return 1;
+    }
+    for(int i = 0; i < arguments->command_count; i++)
+        if(arguments->commands[i] == CMD_TEMP || arguments->commands[i] == CMD_VOLT)
+            commands[count++] = arguments->commands[i];
+    if(!count)
+        commands[count++] = CMD_TEMP;
+
+    if(open_devices(arguments) != 0)
+        return 1;
+    error_t rc = watch_run(&pudomat, &devices[0], commands, count, print_watched,
+                           (void *)arguments, &stats);
+
+    uint64_t transfers = stats.polls + stats.reads;
+    fprintf(stderr, "Cteni stavu: %llu (bez novych dat %llu), aktualizaci: %llu, perioda: %lld ms, prumerne zpozdeni: %lld ms\n",
+            (unsigned long long)stats.polls, (unsigned long long)stats.empty_polls,
+            (unsigned long long)stats.updates, (long long)stats.period_ms,
+            (long long)(stats.updates ? stats.delay_ms / stats.updates : 0));
+    fprintf(stderr, "Prenosu: %llu, pravidelne cteni se stejnym zpozdenim: %llu, usetreno: %lld\n",
+            (unsigned long long)transfers, (unsigned long long)stats.blind_reads,
+            (long long)stats.blind_reads - (long long)transfers);
+    if(arguments->verbose)
+        pudomat_report_stats(&pudomat);
+
+    pudomat_close(&devices[0]);
+    device_count = 0;
+    pudomat_exit(&pudomat);
+    return rc;
+}
+
+static int
+find_command(const struct arguments *arguments, enum command command)
+{
+    for(int i = 0; i < arguments->command_count; i++)
+        if(arguments->commands[i] == command)
+            return i;
+    return -1;
+}
+
+// appends the temperatures and voltages just read to the history
+static error_t
+store_results(const struct arguments *arguments, struct result *results,
+              int result_count)
+{
+    struct pudomat_store store;
+    int temp = find_command(arguments, CMD_TEMP);
+    int volt = find_command(arguments, CMD_VOLT);
+    error_t rc = 0;
+
+    if(temp < 0 && volt < 0)
+        return 0;
+
+    if(pudomat_store_open(&store, arguments->store_dir) != 0)
+        return 1;
+
+    for(int d = 0; d < result_count; d++)
+        if(pudomat_store_sample(&store, results[d].time[temp >= 0 ? temp : volt],
+                                temp >= 0 ? (void *)results[d].data[temp] : NULL,
+                                volt >= 0 ? (void *)results[d].data[volt] : NULL) != 0)
+            rc = 1;
+
+    pudomat_store_close(&store);
+    return rc;
+}
+
+static int
+write_record(const struct pudomat_record *record, void *arg)
+{
+    int fields = (record->rom ? PUDOMAT_FIELD_TEMP : 0) |
+                 (record->voltage || record->current || record->relay ? PUDOMAT_FIELD_VOLT : 0);
+    pudomat_writer_record(arg, record, NULL, fields);
+    return 0;
+}
+
+// prints the stored samples of one sensor in a time range
+static error_t
+query(const struct arguments *arguments)
+{
+    struct pudomat_query_stats stats;
+
+    if(!arguments->sensor)
+    {
+        fprintf(stderr, "Chybi ID teplomeru (--sensor)\n");
+        return 1;
+    }
+
+    if(pudomat_store_query(arguments->store_dir ? arguments->store_dir : PUDOMAT_STORE,
+                           arguments->sensor, arguments->from, arguments->to,
+                           write_record, &writer, &stats) != 0)
+        return 1;
 
+    if(arguments->verbose)
+        fprintf(stderr, "Segmentu: %u/%u, bloku: %llu, prectenych zaznamu: %llu, nalezenych: %llu\n",
+                stats.segments_read, stats.segments,
+                (unsigned long long)stats.blocks_read,
+                (unsigned long long)stats.records_read,
+                (unsigned long long)stats.records_matched);
     return 0;
+}
+
+// writes the stored samples in a time range into a file
+static error_t
+export(const struct arguments *arguments)
+{
+    const char *dir = arguments->store_dir ? arguments->store_dir : PUDOMAT_STORE;
+    const uint64_t *rom = arguments->sensor ? &arguments->sensor : NULL;
+    struct pudomat_query_stats stats;
 
-bad_length:
-    fprintf(stderr, "Chybna delka odpovedi\n");
+    if(arguments->columnar)
+    {
+        struct pudomat_export_stats exported;
+        if(pudomat_export_columnar(dir, arguments->export_path, rom, arguments->from,
+                                   arguments->to, &exported) != 0)
+            return 1;
+        if(arguments->verbose)
+            fprintf(stderr, "Radku: %llu, teplomeru: %u, bajtu: %llu\n",
+                    (unsigned long long)exported.rows, exported.sensors,
+                    (unsigned long long)exported.bytes);
+        return 0;
+    }
+
+    FILE *f = fopen(arguments->export_path, "w");
+    if(!f)
+    {
+        perror(arguments->export_path);
+        return 1;
+    }
+
+    struct pudomat_writer file_writer;
+    if(pudomat_writer_init(&file_writer, f, arguments->format, arguments->verbose) != 0)
+    {
+        fclose(f);
+        return 1;
+    }
+
+    error_t rc = rom ? pudomat_store_query(dir, *rom, arguments->from, arguments->to,
+                                           write_record, &file_writer, &stats)
+                     : pudomat_store_scan(dir, arguments->from, arguments->to,
+                                          write_record, &file_writer, &stats);
+    if(pudomat_writer_close(&file_writer) != 0)
+        rc = 1;
+    if(fclose(f) != 0)
+    {
+        perror(arguments->export_path);
+        rc = 1;
+    }
+    return rc;
+}
+
+// prints totals per sensor over a time range, computed in parallel
+static error_t
+aggregate(const struct arguments *arguments)
+{
+    struct pudomat_aggregate result;
+    int threads = arguments->threads ? arguments->threads
+                                     : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(pudomat_store_aggregate(arguments->store_dir ? arguments->store_dir : PUDOMAT_STORE,
+                               arguments->sensor, arguments->from, arguments->to,
+                               threads, &result) != 0)
+        return 1;
+
+    for(int i = 0; i < result.count; i++)
+    {
+        const struct pudomat_rollup *r = &result.rows[i];
+        printf("x'%016lX' %u %.2lf %.2lf %.2lf", r->rom, r->count,
+               convert_temperature(r->temp_min),
+               (double)r->temp_sum / r->count / 16.0,
+               convert_temperature(r->temp_max));
+        if(arguments->verbose)
+            printf(" %.2lfV %.2lfV %.2lfV rele=%.0lf%%", convert_voltage(r->volt_min),
+                   convert_voltage(r->volt_sum / r->count),
+                   convert_voltage(r->volt_max), 100.0 * r->relay_on / r->count);
+        printf("\n");
+    }
+
+    if(arguments->verbose)
+        fprintf(stderr, "Vlaken: %d, obdobi z agregaci: %llu, segmentu: %u, prectenych zaznamu: %llu\n",
+                threads, (unsigned long long)result.periods_read, result.segments_read,
+                (unsigned long long)result.records_read);
+    pudomat_aggregate_free(&result);
+    return 0;
+}
+
+// prints temperature quantiles per sensor over a time range
+static error_t
+quantiles(const struct arguments *arguments)
+{
+    struct pudomat_quantiles result;
+
+    if(pudomat_store_quantiles(arguments->store_dir ? arguments->store_dir : PUDOMAT_STORE,
+                               arguments->sensor, arguments->from, arguments->to,
+                               &result) != 0)
+        return 1;
+
+    for(int i = 0; i < result.count; i++)
+    {
+        const struct pudomat_sketch *sketch = &result.rows[i].sketch;
+        printf("x'%016lX' %u", result.rows[i].rom, sketch->count);
+        for(int q = 0; q < arguments->quantile_count; q++)
+            printf(" %.2lf", pudomat_sketch_quantile(sketch, arguments->quantiles[q]) / 16.0);
+        printf("\n");
+    }
+
+    if(arguments->verbose)
+        fprintf(stderr, "Obdobi z agregaci: %llu, prectenych zaznamu: %llu\n",
+                (unsigned long long)result.periods_read,
+                (unsigned long long)result.records_read);
+    pudomat_quantiles_free(&result);
+    return 0;
+}
+
+// loads logs of printed samples into the history
+static error_t
+import(const struct arguments *arguments)
+{
+    struct pudomat_store store;
+    const char *dir = arguments->store_dir ? arguments->store_dir : PUDOMAT_STORE;
+    int threads = arguments->threads ? arguments->threads
+                                     : sysconf(_SC_NPROCESSORS_ONLN);
+    error_t rc = 0;
+
+    if(pudomat_store_open(&store, dir) != 0)
+        return 1;
+
+    for(int i = 0; i < arguments->file_count; i++)
+    {
+        struct pudomat_import_stats stats;
+        if(pudomat_import_file(&store, arguments->files[i], threads, &stats) != 0)
+            rc = 1;
+        fprintf(stderr, "%s: radku %llu (%.0f radku/s, cteni %.0f radku/s), zaznamu %llu, preskoceno %llu\n",
+                arguments->files[i], (unsigned long long)stats.lines,
+                stats.seconds > 0 ? stats.lines / stats.seconds : 0,
+                stats.parse_seconds > 0 ? stats.lines / stats.parse_seconds : 0,
+                (unsigned long long)stats.records, (unsigned long long)stats.skipped);
+    }
+
+    // history older than the store had is behind it in the rollups, which
+    // are sorted again so that queries need not scan it whole
+    int ordered = !store.rollups || pudomat_rollups_ordered(store.rollups);
+    pudomat_store_close(&store);
+    if(rc == 0 && !ordered)
+    {
+        fprintf(stderr, "Radim agregace\n");
+        rc = pudomat_rollups_rebuild(dir, threads);
+    }
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    struct arguments arguments = { 0 };
+    arguments.interval = DAEMON_INTERVAL;
+    arguments.socket_path = DAEMON_SOCKET;
+    arguments.shm_name = PUDOMAT_SHM;
+    arguments.to = INT64_MAX;
+
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    device_uid = geteuid();
+    device_gid = getegid();
+
+    if(pudomat_writer_init(&writer, stdout, arguments.format, arguments.verbose) != 0)
+        return 1;
+
+    if(arguments.daemon)
+    {
+        // the daemon keeps root for devices plugged in later, so it takes
+        // no paths from a user who started it through the setuid bit
+        if(device_uid != getuid() &&
+           (arguments.store_dir || arguments.record_path || arguments.replay_path ||
+            strcmp(arguments.socket_path, DAEMON_SOCKET) != 0))
+        {
+            fprintf(stderr, "Cesty pro sluzbu (--store, --record, --replay, --socket) smi zadat jen root\n");
+            return 1;
+        }
+        struct daemon_options options = {
+            .socket_path = arguments.socket_path,
+            .shm_name = arguments.shm_name,
+            .metrics_address = arguments.metrics_address,
+            .store_dir = arguments.store_dir,
+            .interval = arguments.interval,
+            .emulate = arguments.emulate,
+            .replay_path = arguments.replay_path,
+            .record_path = arguments.record_path,
+        };
+        return daemon_run(&options);
+    }
+
+    // the history needs no devices
+    if((arguments.rebuild_rollups || arguments.query || arguments.aggregate ||
+        arguments.quantile_count || arguments.export_path || arguments.import ||
+        arguments.compress) && user_rights() != 0)
+        return 1;
+
+    if(arguments.rebuild_rollups)
+        return pudomat_rollups_rebuild(arguments.store_dir ? arguments.store_dir
+                                                           : PUDOMAT_STORE,
+                                       sysconf(_SC_NPROCESSORS_ONLN));
+
+    if(arguments.query)
+    {
+        error_t rc = query(&arguments);
+        if(pudomat_writer_close(&writer) != 0)
+            rc = 1;
+        return rc;
+    }
+
+    if(arguments.aggregate)
+        return aggregate(&arguments);
+
+    if(arguments.quantile_count)
+        return quantiles(&arguments);
+
+    if(arguments.export_path)
+        return export(&arguments);
+
+    if(arguments.import)
+        return import(&arguments);
+
+    if(arguments.compress)
+    {
+        int written;
+        error_t rc = pudomat_store_compress(arguments.store_dir ? arguments.store_dir
+                                                                : PUDOMAT_STORE, &written);
+        if(arguments.verbose)
+            fprintf(stderr, "Zkomprimovano segmentu: %d\n", written);
+        return rc;
+    }
+
+    if(!arguments.command_count)
+        add_command(&arguments, CMD_TEMP);
+
+    if(arguments.watch)
+    {
+        error_t rc = watch(&arguments);
+        if(pudomat_writer_close(&writer) != 0)
+            rc = 1;
+        return rc;
+    }
+
+    if(arguments.follow)
+    {
+        error_t rc = follow(&arguments);
+        if(pudomat_writer_close(&writer) != 0)
+            rc = 1;
+        return rc;
+    }
+
+    error_t rc = 1;
+    static struct result results[PUDOMAT_MAX_DEVICES];
+    int result_count = 0;
+
+    for(int i = 0; i < arguments.command_count; i++)
+    {
+        if(arguments.commands[i] != CMD_CFG_WRITE)
+            continue;
+
+        if(update_config(arguments.config_write_arg, 0) != 0)
+        {
+            fprintf(stderr, "Neplatny argument\n");
+            goto err;
+        }
+
+        enum command read = CMD_CFG_READ;
+        if(run_commands(&arguments, &read, 1, results, &result_count) != 0)
+            goto err;
+
+        for(int d = 0; d < result_count; d++)
+        {
+            memcpy(results[d].data[i], results[d].data[0], sizeof(struct config));
+            if(update_config(arguments.config_write_arg, (void *)results[d].data[i]) != 0)
+                abort();
+        }
+    }
+
+    if(run_commands(&arguments, arguments.commands, arguments.command_count,
+                    results, &result_count) != 0)
+        goto err;
+
+    if(arguments.store_dir &&
+       (user_rights() != 0 || store_results(&arguments, results, result_count) != 0))
+        goto err;
+
+    if(arguments.verbose)
+        for(int d = 0; d < device_count; d++)
+            pudomat_report_open(&devices[d]);
+    if(arguments.verbose && device_count)
+        pudomat_report_stats(&pudomat);
+
+    int temp = find_command(&arguments, CMD_TEMP);
+    int volt = find_command(&arguments, CMD_VOLT);
+    for(int d = 0; d < result_count; d++)
+    {
+        const char *id = arguments.all ? results[d].id : NULL;
+
+        // rows of the other formats carry temperature and voltage together
+        if(arguments.format != FORMAT_TEXT && (temp >= 0 || volt >= 0))
+            pudomat_writer_sample(&writer, results[d].time[temp >= 0 ? temp : volt], id,
+                                  temp >= 0 ? (void *)results[d].data[temp] : NULL,
+                                  volt >= 0 ? (void *)results[d].data[volt] : NULL);
+
+        for(int i = 0; i < arguments.command_count; i++)
+        {
+            if(arguments.format != FORMAT_TEXT && (i == temp || i == volt))
+                continue;
+            print_response(&arguments, arguments.commands[i], results[d].data[i],
+                           results[d].time[i], id);
+        }
+    }
+
+    rc = 0;
 err:
-    return 1;
+    if(pudomat_writer_close(&writer) != 0)
+        rc = 1;
+    if(daemon_fd >= 0)
+        close(daemon_fd);
+    for(int d = 0; d < device_count; d++)
+        pudomat_close(&devices[d]);
+    if(pudomat.transport)
+        pudomat_exit(&pudomat);
+    return rc;
 }
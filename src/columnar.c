@@ -0,0 +1,297 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "columnar.h"
+#include "index.h"
+
+enum {
+    COL_TIME,
+    COL_SENSOR,
+    COL_ROM,
+    COL_TEMPERATURE,
+    COL_AGE,
+    COL_VOLTAGE,
+    COL_CURRENT,
+    COL_RELAY,
+    COL_COUNT,
+};
+
+static const struct pudomat_column layout[COL_COUNT] = {
+    [COL_TIME] = { "time", COLUMN_INT64, 8, 0, 0, 0, 1, "s" },
+    [COL_SENSOR] = { "sensor", COLUMN_UINT32, 4, COL_ROM + 1, 0, 0, 1, "" },
+    [COL_ROM] = { "rom", COLUMN_UINT64, 8, 0, 0, 0, 1, "" },
+    [COL_TEMPERATURE] = { "temperature", COLUMN_INT16, 2, 0, 0, 0, 0.0625, "C" },
+    [COL_AGE] = { "age", COLUMN_UINT8, 1, 0, 0, 0, 1, "" },
+    [COL_VOLTAGE] = { "voltage", COLUMN_UINT16, 2, 0, 0, 0, 0.004, "V" },
+    [COL_CURRENT] = { "current", COLUMN_UINT16, 2, 0, 0, 0, 0.4, "A" },
+    [COL_RELAY] = { "relay", COLUMN_UINT8, 1, 0, 0, 0, 1, "" },
+};
+
+struct export {
+    uint64_t rows;
+    uint64_t *roms;          // sorted, the dictionary
+    uint32_t rom_count;
+    uint32_t rom_capacity;
+    uint32_t last;           // dictionary index of the previous row
+    int64_t first_time;
+    int64_t last_time;
+    uint8_t *data;           // the mapped file while filling it
+    struct pudomat_column columns[COL_COUNT];
+    int rc;
+};
+
+static uint32_t find_rom(const struct export *e, uint64_t rom)
+{
+    uint32_t lo = 0, hi = e->rom_count;
+    while(lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(e->roms[mid] < rom)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// first pass: how many rows, which sensors and what time span
+static int count_row(const struct pudomat_record *record, void *arg)
+{
+    struct export *e = arg;
+
+    if(!e->rows || record->time < e->first_time)
+        e->first_time = record->time;
+    if(!e->rows || record->time > e->last_time)
+        e->last_time = record->time;
+    e->rows++;
+
+    if(e->rom_count && e->roms[e->last] == record->rom)
+        return 0;
+    uint32_t i = find_rom(e, record->rom);
+    if(i == e->rom_count || e->roms[i] != record->rom)
+    {
+        if(e->rom_count == e->rom_capacity)
+        {
+            uint32_t capacity = e->rom_capacity ? e->rom_capacity * 2 : 64;
+            uint64_t *roms = realloc(e->roms, capacity * sizeof(*roms));
+            if(!roms)
+            {
+                e->rc = 1;
+                return 1;
+            }
+            e->roms = roms;
+            e->rom_capacity = capacity;
+        }
+        memmove(&e->roms[i + 1], &e->roms[i], (e->rom_count - i) * sizeof(*e->roms));
+        e->roms[i] = record->rom;
+        e->rom_count++;
+    }
+    e->last = i;
+    return 0;
+}
+
+#define COLUMN(e, c, type) ((type *)((e)->data + (e)->columns[c].offset))
+
+// second pass: the same records again, now in their columns
+static int fill_row(const struct pudomat_record *record, void *arg)
+{
+    struct export *e = arg;
+
+    // records appended since the first pass come last and are left out
+    if(e->rows == e->columns[COL_TIME].count)
+        return 1;
+
+    uint64_t i = e->rows++;
+    if(e->roms[e->last] != record->rom)
+        e->last = find_rom(e, record->rom);
+
+    COLUMN(e, COL_TIME, int64_t)[i] = record->time;
+    COLUMN(e, COL_SENSOR, uint32_t)[i] = e->last;
+    COLUMN(e, COL_TEMPERATURE, int16_t)[i] = (int16_t)(record->temperature << 4) >> 4;
+    COLUMN(e, COL_AGE, uint8_t)[i] = record->age;
+    COLUMN(e, COL_VOLTAGE, uint16_t)[i] = record->voltage >> 3;
+    COLUMN(e, COL_CURRENT, uint16_t)[i] = record->current >> 3;
+    COLUMN(e, COL_RELAY, uint8_t)[i] = record->relay;
+    return 0;
+}
+
+static int scan(const char *dir, const uint64_t *rom, int64_t from, int64_t to,
+                pudomat_query_cb callback, struct export *e)
+{
+    struct pudomat_query_stats stats;
+    if(rom)
+        return pudomat_store_query(dir, *rom, from, to, callback, e, &stats);
+    return pudomat_store_scan(dir, from, to, callback, e, &stats);
+}
+
+// Writes the samples of the sensor, or of all sensors when rom is NULL, with
+// from <= time <= to into a columnar file at path.
+int pudomat_export_columnar(const char *dir, const char *path, const uint64_t *rom,
+                            int64_t from, int64_t to,
+                            struct pudomat_export_stats *stats)
+{
+    struct export e = { 0 };
+    char tmp[320];
+    int fd = -1, rc = 1;
+    size_t size = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    snprintf(tmp, sizeof(tmp), "%s.new", path);
+
+    if(scan(dir, rom, from, to, count_row, &e) != 0 || e.rc != 0)
+        goto err;
+
+    size = sizeof(struct pudomat_columnar_header) + sizeof(e.columns);
+    for(int c = 0; c < COL_COUNT; c++)
+    {
+        e.columns[c] = layout[c];
+        e.columns[c].count = c == COL_ROM ? e.rom_count : e.rows;
+        size = (size + PUDOMAT_COLUMNAR_ALIGN - 1) / PUDOMAT_COLUMNAR_ALIGN * PUDOMAT_COLUMNAR_ALIGN;
+        e.columns[c].offset = size;
+        size += e.columns[c].count * e.columns[c].element_size;
+    }
+
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0 || ftruncate(fd, size) != 0)
+    {
+        perror(tmp);
+        goto err;
+    }
+    e.data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(e.data == MAP_FAILED)
+    {
+        e.data = NULL;
+        perror(tmp);
+        goto err;
+    }
+
+    struct pudomat_columnar_header *h = (struct pudomat_columnar_header *)e.data;
+    h->magic = PUDOMAT_COLUMNAR_MAGIC;
+    h->version = PUDOMAT_COLUMNAR_VERSION;
+    h->column_count = COL_COUNT;
+    h->header_size = sizeof(*h) + sizeof(e.columns);
+    h->rows = e.rows;
+    h->first_time = e.first_time;
+    h->last_time = e.last_time;
+    memcpy(h + 1, e.columns, sizeof(e.columns));
+    if(e.rom_count)
+        memcpy(COLUMN(&e, COL_ROM, uint64_t), e.roms, e.rom_count * sizeof(*e.roms));
+
+    e.rows = 0;
+    e.last = 0;
+    if(e.rom_count && scan(dir, rom, from, to, fill_row, &e) != 0)
+        goto err;
+    if(e.rows != h->rows)
+    {
+        fprintf(stderr, "%s: historie se behem exportu zmenila\n", path);
+        goto err;
+    }
+
+    if(munmap(e.data, size) != 0 || close(fd) != 0)
+    {
+        e.data = NULL;
+        fd = -1;
+        perror(tmp);
+        goto err;
+    }
+    e.data = NULL;
+    fd = -1;
+    if(rename(tmp, path) != 0)
+    {
+        perror(path);
+        goto err;
+    }
+
+    stats->rows = e.rows;
+    stats->sensors = e.rom_count;
+    stats->bytes = size;
+    rc = 0;
+
+err:
+    if(e.data)
+        munmap(e.data, size);
+    if(fd >= 0)
+        close(fd);
+    if(rc != 0)
+        unlink(tmp);
+    free(e.roms);
+    return rc;
+}
+
+int pudomat_columnar_map(struct pudomat_columnar *file, const char *path)
+{
+    struct stat st;
+
+    memset(file, 0, sizeof(*file));
+    file->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(file->fd < 0 || fstat(file->fd, &st) != 0)
+        goto err;
+
+    file->size = st.st_size;
+    if(file->size < sizeof(*file->header))
+        goto invalid;
+    file->data = mmap(NULL, file->size, PROT_READ, MAP_SHARED, file->fd, 0);
+    if(file->data == MAP_FAILED)
+    {
+        file->data = NULL;
+        goto err;
+    }
+
+    file->header = (const struct pudomat_columnar_header *)file->data;
+    file->columns = (const struct pudomat_column *)(file->header + 1);
+    if(file->header->magic != PUDOMAT_COLUMNAR_MAGIC ||
+       file->header->version != PUDOMAT_COLUMNAR_VERSION ||
+       file->header->header_size != sizeof(*file->header) +
+           (size_t)file->header->column_count * sizeof(*file->columns) ||
+       file->header->header_size > file->size)
+        goto invalid;
+
+    for(uint32_t c = 0; c < file->header->column_count; c++)
+    {
+        const struct pudomat_column *column = &file->columns[c];
+        if(column->offset > file->size ||
+           column->count > (file->size - column->offset) / (column->element_size ? column->element_size : 1))
+            goto invalid;
+    }
+    return 0;
+
+invalid:
+    fprintf(stderr, "%s: neplatny soubor\n", path);
+    pudomat_columnar_unmap(file);
+    return 1;
+
+err:
+    perror(path);
+    pudomat_columnar_unmap(file);
+    return 1;
+}
+
+const void *pudomat_columnar_column(const struct pudomat_columnar *file,
+                                    const char *name,
+                                    const struct pudomat_column **column)
+{
+    for(uint32_t c = 0; c < file->header->column_count; c++)
+    {
+        if(strncmp(file->columns[c].name, name, sizeof(file->columns[c].name)) != 0)
+            continue;
+        if(column)
+            *column = &file->columns[c];
+        return file->data + file->columns[c].offset;
+    }
+    return NULL;
+}
+
+void pudomat_columnar_unmap(struct pudomat_columnar *file)
+{
+    if(file->data)
+        munmap((void *)file->data, file->size);
+    if(file->fd >= 0)
+        close(file->fd);
+    file->data = NULL;
+    file->header = NULL;
+    file->fd = -1;
+}
@@ -0,0 +1,75 @@
+#ifndef COLUMNAR_H
+#define COLUMNAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PUDOMAT_COLUMNAR_MAGIC 0x4c435550 // "PUCL"
+#define PUDOMAT_COLUMNAR_VERSION 1
+#define PUDOMAT_COLUMNAR_ALIGN 64
+
+enum pudomat_column_type {
+    COLUMN_INT64 = 1,
+    COLUMN_UINT64,
+    COLUMN_INT16,
+    COLUMN_UINT16,
+    COLUMN_UINT8,
+    COLUMN_UINT32,
+};
+
+#pragma pack(push, 1)
+
+// A columnar file is this header, column_count directory entries and the
+// column arrays, each little endian and aligned to 64 bytes. Physical value
+// = raw * scale. A column with a dictionary holds indexes into the column
+// numbered dictionary - 1.
+struct pudomat_columnar_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t column_count;
+    uint32_t header_size;    // this header and the directory
+    uint64_t rows;
+    int64_t first_time;
+    int64_t last_time;
+    uint8_t padding[24];
+};
+
+struct pudomat_column {
+    char name[16];
+    uint16_t type;           // enum pudomat_column_type
+    uint16_t element_size;
+    uint32_t dictionary;
+    uint64_t offset;         // from the start of the file
+    uint64_t count;
+    double scale;
+    char unit[8];
+    uint8_t padding[8];
+};
+
+#pragma pack(pop)
+
+struct pudomat_columnar {
+    int fd;
+    size_t size;
+    const uint8_t *data;
+    const struct pudomat_columnar_header *header;
+    const struct pudomat_column *columns;
+};
+
+struct pudomat_export_stats {
+    uint64_t rows;
+    uint32_t sensors;
+    uint64_t bytes;
+};
+
+int pudomat_export_columnar(const char *dir, const char *path, const uint64_t *rom,
+                            int64_t from, int64_t to,
+                            struct pudomat_export_stats *stats);
+
+int pudomat_columnar_map(struct pudomat_columnar *file, const char *path);
+const void *pudomat_columnar_column(const struct pudomat_columnar *file,
+                                    const char *name,
+                                    const struct pudomat_column **column);
+void pudomat_columnar_unmap(struct pudomat_columnar *file);
+
+#endif
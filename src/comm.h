@@ -1,3 +1,6 @@
+#ifndef COMM_H
+#define COMM_H
+
 #pragma pack(push, 1)
 
 #define MAX_TEMP_COUNT 14
@@ -62,3 +65,5 @@ struct debug_data {
 };
     
 #pragma pack(pop)
+
+#endif
@@ -0,0 +1,378 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "compress.h"
+
+static uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+
+static int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+static void put_bits(struct pudomat_encoder *e, uint64_t value, int n)
+{
+    while(n > 0)
+    {
+        int free = 8 - (e->bits & 7);
+        int take = n < free ? n : free;
+        uint8_t chunk = (value >> (n - take)) & ((1u << take) - 1);
+        e->data[e->bits >> 3] |= chunk << (free - take);
+        e->bits += take;
+        n -= take;
+    }
+}
+
+// reading past the end yields zeros and leaves position beyond bits
+static uint64_t get_bits(struct pudomat_decoder *d, int n)
+{
+    uint64_t value = 0;
+
+    if(d->position + n > d->bits)
+    {
+        d->position = d->bits + 1;
+        return 0;
+    }
+
+    while(n > 0)
+    {
+        int avail = 8 - (d->position & 7);
+        int take = n < avail ? n : avail;
+        uint8_t byte = d->data[d->position >> 3];
+        value = (value << take) | ((byte >> (avail - take)) & ((1u << take) - 1));
+        d->position += take;
+        n -= take;
+    }
+    return value;
+}
+
+// '0' same spacing, then 7, 9 and 12 bit buckets, 64 bits for clock jumps
+static void put_time(struct pudomat_encoder *e, int64_t dod)
+{
+    uint64_t z = zigzag(dod);
+    if(z == 0)
+        put_bits(e, 0, 1);
+    else if(z < (1 << 7))
+        put_bits(e, (0x2 << 7) | z, 2 + 7);
+    else if(z < (1 << 9))
+        put_bits(e, (0x6 << 9) | z, 3 + 9);
+    else if(z < (1 << 12))
+        put_bits(e, (0xe << 12) | z, 4 + 12);
+    else
+    {
+        put_bits(e, 0xf, 4);
+        put_bits(e, z, 64);
+    }
+}
+
+static int64_t get_time(struct pudomat_decoder *d)
+{
+    if(!get_bits(d, 1))
+        return 0;
+    if(!get_bits(d, 1))
+        return unzigzag(get_bits(d, 7));
+    if(!get_bits(d, 1))
+        return unzigzag(get_bits(d, 9));
+    if(!get_bits(d, 1))
+        return unzigzag(get_bits(d, 12));
+    return unzigzag(get_bits(d, 64));
+}
+
+// '0' unchanged, then 4 and 8 bit buckets, 17 bits cover any 16 bit delta
+static void put_value(struct pudomat_encoder *e, int32_t delta)
+{
+    uint64_t z = zigzag(delta);
+    if(z == 0)
+        put_bits(e, 0, 1);
+    else if(z < (1 << 4))
+        put_bits(e, (0x2 << 4) | z, 2 + 4);
+    else if(z < (1 << 8))
+        put_bits(e, (0x6 << 8) | z, 3 + 8);
+    else
+        put_bits(e, (0x7 << 17) | z, 3 + 17);
+}
+
+static int32_t get_value(struct pudomat_decoder *d)
+{
+    if(!get_bits(d, 1))
+        return 0;
+    if(!get_bits(d, 1))
+        return unzigzag(get_bits(d, 4));
+    if(!get_bits(d, 1))
+        return unzigzag(get_bits(d, 8));
+    return unzigzag(get_bits(d, 17));
+}
+
+void pudomat_encoder_init(struct pudomat_encoder *encoder, uint8_t *data,
+                          size_t capacity)
+{
+    memset(encoder, 0, sizeof(*encoder));
+    memset(data, 0, capacity);
+    encoder->data = data;
+    encoder->capacity = capacity;
+}
+
+// returns 1 without touching the stream when the record might not fit
+int pudomat_encode(struct pudomat_encoder *e, const struct pudomat_record *r)
+{
+    if(e->capacity - pudomat_encoded_bytes(e) < PUDOMAT_MAX_ENCODED)
+        return 1;
+
+    if(!e->count)
+    {
+        put_bits(e, r->time, 64);
+        put_bits(e, r->temperature, 16);
+        put_bits(e, r->age, 8);
+        put_bits(e, r->voltage, 16);
+        put_bits(e, r->current, 16);
+        put_bits(e, r->relay, 8);
+    }
+    else
+    {
+        int64_t delta = r->time - e->last.time;
+        put_time(e, delta - e->delta);
+        e->delta = delta;
+        put_value(e, (int32_t)r->temperature - e->last.temperature);
+        put_value(e, (int32_t)r->age - e->last.age);
+        put_value(e, (int32_t)r->voltage - e->last.voltage);
+        put_value(e, (int32_t)r->current - e->last.current);
+        put_value(e, (int32_t)r->relay - e->last.relay);
+    }
+
+    e->last = *r;
+    e->count++;
+    return 0;
+}
+
+size_t pudomat_encoded_bytes(const struct pudomat_encoder *encoder)
+{
+    return (encoder->bits + 7) >> 3;
+}
+
+void pudomat_decoder_init(struct pudomat_decoder *decoder, const uint8_t *data,
+                          size_t bytes, uint32_t count, uint64_t rom)
+{
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->data = data;
+    decoder->bits = bytes * 8;
+    decoder->count = count;
+    decoder->last.rom = rom;
+}
+
+// returns 1 at the end of the series or on a truncated stream
+int pudomat_decode(struct pudomat_decoder *d, struct pudomat_record *r)
+{
+    if(!d->count)
+        return 1;
+
+    if(d->position == 0)
+    {
+        if(d->bits < 128)
+            return 1;
+        d->last.time = get_bits(d, 64);
+        d->last.temperature = get_bits(d, 16);
+        d->last.age = get_bits(d, 8);
+        d->last.voltage = get_bits(d, 16);
+        d->last.current = get_bits(d, 16);
+        d->last.relay = get_bits(d, 8);
+    }
+    else
+    {
+        d->delta += get_time(d);
+        d->last.time += d->delta;
+        d->last.temperature += get_value(d);
+        d->last.age += get_value(d);
+        d->last.voltage += get_value(d);
+        d->last.current += get_value(d);
+        d->last.relay += get_value(d);
+    }
+
+    if(d->position > d->bits)
+    {
+        d->count = 0;
+        return 1;
+    }
+
+    d->count--;
+    *r = d->last;
+    return 0;
+}
+
+static int compare_rom(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// writes one block per sensor, each in the original record order
+int pudomat_compress_segment(const struct pudomat_segment *segment,
+                             const char *path)
+{
+    uint64_t count = pudomat_segment_count(segment);
+    const struct pudomat_record *records = segment->records;
+    size_t capacity = count * PUDOMAT_MAX_ENCODED + PUDOMAT_MAX_ENCODED;
+    uint64_t *roms = malloc(count * sizeof(*roms) + 1);
+    uint8_t *buffer = malloc(capacity);
+    FILE *f = NULL;
+    int rc = 1;
+
+    if(!roms || !buffer)
+        goto err;
+
+    for(uint64_t i = 0; i < count; i++)
+        roms[i] = records[i].rom;
+    qsort(roms, count, sizeof(*roms), compare_rom);
+
+    f = fopen(path, "wb");
+    if(!f)
+    {
+        perror(path);
+        goto err;
+    }
+
+    for(uint64_t i = 0; i < count; i++)
+    {
+        if(i > 0 && roms[i] == roms[i - 1])
+            continue;
+
+        struct pudomat_encoder encoder;
+        struct pudomat_block_header header = {
+            .magic = PUDOMAT_ARCHIVE_MAGIC, .version = PUDOMAT_ARCHIVE_VERSION,
+            .rom = roms[i]
+        };
+
+        pudomat_encoder_init(&encoder, buffer, capacity);
+        for(uint64_t j = 0; j < count; j++)
+        {
+            if(records[j].rom != roms[i])
+                continue;
+            if(!encoder.count)
+                header.first_time = records[j].time;
+            header.last_time = records[j].time;
+            pudomat_encode(&encoder, &records[j]);
+        }
+
+        header.count = encoder.count;
+        header.bytes = pudomat_encoded_bytes(&encoder);
+        if(fwrite(&header, sizeof(header), 1, f) != 1 ||
+           fwrite(buffer, 1, header.bytes, f) != header.bytes)
+        {
+            perror(path);
+            goto err;
+        }
+    }
+
+    if(fclose(f) != 0)
+    {
+        f = NULL;
+        perror(path);
+        goto err;
+    }
+    f = NULL;
+    rc = 0;
+
+err:
+    if(f)
+        fclose(f);
+    if(rc != 0)
+        unlink(path);
+    free(roms);
+    free(buffer);
+    return rc;
+}
+
+int pudomat_archive_map(struct pudomat_archive *archive, const char *path)
+{
+    struct stat st;
+
+    memset(archive, 0, sizeof(*archive));
+    archive->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(archive->fd < 0)
+        goto err;
+    if(fstat(archive->fd, &st) != 0)
+        goto err;
+
+    archive->size = st.st_size;
+    if(!archive->size)
+        return 0;
+
+    archive->data = mmap(NULL, archive->size, PROT_READ, MAP_SHARED, archive->fd, 0);
+    if(archive->data == MAP_FAILED)
+    {
+        archive->data = NULL;
+        goto err;
+    }
+    return 0;
+
+err:
+    perror(path);
+    pudomat_archive_unmap(archive);
+    return 1;
+}
+
+// sets the decoder up for the next block; returns 1 past the last one or
+// on a damaged block
+int pudomat_archive_next(struct pudomat_archive *archive,
+                         struct pudomat_decoder *decoder,
+                         struct pudomat_block_header *header)
+{
+    if(archive->size - archive->offset < sizeof(*header))
+        return 1;
+
+    memcpy(header, archive->data + archive->offset, sizeof(*header));
+    if(header->magic != PUDOMAT_ARCHIVE_MAGIC ||
+       header->version != PUDOMAT_ARCHIVE_VERSION ||
+       archive->size - archive->offset - sizeof(*header) < header->bytes)
+        return 1;
+
+    archive->offset += sizeof(*header);
+    pudomat_decoder_init(decoder, archive->data + archive->offset, header->bytes,
+                         header->count, header->rom);
+    archive->offset += header->bytes;
+    return 0;
+}
+
+void pudomat_archive_unmap(struct pudomat_archive *archive)
+{
+    if(archive->data)
+        munmap((void *)archive->data, archive->size);
+    if(archive->fd >= 0)
+        close(archive->fd);
+    archive->data = NULL;
+    archive->fd = -1;
+}
+
+// archives every full segment of the store that has no archive yet
+int pudomat_store_compress(const char *dir, int *written)
+{
+    uint32_t count;
+    int rc = 0;
+
+    *written = 0;
+    pudomat_store_segments(dir, &count);
+    for(uint32_t i = 0; i < count; i++)
+    {
+        struct pudomat_segment segment;
+        char path[300];
+        struct stat st;
+
+        snprintf(path, sizeof(path), "%s/%08u.pgc", dir, i);
+        if(stat(path, &st) == 0)
+            continue;
+        if(pudomat_segment_map(&segment, dir, i) != 0)
+        {
+            rc = 1;
+            continue;
+        }
+        if(pudomat_segment_count(&segment) == segment.header->capacity)
+        {
+            if(pudomat_compress_segment(&segment, path) != 0)
+                rc = 1;
+            else
+                (*written)++;
+        }
+        pudomat_segment_unmap(&segment);
+    }
+    return rc;
+}
@@ -0,0 +1,78 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "store.h"
+
+#define PUDOMAT_ARCHIVE_MAGIC 0x43475550 // "PUGC"
+#define PUDOMAT_ARCHIVE_VERSION 1
+
+// worst case of one encoded record, the first one is stored verbatim
+#define PUDOMAT_MAX_ENCODED (sizeof(struct pudomat_record))
+
+#pragma pack(push, 1)
+
+// an archive file is a sequence of blocks, each one the series of a single
+// sensor: this header followed by (bits + 7) / 8 bytes of bit stream
+struct pudomat_block_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t padding;
+    uint64_t rom;
+    uint32_t count;
+    uint32_t bytes;
+    int64_t first_time;
+    int64_t last_time;
+};
+
+#pragma pack(pop)
+
+// Gorilla-style bit stream: timestamps as delta-of-delta, the raw integer
+// channels as zig-zag encoded deltas to the previous record of the series
+struct pudomat_encoder {
+    uint8_t *data;
+    size_t capacity; // bytes
+    size_t bits;
+    uint32_t count;
+    int64_t delta;
+    struct pudomat_record last;
+};
+
+struct pudomat_decoder {
+    const uint8_t *data;
+    size_t bits;     // length of the stream
+    size_t position;
+    uint32_t count;  // records left
+    int64_t delta;
+    struct pudomat_record last;
+};
+
+struct pudomat_archive {
+    int fd;
+    size_t size;
+    const uint8_t *data;
+    size_t offset;
+};
+
+void pudomat_encoder_init(struct pudomat_encoder *encoder, uint8_t *data,
+                          size_t capacity);
+int pudomat_encode(struct pudomat_encoder *encoder,
+                   const struct pudomat_record *record);
+size_t pudomat_encoded_bytes(const struct pudomat_encoder *encoder);
+
+void pudomat_decoder_init(struct pudomat_decoder *decoder, const uint8_t *data,
+                          size_t bytes, uint32_t count, uint64_t rom);
+int pudomat_decode(struct pudomat_decoder *decoder,
+                   struct pudomat_record *record);
+
+int pudomat_compress_segment(const struct pudomat_segment *segment,
+                             const char *path);
+int pudomat_archive_map(struct pudomat_archive *archive, const char *path);
+int pudomat_archive_next(struct pudomat_archive *archive,
+                         struct pudomat_decoder *decoder,
+                         struct pudomat_block_header *header);
+void pudomat_archive_unmap(struct pudomat_archive *archive);
+int pudomat_store_compress(const char *dir, int *written);
+
+#endif
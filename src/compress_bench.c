@@ -0,0 +1,157 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "compress.h"
+
+// Encodes and decodes years of synthetic minute samples in segment-sized
+// blocks and reports the space per sample and the codec throughput.
+//
+//   compress-bench [years] [sensors]
+
+#define BLOCK_RECORDS PUDOMAT_STORE_RECORDS
+#define DAY 86400.0
+#define YEAR (365 * DAY)
+
+struct block {
+    struct pudomat_block_header header;
+    uint8_t *data;
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a minute schedule with an occasional second of jitter and rare outages;
+// temperatures follow the day and the season, the battery voltage the sun
+static void generate(struct pudomat_record *r, int sensor, int64_t *t,
+                     double *walk)
+{
+    *t += 60;
+    if(rng() % 50 == 0)
+        *t += (int64_t)(rng() % 3) - 1;
+    if(rng() % 100000 == 0)
+        *t += 600 + rng() % 7200;
+
+    double day = sin(2 * M_PI * fmod(*t, DAY) / DAY);
+    double year = sin(2 * M_PI * fmod(*t, YEAR) / YEAR);
+    *walk += ((int)(rng() % 3) - 1) * 0.02;
+    if(*walk > 2 || *walk < -2)
+        *walk *= 0.9;
+
+    double celsius = 12 + sensor * 3 + 4 * day + 10 * year + *walk;
+    double volts = 12.6 + (day > 0 ? 1.2 * day : 0) + (rng() % 3) * 0.004;
+    double amperes = day > 0 ? 8 * day : 0.2;
+
+    r->time = *t;
+    r->rom = 0x2800000000000000ull | sensor;
+    r->temperature = (uint16_t)(int16_t)lrint(celsius * 16);
+    r->age = rng() % 500 == 0;
+    r->voltage = (uint16_t)lrint(volts / 0.004) << 3;
+    r->current = (uint16_t)lrint(amperes / 0.4) << 3;
+    r->relay = volts > 13.5 ? 1 : volts < 12.0 ? 0 : r->relay;
+}
+
+int main(int argc, char *argv[])
+{
+    int years = argc > 1 ? atoi(argv[1]) : 3;
+    int sensors = argc > 2 ? atoi(argv[2]) : 4;
+    uint64_t per_sensor = (uint64_t)(years * YEAR / 60);
+    uint64_t total = per_sensor * sensors;
+    size_t block_count = 0, compressed = 0;
+    double encode_s = 0, decode_s = 0;
+    uint64_t checksum = 0, decoded_checksum = 0, decoded = 0;
+
+    if(years <= 0 || sensors <= 0)
+    {
+        fprintf(stderr, "pouziti: compress-bench [roky] [teplomery]\n");
+        return 1;
+    }
+
+    size_t max_blocks = sensors * (per_sensor / BLOCK_RECORDS + 1);
+    struct block *blocks = calloc(max_blocks, sizeof(*blocks));
+    struct pudomat_record *records = malloc(BLOCK_RECORDS * sizeof(*records));
+    size_t capacity = BLOCK_RECORDS * PUDOMAT_MAX_ENCODED;
+    uint8_t *buffer = malloc(capacity);
+    if(!blocks || !records || !buffer)
+        return 1;
+
+    for(int s = 0; s < sensors; s++)
+    {
+        int64_t t = 1600000000;
+        double walk = 0;
+        struct pudomat_record last = { 0 };
+
+        for(uint64_t done = 0; done < per_sensor; )
+        {
+            int n = per_sensor - done < BLOCK_RECORDS ? per_sensor - done : BLOCK_RECORDS;
+            for(int i = 0; i < n; i++)
+            {
+                records[i] = last;
+                generate(&records[i], s, &t, &walk);
+                last = records[i];
+                checksum += records[i].time ^ records[i].temperature ^
+                            ((uint64_t)records[i].voltage << 16) ^ records[i].relay;
+            }
+
+            struct pudomat_encoder encoder;
+            double start = now_s();
+            pudomat_encoder_init(&encoder, buffer, capacity);
+            for(int i = 0; i < n; i++)
+                pudomat_encode(&encoder, &records[i]);
+            encode_s += now_s() - start;
+
+            struct block *b = &blocks[block_count++];
+            b->header.rom = records[0].rom;
+            b->header.count = encoder.count;
+            b->header.bytes = pudomat_encoded_bytes(&encoder);
+            b->data = malloc(b->header.bytes);
+            memcpy(b->data, buffer, b->header.bytes);
+            compressed += sizeof(b->header) + b->header.bytes;
+            done += n;
+        }
+    }
+
+    double start = now_s();
+    for(size_t i = 0; i < block_count; i++)
+    {
+        struct pudomat_decoder decoder;
+        struct pudomat_record r;
+        pudomat_decoder_init(&decoder, blocks[i].data, blocks[i].header.bytes,
+                             blocks[i].header.count, blocks[i].header.rom);
+        while(pudomat_decode(&decoder, &r) == 0)
+        {
+            decoded_checksum += r.time ^ r.temperature ^
+                                ((uint64_t)r.voltage << 16) ^ r.relay;
+            decoded++;
+        }
+    }
+    decode_s = now_s() - start;
+
+    printf("samples %llu\n", (unsigned long long)total);
+    printf("raw_bytes_per_sample %zu\n", sizeof(struct pudomat_record));
+    printf("compressed_bytes_per_sample %.3f\n", (double)compressed / total);
+    printf("ratio %.1f\n", (double)total * sizeof(struct pudomat_record) / compressed);
+    printf("encode_samples_per_s %.0f\n", total / encode_s);
+    printf("decode_samples_per_s %.0f\n", decoded / decode_s);
+    printf("decode_raw_mb_per_s %.1f\n",
+           decoded * sizeof(struct pudomat_record) / decode_s / 1e6);
+    printf("roundtrip %s\n", decoded == total && decoded_checksum == checksum
+                                 ? "ok" : "FAILED");
+
+    return decoded == total && decoded_checksum == checksum ? 0 : 1;
+}
@@ -0,0 +1,511 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "daemon.h"
+#include "emulator.h"
+#include "replay.h"
+
+#define MAX_POLLFDS (SERVER_MAX_CLIENTS + EXPORTER_MAX_CONNECTIONS + 18)
+
+static volatile sig_atomic_t daemon_stop;
+
+static void stop_handler(int sig) { daemon_stop = 1; }
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void *daemon_snapshot_data(struct snapshot *snapshot, enum command command)
+{
+    switch(command)
+    {
+    case CMD_TEMP:
+        return &snapshot->temp;
+    case CMD_VOLT:
+        return &snapshot->volt;
+    case CMD_DBG_READ:
+        return &snapshot->debug;
+    case CMD_CFG_READ:
+    case CMD_CFG_WRITE:
+        return &snapshot->config;
+    default:
+        return NULL;
+    }
+}
+
+static int in_flight(struct daemon_device *dd)
+{
+    for(int i = CMD_DBG_READ; i < PUDOMAT_CMD_COUNT; i++)
+        if(dd->requests[i].in_flight)
+            return 1;
+    return 0;
+}
+
+static void finish_config_write(struct daemon_device *dd, uint8_t status)
+{
+    if(!dd->config_write_pending)
+        return;
+
+    dd->config_write_pending = 0;
+    server_config_written(&dd->daemon->server, dd, status);
+}
+
+static void submit(struct daemon_device *dd, enum command command);
+
+static void mark_disconnected(struct daemon_device *dd)
+{
+    if(!dd->disconnected_at)
+        dd->disconnected_at = now_ms();
+}
+
+static void request_failed(struct daemon_device *dd,
+                           struct pudomat_request *request)
+{
+    enum command command = request->command;
+    struct pudomat_step step = pudomat_next_step(request);
+
+    dd->daemon->generation++;
+    switch(step.action)
+    {
+    case ACTION_REOPEN:
+        // the hotplug or the next poll finds it again
+        dd->reopen_pending = 1;
+        mark_disconnected(dd);
+        request->attempts = 0;
+        if(command == CMD_CFG_WRITE)
+            finish_config_write(dd, 1);
+        return;
+    case ACTION_GIVE_UP:
+    {
+        const char *msg = translate_error(request->status);
+        fprintf(stderr, "%s: %s\n", dd->device.id,
+                msg ? msg : "Chybna delka odpovedi");
+        request->attempts = 0;
+        if(command == CMD_CFG_WRITE)
+            finish_config_write(dd, 1);
+        return;
+    }
+    case ACTION_RESET:
+        dd->reset_pending = 1;
+        break;
+    case ACTION_RETRY:
+        break;
+    }
+
+    dd->retry_at[command] = now_ms() + step.delay_ms;
+}
+
+static void request_cb(struct pudomat_request *request)
+{
+    struct daemon_device *dd = request->user_data;
+    enum command command = request->command;
+    const void *data = pudomat_response(request);
+
+    if(!data)
+    {
+        request_failed(dd, request);
+        return;
+    }
+
+    request->attempts = 0;
+    if(command == CMD_CFG_WRITE)
+    {
+        finish_config_write(dd, 0);
+        submit(dd, CMD_CFG_READ);
+        return;
+    }
+
+    memcpy(daemon_snapshot_data(&dd->snapshot, command), data,
+           get_response_size(command));
+    dd->snapshot.time[command] = time(NULL);
+    dd->daemon->generation++;
+    if(command == CMD_TEMP && dd->daemon->store_enabled)
+        pudomat_store_sample(&dd->daemon->store, dd->snapshot.time[CMD_TEMP],
+                             &dd->snapshot.temp,
+                             dd->snapshot.time[CMD_VOLT] ? &dd->snapshot.volt : NULL);
+    pudomat_shm_publish(&dd->daemon->shm, dd - dd->daemon->devices, dd->device.id,
+                        command, data, dd->snapshot.time[command]);
+    server_publish(&dd->daemon->server, dd, command);
+}
+
+static void submit(struct daemon_device *dd, enum command command)
+{
+    struct pudomat_request *request = &dd->requests[command];
+
+    if(request->in_flight)
+        return;
+    if(!pudomat_is_open(&dd->device))
+    {
+        // a retry outlived the device, the client must not wait for it
+        dd->retry_at[command] = 0;
+        if(command == CMD_CFG_WRITE)
+            finish_config_write(dd, 1);
+        return;
+    }
+
+    if(pudomat_submit(request, &dd->config_write) != 0)
+        request_failed(dd, request);
+}
+
+static void device_attached(struct daemon_device *dd)
+{
+    pudomat_report_open(&dd->device);
+    dd->daemon->generation++;
+
+    if(dd->disconnected_at)
+    {
+        int64_t gap = now_ms() - dd->disconnected_at;
+        dd->disconnected_at = 0;
+        dd->gaps.count++;
+        dd->gaps.last_ms = gap;
+        dd->gaps.total_ms += gap;
+        if(gap > dd->gaps.max_ms)
+            dd->gaps.max_ms = gap;
+        fprintf(stderr, "Pudomat %s znovu pripojen po %lld ms (vypadku %u, nejdelsi %lld ms, celkem %lld ms)\n",
+                dd->device.id, (long long)gap, dd->gaps.count,
+                (long long)dd->gaps.max_ms, (long long)dd->gaps.total_ms);
+    }
+
+    // refresh right away, the regular schedule continues unchanged
+    submit(dd, CMD_CFG_READ);
+    submit(dd, CMD_TEMP);
+    submit(dd, CMD_VOLT);
+    submit(dd, CMD_DBG_READ);
+}
+
+// takes over a freshly opened device into the slot of the same identity,
+// or into a new slot for a board not seen before
+static void attach_device(struct daemon *d, struct pudomat_device *device)
+{
+    struct daemon_device *dd = NULL;
+
+    for(int i = 0; i < d->device_count; i++)
+        if(strcmp(d->devices[i].device.id, device->id) == 0)
+            dd = &d->devices[i];
+
+    if(dd && pudomat_is_open(&dd->device))
+    {
+        pudomat_close(device);
+        return;
+    }
+
+    if(!dd)
+    {
+        if(d->device_count == PUDOMAT_MAX_DEVICES)
+        {
+            pudomat_close(device);
+            return;
+        }
+        dd = &d->devices[d->device_count];
+        dd->daemon = d;
+        for(int i = CMD_DBG_READ; i < PUDOMAT_CMD_COUNT; i++)
+        {
+            if(pudomat_request_init(&dd->requests[i], &dd->device, i, request_cb, dd) != 0)
+            {
+                for(int j = CMD_DBG_READ; j < i; j++)
+                    pudomat_request_free(&dd->requests[j]);
+                pudomat_close(device);
+                return;
+            }
+        }
+        d->device_count++;
+    }
+
+    dd->device = *device;
+    d->missing_reported = 0;
+    device_attached(dd);
+}
+
+static void scan_devices(struct daemon *d)
+{
+    struct pudomat_device found[PUDOMAT_MAX_DEVICES];
+    int count = pudomat_open_all(&d->pudomat, found, PUDOMAT_MAX_DEVICES);
+
+    if(!count && !d->missing_reported)
+        fprintf(stderr, "Pudomat nenalezen (mozna nebezis jako root?)\n");
+    d->missing_reported = !count;
+
+    for(int i = 0; i < count; i++)
+        attach_device(d, &found[i]);
+}
+
+// boards are looked for on every poll while one is closed; hotplug reports
+// only boards plugged in again, not those closed after a failed transfer
+static int scan_needed(struct daemon *d)
+{
+    if(!d->device_count)
+        return !d->hotplug_enabled;
+    for(int i = 0; i < d->device_count; i++)
+        if(!pudomat_is_open(&d->devices[i].device))
+            return 1;
+    return 0;
+}
+
+static void hotplug_cb(libusb_device *device, int arrived, void *user_data)
+{
+    struct daemon *d = user_data;
+
+    if(arrived)
+    {
+        if(d->arrived_count < PUDOMAT_MAX_DEVICES)
+            d->arrived[d->arrived_count++] = libusb_ref_device(device);
+        return;
+    }
+
+    for(int i = 0; i < d->device_count; i++)
+    {
+        struct daemon_device *dd = &d->devices[i];
+        if(pudomat_is_device(&dd->device, device))
+        {
+            dd->reopen_pending = 1;
+            mark_disconnected(dd);
+        }
+    }
+}
+
+static void maintain_devices(struct daemon *d)
+{
+    for(int i = 0; i < d->arrived_count; i++)
+    {
+        struct pudomat_device device = { 0 };
+        if(pudomat_open_device(&d->pudomat, &device, d->arrived[i]) == 0)
+            attach_device(d, &device);
+        libusb_unref_device(d->arrived[i]);
+    }
+    d->arrived_count = 0;
+
+    for(int i = 0; i < d->device_count; i++)
+    {
+        struct daemon_device *dd = &d->devices[i];
+
+        if(in_flight(dd))
+            continue;
+
+        if(dd->reopen_pending)
+        {
+            fprintf(stderr, "Pudomat %s odpojen\n", dd->device.id);
+            pudomat_close(&dd->device);
+            d->generation++;
+            dd->reopen_pending = 0;
+            dd->reset_pending = 0;
+            memset(dd->retry_at, 0, sizeof(dd->retry_at));
+            finish_config_write(dd, 1);
+        }
+        else if(dd->reset_pending)
+        {
+            pudomat_reset(&dd->device);
+            dd->reset_pending = 0;
+        }
+    }
+}
+
+struct daemon_device *daemon_find_device(struct daemon *d, const char *id,
+                                         int index)
+{
+    if(!id || !id[0])
+        return index < d->device_count ? &d->devices[index] : NULL;
+
+    for(int i = 0; i < d->device_count; i++)
+        if(strncmp(d->devices[i].device.id, id, PUDOMAT_ID_LEN) == 0)
+            return &d->devices[i];
+    return NULL;
+}
+
+// the acknowledgement is reported through server_config_written()
+int daemon_write_config(struct daemon_device *dd, const struct config *config)
+{
+    if(dd->config_write_pending || !pudomat_is_open(&dd->device))
+        return 1;
+
+    dd->config_write = *config;
+    dd->config_write_pending = 1;
+    submit(dd, CMD_CFG_WRITE);
+    return 0;
+}
+
+static int poll_timeout(struct daemon *d, int64_t now)
+{
+    int64_t deadline = d->next_poll;
+    for(int i = 0; i < d->device_count; i++)
+        for(int j = CMD_DBG_READ; j < PUDOMAT_CMD_COUNT; j++)
+            if(d->devices[i].retry_at[j] && d->devices[i].retry_at[j] < deadline)
+                deadline = d->devices[i].retry_at[j];
+
+    int usb_timeout = pudomat_timeout(&d->pudomat);
+    if(usb_timeout >= 0 && now + usb_timeout < deadline)
+        deadline = now + usb_timeout;
+
+    return deadline > now ? (int)(deadline - now) : 0;
+}
+
+static void run_schedule(struct daemon *d, int64_t now)
+{
+    if(now >= d->next_poll)
+    {
+        if(scan_needed(d))
+            scan_devices(d);
+
+        for(int i = 0; i < d->device_count; i++)
+        {
+            submit(&d->devices[i], CMD_TEMP);
+            submit(&d->devices[i], CMD_VOLT);
+            submit(&d->devices[i], CMD_DBG_READ);
+        }
+
+        d->next_poll += d->interval_ms;
+        if(d->next_poll <= now)
+            d->next_poll = now + d->interval_ms;
+    }
+
+    for(int i = 0; i < d->device_count; i++)
+    {
+        struct daemon_device *dd = &d->devices[i];
+        for(int j = CMD_DBG_READ; j < PUDOMAT_CMD_COUNT; j++)
+        {
+            if(dd->retry_at[j] && now >= dd->retry_at[j])
+            {
+                dd->retry_at[j] = 0;
+                submit(dd, j);
+            }
+        }
+    }
+}
+
+static void event_loop(struct daemon *d)
+{
+    struct pollfd fds[MAX_POLLFDS];
+
+    while(!daemon_stop)
+    {
+        int64_t now = now_ms();
+        run_schedule(d, now);
+        maintain_devices(d);
+
+        int server_count = server_pollfds(&d->server, fds, MAX_POLLFDS);
+        int exporter_count = exporter_pollfds(&d->exporter, fds + server_count,
+                                              MAX_POLLFDS - server_count);
+        nfds_t usb_first = server_count + exporter_count;
+        nfds_t nfds = usb_first;
+        nfds += pudomat_pollfds(&d->pudomat, fds + nfds, MAX_POLLFDS - nfds);
+
+        int rc = poll(fds, nfds, poll_timeout(d, now));
+        if(rc < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        int usb_ready = rc == 0;
+        for(nfds_t i = usb_first; i < nfds; i++)
+            if(fds[i].revents)
+                usb_ready = 1;
+        if(usb_ready)
+            pudomat_handle_events(&d->pudomat, 0);
+
+        server_handle(&d->server, fds, server_count);
+        exporter_handle(&d->exporter, fds + server_count, exporter_count);
+    }
+}
+
+static void shutdown_devices(struct daemon *d)
+{
+    for(int i = 0; i < d->device_count; i++)
+        for(int j = CMD_DBG_READ; j < PUDOMAT_CMD_COUNT; j++)
+            pudomat_cancel(&d->devices[i].requests[j]);
+
+    for(int i = 0; i < d->device_count; i++)
+        while(in_flight(&d->devices[i]))
+            pudomat_handle_events(&d->pudomat, PUDOMAT_TIMEOUT_MS);
+
+    for(int i = 0; i < d->device_count; i++)
+    {
+        struct daemon_device *dd = &d->devices[i];
+        finish_config_write(dd, 1);
+        for(int j = CMD_DBG_READ; j < PUDOMAT_CMD_COUNT; j++)
+            pudomat_request_free(&dd->requests[j]);
+        pudomat_close(&dd->device);
+    }
+
+    for(int i = 0; i < d->arrived_count; i++)
+        libusb_unref_device(d->arrived[i]);
+}
+
+int daemon_run(const struct daemon_options *options)
+{
+    static struct daemon d;
+
+    d.interval_ms = options->interval * 1000;
+
+    if((options->emulate ? pudomat_emulator_init(&d.pudomat, options->emulate) :
+        options->replay_path ? pudomat_replay_init(&d.pudomat, options->replay_path) :
+        pudomat_init(&d.pudomat)) != 0)
+        return 1;
+    if(options->record_path && pudomat_record_start(&d.pudomat, options->record_path) != 0)
+    {
+        pudomat_exit(&d.pudomat);
+        return 1;
+    }
+
+    if(server_open(&d.server, &d, options->socket_path) != 0)
+    {
+        pudomat_exit(&d.pudomat);
+        return 1;
+    }
+
+    d.exporter.listen_fd = -1;
+    if(options->metrics_address &&
+       exporter_open(&d.exporter, &d, options->metrics_address) != 0)
+    {
+        server_close(&d.server);
+        pudomat_exit(&d.pudomat);
+        return 1;
+    }
+
+    if(options->store_dir)
+    {
+        if(pudomat_store_open(&d.store, options->store_dir) != 0)
+        {
+            exporter_close(&d.exporter);
+            server_close(&d.server);
+            pudomat_exit(&d.pudomat);
+            return 1;
+        }
+        d.store_enabled = 1;
+    }
+
+    // readers fall back to the socket without the shared snapshot
+    if(pudomat_shm_create(&d.shm, options->shm_name, options->interval) != 0)
+        fprintf(stderr, "Sdilena pamet nedostupna\n");
+
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    // registered before the first scan so no arrival can slip in between
+    d.hotplug_enabled = pudomat_hotplug_register(&d.pudomat, hotplug_cb, &d) == 0;
+
+    scan_devices(&d);
+    d.next_poll = now_ms() + d.interval_ms;
+    event_loop(&d);
+
+    pudomat_hotplug_deregister(&d.pudomat);
+    shutdown_devices(&d);
+
+    server_close(&d.server);
+    exporter_close(&d.exporter);
+    pudomat_shm_close(&d.shm);
+    if(d.store_enabled)
+        pudomat_store_close(&d.store);
+    pudomat_exit(&d.pudomat);
+    return 0;
+}
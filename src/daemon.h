@@ -0,0 +1,86 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdint.h>
+#include <time.h>
+#include "exporter.h"
+#include "pudomat.h"
+#include "server.h"
+#include "shm.h"
+#include "store.h"
+
+#define DAEMON_SOCKET "/run/pudomat.sock"
+#define DAEMON_INTERVAL 10
+
+struct snapshot {
+    time_t time[PUDOMAT_CMD_COUNT];
+    struct temp_response temp;
+    struct volt_response volt;
+    struct debug_data debug;
+    struct config config;
+};
+
+// everything the daemon keeps per board; a slot stays bound to its device
+// identity across disconnects so gaps are tracked per board
+struct daemon_device {
+    struct daemon *daemon;
+    struct pudomat_device device;
+    struct pudomat_request requests[PUDOMAT_CMD_COUNT];
+    int64_t retry_at[PUDOMAT_CMD_COUNT];
+    uint8_t reset_pending;
+    uint8_t reopen_pending;
+
+    struct config config_write;
+    uint8_t config_write_pending;
+
+    struct snapshot snapshot;
+
+    int64_t disconnected_at;
+    struct {
+        uint32_t count;
+        int64_t last_ms;
+        int64_t max_ms;
+        int64_t total_ms;
+    } gaps;
+};
+
+struct daemon {
+    struct pudomat pudomat;
+    struct daemon_device devices[PUDOMAT_MAX_DEVICES];
+    int device_count;
+    uint8_t missing_reported;
+
+    uint8_t hotplug_enabled;
+    libusb_device *arrived[PUDOMAT_MAX_DEVICES];
+    int arrived_count;
+
+    struct server server;
+    struct pudomat_shm shm;
+    struct exporter exporter;
+    struct pudomat_store store;
+    uint8_t store_enabled;
+    uint64_t generation; // bumped whenever a snapshot or a device changes
+
+    unsigned interval_ms;
+    int64_t next_poll;
+};
+
+struct daemon_options {
+    const char *socket_path;
+    const char *shm_name;
+    const char *metrics_address; // NULL without the exporter
+    const char *store_dir;       // NULL without history
+    unsigned interval;
+    int emulate;                 // emulated boards instead of USB, 0 for none
+    const char *replay_path;     // a recording instead of USB, NULL for none
+    const char *record_path;     // NULL without recording
+};
+
+int daemon_run(const struct daemon_options *options);
+
+void *daemon_snapshot_data(struct snapshot *snapshot, enum command command);
+struct daemon_device *daemon_find_device(struct daemon *d, const char *id,
+                                         int index);
+int daemon_write_config(struct daemon_device *dd, const struct config *config);
+
+#endif
@@ -12,6 +12,7 @@
 */
 
 #include <stddef.h>
+#include <hal.h>
 #include <ds18b20.h>
 #include <onewire.h>
 
@@ -153,8 +154,7 @@ uint8_t ds18b20csp(uint8_t *rom )
 
 	//Set pin high
 	//Poor DS18B20 feels better then...
-	*onewire_port |= onewire_mask;
-	*onewire_direction |= onewire_mask;
+	hal_onewire_high();
 
 	return DS18B20_ERROR_OK;
 }
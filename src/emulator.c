@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "emulator.h"
+
+#define USB_NO_MSG -1
+
+static int64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t tick_start(const struct pudomat_emulated_board *b, int64_t k)
+{
+    return b->boot_us + k * EMULATOR_TICK_US;
+}
+
+// The main loop acts on what handle_thermo() set up at tick k: a scan at the
+// start of each cycle, then conversions and reads taking turns. Returns how
+// long interrupts are off per step and the number of steps.
+static int64_t busy_window(const struct pudomat_emulated_board *b, int64_t k,
+                           int *steps)
+{
+    int o = k % EMULATOR_CYCLE;
+
+    if(o == 0)
+    {
+        *steps = 1;
+        return b->sensors * EMULATOR_SEARCH_US;
+    }
+    *steps = b->sensors;
+    return o % 2 ? EMULATOR_CONVERT_US : EMULATOR_READ_US;
+}
+
+// the first moment from t on with interrupts enabled; between the steps of
+// a window the pending interrupts get in
+static int64_t interrupts_on(const struct pudomat_emulated_board *b, int64_t t)
+{
+    int steps;
+
+    if(t >= b->eeprom_from_us && t < b->eeprom_until_us)
+        t = b->eeprom_until_us;
+    if(t < b->boot_us)
+        return t;
+
+    int64_t k = (t - b->boot_us) / EMULATOR_TICK_US;
+    int64_t tick = tick_start(b, k);
+    int64_t step = busy_window(b, k, &steps);
+    if(t - tick < step * steps)
+        return tick + ((t - tick) / step + 1) * step;
+    return t;
+}
+
+static int64_t next_poll(const struct pudomat_emulated_board *b, int64_t t)
+{
+    int64_t n = ((t - b->boot_us) * 1000 + EMULATOR_POLL_NS - 1) / EMULATOR_POLL_NS;
+    return interrupts_on(b, b->boot_us + n * EMULATOR_POLL_NS / 1000);
+}
+
+// token, data packet and handshake with the bus turnarounds
+static int64_t packet_us(int len)
+{
+    return ((105 + 8 * len) * EMULATOR_BIT_NS + 999) / 1000;
+}
+
+// the j-th temperature read of all sensors is done
+static int64_t finish_done(const struct pudomat_emulated_board *b, uint64_t j)
+{
+    int64_t k = j / 11 * EMULATOR_CYCLE + 2 * (j % 11 + 1);
+    return tick_start(b, k) + b->sensors * EMULATOR_READ_US;
+}
+
+static int triangle(uint64_t step, int period)
+{
+    int phase = step % period;
+    return phase < period / 2 ? phase : period - phase;
+}
+
+// finish_temp_read(): slow swings of a couple of degrees around a different
+// level per sensor, the door acts on the two configured sensors
+static void finish_temp_read(struct pudomat_emulated_board *b)
+{
+    int8_t temp_a = -128;
+    int8_t temp_b = -128;
+
+    for(int i = 0; i < MAX_TEMP_COUNT; i++)
+    {
+        struct temp_data *data = &b->temp_response.data[i];
+        if(i >= b->sensors)
+        {
+            data->valid = 0;
+            continue;
+        }
+
+        uint16_t t = (18 + 2 * i) * 16 - 32 + 2 * triangle(b->finishes + 7 * i, 64);
+        data->id = 0x28 | (uint64_t)(b->index + 1) << 8 | (uint64_t)(i + 1) << 16;
+        data->valid = 1;
+        data->age = 0;
+        data->temperature = t;
+        b->debug_data.temp_reads++;
+        if(data->id == b->config.door_temp_id_A)
+            temp_a = (int16_t)t / 16;
+        else if(data->id == b->config.door_temp_id_B)
+            temp_b = (int16_t)t / 16;
+    }
+
+    int8_t action = b->debug_data.door_action;
+    if(action != DA_FORCE_CLOSE && action != DA_FORCE_OPEN &&
+       temp_a != -128 && temp_b != -128)
+    {
+        int8_t diff = temp_b - temp_a;
+        if(diff > b->config.door_temp_diff_open)
+            b->debug_data.door_action = DA_OPEN;
+        else if(diff < b->config.door_temp_diff_close)
+            b->debug_data.door_action = DA_CLOSE;
+    }
+}
+
+// handle_volt(): a solar panel voltage rising and falling between 12 and
+// 15.6 V over about eight minutes
+static void handle_volt(struct pudomat_emulated_board *b)
+{
+    int level = triangle(b->volt_steps / 4, 180);
+
+    switch(b->volt_steps % 4)
+    {
+    case 1:
+        b->volt_response.current = (400 + level * 40) / 400 << 3;
+        break;
+    case 2:
+        b->volt_response.voltage = (12000 + level * 40) / 4 << 3;
+        break;
+    case 3:
+        if(b->volt_response.voltage < b->config.solar_relay_decivolt_lo * 200)
+            b->volt_response.relay = 0;
+        if(b->volt_response.voltage > b->config.solar_relay_decivolt_hi * 200)
+            b->volt_response.relay = 1;
+        break;
+    }
+}
+
+// brings the firmware state up to time t
+static void advance(struct pudomat_emulated_board *b, int64_t t)
+{
+    while(finish_done(b, b->finishes) <= t)
+    {
+        finish_temp_read(b);
+        b->finishes++;
+    }
+    while(tick_start(b, b->volt_steps * EMULATOR_VOLT_TICKS) <= t)
+    {
+        handle_volt(b);
+        b->volt_steps++;
+    }
+
+    int64_t k = (t - b->boot_us) / EMULATOR_TICK_US;
+    b->debug_data.temp_scans = k / EMULATOR_CYCLE + 1;
+    b->debug_data.usb_polls = (t - b->boot_us) * 1000 / EMULATOR_POLL_NS;
+}
+
+// read_config(): an erased EEPROM reads as 0xff
+static void read_config(struct pudomat_emulated_board *b)
+{
+    if(b->config.signature != CONFIG_SIGNATURE)
+    {
+        b->config.solar_relay_decivolt_lo = 126;
+        b->config.solar_relay_decivolt_hi = 154;
+    }
+}
+
+// usbFunctionSetup() at time t
+static int function_setup(struct pudomat_emulated_board *b,
+                          const struct libusb_control_setup *setup, int64_t t,
+                          const void **data)
+{
+    advance(b, t);
+    ++b->debug_data.usb_reqs;
+    switch(setup->bRequest)
+    {
+    case CMD_DBG_READ:
+        *data = &b->debug_data;
+        return sizeof(b->debug_data);
+    case CMD_VOLT:
+        *data = &b->volt_response;
+        return sizeof(b->volt_response);
+    case CMD_TEMP:
+        *data = &b->temp_response;
+        return sizeof(b->temp_response);
+    case CMD_CFG_READ:
+        *data = &b->config;
+        return sizeof(b->config);
+    case CMD_CFG_WRITE:
+        if(libusb_le16_to_cpu(setup->wLength) != sizeof(struct config))
+            return 0;
+        return USB_NO_MSG;
+    }
+    ++b->debug_data.usb_req_errors;
+    return 0;
+}
+
+// usbFunctionWrite() of the bytes from offset on: 1 when the config is
+// complete, 0 for more, -1 past its end
+static int function_write(struct pudomat_emulated_board *b, int offset,
+                          const uint8_t *data, int len, int64_t t)
+{
+    if(offset + len > (int)sizeof(b->config))
+        return -1;
+
+    memcpy((uint8_t *)&b->config + offset, data, len);
+    if(offset + len < (int)sizeof(b->config))
+        return 0;
+
+    // config_updated: the main loop writes the EEPROM with interrupts off
+    b->eeprom_from_us = t;
+    b->eeprom_until_us = t + EMULATOR_EEPROM_US;
+    read_config(b);
+    return 1;
+}
+
+static int emulator_submit(struct pudomat_request *request)
+{
+    struct pudomat_emulated_board *b = request->device->backend;
+    struct pudomat_emulator *emulator = b->pudomat->backend;
+    struct libusb_transfer *transfer = request->transfer;
+    const struct libusb_control_setup *setup = (const void *)request->buffer;
+    uint8_t *payload = request->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+    int64_t t0 = request->submitted_us;
+    int64_t deadline = transfer->timeout ? t0 + transfer->timeout * 1000LL : INT64_MAX;
+    int wlength = libusb_le16_to_cpu(setup->wLength);
+    const void *data = NULL;
+
+    // the transfer waits for the previous one and starts with a frame
+    int64_t t = t0 > b->ep0_free_us ? t0 : b->ep0_free_us;
+    t = (t + EMULATOR_FRAME_US - 1) / EMULATOR_FRAME_US * EMULATOR_FRAME_US;
+
+    transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    transfer->actual_length = 0;
+    t = interrupts_on(b, t) + packet_us(EMULATOR_PACKET);
+    emulator->packets++;
+    int64_t poll = next_poll(b, t);
+    int len = poll < deadline ? function_setup(b, setup, poll, &data) : 0;
+
+    if(len == USB_NO_MSG)
+    {
+        // each OUT packet waits until usbPoll() passed the previous one on
+        for(int offset = 0; offset < wlength && poll < deadline; offset += EMULATOR_PACKET)
+        {
+            int size = wlength - offset < EMULATOR_PACKET ? wlength - offset : EMULATOR_PACKET;
+            t = interrupts_on(b, poll) + packet_us(size);
+            emulator->packets++;
+            poll = next_poll(b, t);
+            if(poll >= deadline)
+                break;
+            int rc = function_write(b, offset, payload + offset, size, poll);
+            transfer->actual_length = offset + size;
+            if(rc < 0)
+            {
+                transfer->status = LIBUSB_TRANSFER_STALL;
+                break;
+            }
+        }
+        t = interrupts_on(b, poll) + packet_us(0);
+    }
+    else if((setup->bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+    {
+        // usbPoll() builds each IN packet from the live buffer
+        if(len > wlength)
+            len = wlength;
+        t = poll;
+        for(int offset = 0; offset < len && t < deadline; offset += EMULATOR_PACKET)
+        {
+            int size = len - offset < EMULATOR_PACKET ? len - offset : EMULATOR_PACKET;
+            if(offset)
+                poll = next_poll(b, t);
+            memcpy(payload + offset, (const uint8_t *)data + offset, size);
+            t = interrupts_on(b, poll) + packet_us(size);
+            emulator->packets++;
+        }
+        transfer->actual_length = len;
+        t = interrupts_on(b, t) + packet_us(0);
+    }
+    else
+    {
+        // OUT data nobody asked for is acknowledged and dropped
+        t = interrupts_on(b, poll) + (wlength + EMULATOR_PACKET - 1) / EMULATOR_PACKET *
+                                         packet_us(EMULATOR_PACKET) + packet_us(0);
+        transfer->actual_length = wlength;
+    }
+    emulator->packets++;
+
+    if(t > deadline)
+    {
+        transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+        transfer->actual_length = 0;
+        t = deadline;
+    }
+    b->ep0_free_us = t;
+    emulator->transfers++;
+    return pudomat_schedule(request, t);
+}
+
+static struct pudomat_emulated_board *find_board(struct pudomat_emulator *emulator,
+                                                 const char *id)
+{
+    for(int i = 0; i < emulator->count; i++)
+        if(!id || strcmp(emulator->boards[i].id, id) == 0)
+            return &emulator->boards[i];
+    return NULL;
+}
+
+static int emulator_open(struct pudomat *pudomat, struct pudomat_device *device,
+                         const char *id)
+{
+    struct pudomat_emulated_board *b = find_board(pudomat->backend, id);
+
+    if(!b)
+        return 1;
+    strcpy(device->id, b->id);
+    device->pudomat = pudomat;
+    device->handle = NULL;
+    device->backend = b;
+    device->cached = 0;
+    device->open_us = 0;
+    return 0;
+}
+
+static int emulator_open_all(struct pudomat *pudomat, struct pudomat_device *devices,
+                             int max)
+{
+    struct pudomat_emulator *emulator = pudomat->backend;
+    int opened = 0;
+
+    for(int i = 0; i < emulator->count && opened < max; i++)
+        if(emulator_open(pudomat, &devices[opened], emulator->boards[i].id) == 0)
+            opened++;
+    return opened;
+}
+
+static void emulator_close(struct pudomat_device *device)
+{
+    device->backend = NULL;
+}
+
+static int emulator_reset(struct pudomat_device *device)
+{
+    struct pudomat_emulated_board *b = device->backend;
+    int64_t now = now_us();
+
+    b->ep0_free_us = (b->ep0_free_us > now ? b->ep0_free_us : now) + EMULATOR_RESET_US;
+    return 0;
+}
+
+static void emulator_stop(struct pudomat *pudomat)
+{
+    free(pudomat->backend);
+    pudomat->backend = NULL;
+}
+
+static void emulator_report(const struct pudomat *pudomat)
+{
+    const struct pudomat_emulator *emulator = pudomat->backend;
+
+    fprintf(stderr, "Emulovanych Pudomatu: %d, prenosu: %llu, paketu: %llu\n",
+            emulator->count, (unsigned long long)emulator->transfers,
+            (unsigned long long)emulator->packets);
+}
+
+const struct pudomat_transport pudomat_emulator_transport = {
+    .name = "emulator",
+    .open = emulator_open,
+    .open_all = emulator_open_all,
+    .close = emulator_close,
+    .reset = emulator_reset,
+    .submit = emulator_submit,
+    .cancel = pudomat_scheduled_cancel,
+    .pollfds = pudomat_scheduled_pollfds,
+    .timeout = pudomat_scheduled_timeout,
+    .handle_events = pudomat_scheduled_handle_events,
+    .stop = emulator_stop,
+    .report = emulator_report,
+};
+
+int pudomat_emulator_init(struct pudomat *pudomat, int count)
+{
+    struct pudomat_emulator *emulator = calloc(1, sizeof(*emulator));
+    int64_t now = now_us();
+
+    memset(pudomat, 0, sizeof(*pudomat));
+    if(!emulator)
+        return 1;
+    if(count < 1)
+        count = 1;
+    if(count > PUDOMAT_MAX_DEVICES)
+        count = PUDOMAT_MAX_DEVICES;
+
+    emulator->count = count;
+    for(int i = 0; i < count; i++)
+    {
+        struct pudomat_emulated_board *b = &emulator->boards[i];
+        b->pudomat = pudomat;
+        snprintf(b->id, PUDOMAT_ID_LEN, "emu-%d", i + 1);
+        b->index = i;
+        b->sensors = EMULATOR_SENSORS;
+        // running for a cycle already, the boards out of phase
+        b->boot_us = now - EMULATOR_CYCLE * EMULATOR_TICK_US -
+                     i * EMULATOR_TICK_US / count;
+        memset(&b->config, 0xff, sizeof(b->config));
+        read_config(b);
+        advance(b, now);
+    }
+
+    pudomat->transport = &pudomat_emulator_transport;
+    pudomat->backend = emulator;
+    return 0;
+}
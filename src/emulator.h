@@ -0,0 +1,62 @@
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include <stdint.h>
+#include "pudomat.h"
+
+#define EMULATOR_TICK_US 1398101 // handle_thermo(), 64 timer0 overflows at 12 MHz / 1024
+#define EMULATOR_CYCLE 23        // ticks from one sensor scan to the next
+#define EMULATOR_VOLT_TICKS 2    // handle_volt() runs every other tick
+#define EMULATOR_POLL_NS 1365333 // usbPoll() on timer2 overflow, 12 MHz / 64 / 256
+#define EMULATOR_BIT_NS 667      // low speed USB, 1.5 Mbit/s
+#define EMULATOR_FRAME_US 1000
+#define EMULATOR_PACKET 8        // low speed control endpoint
+#define EMULATOR_SENSORS 7
+
+// interrupts off in the firmware, per sensor where it is done per sensor
+#define EMULATOR_SEARCH_US 13500  // ROM search, 64 bits of three slots
+#define EMULATOR_CONVERT_US 6600  // reset, match ROM and convert
+#define EMULATOR_READ_US 11600    // reset, match ROM and scratchpad read
+#define EMULATOR_EEPROM_US 80000  // preempt_wait_us(10000) and the config write
+#define EMULATOR_RESET_US 60000   // bus reset and enumeration
+
+// One emulated board: the firmware's response buffers and counters, kept
+// current lazily from the time of each request.
+struct pudomat_emulated_board {
+    struct pudomat *pudomat;
+    char id[PUDOMAT_ID_LEN];
+    int index;
+    int sensors;
+    int64_t boot_us;
+    int64_t ep0_free_us;     // control transfers to a board are serialized
+    int64_t eeprom_from_us;
+    int64_t eeprom_until_us;
+
+    struct config config;
+    struct volt_response volt_response;
+    struct temp_response temp_response;
+    struct debug_data debug_data;
+    uint64_t finishes;       // temperature reads done, of all sensors
+    uint64_t volt_steps;     // handle_volt() steps done
+    uint8_t open;
+};
+
+struct pudomat_emulator {
+    struct pudomat_emulated_board boards[PUDOMAT_MAX_DEVICES];
+    int count;
+    uint64_t transfers;
+    uint64_t packets;
+};
+
+extern const struct pudomat_transport pudomat_emulator_transport;
+
+// Initialized instead of pudomat_init(): count boards that answer the
+// requests as src/firmware.c does in usbFunctionSetup() and
+// usbFunctionWrite(). The firmware's main loop and timer interrupts are
+// emulated on their real schedule, and each transfer takes as long as
+// its 8 byte packets take at low speed. One packet goes per usbPoll(),
+// and the packets wait while the firmware has interrupts off for the
+// 1-Wire bus or the EEPROM.
+int pudomat_emulator_init(struct pudomat *pudomat, int count);
+
+#endif
@@ -0,0 +1,454 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "daemon.h"
+#include "exporter.h"
+
+#define CONTENT_TYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+} counters[] = {
+    { "usb_polls", "Volani usbPoll() ve firmware", offsetof(struct debug_data, usb_polls) },
+    { "usb_requests", "USB prikazy", offsetof(struct debug_data, usb_reqs) },
+    { "usb_request_errors", "Chybne USB prikazy", offsetof(struct debug_data, usb_req_errors) },
+    { "temp_scans", "Hledani teplomeru", offsetof(struct debug_data, temp_scans) },
+    { "temp_scan_errors", "Chyby pri hledani teplomeru", offsetof(struct debug_data, temp_scan_errors) },
+    { "temp_scan_warnings", "Opakovane pokusy pri hledani teplomeru", offsetof(struct debug_data, temp_scan_warns) },
+    { "temp_reads", "Cteni teploty", offsetof(struct debug_data, temp_reads) },
+    { "temp_read_errors", "Chyby pri cteni teploty", offsetof(struct debug_data, temp_read_errors) },
+};
+
+static void release(struct exporter_body *body)
+{
+    if(body && --body->refs == 0)
+        free(body);
+}
+
+static void family(FILE *f, const char *name, const char *type,
+                   const char *help)
+{
+    fprintf(f, "# TYPE pudomat_%s %s\n# HELP pudomat_%s %s\n", name, type,
+            name, help);
+}
+
+// transfer statistics of the retry policy, over all devices
+static void render_usb(const struct pudomat *pudomat, FILE *f)
+{
+    const struct pudomat_stats *stats = &pudomat->stats;
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } steps[] = {
+        { "usb_retries", "Opakovane USB prenosy", offsetof(struct pudomat_stats, retries) },
+        { "usb_resets", "Resety zarizeni", offsetof(struct pudomat_stats, resets) },
+        { "usb_reopens", "Znovu otevreni odpojeneho zarizeni", offsetof(struct pudomat_stats, reopens) },
+        { "usb_give_ups", "Vzdane USB prikazy", offsetof(struct pudomat_stats, give_ups) },
+    };
+    static const char *commands[PUDOMAT_CMD_COUNT] = {
+        [CMD_DBG_READ] = "debug", [CMD_VOLT] = "volt", [CMD_TEMP] = "temp",
+        [CMD_CFG_READ] = "config", [CMD_CFG_WRITE] = "config_write",
+    };
+
+    family(f, "usb_latency_seconds", "histogram", "Doba USB prenosu podle vysledku");
+    for(int o = 0; o < OUTCOME_COUNT; o++)
+    {
+        uint64_t count = 0;
+        for(int b = 0; b < PUDOMAT_LATENCY_BUCKETS; b++)
+        {
+            count += stats->latency[o][b];
+            if(b == PUDOMAT_LATENCY_BUCKETS - 1)
+                fprintf(f, "pudomat_usb_latency_seconds_bucket{outcome=\"%s\",le=\"+Inf\"} %llu\n",
+                        pudomat_outcome_names[o], (unsigned long long)count);
+            else
+                fprintf(f, "pudomat_usb_latency_seconds_bucket{outcome=\"%s\",le=\"%g\"} %llu\n",
+                        pudomat_outcome_names[o], pudomat_latency_bound_us(b) / 1e6,
+                        (unsigned long long)count);
+        }
+        fprintf(f, "pudomat_usb_latency_seconds_count{outcome=\"%s\"} %llu\n",
+                pudomat_outcome_names[o], (unsigned long long)count);
+        fprintf(f, "pudomat_usb_latency_seconds_sum{outcome=\"%s\"} %.6f\n",
+                pudomat_outcome_names[o], stats->latency_sum_us[o] / 1e6);
+    }
+
+    for(int i = 0; i < sizeof(steps) / sizeof(steps[0]); i++)
+    {
+        uint64_t value;
+        memcpy(&value, (const char *)stats + steps[i].offset, sizeof(value));
+        family(f, steps[i].name, "counter", steps[i].help);
+        fprintf(f, "pudomat_%s_total %llu\n", steps[i].name, (unsigned long long)value);
+    }
+
+    family(f, "usb_timeout_seconds", "gauge", "Prizpusobeny casovy limit USB prenosu");
+    for(int c = CMD_DBG_READ; c < PUDOMAT_CMD_COUNT; c++)
+        fprintf(f, "pudomat_usb_timeout_seconds{command=\"%s\"} %.3f\n", commands[c],
+                pudomat_transfer_timeout(pudomat, c, 0) / 1000.0);
+}
+
+static void render_metrics(struct daemon *d, FILE *f)
+{
+    family(f, "up", "gauge", "Zarizeni je pripojeno");
+    for(int i = 0; i < d->device_count; i++)
+        fprintf(f, "pudomat_up{device=\"%s\"} %d\n", d->devices[i].device.id,
+                pudomat_is_open(&d->devices[i].device));
+
+    family(f, "sample_timestamp_seconds", "gauge", "Cas posledniho uspesneho cteni");
+    for(int i = 0; i < d->device_count; i++)
+    {
+        struct snapshot *s = &d->devices[i].snapshot;
+        static const char *names[PUDOMAT_CMD_COUNT] = {
+            [CMD_DBG_READ] = "debug", [CMD_VOLT] = "volt",
+            [CMD_TEMP] = "temp", [CMD_CFG_READ] = "config",
+        };
+        for(int c = CMD_DBG_READ; c <= CMD_CFG_READ; c++)
+            if(s->time[c])
+                fprintf(f, "pudomat_sample_timestamp_seconds{device=\"%s\",command=\"%s\"} %lld\n",
+                        d->devices[i].device.id, names[c], (long long)s->time[c]);
+    }
+
+    family(f, "temperature_celsius", "gauge", "Teplota podle teplomeru");
+    for(int i = 0; i < d->device_count; i++)
+    {
+        struct snapshot *s = &d->devices[i].snapshot;
+        if(!s->time[CMD_TEMP])
+            continue;
+        for(int j = 0; j < MAX_TEMP_COUNT; j++)
+            if(s->temp.data[j].valid)
+                fprintf(f, "pudomat_temperature_celsius{device=\"%s\",rom=\"%016llx\"} %.4f\n",
+                        d->devices[i].device.id,
+                        (unsigned long long)s->temp.data[j].id,
+                        convert_temperature(s->temp.data[j].temperature));
+    }
+
+    family(f, "temperature_age", "gauge", "Stari posledniho cteni teplomeru ve firmware");
+    for(int i = 0; i < d->device_count; i++)
+    {
+        struct snapshot *s = &d->devices[i].snapshot;
+        if(!s->time[CMD_TEMP])
+            continue;
+        for(int j = 0; j < MAX_TEMP_COUNT; j++)
+            if(s->temp.data[j].valid)
+                fprintf(f, "pudomat_temperature_age{device=\"%s\",rom=\"%016llx\"} %d\n",
+                        d->devices[i].device.id,
+                        (unsigned long long)s->temp.data[j].id,
+                        s->temp.data[j].age);
+    }
+
+    family(f, "voltage_volts", "gauge", "Napeti");
+    for(int i = 0; i < d->device_count; i++)
+        if(d->devices[i].snapshot.time[CMD_VOLT])
+            fprintf(f, "pudomat_voltage_volts{device=\"%s\"} %.3f\n", d->devices[i].device.id,
+                    convert_voltage(d->devices[i].snapshot.volt.voltage));
+
+    family(f, "current_amperes", "gauge", "Proud");
+    for(int i = 0; i < d->device_count; i++)
+        if(d->devices[i].snapshot.time[CMD_VOLT])
+            fprintf(f, "pudomat_current_amperes{device=\"%s\"} %.3f\n", d->devices[i].device.id,
+                    convert_current(d->devices[i].snapshot.volt.current));
+
+    family(f, "relay", "gauge", "Sepnuti rele solaru");
+    for(int i = 0; i < d->device_count; i++)
+        if(d->devices[i].snapshot.time[CMD_VOLT])
+            fprintf(f, "pudomat_relay{device=\"%s\"} %d\n", d->devices[i].device.id,
+                    d->devices[i].snapshot.volt.relay ? 1 : 0);
+
+    for(int c = 0; c < sizeof(counters) / sizeof(counters[0]); c++)
+    {
+        family(f, counters[c].name, "counter", counters[c].help);
+        for(int i = 0; i < d->device_count; i++)
+        {
+            struct snapshot *s = &d->devices[i].snapshot;
+            uint32_t value;
+            if(!s->time[CMD_DBG_READ])
+                continue;
+            memcpy(&value, (char *)&s->debug + counters[c].offset, sizeof(value));
+            fprintf(f, "pudomat_%s_total{device=\"%s\"} %u\n", counters[c].name,
+                    d->devices[i].device.id, value);
+        }
+    }
+
+    family(f, "door_countdown", "gauge", "Odpocet akce dveri");
+    for(int i = 0; i < d->device_count; i++)
+        if(d->devices[i].snapshot.time[CMD_DBG_READ])
+            fprintf(f, "pudomat_door_countdown{device=\"%s\"} %d\n", d->devices[i].device.id,
+                    d->devices[i].snapshot.debug.door_countdown);
+
+    family(f, "door_action", "gauge", "Stav dveri (enum door_action)");
+    for(int i = 0; i < d->device_count; i++)
+        if(d->devices[i].snapshot.time[CMD_DBG_READ])
+            fprintf(f, "pudomat_door_action{device=\"%s\"} %d\n", d->devices[i].device.id,
+                    d->devices[i].snapshot.debug.door_action);
+
+    family(f, "disconnects", "counter", "Vypadky spojeni se zarizenim");
+    for(int i = 0; i < d->device_count; i++)
+        fprintf(f, "pudomat_disconnects_total{device=\"%s\"} %u\n", d->devices[i].device.id,
+                d->devices[i].gaps.count);
+
+    render_usb(&d->pudomat, f);
+    fputs("# EOF\n", f);
+}
+
+static struct exporter_body *make_response(const char *status,
+                                           const char *content_type,
+                                           const char *content, size_t length)
+{
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                              status, content_type, length);
+
+    struct exporter_body *body = malloc(sizeof(*body) + header_len + length);
+    if(!body)
+        return NULL;
+    body->refs = 1;
+    body->length = header_len + length;
+    memcpy(body->data, header, header_len);
+    memcpy(body->data + header_len, content, length);
+    return body;
+}
+
+// renders only when the daemon got new data since the last scrape, every
+// scrape in between shares the cached response
+static struct exporter_body *current_body(struct exporter *exporter)
+{
+    struct daemon *d = exporter->daemon;
+
+    if(exporter->body && exporter->generation == d->generation)
+        return exporter->body;
+
+    char *content = NULL;
+    size_t length = 0;
+    FILE *f = open_memstream(&content, &length);
+    if(!f)
+        return exporter->body;
+    render_metrics(d, f);
+    fclose(f);
+
+    struct exporter_body *body = make_response("200 OK", CONTENT_TYPE, content, length);
+    free(content);
+    if(!body)
+        return exporter->body;
+
+    release(exporter->body);
+    exporter->body = body;
+    exporter->generation = d->generation;
+    return body;
+}
+
+static void drop_connection(struct exporter_connection *c)
+{
+    close(c->fd);
+    release(c->body);
+    c->fd = -1;
+    c->body = NULL;
+    c->request_len = 0;
+    c->sent = 0;
+}
+
+static void send_body(struct exporter_connection *c)
+{
+    while(c->sent < c->body->length)
+    {
+        ssize_t n = send(c->fd, c->body->data + c->sent, c->body->length - c->sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                drop_connection(c);
+            return;
+        }
+        c->sent += n;
+    }
+    drop_connection(c);
+}
+
+static void read_request(struct exporter *exporter, struct exporter_connection *c)
+{
+    ssize_t n = recv(c->fd, c->request + c->request_len,
+                     sizeof(c->request) - 1 - c->request_len, MSG_DONTWAIT);
+    if(n <= 0)
+    {
+        if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            drop_connection(c);
+        return;
+    }
+    c->request_len += n;
+    c->request[c->request_len] = 0;
+
+    if(!strstr(c->request, "\r\n\r\n") && !strstr(c->request, "\n\n"))
+    {
+        if(c->request_len == sizeof(c->request) - 1)
+            drop_connection(c);
+        return;
+    }
+
+    if(strncmp(c->request, "GET /metrics ", 13) == 0 ||
+       strncmp(c->request, "GET / ", 6) == 0)
+    {
+        c->body = current_body(exporter);
+        if(c->body)
+            c->body->refs++;
+    }
+    else
+    {
+        static const char text[] = "Nenalezeno\n";
+        c->body = make_response("404 Not Found", "text/plain; charset=utf-8",
+                                text, sizeof(text) - 1);
+    }
+
+    if(!c->body)
+    {
+        drop_connection(c);
+        return;
+    }
+    send_body(c);
+}
+
+static void accept_connection(struct exporter *exporter)
+{
+    int fd = accept(exporter->listen_fd, NULL, NULL);
+    if(fd < 0)
+        return;
+
+    for(int i = 0; i < EXPORTER_MAX_CONNECTIONS; i++)
+    {
+        struct exporter_connection *c = &exporter->connections[i];
+        if(c->fd < 0)
+        {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            c->fd = fd;
+            c->accepted = time(NULL);
+            return;
+        }
+    }
+    close(fd);
+}
+
+// address is [ipv4:]port, the loopback interface without an address
+int exporter_open(struct exporter *exporter, struct daemon *daemon,
+                  const char *address)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    char host[64];
+    const char *port = strrchr(address, ':');
+    int one = 1;
+
+    exporter->daemon = daemon;
+    exporter->listen_fd = -1;
+    exporter->body = NULL;
+    for(int i = 0; i < EXPORTER_MAX_CONNECTIONS; i++)
+        exporter->connections[i].fd = -1;
+
+    if(port)
+    {
+        if(port - address >= sizeof(host))
+            goto invalid;
+        memcpy(host, address, port - address);
+        host[port - address] = 0;
+        if(inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+            goto invalid;
+        port++;
+    }
+    else
+        port = address;
+
+    char *end;
+    long n = strtol(port, &end, 10);
+    if(*end || n <= 0 || n > 65535)
+        goto invalid;
+    addr.sin_port = htons(n);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        goto err;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+       listen(fd, EXPORTER_MAX_CONNECTIONS) != 0)
+    {
+        close(fd);
+        goto err;
+    }
+
+    exporter->listen_fd = fd;
+    return 0;
+
+invalid:
+    fprintf(stderr, "Neplatna adresa exporteru: %s\n", address);
+    return 1;
+
+err:
+    perror(address);
+    return 1;
+}
+
+void exporter_close(struct exporter *exporter)
+{
+    for(int i = 0; i < EXPORTER_MAX_CONNECTIONS; i++)
+        if(exporter->connections[i].fd >= 0)
+            drop_connection(&exporter->connections[i]);
+
+    release(exporter->body);
+    exporter->body = NULL;
+    if(exporter->listen_fd >= 0)
+        close(exporter->listen_fd);
+    exporter->listen_fd = -1;
+}
+
+int exporter_pollfds(struct exporter *exporter, struct pollfd *fds, int max)
+{
+    time_t now = time(NULL);
+    int count = 0;
+
+    if(exporter->listen_fd < 0 || max < 1)
+        return 0;
+    exporter->poll_slot[count] = -1;
+    fds[count++] = (struct pollfd){ .fd = exporter->listen_fd, .events = POLLIN };
+
+    for(int i = 0; i < EXPORTER_MAX_CONNECTIONS && count < max; i++)
+    {
+        struct exporter_connection *c = &exporter->connections[i];
+        if(c->fd < 0)
+            continue;
+        if(now - c->accepted > EXPORTER_IDLE_SECONDS)
+        {
+            drop_connection(c);
+            continue;
+        }
+        exporter->poll_slot[count] = i;
+        fds[count++] = (struct pollfd){
+            .fd = c->fd, .events = c->body ? POLLOUT : POLLIN
+        };
+    }
+    return count;
+}
+
+void exporter_handle(struct exporter *exporter, const struct pollfd *fds,
+                     int count)
+{
+    for(int i = 1; i < count; i++)
+    {
+        struct exporter_connection *c = &exporter->connections[exporter->poll_slot[i]];
+        if(c->fd != fds[i].fd || !fds[i].revents)
+            continue;
+        if(c->body)
+            send_body(c);
+        else
+            read_request(exporter, c);
+    }
+
+    if(count > 0 && fds[0].revents & POLLIN)
+        accept_connection(exporter);
+}
@@ -0,0 +1,47 @@
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define EXPORTER_MAX_CONNECTIONS 64
+#define EXPORTER_REQUEST_MAX 1024
+#define EXPORTER_IDLE_SECONDS 5
+
+struct daemon;
+
+// one rendered response shared by every connection sending it
+struct exporter_body {
+    int refs;
+    size_t length;
+    char data[];
+};
+
+struct exporter_connection {
+    int fd;
+    time_t accepted;
+    char request[EXPORTER_REQUEST_MAX];
+    size_t request_len;
+    struct exporter_body *body;
+    size_t sent;
+};
+
+struct exporter {
+    struct daemon *daemon;
+    int listen_fd;
+    uint64_t generation; // daemon generation the cached body was rendered at
+    struct exporter_body *body;
+    struct exporter_connection connections[EXPORTER_MAX_CONNECTIONS];
+    int poll_slot[EXPORTER_MAX_CONNECTIONS + 1];
+};
+
+int exporter_open(struct exporter *exporter, struct daemon *daemon,
+                  const char *address);
+void exporter_close(struct exporter *exporter);
+int exporter_pollfds(struct exporter *exporter, struct pollfd *fds, int max);
+void exporter_handle(struct exporter *exporter, const struct pollfd *fds,
+                     int count);
+
+#endif
@@ -1,18 +1,9 @@
 #include <string.h>
-#include <avr/interrupt.h>
-#include <avr/io.h>
-#include <avr/eeprom.h>
-#include <avr/wdt.h>
-#include <util/delay.h>
-#include <util/twi.h>
+#include "hal.h"
 #include "ds18b20.h"
-#include "usbdrv.h"
 #include "romsearch.h"
 #include "comm.h"
 
-#define BIT_ON(r, b) (r |= (1 << b))
-#define BIT_OFF(r, b) (r &= ~(1 << b))
-
 #define barrier()  asm volatile ("" ::: "memory")
 
 #define TIME_43ms   0x1
@@ -38,7 +29,7 @@ static uint8_t led_alert;
 static uint8_t led_on;
 
 struct config config;
-struct config config_eeprom EEMEM;
+struct config config_eeprom HAL_EEMEM;
 volatile static uint8_t config_updated;
 static uint8_t *config_write_tgt;
 
@@ -56,7 +47,7 @@ volatile static int16_t door_countdown;
 
 static void read_config()
 {
-    eeprom_read_block(&config, &config_eeprom, sizeof(config));
+    hal_eeprom_read(&config, &config_eeprom, sizeof(config));
     if(config.signature != CONFIG_SIGNATURE)
     {
         config.solar_relay_decivolt_lo = 126;
@@ -66,30 +57,30 @@ static void read_config()
 
 static void write_config()
 {
-    eeprom_write_block(&config, &config_eeprom, sizeof(config));
+    hal_eeprom_write(&config, &config_eeprom, sizeof(config));
 }
 
 static void green_on()
 {
-    BIT_ON(PORTB, PORTB1);
+    hal_led_on();
     led_on = 1;
 }
 
 static void green_off()
 {
-    BIT_OFF(PORTB, PORTB1);
+    hal_led_off();
     led_on = 0;
 }
 
 static void relay_on()
 {
-    BIT_ON(PORTC, PORTC0);
+    hal_relay_on();
     volt_response.relay = 1;
 }
 
 static void relay_off()
 {
-    BIT_OFF(PORTC, PORTC0);
+    hal_relay_off();
     volt_response.relay = 0;
 }
 
@@ -149,7 +140,7 @@ static void twi_op(uint8_t address, uint8_t reg, uint16_t *val, uint8_t op)
     BIT_ON(twcr, TWINT); // reset TWI interrupt
     BIT_ON(twcr, TWIE);  // enable TWI interrupt
     BIT_ON(twcr, TWSTA); // start transmision;
-    TWCR = twcr;
+    hal_twi_control(twcr);
 }
 
 ISR(TWI_vect)
@@ -159,18 +150,18 @@ ISR(TWI_vect)
     BIT_ON(twcr, TWIE);  // enable TWI interrupt
     BIT_ON(twcr, TWINT); // reset TWI interrupt
     BIT_ON(twcr, TWEN);  // enable TWI bus
-    switch(TW_STATUS)
+    switch(hal_twi_status())
     {
     case TW_START:
     case TW_REP_START:
         switch(twi.status)
         {
         case TWI_SETREG_SEND_ADDRESS:
-            TWDR = twi.address;
+            hal_twi_write(twi.address);
             twi.status = TWI_SETREG_SEND_REGPTR;
             break;
         case TWI_READ_SEND_ADDRESS:
-            TWDR = twi.address | 0x01;
+            hal_twi_write(twi.address | 0x01);
             twi.status = TWI_READ_SEND_ADDRESS_DONE;
             break;
         }
@@ -179,7 +170,7 @@ ISR(TWI_vect)
         switch(twi.status)
         {
         case TWI_SETREG_SEND_REGPTR:
-            TWDR = twi.reg;
+            hal_twi_write(twi.reg);
             twi.status = TWI_SETREG_DONE;
             break;
         default:
@@ -197,12 +188,12 @@ ISR(TWI_vect)
         }
         else //TWI_OP_WRITE
         {
-        TWDR = twi.data1;
+        hal_twi_write(twi.data1);
         twi.status = TWI_WRITE_SEND_BYTE0;
         }
         break;
     case TWI_WRITE_SEND_BYTE0:
-        TWDR = twi.data0;
+        hal_twi_write(twi.data0);
         twi.status = TWI_WRITE_SEND_BYTE1;
         break;
     case TWI_WRITE_SEND_BYTE1:
@@ -228,12 +219,12 @@ ISR(TWI_vect)
         switch(twi.status)
         {
         case TWI_READ_RECV_BYTE0:
-            twi.data1 = TWDR;
+            twi.data1 = hal_twi_read();
             BIT_ON(twcr, TWEA);   //ACK (optional)
             twi.status = TWI_READ_RECV_BYTE1;
             break;
         case TWI_READ_RECV_BYTE1:
-            twi.data0 = TWDR;
+            twi.data0 = hal_twi_read();
             BIT_ON(twcr, TWSTO);
             *twi.p_data = twi.data;
             twi.status = TWI_READY;
@@ -246,35 +237,15 @@ ISR(TWI_vect)
         goto unexpected;
     }
 
-    TWCR = twcr;
+    hal_twi_control(twcr);
     return;
 unexpected:
-    BIT_OFF(TWCR, TWEN); // disable TWI bus
+    hal_twi_disable(); // disable TWI bus
 }
 
 static uint8_t temp_rom_count;
 static uint8_t temp_rom[MAX_TEMP_COUNT * 8] __attribute__((section(".bss")));
 
-volatile uint8_t * const onewire_port = &PORTB;
-volatile uint8_t * const onewire_direction = &DDRB;
-volatile uint8_t * const onewire_portin = &PINB;
-const uint8_t onewire_mask = (1 << PORTB0);
-
-void preempt_wait_us(uint16_t us)     //assumption: interrupts disabled
-{
-    uint16_t cycles = us + (us / 2);  
-    TCNT1 = 0;                        //reset timer1 counter
-    OCR1A = cycles;                   //set timer1 TOP value
-    BIT_ON(TIFR1, OCF1A);             //reset OCF1A flag (sic)
-    TCCR1B |= ((1<<WGM12)|(1<<CS11)); //timer1 clk/8 prescaler, CTC mode
-
-    sei();
-    while(!(TIFR1 & (1 << OCF1A)));    //wait for the counter to hit TOP with interrupts enabled
-    cli();
-
-    TCCR1B = 0;                       //timer1 disable
-}
-
 static void scan_temp()
 {
     green_on();
@@ -531,15 +502,15 @@ static void handle_door()
     uint8_t pressed = 0;
     if(is_time(TIME_87ms, 0))
     {        
-        if(EIFR & (1<<INTF1)) //button pushed?
+        if(hal_button_pushed())
         {
-            BIT_ON(EIFR, INTF1); //clear interrupt request flag (sic)
+            hal_button_clear();
             peak = 1;
         }
         else if(peak == 1)
         {
             peak = 0;
-            if(PIND & (1<<PIND3))
+            if(hal_button_down())
             {
                 pressed = 1;
             }
@@ -592,56 +563,12 @@ ISR(TIMER2_OVF_vect)
 }
 
 
-static void door_open()
-{
-    BIT_OFF(PORTC, PORTC1);
-    BIT_ON(PORTC, PORTC2);
-}
-
-static void door_close()
-{
-    BIT_OFF(PORTC, PORTC2);
-    BIT_ON(PORTC, PORTC1);
-}
-
-static void door_off()
-{
-    PORTC &= ~((1<<PORTC1)|(1<<PORTC2));
-}
-
-static void init()
-{
-    BIT_OFF(MCUCR, PUD);              // enable pull-ups
-    BIT_ON(DDRB, PORTB1);             // enable LED
-    TCCR0B |= ((1<<CS02)|(1<<CS00));  // timer0 clk/1024 prescaler
-    BIT_ON(TIMSK0, TOIE0);            // timer0 overflow interrupt
-    BIT_ON(TWSR, TWPS1);              // 1/16 TWI prescaler
-    TWBR = 4;                         // TWI Bit Rate
-    //TWI Bit Rate = 12MHz / (16 + 2*TWBR*TWIPrescale) =
-    //               12MHz / (16 + 2*4*16) = 83kHz
-    BIT_ON(TCCR2B, CS22);             // timer2 clk/64 prescaler
-    BIT_ON(TIMSK2, TOIE2);            // timer2 overflow interrupt
-
-    EICRA |= ((1<<ISC11)|(1<<ISC10)); // interrupt on rising edge INT1 (door button)
-
-    DDRC |= ((1<<PORTC0)|(1<<PORTC1)|(1<<PORTC2)); // PC0, PC1, PC2 for output (door & solar control)
-}
-
-void init_wdt_disable(void) \
-  __attribute__((naked)) \
-  __attribute__((section(".init3")));
-void init_wdt_disable(void)
-{
-  MCUSR = 0;
-  wdt_disable();
-}
-
 void __attribute__((noreturn)) main(void)
 {
-    wdt_disable();
+    hal_wdt_disable();
 
     cli();
-    init();
+    hal_init();
     relay_off(); 
     green_on();
 
@@ -649,7 +576,7 @@ void __attribute__((noreturn)) main(void)
 
     usbInit();
     usbDeviceDisconnect();
-    _delay_ms(250);
+    hal_delay_ms(250);
     usbDeviceConnect();
 
     sei();
@@ -657,7 +584,7 @@ void __attribute__((noreturn)) main(void)
 
     set_led_alert(TIME_87ms, 3);
 
-    wdt_enable(WDTO_8S);
+    hal_wdt_enable();
 
     for(;;){
         if(config_updated)
@@ -685,7 +612,7 @@ void __attribute__((noreturn)) main(void)
             break;
         case TS_FINISH:
             finish_temp_read();
-            wdt_reset();
+            hal_wdt_reset();
             th_state = TS_FINISH_DONE;
             break;
         }
@@ -694,17 +621,19 @@ void __attribute__((noreturn)) main(void)
         switch(door_action)
         {
         case DA_NO_ACTION:
-            door_off();
+            hal_door_off();
             break;
         case DA_OPEN:
         case DA_FORCE_OPEN:
-            door_open();
+            hal_door_open();
             break;
         case DA_CLOSE:
         case DA_FORCE_CLOSE:
-            door_close();
+            hal_door_close();
             break;
         }
+
+        hal_idle();
     }
 }
 
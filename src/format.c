@@ -0,0 +1,473 @@
+#include <stdlib.h>
+#include <string.h>
+#include "format.h"
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const char *csv_header =
+    "time,device,sensor,temperature,age,voltage,current,relay\n";
+
+int pudomat_format_parse(const char *name, enum pudomat_format *format)
+{
+    static const char *names[] = { "text", "csv", "json", "ndjson" };
+    for(int i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if(strcmp(name, names[i]) == 0)
+        {
+            *format = i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// room for n more bytes; a failed allocation drops output and sets error
+static char *reserve(struct pudomat_writer *w, size_t n)
+{
+    if(w->length + n > w->capacity)
+    {
+        size_t capacity = w->capacity * 2 > w->length + n ? w->capacity * 2
+                                                          : w->length + n;
+        char *data = realloc(w->data, capacity);
+        if(!data)
+        {
+            w->error = 1;
+            return NULL;
+        }
+        w->data = data;
+        w->capacity = capacity;
+    }
+    return w->data + w->length;
+}
+
+static void put(struct pudomat_writer *w, const char *s, size_t n)
+{
+    char *p = reserve(w, n);
+    if(!p)
+        return;
+    memcpy(p, s, n);
+    w->length += n;
+}
+
+static void put_char(struct pudomat_writer *w, char c)
+{
+    char *p = reserve(w, 1);
+    if(!p)
+        return;
+    *p = c;
+    w->length++;
+}
+
+static void put_string(struct pudomat_writer *w, const char *s)
+{
+    put(w, s, strlen(s));
+}
+
+// at least min_digits digits, zero padded
+static void put_uint(struct pudomat_writer *w, uint64_t v, int min_digits)
+{
+    char buffer[24];
+    char *p = buffer + sizeof(buffer);
+
+    while(v >= 100)
+    {
+        p -= 2;
+        memcpy(p, &digit_pairs[(v % 100) * 2], 2);
+        v /= 100;
+    }
+    if(v >= 10)
+    {
+        p -= 2;
+        memcpy(p, &digit_pairs[v * 2], 2);
+    }
+    else
+        *--p = '0' + v;
+    while(buffer + sizeof(buffer) - p < min_digits)
+        *--p = '0';
+    put(w, p, buffer + sizeof(buffer) - p);
+}
+
+static void put_int(struct pudomat_writer *w, int64_t v)
+{
+    if(v < 0)
+    {
+        put_char(w, '-');
+        put_uint(w, -(uint64_t)v, 1);
+    }
+    else
+        put_uint(w, v, 1);
+}
+
+// value / 10^decimals with exactly that many decimals
+static void put_fixed(struct pudomat_writer *w, int64_t value, int decimals)
+{
+    static const uint64_t scale[] = { 1, 10, 100, 1000, 10000 };
+    uint64_t magnitude = value < 0 ? -(uint64_t)value : value;
+
+    if(value < 0)
+        put_char(w, '-');
+    put_uint(w, magnitude / scale[decimals], 1);
+    if(decimals)
+    {
+        put_char(w, '.');
+        put_uint(w, magnitude % scale[decimals], decimals);
+    }
+}
+
+static void put_hex(struct pudomat_writer *w, uint64_t v, int digits)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char *p = reserve(w, digits);
+    if(!p)
+        return;
+    for(int i = digits - 1; i >= 0; i--, v >>= 4)
+        p[i] = hex[v & 15];
+    w->length += digits;
+}
+
+// raw DS18B20 value in sixteenths of a degree, see convert_temperature()
+static int16_t sixteenths(uint16_t raw)
+{
+    return (int16_t)(raw << 4) >> 4;
+}
+
+// as printf("%.2lf") rounds the exact value, ties to even
+static void put_temperature_2(struct pudomat_writer *w, uint16_t raw)
+{
+    int v = sixteenths(raw);
+    unsigned a = (v < 0 ? -v : v) * 100;
+    unsigned q = a / 16, r = a % 16;
+    if(r > 8 || (r == 8 && (q & 1)))
+        q++;
+    put_fixed(w, v < 0 ? -(int64_t)q : q, 2);
+}
+
+static uint32_t millivolts(uint16_t raw)
+{
+    return (raw >> 3) * 4;
+}
+
+// 4 mV steps never fall on a tie
+static void put_volts_2(struct pudomat_writer *w, uint16_t raw)
+{
+    put_fixed(w, (millivolts(raw) + 5) / 10, 2);
+}
+
+// "YYYY-MM-DD HH:MM", the seconds too when asked to; localtime() is only
+// consulted once per local hour
+static void put_time(struct pudomat_writer *w, time_t time, int seconds)
+{
+    if(time < w->hour_start || time >= w->hour_start + 3600)
+    {
+        struct tm tm;
+        if(!localtime_r(&time, &tm))
+        {
+            memset(&tm, 0, sizeof(tm));
+            tm.tm_mday = 1;
+        }
+        w->hour_start = time - tm.tm_min * 60 - tm.tm_sec;
+        snprintf(w->hour, sizeof(w->hour), "%d-%02d-%02d %02d", tm.tm_year + 1900,
+                 tm.tm_mon + 1, tm.tm_mday, tm.tm_hour);
+    }
+
+    int offset = time - w->hour_start;
+    put_string(w, w->hour);
+    put_char(w, ':');
+    put_uint(w, offset / 60, 2);
+    if(seconds)
+    {
+        put_char(w, ':');
+        put_uint(w, offset % 60, 2);
+    }
+}
+
+static void put_csv_string(struct pudomat_writer *w, const char *s)
+{
+    if(!strpbrk(s, ",\"\r\n"))
+    {
+        put_string(w, s);
+        return;
+    }
+    put_char(w, '"');
+    for(; *s; s++)
+    {
+        if(*s == '"')
+            put_char(w, '"');
+        put_char(w, *s);
+    }
+    put_char(w, '"');
+}
+
+static void put_json_string(struct pudomat_writer *w, const char *s)
+{
+    put_char(w, '"');
+    for(; *s; s++)
+    {
+        if(*s == '"' || *s == '\\')
+        {
+            put_char(w, '\\');
+            put_char(w, *s);
+        }
+        else if((uint8_t)*s < 0x20)
+        {
+            put(w, "\\u00", 4);
+            put_hex(w, (uint8_t)*s, 2);
+        }
+        else
+            put_char(w, *s);
+    }
+    put_char(w, '"');
+}
+
+static void maybe_flush(struct pudomat_writer *w)
+{
+    if(w->length >= PUDOMAT_WRITER_BLOCK)
+        pudomat_writer_flush(w);
+}
+
+int pudomat_writer_init(struct pudomat_writer *writer, FILE *out,
+                        enum pudomat_format format, int verbose)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->out = out;
+    writer->format = format;
+    writer->verbose = verbose;
+    writer->hour_start = INT64_MAX - 3600;
+    writer->capacity = PUDOMAT_WRITER_BLOCK + 4096;
+    writer->data = malloc(writer->capacity);
+    if(!writer->data)
+        return 1;
+
+    if(format == FORMAT_CSV)
+        put_string(writer, csv_header);
+    return 0;
+}
+
+static void text_record(struct pudomat_writer *w, const struct pudomat_record *r,
+                        const char *device, int fields)
+{
+    put_time(w, r->time, 1);
+    if(device)
+    {
+        put_char(w, ' ');
+        put_string(w, device);
+    }
+
+    if(fields & PUDOMAT_FIELD_TEMP)
+    {
+        put_char(w, ' ');
+        put_temperature_2(w, r->temperature);
+        if(w->verbose)
+        {
+            put_string(w, "°C[raw=");
+            put_hex(w, r->temperature, 4);
+            put_string(w, ",age=");
+            put_uint(w, r->age, 1);
+            put_char(w, ']');
+        }
+    }
+
+    if((fields & PUDOMAT_FIELD_VOLT) && (w->verbose || !(fields & PUDOMAT_FIELD_TEMP)))
+    {
+        put_char(w, ' ');
+        put_volts_2(w, r->voltage);
+        if(w->verbose)
+        {
+            put_string(w, "V ");
+            put_fixed(w, (r->current >> 3) * 40, 2);
+            put_string(w, "A rele=");
+            put_uint(w, r->relay, 1);
+        }
+        else
+            put_string(w, r->relay ? " 14" : " 12");
+    }
+    put_char(w, '\n');
+}
+
+static void csv_record(struct pudomat_writer *w, const struct pudomat_record *r,
+                       const char *device, int fields)
+{
+    put_int(w, r->time);
+    put_char(w, ',');
+    if(device)
+        put_csv_string(w, device);
+    put_char(w, ',');
+    if(fields & PUDOMAT_FIELD_TEMP)
+    {
+        put_hex(w, r->rom, 16);
+        put_char(w, ',');
+        put_fixed(w, sixteenths(r->temperature) * 625, 4);
+        put_char(w, ',');
+        put_uint(w, r->age, 1);
+    }
+    else
+        put(w, ",,", 2);
+    put_char(w, ',');
+    if(fields & PUDOMAT_FIELD_VOLT)
+    {
+        put_fixed(w, millivolts(r->voltage), 3);
+        put_char(w, ',');
+        put_fixed(w, (r->current >> 3) * 4, 1);
+        put_char(w, ',');
+        put_uint(w, r->relay, 1);
+    }
+    else
+        put(w, ",,", 2);
+    put_char(w, '\n');
+}
+
+static void json_record(struct pudomat_writer *w, const struct pudomat_record *r,
+                        const char *device, int fields)
+{
+    if(w->format == FORMAT_JSON)
+        put(w, w->rows ? ",\n" : "[\n", 2);
+
+    put_string(w, "{\"time\":");
+    put_int(w, r->time);
+    if(device)
+    {
+        put_string(w, ",\"device\":");
+        put_json_string(w, device);
+    }
+    if(fields & PUDOMAT_FIELD_TEMP)
+    {
+        // roms do not fit the precision of JSON numbers
+        put_string(w, ",\"sensor\":\"");
+        put_hex(w, r->rom, 16);
+        put_string(w, "\",\"temperature\":");
+        put_fixed(w, sixteenths(r->temperature) * 625, 4);
+        put_string(w, ",\"age\":");
+        put_uint(w, r->age, 1);
+    }
+    if(fields & PUDOMAT_FIELD_VOLT)
+    {
+        put_string(w, ",\"voltage\":");
+        put_fixed(w, millivolts(r->voltage), 3);
+        put_string(w, ",\"current\":");
+        put_fixed(w, (r->current >> 3) * 4, 1);
+        put_string(w, ",\"relay\":");
+        put_uint(w, r->relay, 1);
+    }
+    put_char(w, '}');
+    if(w->format == FORMAT_NDJSON)
+        put_char(w, '\n');
+}
+
+void pudomat_writer_record(struct pudomat_writer *writer,
+                           const struct pudomat_record *record,
+                           const char *device, int fields)
+{
+    switch(writer->format)
+    {
+    case FORMAT_TEXT:
+        text_record(writer, record, device, fields);
+        break;
+    case FORMAT_CSV:
+        csv_record(writer, record, device, fields);
+        break;
+    case FORMAT_JSON:
+    case FORMAT_NDJSON:
+        json_record(writer, record, device, fields);
+        break;
+    }
+    writer->rows++;
+    maybe_flush(writer);
+}
+
+// the lines of -t and -u; temp is expected sorted by id as comp_temp() does
+static void text_sample(struct pudomat_writer *w, time_t time, const char *device,
+                        const struct temp_response *temp,
+                        const struct volt_response *volt)
+{
+    if(temp)
+    {
+        uint64_t last_id = -1;
+
+        put_time(w, time, 0);
+        if(device)
+        {
+            put_char(w, ' ');
+            put_string(w, device);
+        }
+        for(int i = 0; i < MAX_TEMP_COUNT; i++)
+        {
+            const struct temp_data *t = &temp->data[i];
+            if(!t->valid || t->id == last_id)
+                continue;
+            last_id = t->id;
+
+            put_char(w, ' ');
+            if(!w->verbose)
+            {
+                put_int(w, sixteenths(t->temperature) / 16);
+                continue;
+            }
+            put_temperature_2(w, t->temperature);
+            put_string(w, "°C[raw=");
+            put_hex(w, t->temperature, 4);
+            put_string(w, ",age=");
+            put_uint(w, t->age, 1);
+            put_string(w, ",id=x'");
+            put_hex(w, t->id, 16);
+            put_string(w, "']");
+        }
+        put_char(w, '\n');
+    }
+
+    if(volt)
+    {
+        put_time(w, time, 0);
+        if(device)
+        {
+            put_char(w, ' ');
+            put_string(w, device);
+        }
+        put_char(w, ' ');
+        put_volts_2(w, volt->voltage);
+        put_string(w, volt->relay ? " 14\n" : " 12\n");
+    }
+}
+
+void pudomat_writer_sample(struct pudomat_writer *writer, time_t time,
+                           const char *device, const struct temp_response *temp,
+                           const struct volt_response *volt)
+{
+    if(writer->format == FORMAT_TEXT)
+    {
+        text_sample(writer, time, device, temp, volt);
+        maybe_flush(writer);
+        return;
+    }
+
+    struct pudomat_record records[MAX_TEMP_COUNT];
+    int count = pudomat_sample_records(time, temp, volt, records);
+    int fields = (temp && count && records[0].rom ? PUDOMAT_FIELD_TEMP : 0) |
+                 (volt ? PUDOMAT_FIELD_VOLT : 0);
+    for(int i = 0; i < count; i++)
+        pudomat_writer_record(writer, &records[i], device, fields);
+}
+
+int pudomat_writer_flush(struct pudomat_writer *writer)
+{
+    if(writer->length && fwrite(writer->data, 1, writer->length, writer->out) != writer->length)
+        writer->error = 1;
+    writer->written += writer->length;
+    writer->length = 0;
+    if(fflush(writer->out) != 0)
+        writer->error = 1;
+    return writer->error;
+}
+
+int pudomat_writer_close(struct pudomat_writer *writer)
+{
+    if(writer->format == FORMAT_JSON)
+        put_string(writer, writer->rows ? "\n]\n" : "[]\n");
+
+    int rc = pudomat_writer_flush(writer);
+    free(writer->data);
+    writer->data = NULL;
+    return rc;
+}
@@ -0,0 +1,54 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "store.h"
+
+#define PUDOMAT_WRITER_BLOCK (256 * 1024) // flushed once this much is buffered
+
+enum pudomat_format {
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON,
+    FORMAT_NDJSON,
+};
+
+// which parts of a record are present
+#define PUDOMAT_FIELD_TEMP 1
+#define PUDOMAT_FIELD_VOLT 2
+
+// Formats samples into one growing buffer that is written out in large
+// blocks. Text is the classic output of the program, the other formats
+// carry one row per sensor reading: time in seconds since the epoch,
+// device, sensor rom, temperature in degrees, age, voltage in volts,
+// current in amperes and relay state.
+struct pudomat_writer {
+    FILE *out;
+    enum pudomat_format format;
+    uint8_t verbose;
+    char *data;
+    size_t length;
+    size_t capacity;
+    uint64_t rows;
+    uint64_t written;    // bytes flushed so far
+    int error;
+    int64_t hour_start;  // local hour whose "YYYY-MM-DD HH" is cached
+    char hour[48];
+};
+
+int pudomat_format_parse(const char *name, enum pudomat_format *format);
+
+int pudomat_writer_init(struct pudomat_writer *writer, FILE *out,
+                        enum pudomat_format format, int verbose);
+void pudomat_writer_record(struct pudomat_writer *writer,
+                           const struct pudomat_record *record,
+                           const char *device, int fields);
+void pudomat_writer_sample(struct pudomat_writer *writer, time_t time,
+                           const char *device, const struct temp_response *temp,
+                           const struct volt_response *volt);
+int pudomat_writer_flush(struct pudomat_writer *writer);
+int pudomat_writer_close(struct pudomat_writer *writer);
+
+#endif
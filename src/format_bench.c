@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "format.h"
+
+// Formats millions of history rows in every output format into /dev/null
+// and reports rows and megabytes per second, next to the same CSV written
+// with fprintf().
+//
+//   format-bench [millions of rows]
+
+static const char *names[] = { "text", "csv", "json", "ndjson" };
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void generate(struct pudomat_record *r, uint64_t i)
+{
+    r->time = 1600000000 + (int64_t)(i / 4) * 60;
+    r->rom = 0x28000000000000ffull | (i % 4) << 8;
+    r->temperature = (uint16_t)(int16_t)(200 + (int)(i % 701) - 350);
+    r->age = i % 97 == 0;
+    r->voltage = (3000 + i % 500) << 3;
+    r->current = (i % 40) << 3;
+    r->relay = i / 1000 % 2;
+}
+
+int main(int argc, char *argv[])
+{
+    double millions = argc > 1 ? atof(argv[1]) : 5;
+    uint64_t rows = millions * 1e6;
+    FILE *out = fopen("/dev/null", "w");
+
+    if(rows == 0 || !out)
+    {
+        fprintf(stderr, "pouziti: format-bench [miliony radku]\n");
+        return 1;
+    }
+
+    for(int format = FORMAT_TEXT; format <= FORMAT_NDJSON; format++)
+    {
+        struct pudomat_writer writer;
+        struct pudomat_record r;
+
+        if(pudomat_writer_init(&writer, out, format, 1) != 0)
+            return 1;
+
+        double start = now_s();
+        for(uint64_t i = 0; i < rows; i++)
+        {
+            generate(&r, i);
+            pudomat_writer_record(&writer, &r, "1-1.4",
+                                  PUDOMAT_FIELD_TEMP | PUDOMAT_FIELD_VOLT);
+        }
+        pudomat_writer_close(&writer);
+        double elapsed = now_s() - start;
+
+        printf("format %s rows %llu rows_per_s %.0f mb_per_s %.1f\n", names[format],
+               (unsigned long long)rows, rows / elapsed, writer.written / elapsed / 1e6);
+    }
+
+    double start = now_s();
+    for(uint64_t i = 0; i < rows; i++)
+    {
+        struct pudomat_record r;
+        generate(&r, i);
+        fprintf(out, "%lld,%s,%016llX,%.4f,%u,%.3f,%.1f,%u\n", (long long)r.time, "1-1.4",
+                (unsigned long long)r.rom, convert_temperature(r.temperature), r.age,
+                convert_voltage(r.voltage), convert_current(r.current), r.relay);
+    }
+    fflush(out);
+    double elapsed = now_s() - start;
+    printf("format csv-fprintf rows %llu rows_per_s %.0f\n",
+           (unsigned long long)rows, rows / elapsed);
+
+    fclose(out);
+    return 0;
+}
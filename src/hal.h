@@ -0,0 +1,170 @@
+#ifndef HAL_H
+#define HAL_H
+
+// The firmware's access to the board: pins, timer waits, TWI, EEPROM, the
+// watchdog and V-USB. On the AVR these are the registers themselves, as
+// macros so that the 1-Wire timing stays as tight as with direct register
+// access. Built natively they are the mock peripherals of src/hal_host.c,
+// which run the same firmware on a simulated clock (see make host).
+
+#include <stdint.h>
+
+#define BIT_ON(r, b) (r |= (1 << b))
+#define BIT_OFF(r, b) (r &= ~(1 << b))
+
+#ifdef __AVR__
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/wdt.h>
+#include <util/delay.h>
+#include <util/twi.h>
+#include "usbdrv.h"
+
+// green LED, solar relay and the door motor
+#define hal_led_on() BIT_ON(PORTB, PORTB1)
+#define hal_led_off() BIT_OFF(PORTB, PORTB1)
+#define hal_relay_on() BIT_ON(PORTC, PORTC0)
+#define hal_relay_off() BIT_OFF(PORTC, PORTC0)
+#define hal_door_open() do { BIT_OFF(PORTC, PORTC1); BIT_ON(PORTC, PORTC2); } while(0)
+#define hal_door_close() do { BIT_OFF(PORTC, PORTC2); BIT_ON(PORTC, PORTC1); } while(0)
+#define hal_door_off() (PORTC &= ~((1<<PORTC1)|(1<<PORTC2)))
+
+// door button on INT1: the edge flag, cleared by writing one (sic), and the pin
+#define hal_button_pushed() (EIFR & (1<<INTF1))
+#define hal_button_clear() BIT_ON(EIFR, INTF1)
+#define hal_button_down() (PIND & (1<<PIND3))
+
+// 1-Wire bus on PB0: driven high, pulled low, released to the pull-up
+#define hal_onewire_high() do { BIT_ON(PORTB, PORTB0); BIT_ON(DDRB, DDB0); } while(0)
+#define hal_onewire_low() BIT_OFF(PORTB, PORTB0)
+#define hal_onewire_release() BIT_OFF(DDRB, DDB0)
+#define hal_onewire_read() (PINB & (1<<PINB0))
+
+#define hal_delay_us(us) _delay_us(us)
+#define hal_delay_ms(ms) _delay_ms(ms)
+#define hal_idle()
+
+#define hal_twi_control(twcr) (TWCR = (twcr))
+#define hal_twi_disable() BIT_OFF(TWCR, TWEN)
+#define hal_twi_status() TW_STATUS
+#define hal_twi_read() TWDR
+#define hal_twi_write(data) (TWDR = (data))
+
+#define HAL_EEMEM EEMEM
+#define hal_eeprom_read(dst, src, n) eeprom_read_block(dst, src, n)
+#define hal_eeprom_write(src, dst, n) eeprom_write_block(src, dst, n)
+
+#define hal_wdt_enable() wdt_enable(WDTO_8S)
+#define hal_wdt_disable() wdt_disable()
+#define hal_wdt_reset() wdt_reset()
+
+#else
+
+#include <stddef.h>
+
+// interrupts: the I flag in bit 7 of SREG as on the AVR, sei() runs the
+// interrupts that became pending while they were off
+extern volatile uint8_t hal_sreg;
+#define SREG hal_sreg
+#define cli() hal_cli()
+#define sei() hal_sei()
+#define ISR(vector) void vector(void)
+#define TIMER0_OVF_vect hal_timer0_ovf_vect
+#define TIMER2_OVF_vect hal_timer2_ovf_vect
+#define TWI_vect hal_twi_vect
+void hal_cli(void);
+void hal_sei(void);
+void hal_timer0_ovf_vect(void);
+void hal_timer2_ovf_vect(void);
+void hal_twi_vect(void);
+
+// the firmware's main() is started by the one of src/hal_host.c
+#define main firmware_main
+void firmware_main(void) __attribute__((noreturn));
+
+void hal_led_on(void);
+void hal_led_off(void);
+void hal_relay_on(void);
+void hal_relay_off(void);
+void hal_door_open(void);
+void hal_door_close(void);
+void hal_door_off(void);
+
+uint8_t hal_button_pushed(void);
+void hal_button_clear(void);
+uint8_t hal_button_down(void);
+
+void hal_onewire_high(void);
+void hal_onewire_low(void);
+void hal_onewire_release(void);
+uint8_t hal_onewire_read(void);
+
+void hal_delay_us(double us);
+void hal_delay_ms(double ms);
+void hal_idle(void); // the main loop has nothing to do until the next interrupt
+
+// TWCR bits and TW_STATUS codes of util/twi.h
+#define TWIE 0
+#define TWEN 2
+#define TWSTO 4
+#define TWSTA 5
+#define TWEA 6
+#define TWINT 7
+#define TW_START 0x08
+#define TW_REP_START 0x10
+#define TW_MT_SLA_ACK 0x18
+#define TW_MT_SLA_NACK 0x20
+#define TW_MT_DATA_ACK 0x28
+#define TW_MR_SLA_ACK 0x40
+#define TW_MR_SLA_NACK 0x48
+#define TW_MR_DATA_ACK 0x50
+#define TW_MR_DATA_NACK 0x58
+void hal_twi_control(uint8_t twcr);
+void hal_twi_disable(void);
+uint8_t hal_twi_status(void);
+uint8_t hal_twi_read(void);
+void hal_twi_write(uint8_t data);
+
+#define HAL_EEMEM
+void hal_eeprom_read(void *dst, const void *src, size_t n);
+void hal_eeprom_write(const void *src, void *dst, size_t n);
+
+void hal_wdt_enable(void);
+void hal_wdt_disable(void);
+void hal_wdt_reset(void);
+
+// the part of usbdrv.h the firmware uses, polled by the mock USB host
+typedef uint8_t usbMsgLen_t;
+typedef uint8_t *usbMsgPtr_t;
+#define USB_NO_MSG ((usbMsgLen_t)-1)
+typedef union usbWord {
+    uint16_t word;
+    uint8_t bytes[2];
+} usbWord_t;
+typedef struct usbRequest {
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    usbWord_t wValue;
+    usbWord_t wIndex;
+    usbWord_t wLength;
+} usbRequest_t;
+extern usbMsgPtr_t usbMsgPtr;
+void usbInit(void);
+void usbPoll(void);
+void usbDeviceConnect(void);
+void usbDeviceDisconnect(void);
+usbMsgLen_t usbFunctionSetup(unsigned char data[8]);
+uint8_t usbFunctionWrite(uint8_t *data, uint8_t len);
+
+#endif
+
+// timer1 busy wait with interrupts enabled for its duration; called with
+// them disabled and returns with them disabled
+void preempt_wait_us(uint16_t us);
+
+// timers, TWI, the LED, relay and door pins, INT1 for the door button
+void hal_init(void);
+
+#endif
@@ -0,0 +1,43 @@
+#include "hal.h"
+
+void preempt_wait_us(uint16_t us)     //assumption: interrupts disabled
+{
+    uint16_t cycles = us + (us / 2);
+    TCNT1 = 0;                        //reset timer1 counter
+    OCR1A = cycles;                   //set timer1 TOP value
+    BIT_ON(TIFR1, OCF1A);             //reset OCF1A flag (sic)
+    TCCR1B |= ((1<<WGM12)|(1<<CS11)); //timer1 clk/8 prescaler, CTC mode
+
+    sei();
+    while(!(TIFR1 & (1 << OCF1A)));    //wait for the counter to hit TOP with interrupts enabled
+    cli();
+
+    TCCR1B = 0;                       //timer1 disable
+}
+
+void hal_init()
+{
+    BIT_OFF(MCUCR, PUD);              // enable pull-ups
+    BIT_ON(DDRB, PORTB1);             // enable LED
+    TCCR0B |= ((1<<CS02)|(1<<CS00));  // timer0 clk/1024 prescaler
+    BIT_ON(TIMSK0, TOIE0);            // timer0 overflow interrupt
+    BIT_ON(TWSR, TWPS1);              // 1/16 TWI prescaler
+    TWBR = 4;                         // TWI Bit Rate
+    //TWI Bit Rate = 12MHz / (16 + 2*TWBR*TWIPrescale) =
+    //               12MHz / (16 + 2*4*16) = 83kHz
+    BIT_ON(TCCR2B, CS22);             // timer2 clk/64 prescaler
+    BIT_ON(TIMSK2, TOIE2);            // timer2 overflow interrupt
+
+    EICRA |= ((1<<ISC11)|(1<<ISC10)); // interrupt on rising edge INT1 (door button)
+
+    DDRC |= ((1<<PORTC0)|(1<<PORTC1)|(1<<PORTC2)); // PC0, PC1, PC2 for output (door & solar control)
+}
+
+void init_wdt_disable(void) \
+  __attribute__((naked)) \
+  __attribute__((section(".init3")));
+void init_wdt_disable(void)
+{
+  MCUSR = 0;
+  wdt_disable();
+}
@@ -0,0 +1,910 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hal.h"
+#include "comm.h"
+
+#undef main // the firmware's, this one starts it
+
+// Mock peripherals that run src/firmware.c natively on a simulated clock.
+// Time only passes in waits and while the main loop idles; timer overflows
+// and TWI completions raise their interrupt flags on schedule and the
+// handlers run as soon as interrupts are on, with an overflow that comes
+// while its flag is still set lost as on the AVR. DS18B20 sensors answer on
+// the 1-Wire bus slot by slot, an INA219 at TWI address 0x80 reports a
+// battery voltage swinging across the relay thresholds, and a USB host
+// polls the commands round robin through usbFunctionSetup() and, once, sets
+// the door sensors through usbFunctionWrite().
+//
+//   firmware-host [seconds] [sensors] [requests/s] [noise] [button period s]
+//
+// noise is the probability that a 1-Wire read slot returns the wrong bit.
+// At the end the firmware's debug counters are read over the mock USB and
+// printed with the peripherals' own as "key value" lines.
+
+#define NS 1000LL
+#define MS 1000000LL
+#define S 1000000000LL
+
+#define TIMER0_NS 21845333      // 12 MHz / 1024 / 256
+#define TIMER2_NS 1365333       // 12 MHz / 64 / 256
+#define TWI_START_NS 12000
+#define TWI_BYTE_NS 108000      // 9 bits at 83 kHz
+#define EEPROM_BYTE_NS 3400000
+#define WDT_NS (8 * S)
+#define BUTTON_NS (300 * MS)
+
+#define MAX_SENSORS MAX_TEMP_COUNT
+#define RESET_NS (480 * NS)     // a longer low pulse resets the sensors
+#define SAMPLE_NS (15 * NS)     // a shorter one is a one or a read slot
+#define SLOT_HOLD_NS (30 * NS)  // a sensor sending a zero holds the bus
+#define PRESENCE_FROM_NS (30 * NS)
+#define PRESENCE_UNTIL_NS (150 * NS)
+#define CONVERT_NS (750 * MS)
+
+volatile uint8_t hal_sreg;
+usbMsgPtr_t usbMsgPtr;
+
+static int64_t now;             // simulated ns since power on
+static int64_t end;
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static struct {
+    double seconds;
+    int sensors;
+    double requests_per_s;
+    double noise;
+    double button_period_s;
+} options = { 120, 7, 5, 0, 0 };
+
+static struct {
+    uint64_t timer0;
+    uint64_t timer2;
+    uint64_t timer0_lost;
+    uint64_t timer2_lost;
+    uint64_t twi;
+    int64_t irq_off_since;
+    int64_t irq_off_max;
+    int64_t irq_off_total;
+    uint64_t onewire_resets;
+    uint64_t onewire_slots;
+    uint64_t onewire_flips;
+    uint64_t eeprom_bytes;
+    uint64_t wdt_expired;
+    uint64_t relay_switches;
+    uint64_t door_opens;
+    uint64_t door_closes;
+    uint64_t led_switches;
+    uint64_t usb_requests;
+    uint64_t usb_errors;
+    uint64_t button_pushes;
+} stats;
+
+static uint64_t rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ---- interrupts
+
+enum { IRQ_TIMER2, IRQ_TIMER0, IRQ_TWI, IRQ_COUNT }; // by priority
+
+static uint8_t pending[IRQ_COUNT];
+static int64_t timer0_next = TIMER0_NS, timer2_next = TIMER2_NS;
+static int64_t twi_due = -1;
+static int64_t button_next = -1;
+static int64_t wdt_last = -1;
+
+static void report();
+
+static void dispatch()
+{
+    for(int irq = 0; irq < IRQ_COUNT; irq++)
+    {
+        if(!pending[irq])
+            continue;
+        pending[irq] = 0;
+        hal_sreg &= ~0x80;
+        if(irq == IRQ_TIMER2)
+            hal_timer2_ovf_vect();
+        else if(irq == IRQ_TIMER0)
+            hal_timer0_ovf_vect();
+        else
+            hal_twi_vect();
+        hal_sreg |= 0x80;
+        irq = -1;
+    }
+}
+
+static void raise_irq(int irq, uint64_t *lost)
+{
+    if(pending[irq] && lost)
+        ++*lost;
+    pending[irq] = 1;
+}
+
+// lets the simulated time run to t, raising the interrupts that come due
+// and running them whenever interrupts are on
+static void advance(int64_t t)
+{
+    for(;;)
+    {
+        int64_t next = t;
+        if(timer0_next < next)
+            next = timer0_next;
+        if(timer2_next < next)
+            next = timer2_next;
+        if(twi_due >= 0 && twi_due < next)
+            next = twi_due;
+        if(button_next >= 0 && button_next < next)
+            next = button_next;
+        if(next < now)
+            next = now;
+        now = next;
+
+        if(now >= end)
+        {
+            report();
+            exit(0);
+        }
+        if(wdt_last >= 0 && now - wdt_last > WDT_NS)
+        {
+            stats.wdt_expired++;
+            wdt_last = now;
+        }
+
+        int raised = 0;
+        if(now >= timer0_next)
+        {
+            raise_irq(IRQ_TIMER0, &stats.timer0_lost);
+            stats.timer0++;
+            timer0_next += TIMER0_NS;
+            raised = 1;
+        }
+        if(now >= timer2_next)
+        {
+            raise_irq(IRQ_TIMER2, &stats.timer2_lost);
+            stats.timer2++;
+            timer2_next += TIMER2_NS;
+            raised = 1;
+        }
+        if(twi_due >= 0 && now >= twi_due)
+        {
+            raise_irq(IRQ_TWI, NULL);
+            twi_due = -1;
+            raised = 1;
+        }
+        if(button_next >= 0 && now >= button_next)
+        {
+            stats.button_pushes++;
+            button_next += options.button_period_s * S;
+            raised = 1;
+        }
+        if(hal_sreg & 0x80)
+            dispatch();
+        if(!raised && now >= t)
+            return;
+    }
+}
+
+// the windows with interrupts off are measured from the first sei(), the
+// start up is left out
+void hal_cli()
+{
+    if(hal_sreg & 0x80)
+        stats.irq_off_since = now;
+    hal_sreg &= ~0x80;
+}
+
+void hal_sei()
+{
+    if(!(hal_sreg & 0x80) && stats.irq_off_since >= 0)
+    {
+        int64_t off = now - stats.irq_off_since;
+        stats.irq_off_total += off;
+        if(off > stats.irq_off_max)
+            stats.irq_off_max = off;
+    }
+    hal_sreg |= 0x80;
+    dispatch();
+}
+
+void hal_delay_us(double us)
+{
+    advance(now + us * NS);
+}
+
+void hal_delay_ms(double ms)
+{
+    advance(now + ms * MS);
+}
+
+void hal_idle()
+{
+    int64_t next = timer2_next < timer0_next ? timer2_next : timer0_next;
+    if(twi_due >= 0 && twi_due < next)
+        next = twi_due;
+    advance(next);
+}
+
+void preempt_wait_us(uint16_t us)
+{
+    int64_t until = now + us * NS;
+    sei();
+    advance(until);
+    cli();
+}
+
+void hal_init()
+{
+}
+
+// ---- pins
+
+static uint8_t led, relay, door_opening, door_closing;
+
+void hal_led_on()
+{
+    stats.led_switches += !led;
+    led = 1;
+}
+
+void hal_led_off()
+{
+    led = 0;
+}
+
+void hal_relay_on()
+{
+    stats.relay_switches += !relay;
+    relay = 1;
+}
+
+void hal_relay_off()
+{
+    stats.relay_switches += relay;
+    relay = 0;
+}
+
+void hal_door_open()
+{
+    stats.door_opens += !door_opening;
+    door_opening = 1;
+    door_closing = 0;
+}
+
+void hal_door_close()
+{
+    stats.door_closes += !door_closing;
+    door_closing = 1;
+    door_opening = 0;
+}
+
+void hal_door_off()
+{
+    door_opening = door_closing = 0;
+}
+
+static uint64_t button_seen;
+
+uint8_t hal_button_pushed()
+{
+    return stats.button_pushes != button_seen;
+}
+
+void hal_button_clear()
+{
+    button_seen = stats.button_pushes;
+}
+
+uint8_t hal_button_down()
+{
+    int64_t period = options.button_period_s * S;
+    return period > 0 && now >= period && (now % period) < BUTTON_NS;
+}
+
+// ---- 1-Wire bus with DS18B20 sensors
+
+enum sensor_state {
+    SENSOR_IDLE,        // not addressed until the next reset
+    SENSOR_ROM,         // receiving the ROM command
+    SENSOR_SEARCH,
+    SENSOR_MATCH,
+    SENSOR_FUNCTION,    // receiving the function command
+    SENSOR_SEND,
+    SENSOR_WRITE_SP,
+    SENSOR_CONVERT,
+};
+
+struct sensor {
+    uint8_t rom[8];
+    enum sensor_state state;
+    int bit;            // of the command, ROM or data being transferred
+    int phase;          // search: own bit, its complement, master's choice
+    uint8_t rx;
+    uint8_t tx[9];
+    int tx_bits;
+    uint8_t scratchpad[9];
+    int64_t converted;  // when the running conversion is done
+    int converting;
+    int64_t hold_until; // pulling the bus low for a zero
+};
+
+static struct sensor sensors[MAX_SENSORS];
+static int master_low;
+static int64_t slot_start;
+static int64_t presence_from, presence_until;
+
+static uint8_t crc8(const uint8_t *data, int length)
+{
+    uint8_t crc = 0;
+    for(int i = 0; i < length; i++)
+    {
+        uint8_t byte = data[i];
+        for(int j = 0; j < 8; j++)
+        {
+            uint8_t mix = (crc ^ byte) & 0x01;
+            crc >>= 1;
+            if(mix)
+                crc ^= 0x8C;
+            byte >>= 1;
+        }
+    }
+    return crc;
+}
+
+// a slow swing per sensor, the second warmer than the first by more than the
+// door thresholds for part of it
+static double temperature(int i, int64_t t)
+{
+    return 20 + 3 * i + 5 * sin(2 * M_PI * t / (600.0 * S) + i);
+}
+
+static void sensors_init()
+{
+    for(int i = 0; i < options.sensors; i++)
+    {
+        struct sensor *s = &sensors[i];
+        s->rom[0] = 0x28;
+        for(int b = 1; b < 7; b++)
+            s->rom[b] = rng();
+        s->rom[7] = crc8(s->rom, 7);
+        // power-on scratchpad, 85 degrees
+        uint8_t sp[9] = { 0x50, 0x05, 0x4b, 0x46, 0x7f, 0xff, 0x0c, 0x10 };
+        memcpy(s->scratchpad, sp, sizeof(sp));
+        s->scratchpad[8] = crc8(s->scratchpad, 8);
+    }
+}
+
+static int rom_bit(const struct sensor *s, int bit)
+{
+    return (s->rom[bit / 8] >> (bit % 8)) & 1;
+}
+
+static void sensor_send(struct sensor *s, const uint8_t *data, int bytes)
+{
+    memcpy(s->tx, data, bytes);
+    s->tx_bits = bytes * 8;
+    s->bit = 0;
+    s->state = SENSOR_SEND;
+}
+
+// the bit the sensor puts on the bus in the slot starting now, -1 if none
+static int sensor_output(const struct sensor *s)
+{
+    switch(s->state)
+    {
+    case SENSOR_SEARCH:
+        if(s->phase < 2)
+            return rom_bit(s, s->bit) ^ s->phase;
+        return -1;
+    case SENSOR_SEND:
+        return (s->tx[s->bit / 8] >> (s->bit % 8)) & 1;
+    case SENSOR_CONVERT:
+        return now >= s->converted;
+    default:
+        return -1;
+    }
+}
+
+static void sensor_command(struct sensor *s, uint8_t command)
+{
+    s->bit = 0;
+    switch(command)
+    {
+    case 0xF0: // search ROM
+        s->phase = 0;
+        s->state = SENSOR_SEARCH;
+        break;
+    case 0x55: // match ROM
+        s->state = SENSOR_MATCH;
+        break;
+    case 0xCC: // skip ROM
+        s->state = SENSOR_FUNCTION;
+        break;
+    case 0x33: // read ROM
+        sensor_send(s, s->rom, 8);
+        break;
+    default:
+        s->state = SENSOR_IDLE;
+    }
+}
+
+static void sensor_function(struct sensor *s, uint8_t command, int index)
+{
+    s->bit = 0;
+    switch(command)
+    {
+    case 0x44: // convert
+        s->converted = now + CONVERT_NS;
+        s->converting = 1;
+        s->state = SENSOR_CONVERT;
+        break;
+    case 0xBE: // read scratchpad
+        if(s->converting && now >= s->converted)
+        {
+            int16_t t = lround(temperature(index, s->converted) * 16);
+            s->scratchpad[0] = t;
+            s->scratchpad[1] = t >> 8;
+            s->scratchpad[8] = crc8(s->scratchpad, 8);
+            s->converting = 0;
+        }
+        sensor_send(s, s->scratchpad, 9);
+        break;
+    case 0x4E: // write scratchpad
+        s->state = SENSOR_WRITE_SP;
+        break;
+    default:
+        s->state = SENSOR_IDLE;
+    }
+}
+
+// the master ended a low pulse of the given length
+static void sensor_slot(struct sensor *s, int index, int64_t pulse)
+{
+    int value = pulse < SAMPLE_NS;
+
+    switch(s->state)
+    {
+    case SENSOR_IDLE:
+    case SENSOR_CONVERT:
+        break;
+    case SENSOR_ROM:
+    case SENSOR_FUNCTION:
+        s->rx = (s->rx >> 1) | (value << 7);
+        if(++s->bit == 8)
+        {
+            if(s->state == SENSOR_ROM)
+                sensor_command(s, s->rx);
+            else
+                sensor_function(s, s->rx, index);
+        }
+        break;
+    case SENSOR_SEARCH:
+        if(s->phase++ < 2)
+            break;
+        s->phase = 0;
+        if(value != rom_bit(s, s->bit))
+            s->state = SENSOR_IDLE;
+        else if(++s->bit == 64)
+        {
+            s->bit = 0;
+            s->state = SENSOR_FUNCTION;
+        }
+        break;
+    case SENSOR_MATCH:
+        if(value != rom_bit(s, s->bit))
+            s->state = SENSOR_IDLE;
+        else if(++s->bit == 64)
+        {
+            s->bit = 0;
+            s->state = SENSOR_FUNCTION;
+        }
+        break;
+    case SENSOR_SEND:
+        if(++s->bit == s->tx_bits)
+            s->state = SENSOR_IDLE;
+        break;
+    case SENSOR_WRITE_SP:
+        s->rx = (s->rx >> 1) | (value << 7);
+        if(++s->bit % 8 == 0)
+            s->scratchpad[1 + s->bit / 8] = s->rx;
+        if(s->bit == 24)
+        {
+            s->scratchpad[8] = crc8(s->scratchpad, 8);
+            s->state = SENSOR_IDLE;
+        }
+        break;
+    }
+}
+
+void hal_onewire_low()
+{
+    if(master_low)
+        return;
+    master_low = 1;
+    slot_start = now;
+    for(int i = 0; i < options.sensors; i++)
+        if(sensor_output(&sensors[i]) == 0)
+            sensors[i].hold_until = now + SLOT_HOLD_NS;
+}
+
+static void onewire_rise()
+{
+    int64_t pulse = now - slot_start;
+
+    if(!master_low)
+        return;
+    master_low = 0;
+    if(pulse >= RESET_NS)
+    {
+        stats.onewire_resets++;
+        presence_from = now + PRESENCE_FROM_NS;
+        presence_until = options.sensors ? now + PRESENCE_UNTIL_NS : 0;
+        for(int i = 0; i < options.sensors; i++)
+        {
+            sensors[i].state = SENSOR_ROM;
+            sensors[i].bit = 0;
+            sensors[i].hold_until = 0;
+        }
+        return;
+    }
+    stats.onewire_slots++;
+    for(int i = 0; i < options.sensors; i++)
+        sensor_slot(&sensors[i], i, pulse);
+}
+
+void hal_onewire_high()
+{
+    onewire_rise();
+}
+
+void hal_onewire_release()
+{
+    onewire_rise();
+}
+
+uint8_t hal_onewire_read()
+{
+    int low = master_low || (now >= presence_from && now < presence_until);
+
+    for(int i = 0; i < options.sensors && !low; i++)
+        low = now < sensors[i].hold_until;
+    if(options.noise > 0 && rng() % 1000000 < options.noise * 1000000)
+    {
+        stats.onewire_flips++;
+        low = !low;
+    }
+    return !low;
+}
+
+// ---- TWI with an INA219 at 0x80
+
+static struct {
+    uint8_t enabled;
+    enum { TWI_IDLE, TWI_ADDRESS, TWI_TRANSMIT, TWI_RECEIVE } mode;
+    uint8_t status;
+    uint8_t data;
+    int byte;
+    uint8_t pointer;
+    uint8_t high;
+    uint16_t registers[6];
+} twi;
+
+static uint16_t ina219_register(uint8_t pointer)
+{
+    double volts = 13.5 + 2.5 * sin(2 * M_PI * now / (900.0 * S));
+
+    switch(pointer)
+    {
+    case 0x01: // shunt voltage, 10 uV
+        return 1000 + 500 * sin(2 * M_PI * now / (300.0 * S));
+    case 0x02: // bus voltage, 4 mV from bit 3
+        return (uint16_t)(volts * 250) << 3;
+    default:
+        return twi.registers[pointer % 6];
+    }
+}
+
+void hal_twi_control(uint8_t twcr)
+{
+    twi.enabled = (twcr >> TWEN) & 1;
+    if(!twi.enabled)
+    {
+        twi.mode = TWI_IDLE;
+        twi_due = -1;
+        return;
+    }
+    if(!(twcr & (1 << TWINT)))
+        return;
+
+    if(twcr & (1 << TWSTO))
+    {
+        twi.mode = TWI_IDLE;
+        stats.twi++;
+        return;
+    }
+    if(twcr & (1 << TWSTA))
+    {
+        twi.status = twi.mode == TWI_IDLE ? TW_START : TW_REP_START;
+        twi.mode = TWI_ADDRESS;
+        twi_due = now + TWI_START_NS;
+        return;
+    }
+
+    switch(twi.mode)
+    {
+    case TWI_ADDRESS:
+        if((twi.data & 0xFE) == 0x80)
+        {
+            twi.mode = twi.data & 1 ? TWI_RECEIVE : TWI_TRANSMIT;
+            twi.status = twi.data & 1 ? TW_MR_SLA_ACK : TW_MT_SLA_ACK;
+        }
+        else
+            twi.status = twi.data & 1 ? TW_MR_SLA_NACK : TW_MT_SLA_NACK;
+        twi.byte = 0;
+        break;
+    case TWI_TRANSMIT:
+        if(twi.byte == 0)
+            twi.pointer = twi.data;
+        else if(twi.byte == 1)
+            twi.high = twi.data;
+        else if(twi.byte == 2)
+            twi.registers[twi.pointer % 6] = twi.high << 8 | twi.data;
+        twi.byte++;
+        twi.status = TW_MT_DATA_ACK;
+        break;
+    case TWI_RECEIVE:
+    {
+        uint16_t value = ina219_register(twi.pointer);
+        twi.data = twi.byte++ == 0 ? value >> 8 : value;
+        twi.status = twcr & (1 << TWEA) ? TW_MR_DATA_ACK : TW_MR_DATA_NACK;
+        break;
+    }
+    default:
+        return;
+    }
+    twi_due = now + TWI_BYTE_NS;
+}
+
+void hal_twi_disable()
+{
+    hal_twi_control(0);
+}
+
+uint8_t hal_twi_status()
+{
+    return twi.status;
+}
+
+uint8_t hal_twi_read()
+{
+    return twi.data;
+}
+
+void hal_twi_write(uint8_t data)
+{
+    twi.data = data;
+}
+
+// ---- EEPROM, the firmware's HAL_EEMEM variables themselves
+
+void hal_eeprom_read(void *dst, const void *src, size_t n)
+{
+    memcpy(dst, src, n);
+}
+
+// eeprom_write_block() waits out each byte's erase and write
+void hal_eeprom_write(const void *src, void *dst, size_t n)
+{
+    memcpy(dst, src, n);
+    stats.eeprom_bytes += n;
+    advance(now + n * EEPROM_BYTE_NS);
+}
+
+void hal_wdt_enable()
+{
+    wdt_last = now;
+}
+
+void hal_wdt_disable()
+{
+    wdt_last = -1;
+}
+
+void hal_wdt_reset()
+{
+    if(wdt_last >= 0)
+        wdt_last = now;
+}
+
+// ---- USB host: one setup packet or 8 byte data packet per usbPoll()
+
+static const enum command usb_commands[] = { CMD_TEMP, CMD_VOLT, CMD_DBG_READ, CMD_CFG_READ };
+static int usb_next_command;
+static int64_t usb_next = 500 * MS;
+static int usb_packets;          // data packets of the request in progress
+static struct config usb_config; // being written
+static int usb_written = -1;
+static int usb_configure;
+
+static int response_size(enum command command)
+{
+    switch(command)
+    {
+    case CMD_DBG_READ:
+        return sizeof(struct debug_data);
+    case CMD_VOLT:
+        return sizeof(struct volt_response);
+    case CMD_TEMP:
+        return sizeof(struct temp_response);
+    case CMD_CFG_READ:
+        return sizeof(struct config);
+    default:
+        return 0;
+    }
+}
+
+static usbMsgLen_t setup(enum command command, uint16_t length, int in)
+{
+    usbRequest_t request = {
+        .bmRequestType = in ? 0xC0 : 0x40,
+        .bRequest = command,
+        .wLength.word = length,
+    };
+    return usbFunctionSetup((unsigned char *)&request);
+}
+
+void usbPoll()
+{
+    if(usb_packets)
+    {
+        usb_packets--;
+        return;
+    }
+    if(usb_written >= 0)
+    {
+        int len = sizeof(usb_config) - usb_written < 8 ? sizeof(usb_config) - usb_written : 8;
+        uint8_t rc = usbFunctionWrite((uint8_t *)&usb_config + usb_written, len);
+        usb_written += len;
+        if(rc == 0xFF || (rc == 1) != (usb_written == sizeof(usb_config)))
+            stats.usb_errors++;
+        if(rc != 0)
+            usb_written = -1;
+        return;
+    }
+    if(now < usb_next || options.requests_per_s <= 0)
+        return;
+    usb_next += S / options.requests_per_s;
+    stats.usb_requests++;
+
+    // the door sensors set once all of them are found
+    if(usb_configure && now >= 2 * S)
+    {
+        usb_configure = 0;
+        usb_config = (struct config) {
+            .door_temp_id_A = *(uint64_t *)sensors[0].rom,
+            .door_temp_id_B = *(uint64_t *)sensors[1].rom,
+            .solar_relay_decivolt_lo = 126,
+            .solar_relay_decivolt_hi = 154,
+            .door_temp_diff_close = 1,
+            .door_temp_diff_open = 5,
+            .signature = CONFIG_SIGNATURE,
+        };
+        if(setup(CMD_CFG_WRITE, sizeof(usb_config), 0) != USB_NO_MSG)
+            stats.usb_errors++;
+        else
+            usb_written = 0;
+        return;
+    }
+
+    enum command command = usb_commands[usb_next_command++ % 4];
+    int len = setup(command, response_size(command), 1);
+    if(len != response_size(command))
+        stats.usb_errors++;
+    usb_packets = (len + 7) / 8;
+}
+
+void usbInit()
+{
+}
+
+void usbDeviceConnect()
+{
+}
+
+void usbDeviceDisconnect()
+{
+}
+
+// ---- report
+
+static double start_s;
+
+static void report()
+{
+    struct debug_data debug;
+    struct temp_response temps;
+    double wall = now_s() - start_s;
+
+    setup(CMD_DBG_READ, sizeof(debug), 1);
+    memcpy(&debug, usbMsgPtr, sizeof(debug));
+    setup(CMD_TEMP, sizeof(temps), 1);
+    memcpy(&temps, usbMsgPtr, sizeof(temps));
+
+    printf("host seconds %g wall_s %.3f speedup %.0f sensors %d noise %g\n",
+           (double)now / S, wall, wall > 0 ? now / (wall * S) : 0, options.sensors,
+           options.noise);
+    printf("firmware usb_polls %u usb_reqs %u usb_req_errors %u temp_scans %u "
+           "temp_scan_errors %u temp_scan_warns %u temp_reads %u temp_read_errors %u "
+           "door_action %d door_countdown %d\n",
+           debug.usb_polls, debug.usb_reqs, debug.usb_req_errors, debug.temp_scans,
+           debug.temp_scan_errors, debug.temp_scan_warns, debug.temp_reads,
+           debug.temp_read_errors, debug.door_action, debug.door_countdown);
+    printf("interrupts timer0 %llu timer0_lost %llu timer2 %llu timer2_lost %llu "
+           "off_max_us %.1f off_total_ms %.1f\n",
+           (unsigned long long)stats.timer0, (unsigned long long)stats.timer0_lost,
+           (unsigned long long)stats.timer2, (unsigned long long)stats.timer2_lost,
+           stats.irq_off_max / 1e3, stats.irq_off_total / 1e6);
+    printf("peripherals onewire_resets %llu onewire_slots %llu onewire_flips %llu "
+           "twi_transfers %llu eeprom_bytes %llu wdt_expired %llu usb_requests %llu "
+           "usb_errors %llu\n",
+           (unsigned long long)stats.onewire_resets, (unsigned long long)stats.onewire_slots,
+           (unsigned long long)stats.onewire_flips, (unsigned long long)stats.twi,
+           (unsigned long long)stats.eeprom_bytes, (unsigned long long)stats.wdt_expired,
+           (unsigned long long)stats.usb_requests, (unsigned long long)stats.usb_errors);
+    printf("outputs relay %d relay_switches %llu door_opens %llu door_closes %llu "
+           "button_pushes %llu led_switches %llu\n",
+           relay, (unsigned long long)stats.relay_switches,
+           (unsigned long long)stats.door_opens, (unsigned long long)stats.door_closes,
+           (unsigned long long)stats.button_pushes, (unsigned long long)stats.led_switches);
+    for(int i = 0; i < MAX_TEMP_COUNT; i++)
+        if(temps.data[i].valid)
+            printf("sensor %016llx temperature %.4f age %d\n",
+                   (unsigned long long)temps.data[i].id,
+                   (int16_t)temps.data[i].temperature / 16.0, temps.data[i].age);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc > 1)
+        options.seconds = atof(argv[1]);
+    if(argc > 2)
+        options.sensors = atoi(argv[2]);
+    if(argc > 3)
+        options.requests_per_s = atof(argv[3]);
+    if(argc > 4)
+        options.noise = atof(argv[4]);
+    if(argc > 5)
+        options.button_period_s = atof(argv[5]);
+    if(options.seconds <= 0 || options.sensors < 0 || options.sensors > MAX_SENSORS ||
+       options.requests_per_s < 0 || options.noise < 0 || options.noise > 1 ||
+       options.button_period_s < 0)
+    {
+        fprintf(stderr, "pouziti: firmware-host [sekund] [teplomeru] [pozadavku/s] "
+                        "[sum] [perioda tlacitka s]\n");
+        return 1;
+    }
+
+    end = options.seconds * S;
+    if(options.button_period_s > 0)
+        button_next = options.button_period_s * S;
+    usb_configure = options.sensors >= 2;
+    stats.irq_off_since = -1;
+    sensors_init();
+    start_s = now_s();
+    firmware_main();
+}
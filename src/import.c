@@ -0,0 +1,490 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "import.h"
+
+#define TIMESTAMP_LEN 16      // "YYYY-MM-DD HH:MM" as printed by print_response()
+#define MIN_CHUNK (256 * 1024)
+#define APPEND_BATCH 65536
+
+enum line_kind {
+    LINE_NONE,
+    LINE_TEMP,
+    LINE_VOLT,
+};
+
+struct chunk {
+    const char *start;
+    const char *end;
+    struct pudomat_record *records;
+    size_t count;
+    size_t capacity;
+    uint64_t lines;
+    uint64_t skipped;
+    int64_t hour_key;         // local hour whose utc offset is cached
+    int64_t hour_offset;
+    enum line_kind last_kind; // -t and -u print a sample as two lines
+    int64_t last_time;
+    uint64_t last_label;
+    size_t last_first;
+    int rc;
+};
+
+static int64_t days_from_civil(int y, int m, int d)
+{
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+// the logs are in local time; mktime() is only asked once per hour
+static int64_t local_time(struct chunk *c, int y, int mo, int d, int h, int mi)
+{
+    int64_t key = ((int64_t)(y * 13 + mo) * 32 + d) * 24 + h;
+    int64_t civil = days_from_civil(y, mo, d) * 86400 + h * 3600;
+
+    if(key != c->hour_key)
+    {
+        struct tm tm = {
+            .tm_year = y - 1900, .tm_mon = mo - 1, .tm_mday = d,
+            .tm_hour = h, .tm_isdst = -1
+        };
+        c->hour_key = key;
+        c->hour_offset = mktime(&tm) - civil;
+    }
+    return civil + c->hour_offset + mi * 60;
+}
+
+static int parse_digits(const char *p, int n, int *v)
+{
+    int t = 0;
+    for(int i = 0; i < n; i++)
+    {
+        if(p[i] < '0' || p[i] > '9')
+            return 1;
+        t = t * 10 + (p[i] - '0');
+    }
+    *v = t;
+    return 0;
+}
+
+// an optionally negative decimal integer, returns the end or NULL
+static const char *parse_int(const char *p, const char *end, int64_t *v)
+{
+    int negative = p < end && *p == '-';
+    const char *digits = p + negative;
+    int64_t t = 0;
+
+    for(p = digits; p < end && *p >= '0' && *p <= '9'; p++)
+        t = t * 10 + (*p - '0');
+    if(p == digits)
+        return NULL;
+    *v = negative ? -t : t;
+    return p;
+}
+
+static const char *parse_hex(const char *p, const char *end, uint64_t *v)
+{
+    const char *digits = p;
+    uint64_t t = 0;
+
+    for(; p < end; p++)
+    {
+        if(*p >= '0' && *p <= '9')
+            t = t * 16 + (*p - '0');
+        else if(*p >= 'A' && *p <= 'F')
+            t = t * 16 + (*p - 'A' + 10);
+        else if(*p >= 'a' && *p <= 'f')
+            t = t * 16 + (*p - 'a' + 10);
+        else
+            break;
+    }
+    if(p == digits || p - digits > 16)
+        return NULL;
+    *v = t;
+    return p;
+}
+
+static const char *expect(const char *p, const char *end, const char *s)
+{
+    size_t n = strlen(s);
+    return p && end - p >= n && memcmp(p, s, n) == 0 ? p + n : NULL;
+}
+
+// "12.34" volts to the raw ADC value, see convert_voltage()
+static const char *parse_volts(const char *p, const char *end, uint16_t *v)
+{
+    int64_t whole, hundredths = 0;
+
+    p = parse_int(p, end, &whole);
+    if(!p || p == end || *p != '.' || whole < 0)
+        return NULL;
+    for(int i = 0, scale = 10; i < 2; i++, scale /= 10)
+    {
+        if(++p == end || *p < '0' || *p > '9')
+            return NULL;
+        hundredths += (*p - '0') * scale;
+    }
+    int64_t units = ((whole * 100 + hundredths) * 5 + 1) / 2; // 4 mV steps
+    if(units > 0x1fff)
+        return NULL;
+    *v = units << 3;
+    return p + 1;
+}
+
+// "19.38°C[raw=0136,age=0,id=x'28FF...']", the printed value is redundant
+static const char *parse_verbose(const char *p, const char *end,
+                                 struct pudomat_record *r)
+{
+    uint64_t raw;
+    int64_t age;
+
+    while(p < end && *p != '[')
+        p++;
+    p = expect(p, end, "[raw=");
+    if(!p || !(p = parse_hex(p, end, &raw)) || raw > 0xffff)
+        return NULL;
+    p = expect(p, end, ",age=");
+    if(!p || !(p = parse_int(p, end, &age)) || age < 0 || age > 255)
+        return NULL;
+    p = expect(p, end, ",id=x'");
+    if(!p || !(p = parse_hex(p, end, &r->rom)))
+        return NULL;
+    p = expect(p, end, "']");
+    r->temperature = raw;
+    r->age = age;
+    return p;
+}
+
+static struct pudomat_record *add_record(struct chunk *c)
+{
+    if(c->count == c->capacity)
+    {
+        size_t capacity = c->capacity ? c->capacity * 2 : 4096;
+        struct pudomat_record *records = realloc(c->records, capacity * sizeof(*records));
+        if(!records)
+            return NULL;
+        c->records = records;
+        c->capacity = capacity;
+    }
+    memset(&c->records[c->count], 0, sizeof(*c->records));
+    return &c->records[c->count++];
+}
+
+// lines of -a carry the device id, sensors without a printed id are told
+// apart by it and by their column
+static uint64_t hash_label(const char *p, const char *end)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for(; p < end; p++)
+        h = (h ^ (uint8_t)*p) * 0x100000001b3ull;
+    return (h & 0xffffffffffffull) << 16;
+}
+
+// returns 1 for lines without a sample, -1 when out of memory
+static int parse_line(struct chunk *c, const char *p, const char *end)
+{
+    int y, mo, d, h, mi;
+
+    if(end - p < TIMESTAMP_LEN || p[4] != '-' || p[7] != '-' || p[10] != ' ' ||
+       p[13] != ':' || parse_digits(p, 4, &y) || parse_digits(p + 5, 2, &mo) ||
+       parse_digits(p + 8, 2, &d) || parse_digits(p + 11, 2, &h) ||
+       parse_digits(p + 14, 2, &mi) || mo < 1 || mo > 12 || d < 1 || d > 31 ||
+       h > 23 || mi > 59)
+        return 1;
+
+    int64_t time = local_time(c, y, mo, d, h, mi);
+    size_t first = c->count;
+    uint64_t label = 0;
+    int column = 0, volt = 0, relay = -1;
+    uint16_t voltage = 0;
+
+    for(p += TIMESTAMP_LEN; p < end; )
+    {
+        if(*p == ' ')
+        {
+            p++;
+            continue;
+        }
+
+        const char *token = p, *token_end = p, *parsed;
+        int decimal = 0, verbose = 0;
+        for(; token_end < end && *token_end != ' '; token_end++)
+        {
+            decimal |= *token_end == '.';
+            verbose |= *token_end == '[';
+        }
+        p = token_end;
+
+        int64_t value;
+        struct pudomat_record *r;
+        if(volt)
+        {
+            parsed = parse_int(token, token_end, &value);
+            if(relay >= 0 || !parsed || (value != 12 && value != 14))
+                goto bad;
+            relay = value == 14;
+        }
+        else if(verbose)
+        {
+            if(!(r = add_record(c)))
+                return -1;
+            parsed = parse_verbose(token, token_end, r);
+            r->time = time;
+            column++;
+        }
+        else if(decimal && !column &&
+                (parsed = parse_volts(token, token_end, &voltage)) == token_end)
+            volt = 1;
+        else if((parsed = parse_int(token, token_end, &value)) == token_end)
+        {
+            if(!(r = add_record(c)))
+                return -1;
+            r->time = time;
+            r->rom = label | ++column;
+            r->temperature = (uint16_t)(value * 16);
+        }
+        else if(!column && !label)
+        {
+            label = hash_label(token, token_end);
+            parsed = token_end;
+        }
+        else
+            goto bad;
+
+        if(parsed != token_end)
+            goto bad;
+    }
+
+    int paired = c->last_time == time && c->last_label == label;
+    if(volt)
+    {
+        if(relay < 0)
+            goto bad;
+        if(paired && c->last_kind == LINE_TEMP)
+        {
+            for(size_t i = c->last_first; i < c->count; i++)
+            {
+                c->records[i].voltage = voltage;
+                c->records[i].relay = relay;
+            }
+            c->last_kind = LINE_NONE;
+            return 0;
+        }
+
+        struct pudomat_record *r = add_record(c);
+        if(!r)
+            return -1;
+        r->time = time;
+        r->rom = label;
+        r->voltage = voltage;
+        r->relay = relay;
+        c->last_kind = LINE_VOLT;
+        c->last_first = c->count - 1;
+    }
+    else if(column)
+    {
+        if(paired && c->last_kind == LINE_VOLT && c->last_first == first - 1)
+        {
+            struct pudomat_record v = c->records[first - 1];
+            memmove(&c->records[first - 1], &c->records[first],
+                    (c->count - first) * sizeof(*c->records));
+            c->count--;
+            for(size_t i = first - 1; i < c->count; i++)
+            {
+                c->records[i].voltage = v.voltage;
+                c->records[i].relay = v.relay;
+            }
+            c->last_kind = LINE_NONE;
+            return 0;
+        }
+        c->last_kind = LINE_TEMP;
+        c->last_first = first;
+    }
+    else
+        return 1;
+
+    c->last_time = time;
+    c->last_label = label;
+    return 0;
+
+bad:
+    c->count = first;
+    return 1;
+}
+
+static void *parse_chunk(void *arg)
+{
+    struct chunk *c = arg;
+
+    for(const char *p = c->start; p < c->end; )
+    {
+        const char *nl = memchr(p, '\n', c->end - p);
+        const char *line_end = nl ? nl : c->end;
+
+        if(line_end > p && line_end[-1] == '\r')
+            line_end--;
+        if(line_end > p)
+        {
+            int rc = parse_line(c, p, line_end);
+            if(rc < 0)
+            {
+                c->rc = 1;
+                break;
+            }
+            c->lines++;
+            c->skipped += rc;
+        }
+        p = nl ? nl + 1 : c->end;
+    }
+    return NULL;
+}
+
+// the first line boundary after p that does not split one sample
+static const char *chunk_boundary(const char *start, const char *p, const char *end)
+{
+    const char *nl = memchr(p, '\n', end - p);
+    if(!nl)
+        return end;
+
+    const char *line = nl;
+    while(line > start && line[-1] != '\n')
+        line--;
+
+    for(p = nl + 1; p < end && end - p >= TIMESTAMP_LEN && nl - line >= TIMESTAMP_LEN &&
+                    memcmp(line, p, TIMESTAMP_LEN) == 0; )
+    {
+        nl = memchr(p, '\n', end - p);
+        if(!nl)
+            return end;
+        line = p;
+        p = nl + 1;
+    }
+    return p;
+}
+
+static void parse_chunks(struct chunk *chunks, int count)
+{
+    pthread_t threads[count];
+    int started[count];
+
+    for(int i = 1; i < count; i++)
+        started[i] = pthread_create(&threads[i], NULL, parse_chunk, &chunks[i]) == 0;
+    parse_chunk(&chunks[0]);
+    for(int i = 1; i < count; i++)
+    {
+        if(started[i])
+            pthread_join(threads[i], NULL);
+        else
+            parse_chunk(&chunks[i]);
+    }
+}
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parses a log of printed samples in parallel chunks and appends them to the
+// store in file order.
+int pudomat_import_file(struct pudomat_store *store, const char *path,
+                        int threads, struct pudomat_import_stats *stats)
+{
+    struct stat st;
+    const char *data = NULL;
+    struct chunk *chunks = NULL;
+    int fd, rc = 1;
+
+    memset(stats, 0, sizeof(*stats));
+    double start = now_s();
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &st) != 0)
+    {
+        perror(path);
+        goto err;
+    }
+    stats->bytes = st.st_size;
+    if(!st.st_size)
+    {
+        rc = 0;
+        goto err;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED)
+    {
+        data = NULL;
+        perror(path);
+        goto err;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    if(threads > st.st_size / MIN_CHUNK + 1)
+        threads = st.st_size / MIN_CHUNK + 1;
+    if(threads < 1)
+        threads = 1;
+
+    chunks = calloc(threads, sizeof(*chunks));
+    if(!chunks)
+        goto err;
+
+    const char *end = data + st.st_size, *p = data;
+    for(int i = 0; i < threads; i++)
+    {
+        chunks[i].start = p;
+        chunks[i].hour_key = -1;
+        chunks[i].last_time = INT64_MIN;
+        if(i + 1 < threads && data + st.st_size * (i + 1) / threads > p)
+            p = chunk_boundary(data, data + st.st_size * (i + 1) / threads, end);
+        else if(i + 1 == threads)
+            p = end;
+        chunks[i].end = p;
+    }
+
+    parse_chunks(chunks, threads);
+    stats->parse_seconds = now_s() - start;
+
+    rc = 0;
+    for(int i = 0; i < threads; i++)
+    {
+        struct chunk *c = &chunks[i];
+        if(c->rc != 0)
+        {
+            fprintf(stderr, "%s: nedostatek pameti\n", path);
+            rc = 1;
+        }
+        stats->lines += c->lines;
+        stats->skipped += c->skipped;
+        for(size_t done = 0; rc == 0 && done < c->count; )
+        {
+            int n = c->count - done < APPEND_BATCH ? c->count - done : APPEND_BATCH;
+            if(pudomat_store_append(store, c->records + done, n) != 0)
+                rc = 1;
+            done += n;
+            stats->records += n;
+        }
+    }
+
+err:
+    for(int i = 0; chunks && i < threads; i++)
+        free(chunks[i].records);
+    free(chunks);
+    if(data)
+        munmap((void *)data, st.st_size);
+    if(fd >= 0)
+        close(fd);
+    stats->seconds = now_s() - start;
+    return rc;
+}
@@ -0,0 +1,19 @@
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include <stdint.h>
+#include "store.h"
+
+struct pudomat_import_stats {
+    uint64_t bytes;
+    uint64_t lines;
+    uint64_t records;
+    uint64_t skipped;      // lines without a sample, e.g. -r and -d output
+    double parse_seconds;
+    double seconds;
+};
+
+int pudomat_import_file(struct pudomat_store *store, const char *path,
+                        int threads, struct pudomat_import_stats *stats);
+
+#endif
@@ -0,0 +1,345 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "index.h"
+
+struct posting {
+    uint64_t rom;
+    uint32_t block;
+    uint32_t records;
+};
+
+static int compare_rom(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int compare_posting(const void *a, const void *b)
+{
+    const struct posting *x = a, *y = b;
+    if(x->rom != y->rom)
+        return x->rom < y->rom ? -1 : 1;
+    return x->block < y->block ? -1 : x->block > y->block;
+}
+
+// points the sections into data, which has to hold size bytes
+static int set_sections(struct pudomat_index *index, size_t size)
+{
+    const struct pudomat_index_header *h = index->data;
+
+    if(size < sizeof(*h) || h->magic != PUDOMAT_INDEX_MAGIC ||
+       h->version != PUDOMAT_INDEX_VERSION ||
+       h->block_records != PUDOMAT_INDEX_BLOCK ||
+       size != sizeof(*h) + (size_t)h->block_count * sizeof(struct pudomat_index_block) +
+               (size_t)h->rom_count * sizeof(struct pudomat_index_rom) +
+               (size_t)h->posting_count * sizeof(uint32_t))
+        return 1;
+
+    index->size = size;
+    index->header = h;
+    index->blocks = (const struct pudomat_index_block *)(h + 1);
+    index->roms = (const struct pudomat_index_rom *)(index->blocks + h->block_count);
+    index->postings = (const uint32_t *)(index->roms + h->rom_count);
+    return 0;
+}
+
+int pudomat_index_build(struct pudomat_index *index,
+                        const struct pudomat_segment *segment)
+{
+    uint64_t count = pudomat_segment_count(segment);
+    uint32_t block_count = (count + PUDOMAT_INDEX_BLOCK - 1) / PUDOMAT_INDEX_BLOCK;
+    uint64_t roms[PUDOMAT_INDEX_BLOCK];
+    struct posting *postings = NULL;
+    size_t posting_count = 0;
+    int rc = 1;
+
+    memset(index, 0, sizeof(*index));
+    index->fd = -1;
+
+    // a block never holds more sensors than records
+    postings = malloc((count ? count : 1) * sizeof(*postings));
+    struct pudomat_index_block *blocks = malloc((block_count ? block_count : 1) * sizeof(*blocks));
+    if(!postings || !blocks)
+        goto err;
+
+    int64_t first_time = 0, last_time = 0;
+    for(uint32_t b = 0; b < block_count; b++)
+    {
+        const struct pudomat_record *records = &segment->records[(uint64_t)b * PUDOMAT_INDEX_BLOCK];
+        int n = count - (uint64_t)b * PUDOMAT_INDEX_BLOCK < PUDOMAT_INDEX_BLOCK
+                    ? count - (uint64_t)b * PUDOMAT_INDEX_BLOCK : PUDOMAT_INDEX_BLOCK;
+
+        // writers may interleave, so the times are only nearly sorted
+        blocks[b].first_time = blocks[b].last_time = records[0].time;
+        for(int i = 0; i < n; i++)
+        {
+            if(records[i].time < blocks[b].first_time)
+                blocks[b].first_time = records[i].time;
+            if(records[i].time > blocks[b].last_time)
+                blocks[b].last_time = records[i].time;
+            roms[i] = records[i].rom;
+        }
+        if(!b || blocks[b].first_time < first_time)
+            first_time = blocks[b].first_time;
+        if(!b || blocks[b].last_time > last_time)
+            last_time = blocks[b].last_time;
+
+        qsort(roms, n, sizeof(roms[0]), compare_rom);
+        for(int i = 0; i < n; i++)
+        {
+            if(i > 0 && roms[i] == roms[i - 1])
+            {
+                postings[posting_count - 1].records++;
+                continue;
+            }
+            postings[posting_count++] = (struct posting){ roms[i], b, 1 };
+        }
+    }
+    qsort(postings, posting_count, sizeof(*postings), compare_posting);
+
+    uint32_t rom_count = 0;
+    for(size_t i = 0; i < posting_count; i++)
+        if(!i || postings[i].rom != postings[i - 1].rom)
+            rom_count++;
+
+    size_t size = sizeof(struct pudomat_index_header) +
+                  (size_t)block_count * sizeof(struct pudomat_index_block) +
+                  (size_t)rom_count * sizeof(struct pudomat_index_rom) +
+                  posting_count * sizeof(uint32_t);
+    index->data = calloc(1, size);
+    if(!index->data)
+        goto err;
+
+    struct pudomat_index_header *h = index->data;
+    h->magic = PUDOMAT_INDEX_MAGIC;
+    h->version = PUDOMAT_INDEX_VERSION;
+    h->block_records = PUDOMAT_INDEX_BLOCK;
+    h->block_count = block_count;
+    h->rom_count = rom_count;
+    h->posting_count = posting_count;
+    h->records = count;
+    h->first_time = first_time;
+    h->last_time = last_time;
+
+    struct pudomat_index_block *out_blocks = (struct pudomat_index_block *)(h + 1);
+    struct pudomat_index_rom *out_roms = (struct pudomat_index_rom *)(out_blocks + block_count);
+    uint32_t *out_postings = (uint32_t *)(out_roms + rom_count);
+
+    memcpy(out_blocks, blocks, block_count * sizeof(*blocks));
+    struct pudomat_index_rom *rom = out_roms - 1;
+    for(size_t i = 0; i < posting_count; i++)
+    {
+        if(!i || postings[i].rom != postings[i - 1].rom)
+        {
+            rom++;
+            rom->rom = postings[i].rom;
+            rom->posting = i;
+        }
+        rom->block_count++;
+        rom->records += postings[i].records;
+        out_postings[i] = postings[i].block;
+    }
+
+    rc = set_sections(index, size);
+
+err:
+    if(rc != 0)
+        pudomat_index_free(index);
+    free(postings);
+    free(blocks);
+    return rc;
+}
+
+// stored next to the segment so that other readers need not rebuild it
+static void save_index(const struct pudomat_index *index, const char *path)
+{
+    char tmp[320];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return; // a read-only store is queried without saved indexes
+
+    ssize_t n = write(fd, index->data, index->size);
+    if(close(fd) != 0 || n != (ssize_t)index->size || rename(tmp, path) != 0)
+        unlink(tmp);
+}
+
+// a full segment never changes, so its index is saved and reused; the
+// segment still being written is indexed on every load
+int pudomat_index_load(struct pudomat_index *index, const char *dir,
+                       const struct pudomat_segment *segment)
+{
+    char path[300];
+    struct stat st;
+    uint64_t count = pudomat_segment_count(segment);
+
+    if(count < segment->header->capacity)
+        return pudomat_index_build(index, segment);
+
+    memset(index, 0, sizeof(*index));
+    snprintf(path, sizeof(path), "%s/%08u.idx", dir, segment->number);
+    index->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(index->fd >= 0 && fstat(index->fd, &st) == 0 && st.st_size > 0)
+    {
+        index->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, index->fd, 0);
+        if(index->data == MAP_FAILED)
+            index->data = NULL;
+        else if(set_sections(index, st.st_size) == 0 && index->header->records == count)
+            return 0;
+        else
+            munmap(index->data, st.st_size);
+    }
+    if(index->fd >= 0)
+        close(index->fd);
+
+    if(pudomat_index_build(index, segment) != 0)
+    {
+        fprintf(stderr, "%s: nelze vytvorit index\n", path);
+        return 1;
+    }
+    save_index(index, path);
+    return 0;
+}
+
+const struct pudomat_index_rom *pudomat_index_find(const struct pudomat_index *index,
+                                                   uint64_t rom)
+{
+    uint32_t lo = 0, hi = index->header->rom_count;
+    while(lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(index->roms[mid].rom < rom)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < index->header->rom_count && index->roms[lo].rom == rom
+               ? &index->roms[lo] : NULL;
+}
+
+void pudomat_index_free(struct pudomat_index *index)
+{
+    if(index->fd >= 0)
+    {
+        if(index->data)
+            munmap(index->data, index->size);
+        close(index->fd);
+    }
+    else
+        free(index->data);
+    index->data = NULL;
+    index->header = NULL;
+    index->fd = -1;
+}
+
+// a saved index tells whether a full segment is worth mapping at all
+int pudomat_index_outside(const char *dir, uint32_t number, int64_t from,
+                          int64_t to)
+{
+    struct pudomat_index_header h;
+    char path[300];
+
+    snprintf(path, sizeof(path), "%s/%08u.idx", dir, number);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return 0;
+    ssize_t n = pread(fd, &h, sizeof(h), 0);
+    close(fd);
+
+    return n == sizeof(h) && h.magic == PUDOMAT_INDEX_MAGIC &&
+           h.version == PUDOMAT_INDEX_VERSION &&
+           (h.last_time < from || h.first_time > to);
+}
+
+// calls back the records with from <= time <= to, of one sensor or all of
+// them, in store order; only the blocks the indexes point at are read
+static int scan_store(const char *dir, const uint64_t *rom, int64_t from,
+                      int64_t to, pudomat_query_cb callback, void *arg,
+                      struct pudomat_query_stats *stats)
+{
+    uint32_t count;
+    int stop = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    pudomat_store_segments(dir, &count);
+    stats->segments = count;
+
+    for(uint32_t s = 0; s < count && !stop; s++)
+    {
+        struct pudomat_segment segment;
+        struct pudomat_index index;
+
+        if(pudomat_index_outside(dir, s, from, to))
+            continue;
+        if(pudomat_segment_map(&segment, dir, s) != 0)
+            return 1;
+        if(pudomat_index_load(&index, dir, &segment) != 0)
+        {
+            pudomat_segment_unmap(&segment);
+            return 1;
+        }
+
+        const struct pudomat_index_header *h = index.header;
+        const struct pudomat_index_rom *r = NULL;
+        uint32_t blocks = 0;
+        int touched = 0;
+        if(h->records && h->first_time <= to && h->last_time >= from)
+        {
+            if(!rom)
+                blocks = h->block_count;
+            else if((r = pudomat_index_find(&index, *rom)))
+                blocks = r->block_count;
+        }
+
+        for(uint32_t p = 0; p < blocks && !stop; p++)
+        {
+            uint32_t b = r ? index.postings[r->posting + p] : p;
+            if(index.blocks[b].last_time < from || index.blocks[b].first_time > to)
+                continue;
+
+            if(!touched++)
+                stats->segments_read++;
+            stats->blocks_read++;
+            uint64_t start = (uint64_t)b * PUDOMAT_INDEX_BLOCK;
+            uint64_t end = start + PUDOMAT_INDEX_BLOCK < h->records
+                               ? start + PUDOMAT_INDEX_BLOCK : h->records;
+            for(uint64_t i = start; i < end; i++)
+            {
+                const struct pudomat_record *record = &segment.records[i];
+                stats->records_read++;
+                if((rom && record->rom != *rom) || record->time < from || record->time > to)
+                    continue;
+                stats->records_matched++;
+                if(callback(record, arg) != 0)
+                {
+                    stop = 1;
+                    break;
+                }
+            }
+        }
+
+        pudomat_index_free(&index);
+        pudomat_segment_unmap(&segment);
+    }
+    return 0;
+}
+
+int pudomat_store_query(const char *dir, uint64_t rom, int64_t from, int64_t to,
+                        pudomat_query_cb callback, void *arg,
+                        struct pudomat_query_stats *stats)
+{
+    return scan_store(dir, &rom, from, to, callback, arg, stats);
+}
+
+int pudomat_store_scan(const char *dir, int64_t from, int64_t to,
+                       pudomat_query_cb callback, void *arg,
+                       struct pudomat_query_stats *stats)
+{
+    return scan_store(dir, NULL, from, to, callback, arg, stats);
+}
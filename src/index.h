@@ -0,0 +1,80 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "store.h"
+
+#define PUDOMAT_INDEX_MAGIC 0x49475550 // "PUGI"
+#define PUDOMAT_INDEX_VERSION 1
+#define PUDOMAT_INDEX_BLOCK 512 // records per index block
+
+#pragma pack(push, 1)
+
+// an index file is this header, the time range of every block of the
+// segment, the sensors sorted by rom and the block numbers of each sensor
+struct pudomat_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_records;
+    uint32_t block_count;
+    uint32_t rom_count;
+    uint32_t posting_count;
+    uint64_t records;     // segment records the index covers
+    int64_t first_time;   // oldest and newest record of the segment
+    int64_t last_time;
+    uint8_t padding[24];
+};
+
+struct pudomat_index_block {
+    int64_t first_time;
+    int64_t last_time;
+};
+
+struct pudomat_index_rom {
+    uint64_t rom;
+    uint32_t posting;     // first of its block numbers
+    uint32_t block_count;
+    uint64_t records;
+};
+
+#pragma pack(pop)
+
+struct pudomat_index {
+    int fd;
+    size_t size;
+    void *data;           // mapped file or malloc'd when fd < 0
+    const struct pudomat_index_header *header;
+    const struct pudomat_index_block *blocks;
+    const struct pudomat_index_rom *roms;
+    const uint32_t *postings;
+};
+
+struct pudomat_query_stats {
+    uint32_t segments;         // in the store
+    uint32_t segments_read;    // with a block in the range
+    uint64_t blocks_read;
+    uint64_t records_read;
+    uint64_t records_matched;
+};
+
+typedef int (*pudomat_query_cb)(const struct pudomat_record *record, void *arg);
+
+int pudomat_index_build(struct pudomat_index *index,
+                        const struct pudomat_segment *segment);
+int pudomat_index_load(struct pudomat_index *index, const char *dir,
+                       const struct pudomat_segment *segment);
+const struct pudomat_index_rom *pudomat_index_find(const struct pudomat_index *index,
+                                                   uint64_t rom);
+int pudomat_index_outside(const char *dir, uint32_t number, int64_t from,
+                          int64_t to);
+void pudomat_index_free(struct pudomat_index *index);
+
+int pudomat_store_query(const char *dir, uint64_t rom, int64_t from, int64_t to,
+                        pudomat_query_cb callback, void *arg,
+                        struct pudomat_query_stats *stats);
+int pudomat_store_scan(const char *dir, int64_t from, int64_t to,
+                       pudomat_query_cb callback, void *arg,
+                       struct pudomat_query_stats *stats);
+
+#endif
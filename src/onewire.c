@@ -11,14 +11,10 @@
 	\brief Implements 1wire protocol functions
 */
 
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <util/delay.h>
 #include <inttypes.h>
+#include <hal.h>
 #include <onewire.h>
 
-void preempt_wait_us(uint16_t us);
-
 //! Initializes 1wire bus before transmission
 uint8_t onewireInit()
 {
@@ -29,22 +25,20 @@ uint8_t onewireInit()
 		cli( );
 	#endif
 
-	*onewire_port |= onewire_mask; //Write 1 to output
-	*onewire_direction |= onewire_mask; //Set port to output
-	*onewire_port &= ~onewire_mask; //Write 0 to output
+	hal_onewire_high(); //Write 1 to output, set port to output
+	hal_onewire_low(); //Write 0 to output
 
 	preempt_wait_us( 600 );
 
-	*onewire_direction &= ~onewire_mask; //Set port to input
+	hal_onewire_release(); //Set port to input
 
 	preempt_wait_us( 70 );
 
-	response = *onewire_portin & onewire_mask; //Read input
+	response = hal_onewire_read(); //Read input
 
 	preempt_wait_us( 200 );
 
-	*onewire_port |= onewire_mask; //Write 1 to output
-	*onewire_direction |= onewire_mask; //Set port to output
+	hal_onewire_high(); //Write 1 to output, set port to output
 
 	preempt_wait_us( 600 );
 
@@ -62,17 +56,16 @@ uint8_t onewireWriteBit(uint8_t bit)
 		cli( );
 	#endif
 
-	*onewire_port |= onewire_mask; //Write 1 to output
-	*onewire_direction |= onewire_mask;
-	*onewire_port &= ~onewire_mask; //Write 0 to output
+	hal_onewire_high(); //Write 1 to output
+	hal_onewire_low(); //Write 0 to output
 
-	if ( bit != 0 ) _delay_us( 8 );
+	if ( bit != 0 ) hal_delay_us( 8 );
 	else preempt_wait_us( 80 );
 
-	*onewire_port |= onewire_mask;
+	hal_onewire_high();
 
 	if ( bit != 0 ) preempt_wait_us( 80 );
-	else _delay_us( 2 );
+	else hal_delay_us( 2 );
 
 	SREG = sreg;
 
@@ -105,13 +98,12 @@ uint8_t onewireReadBit()
 		cli( );
 	#endif
 
-	*onewire_port |= onewire_mask; //Write 1 to output
-	*onewire_direction |= onewire_mask;
-	*onewire_port &= ~onewire_mask; //Write 0 to output
-	_delay_us( 2 );
-	*onewire_direction &= ~onewire_mask; //Set port to input
-	_delay_us( 5 );
-	bit = ( ( *onewire_portin & onewire_mask ) != 0 ); //Read input
+	hal_onewire_high(); //Write 1 to output
+	hal_onewire_low(); //Write 0 to output
+	hal_delay_us( 2 );
+	hal_onewire_release(); //Set port to input
+	hal_delay_us( 5 );
+	bit = ( hal_onewire_read() != 0 ); //Read input
 	preempt_wait_us( 60 );
 	SREG = sreg;
 
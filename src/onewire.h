@@ -19,11 +19,6 @@
 #define ONEWIRE_ERROR_OK 	0 //! Communication success
 #define ONEWIRE_ERROR_COMM 	1 //! Communication failure
 
-extern volatile uint8_t * const onewire_port;
-extern volatile uint8_t * const onewire_direction;
-extern volatile uint8_t * const onewire_portin;
-extern const uint8_t onewire_mask;
-
 /**
 	\brief Initializes 1wire bus (basically sends a reset pulse)
 	\param port A pointer to the port output register
@@ -0,0 +1,1007 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "pudomat.h"
+#include "replay.h"
+
+const char *translate_error(int status) {
+    const char *message = "Neznamy status";
+
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+        message = NULL;
+        break;
+    case LIBUSB_TRANSFER_ERROR:
+        message = "Chyba";
+        break;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        message = "Vyprsel cas";
+        break;
+    case LIBUSB_TRANSFER_CANCELLED:
+        message = "Zruseno";
+        break;
+    case LIBUSB_TRANSFER_STALL:
+        message = "Chyba prenosu dat";
+        break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        message = "Odpojeno";
+        break;
+    case LIBUSB_TRANSFER_OVERFLOW:
+        message = "Preteceni datoveho bufferu";
+        break;
+    }
+
+    return message;
+}
+
+uint16_t get_response_size(enum command command)
+{
+    switch(command)
+    {
+    case CMD_DBG_READ:
+        return sizeof(struct debug_data);
+    case CMD_VOLT:
+        return sizeof(struct volt_response);
+    case CMD_TEMP:
+        return sizeof(struct temp_response);
+    case CMD_CFG_READ:
+    case CMD_CFG_WRITE:
+        return sizeof(struct config);
+    default:
+        abort();
+    }
+}
+
+double convert_temperature(uint16_t t) {
+    return (double)((((int16_t)t) << 4) >> 4) / 16;
+}
+
+double convert_voltage(int t) { return (double)(t >> 3) * 0.004; }
+
+double convert_current(int t) { return (double)(t >> 3) * 0.004 * 100; }
+
+static int64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int pudomat_init(struct pudomat *pudomat)
+{
+    memset(pudomat, 0, sizeof(*pudomat));
+    pudomat->transport = &pudomat_libusb_transport;
+    if(libusb_init(&pudomat->ctx) != 0)
+    {
+        fprintf(stderr, "Nelze inicializovat libusb\n");
+        return 1;
+    }
+    return 0;
+}
+
+void pudomat_exit(struct pudomat *pudomat)
+{
+    if(pudomat->recorder)
+        pudomat_record_stop(pudomat->recorder);
+    pudomat->recorder = NULL;
+    if(pudomat->transport)
+        pudomat->transport->stop(pudomat);
+    pudomat->transport = NULL;
+}
+
+static void usb_stop(struct pudomat *pudomat)
+{
+    pudomat_hotplug_deregister(pudomat);
+    if(pudomat->ctx)
+        libusb_exit(pudomat->ctx);
+    pudomat->ctx = NULL;
+}
+
+static int is_pudomat(libusb_device *device)
+{
+    struct libusb_device_descriptor desc;
+    if(libusb_get_device_descriptor(device, &desc) != 0)
+        return 0;
+    return desc.idVendor == PUDOMAT_VID && desc.idProduct == PUDOMAT_PID;
+}
+
+// serial number when the firmware provides one, otherwise the bus and port
+// chain the device is plugged into, e.g. 1-1.4
+static void identify(struct pudomat_device *device)
+{
+    libusb_device *usb_device = libusb_get_device(device->handle);
+    struct libusb_device_descriptor desc;
+    unsigned char *id = (unsigned char *)device->id;
+
+    if(libusb_get_device_descriptor(usb_device, &desc) == 0 && desc.iSerialNumber &&
+       libusb_get_string_descriptor_ascii(device->handle, desc.iSerialNumber,
+                                          id, PUDOMAT_ID_LEN) > 0)
+    {
+        for(; *id; id++)
+            if(*id <= ' ' || *id > '~')
+                *id = '_';
+        return;
+    }
+
+    uint8_t ports[7];
+    int count = libusb_get_port_numbers(usb_device, ports, sizeof(ports));
+    int len = snprintf(device->id, PUDOMAT_ID_LEN, "%d",
+                       libusb_get_bus_number(usb_device));
+    for(int i = 0; i < count && len < PUDOMAT_ID_LEN; i++)
+        len += snprintf(device->id + len, PUDOMAT_ID_LEN - len,
+                        i ? ".%d" : "-%d", ports[i]);
+}
+
+// the cache holds one line per known device: its usbfs node, how long the
+// enumeration that found it took and its identity
+struct cache_entry {
+    char path[32];
+    long long enumerate_us;
+    char id[PUDOMAT_ID_LEN];
+};
+
+// only nodes as write_cache names them, /dev/bus/usb/BBB/AAA, are opened
+static int cache_path_valid(const char *path)
+{
+    char bus[4], address[4];
+    int len = 0;
+
+    return sscanf(path, "/dev/bus/usb/%3[0-9]/%3[0-9]%n", bus, address, &len) == 2 &&
+           len == strlen("/dev/bus/usb/000/000") && !path[len];
+}
+
+static int read_cache(struct cache_entry *entries)
+{
+    int count = 0;
+
+    FILE *f = fopen(PUDOMAT_CACHE, "r");
+    if(!f)
+        return 0;
+    while(count < PUDOMAT_MAX_DEVICES &&
+          fscanf(f, "%31s %lld %31s", entries[count].path,
+                 &entries[count].enumerate_us, entries[count].id) == 3)
+        if(cache_path_valid(entries[count].path))
+            count++;
+    fclose(f);
+    return count;
+}
+
+static void write_cache(struct pudomat_device *device)
+{
+    struct cache_entry entries[PUDOMAT_MAX_DEVICES];
+    libusb_device *usb_device = libusb_get_device(device->handle);
+    char path[32];
+
+    snprintf(path, sizeof(path), "/dev/bus/usb/%03d/%03d",
+             libusb_get_bus_number(usb_device),
+             libusb_get_device_address(usb_device));
+
+    int count = read_cache(entries);
+    int i;
+    for(i = 0; i < count; i++)
+        if(strcmp(entries[i].id, device->id) == 0 || strcmp(entries[i].path, path) == 0)
+            break;
+    if(i == PUDOMAT_MAX_DEVICES)
+        i = PUDOMAT_MAX_DEVICES - 1;
+    if(i == count && count < PUDOMAT_MAX_DEVICES)
+        count++;
+
+    strcpy(entries[i].path, path);
+    entries[i].enumerate_us = device->pudomat->enumerate_us;
+    strcpy(entries[i].id, device->id);
+
+    FILE *f = fopen(PUDOMAT_CACHE, "w");
+    if(!f)
+        return;
+    for(i = 0; i < count; i++)
+        fprintf(f, "%s %lld %s\n", entries[i].path, entries[i].enumerate_us,
+                entries[i].id);
+    fclose(f);
+}
+
+static int open_cached(struct pudomat_device *device, const char *id)
+{
+    struct cache_entry entries[PUDOMAT_MAX_DEVICES];
+    int count = read_cache(entries);
+
+    for(int i = 0; i < count; i++)
+    {
+        if(id && strcmp(entries[i].id, id) != 0)
+            continue;
+
+        int fd = open(entries[i].path, O_RDWR | O_CLOEXEC);
+        if(fd < 0)
+            continue;
+
+        if(libusb_wrap_sys_device(device->pudomat->ctx, fd, &device->handle) != 0)
+        {
+            close(fd);
+            continue;
+        }
+
+        if(!is_pudomat(libusb_get_device(device->handle)))
+        {
+            libusb_close(device->handle);
+            device->handle = NULL;
+            close(fd);
+            continue;
+        }
+
+        device->fd = fd;
+        strcpy(device->id, entries[i].id);
+        device->pudomat->enumerate_us = entries[i].enumerate_us;
+        return 0;
+    }
+
+    return 1;
+}
+
+static int open_by_id(struct pudomat_device *device, const char *id)
+{
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(device->pudomat->ctx, &list);
+    if(count < 0)
+        return 1;
+
+    for(ssize_t i = 0; i < count; i++)
+    {
+        if(!is_pudomat(list[i]) || libusb_open(list[i], &device->handle) != 0)
+            continue;
+
+        identify(device);
+        if(strcmp(device->id, id) == 0)
+            break;
+
+        libusb_close(device->handle);
+        device->handle = NULL;
+    }
+
+    libusb_free_device_list(list, 1);
+    return device->handle ? 0 : 1;
+}
+
+// opens the first Pudomat, or the one with the given identity
+int pudomat_open(struct pudomat *pudomat, struct pudomat_device *device,
+                 const char *id)
+{
+    if(pudomat_is_open(device))
+        return 0;
+
+    device->pudomat = pudomat;
+    return pudomat->transport->open(pudomat, device, id);
+}
+
+static int usb_open(struct pudomat *pudomat, struct pudomat_device *device,
+                    const char *id)
+{
+    int64_t start = now_us();
+    if(open_cached(device, id) == 0)
+    {
+        device->cached = 1;
+        device->open_us = now_us() - start;
+        return 0;
+    }
+
+    device->cached = 0;
+    if(id)
+    {
+        if(open_by_id(device, id) != 0)
+            return 1;
+    }
+    else
+    {
+        device->handle =
+            libusb_open_device_with_vid_pid(pudomat->ctx, PUDOMAT_VID, PUDOMAT_PID);
+        if(!device->handle)
+            return 1;
+        identify(device);
+    }
+
+    device->open_us = pudomat->enumerate_us = now_us() - start;
+    write_cache(device);
+    return 0;
+}
+
+int pudomat_open_all(struct pudomat *pudomat, struct pudomat_device *devices,
+                     int max)
+{
+    return pudomat->transport->open_all(pudomat, devices, max);
+}
+
+static int usb_open_all(struct pudomat *pudomat, struct pudomat_device *devices,
+                        int max)
+{
+    libusb_device **list;
+    int64_t start = now_us();
+    ssize_t count = libusb_get_device_list(pudomat->ctx, &list);
+    if(count < 0)
+        return 0;
+
+    int opened = 0;
+    for(ssize_t i = 0; i < count && opened < max; i++)
+    {
+        struct pudomat_device *device = &devices[opened];
+        device->pudomat = pudomat;
+        device->backend = NULL;
+        device->cached = 0;
+        if(!is_pudomat(list[i]) || libusb_open(list[i], &device->handle) != 0)
+        {
+            device->handle = NULL;
+            continue;
+        }
+        identify(device);
+        opened++;
+    }
+    libusb_free_device_list(list, 1);
+
+    pudomat->enumerate_us = now_us() - start;
+    for(int i = 0; i < opened; i++)
+    {
+        devices[i].open_us = pudomat->enumerate_us;
+        write_cache(&devices[i]);
+    }
+    return opened;
+}
+
+int pudomat_open_device(struct pudomat *pudomat, struct pudomat_device *device,
+                        libusb_device *usb_device)
+{
+    if(pudomat_is_open(device))
+        return 0;
+    if(pudomat->transport != &pudomat_libusb_transport)
+        return 1;
+
+    device->pudomat = pudomat;
+    int64_t start = now_us();
+    if(libusb_open(usb_device, &device->handle) != 0)
+    {
+        device->handle = NULL;
+        return 1;
+    }
+
+    device->cached = 0;
+    device->open_us = now_us() - start;
+    identify(device);
+    write_cache(device);
+    return 0;
+}
+
+void pudomat_close(struct pudomat_device *device)
+{
+    if(pudomat_is_open(device))
+        device->pudomat->transport->close(device);
+}
+
+static void usb_close(struct pudomat_device *device)
+{
+    libusb_close(device->handle);
+    device->handle = NULL;
+
+    if(device->cached)
+        close(device->fd);
+    device->cached = 0;
+}
+
+int pudomat_is_open(const struct pudomat_device *device)
+{
+    return device->handle || device->backend;
+}
+
+int pudomat_reset(struct pudomat_device *device)
+{
+    if(!pudomat_is_open(device))
+        return 1;
+    device->pudomat->stats.resets++;
+    return device->pudomat->transport->reset(device);
+}
+
+static int usb_reset(struct pudomat_device *device)
+{
+    return libusb_reset_device(device->handle) != 0;
+}
+
+// finds the same device again after it dropped off the bus
+int pudomat_reopen(struct pudomat_device *device)
+{
+    char id[PUDOMAT_ID_LEN];
+
+    strcpy(id, device->id);
+    pudomat_close(device);
+    device->pudomat->stats.reopens++;
+    return pudomat_open(device->pudomat, device, id);
+}
+
+int pudomat_is_device(const struct pudomat_device *device,
+                      libusb_device *usb_device)
+{
+    return device->handle && libusb_get_device(device->handle) == usb_device;
+}
+
+static int hotplug_cb(libusb_context *ctx, libusb_device *usb_device,
+                      libusb_hotplug_event event, void *user_data)
+{
+    struct pudomat *pudomat = user_data;
+
+    pudomat->hotplug_cb(usb_device, event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+                        pudomat->hotplug_user_data);
+    return 0;
+}
+
+// the callback runs from pudomat_handle_events(); a device that arrived may
+// only be opened after it returns
+int pudomat_hotplug_register(struct pudomat *pudomat, pudomat_hotplug_cb cb,
+                             void *user_data)
+{
+    if(pudomat->transport != &pudomat_libusb_transport ||
+       !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+        return 1;
+
+    pudomat->hotplug_cb = cb;
+    pudomat->hotplug_user_data = user_data;
+    if(libusb_hotplug_register_callback(pudomat->ctx,
+                                        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                        LIBUSB_HOTPLUG_NO_FLAGS, PUDOMAT_VID, PUDOMAT_PID,
+                                        LIBUSB_HOTPLUG_MATCH_ANY, hotplug_cb, pudomat,
+                                        &pudomat->hotplug) != 0)
+        return 1;
+
+    pudomat->hotplug_registered = 1;
+    return 0;
+}
+
+void pudomat_hotplug_deregister(struct pudomat *pudomat)
+{
+    if(pudomat->hotplug_registered)
+        libusb_hotplug_deregister_callback(pudomat->ctx, pudomat->hotplug);
+    pudomat->hotplug_registered = 0;
+}
+
+void pudomat_report_open(const struct pudomat_device *device)
+{
+    if(device->backend)
+        fprintf(stderr, "Pudomat %s: %s\n", device->id, device->pudomat->transport->name);
+    else if(device->cached)
+        fprintf(stderr, "Pudomat %s otevren z cache za %lld us (uspora %lld us oproti enumeraci)\n",
+                device->id, (long long)device->open_us,
+                (long long)(device->pudomat->enumerate_us - device->open_us));
+    else
+        fprintf(stderr, "Pudomat %s nalezen enumeraci za %lld us\n",
+                device->id, (long long)device->open_us);
+}
+
+const char *pudomat_outcome_names[OUTCOME_COUNT] = {
+    [OUTCOME_COMPLETED] = "completed",
+    [OUTCOME_TIMED_OUT] = "timed_out",
+    [OUTCOME_STALL] = "stall",
+    [OUTCOME_NO_DEVICE] = "no_device",
+    [OUTCOME_ERROR] = "error",
+};
+
+enum pudomat_outcome pudomat_outcome(const struct pudomat_request *request)
+{
+    switch(request->status)
+    {
+    case LIBUSB_TRANSFER_COMPLETED:
+        return pudomat_response(request) ? OUTCOME_COMPLETED : OUTCOME_ERROR;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+        return OUTCOME_TIMED_OUT;
+    case LIBUSB_TRANSFER_STALL:
+        return OUTCOME_STALL;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+        return OUTCOME_NO_DEVICE;
+    default:
+        return OUTCOME_ERROR;
+    }
+}
+
+int64_t pudomat_latency_bound_us(int bucket)
+{
+    return bucket < PUDOMAT_LATENCY_BUCKETS - 1 ? (int64_t)250 << bucket : INT64_MAX;
+}
+
+static void record(struct pudomat *pudomat, const struct pudomat_request *request,
+                   enum pudomat_outcome outcome, int64_t latency_us)
+{
+    struct pudomat_stats *stats = &pudomat->stats;
+    int bucket = 0;
+
+    while(latency_us > pudomat_latency_bound_us(bucket))
+        bucket++;
+    stats->transfers[outcome]++;
+    stats->latency[outcome][bucket]++;
+    stats->latency_sum_us[outcome] += latency_us;
+    if(latency_us > stats->latency_max_us[outcome])
+        stats->latency_max_us[outcome] = latency_us;
+
+    if(outcome != OUTCOME_COMPLETED)
+        return;
+
+    // RFC 6298 smoothing of the round trips that made it
+    struct pudomat_rtt *rtt = &pudomat->rtt[request->command];
+    if(!rtt->samples++)
+    {
+        rtt->srtt_us = latency_us;
+        rtt->rttvar_us = latency_us / 2;
+        return;
+    }
+    int64_t error = rtt->srtt_us > latency_us ? rtt->srtt_us - latency_us
+                                              : latency_us - rtt->srtt_us;
+    rtt->rttvar_us += (error - rtt->rttvar_us) / 4;
+    rtt->srtt_us += (latency_us - rtt->srtt_us) / 8;
+}
+
+// four deviations above the smoothed round trip, doubled with each timeout
+// of the request in a row
+int pudomat_transfer_timeout(const struct pudomat *pudomat,
+                             enum command command, int attempts)
+{
+    const struct pudomat_rtt *rtt = &pudomat->rtt[command];
+    if(rtt->samples < PUDOMAT_RTT_SAMPLES)
+        return PUDOMAT_TIMEOUT_MS;
+
+    int64_t timeout = (rtt->srtt_us + 4 * rtt->rttvar_us) / 1000 + 1;
+    if(timeout < PUDOMAT_TIMEOUT_MIN_MS)
+        timeout = PUDOMAT_TIMEOUT_MIN_MS;
+    for(int i = 0; i < attempts && timeout < PUDOMAT_TIMEOUT_MS; i++)
+        timeout *= 2;
+    return timeout < PUDOMAT_TIMEOUT_MS ? timeout : PUDOMAT_TIMEOUT_MS;
+}
+
+// What to do after a failed transfer, given up after PUDOMAT_RETRIES in a
+// row. A timeout means the firmware was busy with interrupts off, so it is
+// retried at once with a longer timeout and the device is reset only when
+// that keeps happening. A stall is the firmware refusing the request: a short
+// pause, then a reset clears the endpoint. A device that dropped off is
+// looked up again. Anything else gets growing pauses and a late reset.
+struct pudomat_step pudomat_next_step(struct pudomat_request *request)
+{
+    struct pudomat_stats *stats = &request->device->pudomat->stats;
+    struct pudomat_step step = { ACTION_RETRY, 0 };
+    int attempts = ++request->attempts;
+
+    switch(pudomat_outcome(request))
+    {
+    case OUTCOME_COMPLETED:
+        request->attempts = 0;
+        return step;
+    case OUTCOME_TIMED_OUT:
+        if(attempts == 3)
+            step.action = ACTION_RESET;
+        step.delay_ms = 10 * attempts;
+        break;
+    case OUTCOME_STALL:
+        if(attempts == 2)
+            step.action = ACTION_RESET;
+        step.delay_ms = 50;
+        break;
+    case OUTCOME_NO_DEVICE:
+        step.action = ACTION_REOPEN;
+        step.delay_ms = 250 * attempts;
+        break;
+    default:
+        if(attempts == 4)
+            step.action = ACTION_RESET;
+        step.delay_ms = 80 * attempts;
+        break;
+    }
+
+    if(attempts >= PUDOMAT_RETRIES)
+    {
+        step.action = ACTION_GIVE_UP;
+        stats->give_ups++;
+    }
+    else
+        stats->retries++;
+    return step;
+}
+
+static void request_cb(struct libusb_transfer *transfer)
+{
+    struct pudomat_request *request = transfer->user_data;
+    struct pudomat *pudomat = request->device->pudomat;
+    int64_t latency_us = now_us() - request->submitted_us;
+
+    request->in_flight = 0;
+    request->status = transfer->status;
+    if(pudomat->recorder)
+        pudomat_record_transfer(pudomat->recorder, request, latency_us);
+    record(pudomat, request, pudomat_outcome(request), latency_us);
+    if(request->callback)
+        request->callback(request);
+}
+
+int pudomat_request_init(struct pudomat_request *request,
+                         struct pudomat_device *device, enum command command,
+                         pudomat_cb callback, void *user_data)
+{
+    memset(request, 0, sizeof(*request));
+    request->device = device;
+    request->command = command;
+    request->callback = callback;
+    request->user_data = user_data;
+    request->transfer = libusb_alloc_transfer(0);
+    if(!request->transfer)
+        return 1;
+
+    libusb_fill_control_setup(request->buffer,
+                              LIBUSB_RECIPIENT_DEVICE | LIBUSB_REQUEST_TYPE_VENDOR | (command == CMD_CFG_WRITE ? LIBUSB_ENDPOINT_OUT : LIBUSB_ENDPOINT_IN),
+                              command,
+                              0,
+                              0,
+                              get_response_size(command));
+    return 0;
+}
+
+void pudomat_request_free(struct pudomat_request *request)
+{
+    if(request->transfer)
+        libusb_free_transfer(request->transfer);
+    request->transfer = NULL;
+}
+
+void pudomat_request_config(struct pudomat_request *request,
+                            const struct config *config)
+{
+    struct config *payload = (void *)(request->buffer + LIBUSB_CONTROL_SETUP_SIZE);
+    memcpy(payload, config, sizeof(struct config));
+    payload->signature = CONFIG_SIGNATURE;
+}
+
+int pudomat_submit(struct pudomat_request *request, const void *data)
+{
+    if(request->in_flight)
+        return 1;
+
+    if(!pudomat_is_open(request->device))
+    {
+        request->status = LIBUSB_TRANSFER_NO_DEVICE;
+        return 1;
+    }
+
+    if(request->command == CMD_CFG_WRITE && data)
+        pudomat_request_config(request, data);
+
+    libusb_fill_control_transfer(request->transfer, request->device->handle,
+                                 request->buffer, request_cb, request,
+                                 pudomat_transfer_timeout(request->device->pudomat,
+                                                          request->command,
+                                                          request->attempts));
+    request->submitted_us = now_us();
+
+    int rc = request->device->pudomat->transport->submit(request);
+    if(rc != 0)
+    {
+        // only a board that is gone is reopened, a busy or short of memory
+        // one goes through the retries and resets like a failed transfer
+        request->status = rc == LIBUSB_ERROR_NO_DEVICE ? LIBUSB_TRANSFER_NO_DEVICE
+                                                       : LIBUSB_TRANSFER_ERROR;
+        return 1;
+    }
+
+    request->in_flight = 1;
+    return 0;
+}
+
+static int usb_submit(struct pudomat_request *request)
+{
+    return libusb_submit_transfer(request->transfer);
+}
+
+int pudomat_cancel(struct pudomat_request *request)
+{
+    if(!request->in_flight)
+        return 1;
+    return request->device->pudomat->transport->cancel(request);
+}
+
+static int usb_cancel(struct pudomat_request *request)
+{
+    return libusb_cancel_transfer(request->transfer) != 0;
+}
+
+const void *pudomat_response(const struct pudomat_request *request)
+{
+    if(request->status != LIBUSB_TRANSFER_COMPLETED)
+        return NULL;
+
+    if(request->transfer->actual_length != get_response_size(request->command))
+        return NULL;
+
+    return request->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+}
+
+int pudomat_pollfds(struct pudomat *pudomat, struct pollfd *fds, int max)
+{
+    return pudomat->transport->pollfds(pudomat, fds, max);
+}
+
+static int usb_pollfds(struct pudomat *pudomat, struct pollfd *fds, int max)
+{
+    const struct libusb_pollfd **usb_fds = libusb_get_pollfds(pudomat->ctx);
+    int count = 0;
+
+    for(; usb_fds && usb_fds[count] && count < max; count++)
+        fds[count] = (struct pollfd){ .fd = usb_fds[count]->fd,
+                                      .events = usb_fds[count]->events };
+    libusb_free_pollfds(usb_fds);
+    return count;
+}
+
+void pudomat_set_fd_notifiers(struct pudomat *pudomat,
+                              pudomat_fd_added_cb added,
+                              pudomat_fd_removed_cb removed, void *user_data)
+{
+    if(pudomat->ctx)
+        libusb_set_pollfd_notifiers(pudomat->ctx, added, removed, user_data);
+}
+
+// milliseconds until pudomat_handle_events() must be called even without
+// descriptor activity, -1 when only descriptor activity matters
+int pudomat_timeout(struct pudomat *pudomat)
+{
+    return pudomat->transport->timeout(pudomat);
+}
+
+static int usb_timeout(struct pudomat *pudomat)
+{
+    struct timeval tv;
+    if(libusb_get_next_timeout(pudomat->ctx, &tv) != 1)
+        return -1;
+    return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+int pudomat_handle_events(struct pudomat *pudomat, int timeout_ms)
+{
+    return pudomat->transport->handle_events(pudomat, timeout_ms);
+}
+
+static int usb_handle_events(struct pudomat *pudomat, int timeout_ms)
+{
+    struct timeval tv = { .tv_sec = timeout_ms / 1000,
+                          .tv_usec = (timeout_ms % 1000) * 1000 };
+    return libusb_handle_events_timeout(pudomat->ctx, &tv) != 0;
+}
+
+const struct pudomat_transport pudomat_libusb_transport = {
+    .name = "libusb",
+    .open = usb_open,
+    .open_all = usb_open_all,
+    .close = usb_close,
+    .reset = usb_reset,
+    .submit = usb_submit,
+    .cancel = usb_cancel,
+    .pollfds = usb_pollfds,
+    .timeout = usb_timeout,
+    .handle_events = usb_handle_events,
+    .stop = usb_stop,
+};
+
+// the transfer is finished already, the completion runs at due_us from
+// pudomat_handle_events()
+int pudomat_schedule(struct pudomat_request *request, int64_t due_us)
+{
+    struct pudomat *pudomat = request->device->pudomat;
+
+    if(pudomat->scheduled_count == PUDOMAT_SCHEDULED)
+        return LIBUSB_ERROR_BUSY;
+    // after the completions due now, which may submit again
+    if(due_us <= now_us())
+        due_us = now_us() + 1;
+    pudomat->scheduled[pudomat->scheduled_count++] =
+        (struct pudomat_scheduled){ .request = request, .due_us = due_us };
+    return 0;
+}
+
+static void complete(struct pudomat *pudomat, int i)
+{
+    struct libusb_transfer *transfer = pudomat->scheduled[i].request->transfer;
+
+    pudomat->scheduled[i] = pudomat->scheduled[--pudomat->scheduled_count];
+    transfer->callback(transfer);
+}
+
+int pudomat_scheduled_cancel(struct pudomat_request *request)
+{
+    struct pudomat *pudomat = request->device->pudomat;
+
+    for(int i = 0; i < pudomat->scheduled_count; i++)
+        if(pudomat->scheduled[i].request == request)
+        {
+            request->transfer->status = LIBUSB_TRANSFER_CANCELLED;
+            request->transfer->actual_length = 0;
+            complete(pudomat, i);
+            return 0;
+        }
+    return 1;
+}
+
+int pudomat_scheduled_pollfds(struct pudomat *pudomat, struct pollfd *fds, int max)
+{
+    return 0;
+}
+
+static int64_t next_due(const struct pudomat *pudomat)
+{
+    int64_t due = INT64_MAX;
+    for(int i = 0; i < pudomat->scheduled_count; i++)
+        if(pudomat->scheduled[i].due_us < due)
+            due = pudomat->scheduled[i].due_us;
+    return due;
+}
+
+int pudomat_scheduled_timeout(struct pudomat *pudomat)
+{
+    if(!pudomat->scheduled_count)
+        return -1;
+    int64_t left = next_due(pudomat) - now_us();
+    return left > 0 ? (left + 999) / 1000 : 0;
+}
+
+// sleeps until the first completion due, timeout_ms at most, then runs all
+// that are due
+int pudomat_scheduled_handle_events(struct pudomat *pudomat, int timeout_ms)
+{
+    int64_t now = now_us();
+    int64_t until = now + (int64_t)timeout_ms * 1000;
+    int64_t due = next_due(pudomat);
+
+    if(due < until)
+        until = due;
+    if(until > now)
+    {
+        struct timespec ts = { .tv_sec = (until - now) / 1000000,
+                               .tv_nsec = (until - now) % 1000000 * 1000 };
+        nanosleep(&ts, NULL);
+        now = now_us();
+    }
+
+    for(int i = 0; i < pudomat->scheduled_count;)
+    {
+        if(pudomat->scheduled[i].due_us > now)
+            i++;
+        else
+        {
+            complete(pudomat, i);
+            i = 0;
+        }
+    }
+    return 0;
+}
+
+// a reset or reopen is done once per device and round
+static int acted_before(struct pudomat_request *requests, const uint8_t *acted,
+                        int i)
+{
+    for(int j = 0; j < i; j++)
+        if(requests[j].device == requests[i].device && acted[j])
+            return 1;
+    return 0;
+}
+
+// submits all requests together and waits for them in one event loop; failed
+// ones are resubmitted together after the longest pause their failures ask
+// for, see pudomat_next_step()
+int pudomat_run(struct pudomat *pudomat, struct pudomat_request *requests,
+                int count)
+{
+    uint8_t done[count], acted[count];
+    int pending = count;
+
+    for(int i = 0; i < count; i++)
+    {
+        requests[i].attempts = 0;
+        done[i] = 0;
+    }
+
+    while(pending)
+    {
+        for(int i = 0; i < count; i++)
+            if(!done[i] && !pudomat_response(&requests[i]))
+                pudomat_submit(&requests[i], NULL);
+
+        for(;;)
+        {
+            int busy = 0;
+            for(int i = 0; i < count; i++)
+                busy |= requests[i].in_flight;
+            if(!busy)
+                break;
+            pudomat_handle_events(pudomat, PUDOMAT_TIMEOUT_MS);
+        }
+
+        int delay_ms = 0;
+        pending = 0;
+        for(int i = 0; i < count; i++)
+        {
+            acted[i] = 0;
+            if(done[i] || pudomat_response(&requests[i]))
+            {
+                done[i] = 1;
+                continue;
+            }
+
+            struct pudomat_step step = pudomat_next_step(&requests[i]);
+            if(step.action == ACTION_GIVE_UP)
+            {
+                const char *msg = translate_error(requests[i].status);
+                fprintf(stderr, "%s: %s\n", requests[i].device->id,
+                        msg ? msg : "Chybna delka odpovedi");
+                done[i] = 1;
+                continue;
+            }
+            if(step.action == ACTION_RESET && !acted_before(requests, acted, i))
+            {
+                acted[i] = 1;
+                pudomat_reset(requests[i].device);
+            }
+            else if(step.action == ACTION_REOPEN && !acted_before(requests, acted, i))
+            {
+                // time to come back on the bus
+                acted[i] = 1;
+                usleep(step.delay_ms * 1000);
+                step.delay_ms = 0;
+                pudomat_reopen(requests[i].device);
+            }
+            pending++;
+            if(step.delay_ms > delay_ms)
+                delay_ms = step.delay_ms;
+        }
+        if(pending)
+            usleep(delay_ms * 1000);
+    }
+
+    for(int i = 0; i < count; i++)
+        if(!pudomat_response(&requests[i]))
+            return 1;
+    return 0;
+}
+
+void pudomat_report_stats(const struct pudomat *pudomat)
+{
+    static const char *outcomes[OUTCOME_COUNT] = {
+        [OUTCOME_COMPLETED] = "Dokonceno", [OUTCOME_TIMED_OUT] = "Vyprsel cas",
+        [OUTCOME_STALL] = "Chyba prenosu dat", [OUTCOME_NO_DEVICE] = "Odpojeno",
+        [OUTCOME_ERROR] = "Chyba",
+    };
+    static const char *commands[PUDOMAT_CMD_COUNT] = {
+        [CMD_DBG_READ] = "ladici data", [CMD_VOLT] = "napeti", [CMD_TEMP] = "teploty",
+        [CMD_CFG_READ] = "cteni konfigurace", [CMD_CFG_WRITE] = "zapis konfigurace",
+    };
+    const struct pudomat_stats *stats = &pudomat->stats;
+
+    for(int o = 0; o < OUTCOME_COUNT; o++)
+    {
+        if(!stats->transfers[o])
+            continue;
+        fprintf(stderr, "%s: %llu prenosu, prumer %.2f ms, max %.2f ms,", outcomes[o],
+                (unsigned long long)stats->transfers[o],
+                stats->latency_sum_us[o] / 1000.0 / stats->transfers[o],
+                stats->latency_max_us[o] / 1000.0);
+        for(int b = 0; b < PUDOMAT_LATENCY_BUCKETS; b++)
+        {
+            if(!stats->latency[o][b])
+                continue;
+            if(b == PUDOMAT_LATENCY_BUCKETS - 1)
+                fprintf(stderr, " vic:%llu", (unsigned long long)stats->latency[o][b]);
+            else
+                fprintf(stderr, " <=%gms:%llu", pudomat_latency_bound_us(b) / 1000.0,
+                        (unsigned long long)stats->latency[o][b]);
+        }
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "Opakovani: %llu, resetu: %llu, znovu otevreni: %llu, vzdano: %llu\n",
+            (unsigned long long)stats->retries, (unsigned long long)stats->resets,
+            (unsigned long long)stats->reopens, (unsigned long long)stats->give_ups);
+    for(int c = CMD_DBG_READ; c < PUDOMAT_CMD_COUNT; c++)
+        if(pudomat->rtt[c].samples)
+            fprintf(stderr, "Casovy limit pro %s: %d ms (odezva %.2f ms +- %.2f ms)\n",
+                    commands[c], pudomat_transfer_timeout(pudomat, c, 0),
+                    pudomat->rtt[c].srtt_us / 1000.0, pudomat->rtt[c].rttvar_us / 1000.0);
+    if(pudomat->recorder)
+        fprintf(stderr, "Zaznamenano prenosu: %llu\n",
+                (unsigned long long)pudomat->recorder->transactions);
+    if(pudomat->transport->report)
+        pudomat->transport->report(pudomat);
+}
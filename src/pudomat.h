@@ -0,0 +1,217 @@
+#ifndef PUDOMAT_H
+#define PUDOMAT_H
+
+#include <libusb-1.0/libusb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include "comm.h"
+
+#define PUDOMAT_VID 0x16c0
+#define PUDOMAT_PID 0x0939
+
+#define PUDOMAT_TIMEOUT_MS 500     // until round trips are known, and the cap
+#define PUDOMAT_TIMEOUT_MIN_MS 50
+#define PUDOMAT_RTT_SAMPLES 8      // round trips measured before adapting
+#define PUDOMAT_RETRIES 5
+#define PUDOMAT_LATENCY_BUCKETS 14 // 0.25 ms doubling up to 1.024 s, then +Inf
+#define PUDOMAT_MAX_RESPONSE sizeof(struct temp_response)
+#define PUDOMAT_CMD_COUNT (CMD_CFG_WRITE + 1)
+#define PUDOMAT_MAX_DEVICES 8
+#define PUDOMAT_ID_LEN 32
+#define PUDOMAT_SCHEDULED (PUDOMAT_MAX_DEVICES * PUDOMAT_CMD_COUNT)
+#define PUDOMAT_CACHE "/run/pudomat.dev"
+
+// how a transfer ended, failures classified as in translate_error()
+enum pudomat_outcome {
+    OUTCOME_COMPLETED,
+    OUTCOME_TIMED_OUT,
+    OUTCOME_STALL,
+    OUTCOME_NO_DEVICE,
+    OUTCOME_ERROR,      // any other status or a short response
+    OUTCOME_COUNT,
+};
+
+enum pudomat_action {
+    ACTION_RETRY,
+    ACTION_RESET,       // reset the device, then retry
+    ACTION_REOPEN,      // open the device again, then retry
+    ACTION_GIVE_UP,
+};
+
+struct pudomat_step {
+    enum pudomat_action action;
+    int delay_ms;       // before the retry
+};
+
+// smoothed round trip of one command, as the TCP retransmission timer
+struct pudomat_rtt {
+    int64_t srtt_us;
+    int64_t rttvar_us;
+    uint32_t samples;
+};
+
+struct pudomat_stats {
+    uint64_t transfers[OUTCOME_COUNT];
+    uint64_t latency[OUTCOME_COUNT][PUDOMAT_LATENCY_BUCKETS];
+    int64_t latency_sum_us[OUTCOME_COUNT];
+    int64_t latency_max_us[OUTCOME_COUNT];
+    uint64_t retries;
+    uint64_t resets;
+    uint64_t reopens;
+    uint64_t give_ups;
+};
+
+extern const char *pudomat_outcome_names[OUTCOME_COUNT];
+
+struct pudomat;
+struct pudomat_device;
+struct pudomat_request;
+struct pudomat_recorder;
+
+typedef void (*pudomat_hotplug_cb)(libusb_device *usb_device, int arrived,
+                                   void *user_data);
+
+// Carries the control transfers. libusb talks to the boards; the other
+// backends stand in for them and finish each transfer the way libusb would:
+// they fill in transfer->status, ->actual_length and the response when they
+// take the request and pass it to pudomat_schedule(), which runs the
+// completion when the transfer would have finished on the bus. submit
+// returns 0 or the libusb_error that kept the request from being taken.
+struct pudomat_transport {
+    const char *name;
+    int (*open)(struct pudomat *pudomat, struct pudomat_device *device,
+                const char *id);
+    int (*open_all)(struct pudomat *pudomat, struct pudomat_device *devices,
+                    int max);
+    void (*close)(struct pudomat_device *device);
+    int (*reset)(struct pudomat_device *device);
+    int (*submit)(struct pudomat_request *request);
+    int (*cancel)(struct pudomat_request *request);
+    int (*pollfds)(struct pudomat *pudomat, struct pollfd *fds, int max);
+    int (*timeout)(struct pudomat *pudomat);
+    int (*handle_events)(struct pudomat *pudomat, int timeout_ms);
+    void (*stop)(struct pudomat *pudomat);
+    void (*report)(const struct pudomat *pudomat); // optional, for -v
+};
+
+extern const struct pudomat_transport pudomat_libusb_transport;
+
+struct pudomat_scheduled {
+    struct pudomat_request *request;
+    int64_t due_us;
+};
+
+struct pudomat {
+    const struct pudomat_transport *transport;
+    void *backend;        // state of a transport other than libusb
+    libusb_context *ctx;
+    int64_t enumerate_us; // duration of the last full enumeration
+
+    struct pudomat_rtt rtt[PUDOMAT_CMD_COUNT];
+    struct pudomat_stats stats;
+    struct pudomat_recorder *recorder; // see replay.h
+    struct pudomat_scheduled scheduled[PUDOMAT_SCHEDULED];
+    int scheduled_count;
+
+    libusb_hotplug_callback_handle hotplug;
+    uint8_t hotplug_registered;
+    pudomat_hotplug_cb hotplug_cb;
+    void *hotplug_user_data;
+};
+
+struct pudomat_device {
+    struct pudomat *pudomat;
+    libusb_device_handle *handle;
+    void *backend;           // the board of a transport other than libusb
+    int fd;                  // usbfs node wrapped by handle, -1 if enumerated
+    uint8_t cached;          // last open used the cached bus path
+    int64_t open_us;         // duration of the last open
+    char id[PUDOMAT_ID_LEN]; // serial number, bus-port path without one
+};
+
+typedef void (*pudomat_cb)(struct pudomat_request *request);
+
+// one preallocated control transfer with its own setup + data buffer
+struct pudomat_request {
+    struct pudomat_device *device;
+    enum command command;
+    struct libusb_transfer *transfer;
+    pudomat_cb callback;
+    void *user_data;
+    int in_flight;
+    enum libusb_transfer_status status;
+    int attempts;            // failed in a row
+    int64_t submitted_us;
+    unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + PUDOMAT_MAX_RESPONSE];
+};
+
+const char *translate_error(int status);
+uint16_t get_response_size(enum command command);
+double convert_temperature(uint16_t t);
+double convert_voltage(int t);
+double convert_current(int t);
+
+int pudomat_init(struct pudomat *pudomat);
+void pudomat_exit(struct pudomat *pudomat);
+
+int pudomat_open(struct pudomat *pudomat, struct pudomat_device *device,
+                 const char *id);
+int pudomat_open_all(struct pudomat *pudomat, struct pudomat_device *devices,
+                     int max);
+int pudomat_open_device(struct pudomat *pudomat, struct pudomat_device *device,
+                        libusb_device *usb_device);
+void pudomat_close(struct pudomat_device *device);
+int pudomat_is_open(const struct pudomat_device *device);
+int pudomat_reset(struct pudomat_device *device);
+int pudomat_reopen(struct pudomat_device *device);
+int pudomat_is_device(const struct pudomat_device *device,
+                      libusb_device *usb_device);
+void pudomat_report_open(const struct pudomat_device *device);
+
+int pudomat_hotplug_register(struct pudomat *pudomat, pudomat_hotplug_cb cb,
+                             void *user_data);
+void pudomat_hotplug_deregister(struct pudomat *pudomat);
+
+int pudomat_request_init(struct pudomat_request *request,
+                         struct pudomat_device *device, enum command command,
+                         pudomat_cb callback, void *user_data);
+void pudomat_request_free(struct pudomat_request *request);
+void pudomat_request_config(struct pudomat_request *request,
+                            const struct config *config);
+int pudomat_submit(struct pudomat_request *request, const void *data);
+enum pudomat_outcome pudomat_outcome(const struct pudomat_request *request);
+struct pudomat_step pudomat_next_step(struct pudomat_request *request);
+int pudomat_transfer_timeout(const struct pudomat *pudomat,
+                             enum command command, int attempts);
+int64_t pudomat_latency_bound_us(int bucket);
+void pudomat_report_stats(const struct pudomat *pudomat);
+int pudomat_cancel(struct pudomat_request *request);
+const void *pudomat_response(const struct pudomat_request *request);
+
+// Event loop integration: poll the descriptors from pudomat_pollfds() (or
+// track them through the notifiers), wake up after pudomat_timeout() ms at the
+// latest and call pudomat_handle_events(pudomat, 0). Completion callbacks run
+// from inside pudomat_handle_events(); none of these calls block.
+typedef void (*pudomat_fd_added_cb)(int fd, short events, void *user_data);
+typedef void (*pudomat_fd_removed_cb)(int fd, void *user_data);
+
+int pudomat_pollfds(struct pudomat *pudomat, struct pollfd *fds, int max);
+void pudomat_set_fd_notifiers(struct pudomat *pudomat,
+                              pudomat_fd_added_cb added,
+                              pudomat_fd_removed_cb removed, void *user_data);
+int pudomat_timeout(struct pudomat *pudomat);
+int pudomat_handle_events(struct pudomat *pudomat, int timeout_ms);
+
+// for transports other than libusb
+int pudomat_schedule(struct pudomat_request *request, int64_t due_us);
+int pudomat_scheduled_cancel(struct pudomat_request *request);
+int pudomat_scheduled_pollfds(struct pudomat *pudomat, struct pollfd *fds, int max);
+int pudomat_scheduled_timeout(struct pudomat *pudomat);
+int pudomat_scheduled_handle_events(struct pudomat *pudomat, int timeout_ms);
+
+// blocking convenience for one-shot callers
+int pudomat_run(struct pudomat *pudomat, struct pudomat_request *requests,
+                int count);
+
+#endif
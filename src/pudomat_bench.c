@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emulator.h"
+#include "pudomat.h"
+#include "replay.h"
+
+// Issues every command over and over, one request at a time as the CLI
+// does, and prints one line per command: latency percentiles of whole
+// requests with their retries, transfers per second, the retries, resets
+// and failures, and the CPU time per request. The firmware's own request
+// counters are read before and after. The config is written back unchanged
+// and fewer times, since the EEPROM wears out. Commands a recording lacks
+// are left out.
+//
+//   pudomat-bench [requests] [usb | emu | recording] [device]
+
+#define CFG_WRITES_MAX 50
+
+static const struct {
+    enum command command;
+    const char *name;
+} commands[] = {
+    { CMD_DBG_READ, "debug" },
+    { CMD_VOLT, "volt" },
+    { CMD_TEMP, "temp" },
+    { CMD_CFG_READ, "cfg_read" },
+    { CMD_CFG_WRITE, "cfg_write" },
+};
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t transfers(const struct pudomat_stats *stats)
+{
+    uint64_t n = 0;
+    for(int o = 0; o < OUTCOME_COUNT; o++)
+        n += stats->transfers[o];
+    return n;
+}
+
+// a recording may lack some commands, they are left out
+static int recorded(const struct pudomat *pudomat, enum command command)
+{
+    const struct pudomat_replay *replay = pudomat->backend;
+
+    if(pudomat->transport != &pudomat_replay_transport)
+        return 1;
+    for(uint64_t i = 0; i < replay->count; i++)
+        if(replay->transactions[i].command == command)
+            return 1;
+    return 0;
+}
+
+// one request run to its end as pudomat_run() does for the CLI
+static int request(struct pudomat *pudomat, struct pudomat_device *device,
+                   enum command command, const struct config *config, void *response)
+{
+    struct pudomat_request r;
+    int rc;
+
+    if(pudomat_request_init(&r, device, command, NULL, NULL) != 0)
+        return 1;
+    if(command == CMD_CFG_WRITE)
+        pudomat_request_config(&r, config);
+    rc = pudomat_run(pudomat, &r, 1);
+    if(rc == 0 && response)
+        memcpy(response, pudomat_response(&r), get_response_size(command));
+    pudomat_request_free(&r);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 200;
+    const char *source = argc > 2 ? argv[2] : "usb";
+    const char *id = argc > 3 ? argv[3] : NULL;
+    struct pudomat pudomat;
+    struct pudomat_device device = { 0 };
+    struct debug_data before, after;
+    struct config config;
+    double *latency;
+    int rc = 1;
+
+    if(count <= 0 || !(latency = malloc(count * sizeof(*latency))))
+    {
+        fprintf(stderr, "pouziti: pudomat-bench [pocet] [usb | emu | zaznam] [zarizeni]\n");
+        return 1;
+    }
+
+    if((strcmp(source, "emu") == 0 ? pudomat_emulator_init(&pudomat, 1) :
+        strcmp(source, "usb") == 0 ? pudomat_init(&pudomat) :
+        pudomat_replay_init(&pudomat, source)) != 0)
+        return 1;
+    if(pudomat_open(&pudomat, &device, id) != 0)
+    {
+        fprintf(stderr, "Pudomat nenalezen (mozna nebezis jako root?)\n");
+        goto err;
+    }
+    int have_config = recorded(&pudomat, CMD_CFG_READ);
+    int have_debug = recorded(&pudomat, CMD_DBG_READ);
+    if((have_config && request(&pudomat, &device, CMD_CFG_READ, NULL, &config) != 0) ||
+       (have_debug && request(&pudomat, &device, CMD_DBG_READ, NULL, &before) != 0))
+        goto err;
+
+    printf("bench transport %s device %s requests %d time %lld\n",
+           pudomat.transport == &pudomat_libusb_transport ? "usb" : source,
+           device.id, count, (long long)time(NULL));
+
+    for(int c = 0; c < sizeof(commands) / sizeof(commands[0]); c++)
+    {
+        enum command command = commands[c].command;
+        int n = command == CMD_CFG_WRITE && count > CFG_WRITES_MAX ? CFG_WRITES_MAX : count;
+        struct pudomat_stats stats = pudomat.stats;
+        int failed = 0;
+
+        if(!recorded(&pudomat, command) || (command == CMD_CFG_WRITE && !have_config))
+            continue;
+
+        double start = now_s(), cpu = cpu_s();
+        for(int i = 0; i < n; i++)
+        {
+            double t = now_s();
+            failed += request(&pudomat, &device, command, &config, NULL) != 0;
+            latency[i] = now_s() - t;
+        }
+        double elapsed = now_s() - start;
+        cpu = cpu_s() - cpu;
+        qsort(latency, n, sizeof(double), compare_double);
+
+        printf("command %s requests %d failed %d p50_ms %.3f p90_ms %.3f p99_ms %.3f "
+               "max_ms %.3f requests_per_s %.1f transfers_per_s %.1f retries %llu "
+               "resets %llu reopens %llu give_ups %llu cpu_us_per_request %.1f\n",
+               commands[c].name, n, failed, latency[n / 2] * 1e3,
+               latency[n * 9 / 10] * 1e3, latency[n * 99 / 100] * 1e3,
+               latency[n - 1] * 1e3, n / elapsed,
+               (transfers(&pudomat.stats) - transfers(&stats)) / elapsed,
+               (unsigned long long)(pudomat.stats.retries - stats.retries),
+               (unsigned long long)(pudomat.stats.resets - stats.resets),
+               (unsigned long long)(pudomat.stats.reopens - stats.reopens),
+               (unsigned long long)(pudomat.stats.give_ups - stats.give_ups),
+               cpu / n * 1e6);
+        fflush(stdout);
+    }
+
+    if(have_debug && request(&pudomat, &device, CMD_DBG_READ, NULL, &after) == 0)
+        printf("firmware usb_requests %u usb_request_errors %u usb_polls %u\n",
+               after.usb_reqs - before.usb_reqs, after.usb_req_errors - before.usb_req_errors,
+               after.usb_polls - before.usb_polls);
+    rc = 0;
+
+err:
+    pudomat_close(&device);
+    pudomat_exit(&pudomat);
+    free(latency);
+    return rc;
+}
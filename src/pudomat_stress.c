@@ -0,0 +1,452 @@
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "emulator.h"
+#include "pudomat.h"
+
+// Loads one Pudomat from several threads at once with a mix of commands,
+// at request rates stepped up stage by stage, as several scripts polling
+// the board would. After each stage the firmware's counters are read, and
+// one line per stage pairs the rate reached with the USB request errors and
+// the 1-Wire read and scan errors the firmware counted meanwhile. The last
+// lines correlate the rate with the error ratios and name the highest rate
+// that still did as well as the lowest one.
+//
+// Over USB each thread has its own libusb context and device handle, like a
+// separate process. The emulated board lives in one pudomat, so the threads
+// take turns on it; the firmware serializes control transfers anyway.
+//
+//   pudomat-stress [threads] [rates] [mix] [seconds] [usb | emu] [device]
+//   pudomat-stress 4 1,2,5,10,20,50,100 temp=4,volt=2,debug=1,cfg=1 35 usb
+
+#define MAX_THREADS 32
+#define MAX_STAGES 32
+#define SAFE_MARGIN 0.01 // error ratio allowed above that of the first stage
+
+static const struct {
+    enum command command;
+    const char *name;
+} commands[] = {
+    { CMD_TEMP, "temp" },
+    { CMD_VOLT, "volt" },
+    { CMD_DBG_READ, "debug" },
+    { CMD_CFG_READ, "cfg" },
+};
+
+#define COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+struct client {
+    struct pudomat own;
+    struct pudomat_device device;
+    struct pudomat *pudomat;
+    pthread_mutex_t *lock;  // the shared emulator, NULL over USB
+    uint64_t rng_state;
+
+    // the stage being run
+    double start, end, period;
+    double *latency;
+    int capacity;
+    int requests;
+    int failed;
+};
+
+struct stage {
+    double target;
+    double achieved;
+    int requests;
+    int failed;
+    uint64_t retries;
+    uint64_t give_ups;
+    double p50, p99, max;
+    struct debug_data debug;  // counted by the firmware during the stage
+};
+
+static const int *mix;
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// clock_nanosleep() returns the error instead of setting errno
+static int sleep_until(double t)
+{
+    struct timespec ts = { (time_t)t, (long)((t - (time_t)t) * 1e9) };
+    int rc;
+
+    while((rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) == EINTR)
+        ;
+    if(rc != 0)
+        fprintf(stderr, "clock_nanosleep: %s\n", strerror(rc));
+    return rc;
+}
+
+static uint64_t rng(struct client *client)
+{
+    client->rng_state ^= client->rng_state << 13;
+    client->rng_state ^= client->rng_state >> 7;
+    client->rng_state ^= client->rng_state << 17;
+    return client->rng_state;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// one request run to its end, as pudomat_run() does for the CLI
+static int request(struct client *client, enum command command, void *response)
+{
+    struct pudomat_request r;
+    int rc = 1;
+
+    if(client->lock)
+        pthread_mutex_lock(client->lock);
+    if(pudomat_request_init(&r, &client->device, command, NULL, NULL) == 0)
+    {
+        rc = pudomat_run(client->pudomat, &r, 1);
+        if(rc == 0 && response)
+            memcpy(response, pudomat_response(&r), get_response_size(command));
+        pudomat_request_free(&r);
+    }
+    if(client->lock)
+        pthread_mutex_unlock(client->lock);
+    return rc;
+}
+
+static enum command pick(struct client *client)
+{
+    int total = 0, c = 0;
+
+    for(int i = 0; i < COMMANDS; i++)
+        total += mix[i];
+    int n = rng(client) % total;
+    while(n >= mix[c])
+        n -= mix[c++];
+    return commands[c].command;
+}
+
+// requests at a fixed pace from a random phase on; a request that overruns
+// its slot delays the next one instead of letting them bunch up
+static void *work(void *arg)
+{
+    struct client *client = arg;
+    double due = client->start + client->period * (rng(client) % 1000) / 1000.0;
+
+    while(due < client->end && client->requests < client->capacity)
+    {
+        if(sleep_until(due) != 0)
+            break;
+        double t = now_s();
+        client->failed += request(client, pick(client), NULL) != 0;
+        double done = now_s();
+        client->latency[client->requests++] = done - t;
+        due += client->period;
+        if(due < done)
+            due = done;
+    }
+    return NULL;
+}
+
+static int parse_mix(const char *arg, int *weights)
+{
+    memset(weights, 0, COMMANDS * sizeof(*weights));
+    while(*arg)
+    {
+        int c = 0, len = strcspn(arg, "=");
+        char *end;
+
+        while(c < COMMANDS && (strlen(commands[c].name) != len ||
+                               strncmp(arg, commands[c].name, len) != 0))
+            c++;
+        if(c == COMMANDS || arg[len] != '=')
+            return 1;
+        weights[c] = strtol(arg + len + 1, &end, 10);
+        if(end == arg + len + 1 || weights[c] < 0 || (*end && *end != ','))
+            return 1;
+        arg = *end ? end + 1 : end;
+    }
+    for(int c = 0; c < COMMANDS; c++)
+        if(weights[c])
+            return 0;
+    return 1;
+}
+
+static int parse_rates(const char *arg, double *rates)
+{
+    int count = 0;
+
+    while(*arg && count < MAX_STAGES)
+    {
+        char *end;
+        rates[count] = strtod(arg, &end);
+        if(end == arg || rates[count] <= 0 || (*end && *end != ','))
+            return 0;
+        count++;
+        arg = *end ? end + 1 : end;
+    }
+    return *arg ? 0 : count;
+}
+
+static double ratio(uint32_t errors, uint32_t total)
+{
+    return total ? (double)errors / total : 0;
+}
+
+// Pearson's r of the achieved rate and an error ratio over the stages
+static double correlation(const struct stage *stages, int count,
+                          double (*errors)(const struct stage *))
+{
+    double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+
+    for(int s = 0; s < count; s++)
+    {
+        double x = stages[s].achieved, y = errors(&stages[s]);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        syy += y * y;
+        sxy += x * y;
+    }
+    double vx = count * sxx - sx * sx, vy = count * syy - sy * sy;
+    return vx > 0 && vy > 0 ? (count * sxy - sx * sy) / sqrt(vx * vy) : 0;
+}
+
+static double usb_errors(const struct stage *s)
+{
+    return ratio(s->debug.usb_req_errors, s->debug.usb_reqs);
+}
+
+static double read_errors(const struct stage *s)
+{
+    return ratio(s->debug.temp_read_errors, s->debug.temp_reads);
+}
+
+static double scan_errors(const struct stage *s)
+{
+    return ratio(s->debug.temp_scan_errors, s->debug.temp_scans);
+}
+
+static double failures(const struct stage *s)
+{
+    return ratio(s->failed, s->requests);
+}
+
+static void debug_delta(struct debug_data *d, const struct debug_data *before,
+                        const struct debug_data *after)
+{
+    d->usb_polls = after->usb_polls - before->usb_polls;
+    d->usb_reqs = after->usb_reqs - before->usb_reqs;
+    d->usb_req_errors = after->usb_req_errors - before->usb_req_errors;
+    d->temp_scans = after->temp_scans - before->temp_scans;
+    d->temp_scan_errors = after->temp_scan_errors - before->temp_scan_errors;
+    d->temp_scan_warns = after->temp_scan_warns - before->temp_scan_warns;
+    d->temp_read_errors = after->temp_read_errors - before->temp_read_errors;
+    d->temp_reads = after->temp_reads - before->temp_reads;
+}
+
+// the retry counters of all the clients, the shared emulator counted once
+static void sum_stats(const struct client *clients, int threads, uint64_t *retries,
+                      uint64_t *give_ups)
+{
+    *retries = *give_ups = 0;
+    for(int i = 0; i < threads && (i == 0 || !clients[i].lock); i++)
+    {
+        *retries += clients[i].pudomat->stats.retries;
+        *give_ups += clients[i].pudomat->stats.give_ups;
+    }
+}
+
+static int run_stage(struct client *clients, int threads, struct client *monitor,
+                     double seconds, struct stage *stage)
+{
+    pthread_t ids[threads];
+    struct debug_data before, after;
+    uint64_t retries, give_ups;
+    int total = 0;
+
+    if(request(monitor, CMD_DBG_READ, &before) != 0)
+        return 1;
+    sum_stats(clients, threads, &retries, &give_ups);
+
+    double start = now_s() + 0.01;
+    for(int i = 0; i < threads; i++)
+    {
+        struct client *c = &clients[i];
+        c->start = start;
+        c->end = start + seconds;
+        c->period = threads / stage->target;
+        c->capacity = seconds / c->period + 2;
+        c->requests = c->failed = 0;
+        if(!(c->latency = malloc(c->capacity * sizeof(double))) ||
+           pthread_create(&ids[i], NULL, work, c) != 0)
+        {
+            free(c->latency);
+            while(--i >= 0)
+            {
+                pthread_join(ids[i], NULL);
+                free(clients[i].latency);
+            }
+            return 1;
+        }
+    }
+    for(int i = 0; i < threads; i++)
+    {
+        pthread_join(ids[i], NULL);
+        total += clients[i].requests;
+    }
+    double elapsed = now_s() - start;
+
+    double *latency = malloc((total ? total : 1) * sizeof(double));
+    stage->requests = stage->failed = 0;
+    for(int i = 0; i < threads; i++)
+    {
+        if(latency)
+            memcpy(latency + stage->requests, clients[i].latency,
+                   clients[i].requests * sizeof(double));
+        stage->requests += clients[i].requests;
+        stage->failed += clients[i].failed;
+        free(clients[i].latency);
+    }
+    if(!latency)
+        return 1;
+    qsort(latency, total, sizeof(double), compare_double);
+    sum_stats(clients, threads, &stage->retries, &stage->give_ups);
+    stage->retries -= retries;
+    stage->give_ups -= give_ups;
+    stage->achieved = total / elapsed;
+    stage->p50 = total ? latency[total / 2] : 0;
+    stage->p99 = total ? latency[total * 99 / 100] : 0;
+    stage->max = total ? latency[total - 1] : 0;
+    free(latency);
+
+    if(request(monitor, CMD_DBG_READ, &after) != 0)
+        return 1;
+    debug_delta(&stage->debug, &before, &after);
+    return 0;
+}
+
+static int client_open(struct client *client, const char *id)
+{
+    if(pudomat_open(client->pudomat, &client->device, id) != 0)
+    {
+        fprintf(stderr, "Pudomat nenalezen (mozna nebezis jako root?)\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    const char *rates_arg = argc > 2 ? argv[2] : "1,2,5,10,20,50,100";
+    const char *mix_arg = argc > 3 ? argv[3] : "temp=4,volt=2,debug=1,cfg=1";
+    double seconds = argc > 4 ? atof(argv[4]) : 35;
+    const char *source = argc > 5 ? argv[5] : "usb";
+    const char *id = argc > 6 ? argv[6] : NULL;
+    static struct client clients[MAX_THREADS + 1];
+    struct client *monitor = &clients[threads];
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    struct stage stages[MAX_STAGES];
+    double rates[MAX_STAGES];
+    int weights[COMMANDS];
+    int emulate = strcmp(source, "emu") == 0;
+    int opened = 0, count, done = 0, safe = -1, rc = 1;
+
+    count = parse_rates(rates_arg, rates);
+    if(threads <= 0 || threads > MAX_THREADS || !count ||
+       parse_mix(mix_arg, weights) != 0 || seconds <= 0 ||
+       (!emulate && strcmp(source, "usb") != 0))
+    {
+        fprintf(stderr, "pouziti: pudomat-stress [vlaken] [pozadavku/s,...] "
+                        "[temp=vaha,volt=vaha,debug=vaha,cfg=vaha] [sekund] "
+                        "[usb | emu] [zarizeni]\n");
+        return 1;
+    }
+    mix = weights;
+
+    // the threads and the monitor, which reads the firmware's counters
+    for(; opened <= threads; opened++)
+    {
+        struct client *c = &clients[opened];
+        c->rng_state = 0x9e3779b97f4a7c15ull * (opened + 1);
+        if(emulate)
+        {
+            c->pudomat = &clients[0].own;
+            c->lock = &lock;
+            if(opened == 0 && pudomat_emulator_init(c->pudomat, 1) != 0)
+                return 1;
+        }
+        else
+        {
+            c->pudomat = &c->own;
+            if(pudomat_init(c->pudomat) != 0)
+                goto err;
+        }
+        if(client_open(c, id) != 0)
+        {
+            if(!emulate)
+                pudomat_exit(c->pudomat);
+            goto err;
+        }
+    }
+
+    printf("stress transport %s device %s threads %d seconds %g mix %s time %lld\n",
+           source, monitor->device.id, threads, seconds, mix_arg,
+           (long long)time(NULL));
+
+    for(; done < count; done++)
+    {
+        struct stage *s = &stages[done];
+        s->target = rates[done];
+        if(run_stage(clients, threads, monitor, seconds, s) != 0)
+            goto err;
+
+        printf("stage target_per_s %g requests_per_s %.1f requests %d failed %d "
+               "p50_ms %.3f p99_ms %.3f max_ms %.3f retries %llu give_ups %llu "
+               "usb_reqs %u usb_req_errors %u temp_reads %u temp_read_errors %u "
+               "temp_scans %u temp_scan_errors %u temp_scan_warns %u\n",
+               s->target, s->achieved, s->requests, s->failed,
+               s->p50 * 1e3, s->p99 * 1e3, s->max * 1e3,
+               (unsigned long long)s->retries, (unsigned long long)s->give_ups,
+               s->debug.usb_reqs, s->debug.usb_req_errors, s->debug.temp_reads,
+               s->debug.temp_read_errors, s->debug.temp_scans,
+               s->debug.temp_scan_errors, s->debug.temp_scan_warns);
+        fflush(stdout);
+
+        // safe while every request gets through at the pace asked, give or
+        // take the slot each thread's phase may cost, and the firmware does
+        // no worse than at the first stage
+        if(safe == done - 1 && !s->failed && !s->give_ups &&
+           s->requests + threads >= 0.95 * s->target * seconds &&
+           usb_errors(s) <= usb_errors(&stages[0]) + SAFE_MARGIN &&
+           read_errors(s) <= read_errors(&stages[0]) + SAFE_MARGIN &&
+           scan_errors(s) <= scan_errors(&stages[0]) + SAFE_MARGIN)
+            safe = done;
+    }
+
+    printf("correlation usb_req_errors %.3f temp_read_errors %.3f temp_scan_errors %.3f "
+           "failed %.3f\n", correlation(stages, done, usb_errors),
+           correlation(stages, done, read_errors), correlation(stages, done, scan_errors),
+           correlation(stages, done, failures));
+    printf("safe_requests_per_s %g\n", safe >= 0 ? stages[safe].target : 0);
+    rc = 0;
+
+err:
+    for(int i = 0; i < opened; i++)
+    {
+        pudomat_close(&clients[i].device);
+        if(!emulate)
+            pudomat_exit(clients[i].pudomat);
+    }
+    if(emulate && opened)
+        pudomat_exit(clients[0].pudomat);
+    return rc;
+}
@@ -0,0 +1,238 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "aggregate.h"
+#include "index.h"
+
+// Grows a store of minute samples segment by segment and reports at every
+// size the latency of indexed range queries against a full scan, then the
+// throughput of aggregating the whole store with 1, 2, 4... threads.
+//
+//   query-bench [segments] [directory]
+
+#define SENSORS 4
+#define QUERIES 200
+#define BATCH 1024
+
+static const struct {
+    const char *name;
+    int64_t seconds;
+} windows[] = {
+    { "hour", 3600 },
+    { "day", 86400 },
+    { "week", 7 * 86400 },
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int count_record(const struct pudomat_record *record, void *arg)
+{
+    (*(uint64_t *)arg)++;
+    return 0;
+}
+
+// what a query costs without the indexes
+static uint64_t scan(const char *dir, uint64_t rom, int64_t from, int64_t to)
+{
+    uint32_t count;
+    uint64_t matched = 0;
+
+    pudomat_store_segments(dir, &count);
+    for(uint32_t s = 0; s < count; s++)
+    {
+        struct pudomat_segment segment;
+        if(pudomat_segment_map(&segment, dir, s) != 0)
+            continue;
+        uint64_t n = pudomat_segment_count(&segment);
+        for(uint64_t i = 0; i < n; i++)
+        {
+            const struct pudomat_record *r = &segment.records[i];
+            if(r->rom == rom && r->time >= from && r->time <= to)
+                matched++;
+        }
+        pudomat_segment_unmap(&segment);
+    }
+    return matched;
+}
+
+static void remove_store(const char *dir)
+{
+    char path[300];
+    DIR *d = opendir(dir);
+    struct dirent *e;
+
+    while(d && (e = readdir(d)))
+    {
+        if(e->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        unlink(path);
+    }
+    if(d)
+        closedir(d);
+    rmdir(dir);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_segments = argc > 1 ? atoi(argv[1]) : 32;
+    char temp_dir[] = "/tmp/pudomat-query-XXXXXX";
+    const char *dir = argc > 2 ? argv[2] : temp_dir;
+    struct pudomat_store store;
+    struct pudomat_record batch[BATCH * SENSORS];
+    static double indexed[QUERIES], scanned[QUERIES];
+    int64_t t = 1600000000, first = t;
+    int rc = 0;
+
+    if(max_segments <= 0)
+    {
+        fprintf(stderr, "pouziti: query-bench [segmenty] [adresar]\n");
+        return 1;
+    }
+    if(argc <= 2 && !mkdtemp(temp_dir))
+    {
+        perror(temp_dir);
+        return 1;
+    }
+    if(pudomat_store_open(&store, dir) != 0)
+        return 1;
+
+    uint64_t records = 0;
+    for(int segments = 1; segments <= max_segments; segments *= 2)
+    {
+        while(records < (uint64_t)segments * PUDOMAT_STORE_RECORDS)
+        {
+            for(int i = 0; i < BATCH; i++, t += 60)
+                for(int s = 0; s < SENSORS; s++)
+                    batch[i * SENSORS + s] = (struct pudomat_record){
+                        .time = t, .rom = 0x2800000000000000ull | s,
+                        .temperature = 320 + rng() % 64,
+                        .voltage = 25000 + rng() % 800, .current = 64,
+                    };
+            if(pudomat_store_append(&store, batch, BATCH * SENSORS) != 0)
+            {
+                rc = 1;
+                goto err;
+            }
+            records += BATCH * SENSORS;
+        }
+
+        // the first query over new full segments saves their indexes
+        struct pudomat_query_stats stats;
+        uint64_t matched = 0;
+        double start = now_s();
+        pudomat_store_query(dir, 0x2800000000000000ull, first, first, count_record,
+                            &matched, &stats);
+        double cold = now_s() - start;
+
+        for(int w = 0; w < sizeof(windows) / sizeof(windows[0]); w++)
+        {
+            uint64_t blocks = 0;
+            for(int q = 0; q < QUERIES; q++)
+            {
+                uint64_t rom = 0x2800000000000000ull | rng() % SENSORS;
+                int64_t from = first + rng() % (t - first - windows[w].seconds);
+                int64_t to = from + windows[w].seconds - 1;
+                uint64_t expected;
+
+                matched = 0;
+                start = now_s();
+                pudomat_store_query(dir, rom, from, to, count_record, &matched, &stats);
+                indexed[q] = now_s() - start;
+                blocks += stats.blocks_read;
+
+                start = now_s();
+                expected = scan(dir, rom, from, to);
+                scanned[q] = now_s() - start;
+
+                if(matched != expected)
+                {
+                    fprintf(stderr, "Nesouhlasi pocet zaznamu: %llu != %llu\n",
+                            (unsigned long long)matched, (unsigned long long)expected);
+                    rc = 1;
+                }
+            }
+            qsort(indexed, QUERIES, sizeof(double), compare_double);
+            qsort(scanned, QUERIES, sizeof(double), compare_double);
+
+            printf("segments %d records %llu window %s cold_index_ms %.1f "
+                   "blocks_per_query %.1f indexed_p50_us %.1f indexed_p99_us %.1f "
+                   "scan_p50_us %.1f scan_p99_us %.1f\n",
+                   segments, (unsigned long long)records, windows[w].name, cold * 1e3,
+                   (double)blocks / QUERIES, indexed[QUERIES / 2] * 1e6,
+                   indexed[QUERIES * 99 / 100] * 1e6, scanned[QUERIES / 2] * 1e6,
+                   scanned[QUERIES * 99 / 100] * 1e6);
+            cold = 0;
+        }
+        fflush(stdout);
+    }
+
+    double single = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for(int threads = 1; threads <= cpus * 2; threads *= 2)
+    {
+        struct pudomat_aggregate aggregate;
+        uint64_t total = 0;
+        double best = 0;
+
+        // best of three, the store is in the page cache after the first
+        for(int run = 0; run < 3; run++)
+        {
+            double start = now_s();
+            if(pudomat_store_aggregate(dir, 0, INT64_MIN, INT64_MAX, threads, &aggregate) != 0)
+            {
+                rc = 1;
+                goto err;
+            }
+            double elapsed = now_s() - start;
+            if(!run || elapsed < best)
+                best = elapsed;
+            total = 0;
+            for(int i = 0; i < aggregate.count; i++)
+                total += aggregate.rows[i].count;
+            pudomat_aggregate_free(&aggregate);
+        }
+        if(threads == 1)
+            single = best;
+
+        if(total != records)
+        {
+            fprintf(stderr, "Nesouhlasi pocet zaznamu: %llu != %llu\n",
+                    (unsigned long long)total, (unsigned long long)records);
+            rc = 1;
+        }
+        printf("aggregate threads %d records %llu ms %.1f records_per_s %.0f speedup %.2f\n",
+               threads, (unsigned long long)records, best * 1e3, records / best,
+               single / best);
+    }
+
+err:
+    pudomat_store_close(&store);
+    if(argc <= 2)
+        remove_store(dir);
+    return rc;
+}
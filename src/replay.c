@@ -0,0 +1,270 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "replay.h"
+
+static int64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int pudomat_record_start(struct pudomat *pudomat, const char *path)
+{
+    struct pudomat_replay_header header = {
+        .magic = PUDOMAT_REPLAY_MAGIC,
+        .version = PUDOMAT_REPLAY_VERSION,
+        .transaction_size = sizeof(struct pudomat_transaction),
+        .started = time(NULL),
+    };
+    struct pudomat_recorder *recorder = calloc(1, sizeof(*recorder));
+
+    if(!recorder)
+        return 1;
+    recorder->f = fopen(path, "w");
+    if(!recorder->f || fwrite(&header, sizeof(header), 1, recorder->f) != 1)
+    {
+        perror(path);
+        if(recorder->f)
+            fclose(recorder->f);
+        free(recorder);
+        return 1;
+    }
+    recorder->start_us = now_us();
+    pudomat->recorder = recorder;
+    return 0;
+}
+
+void pudomat_record_transfer(struct pudomat_recorder *recorder,
+                             const struct pudomat_request *request,
+                             int64_t latency_us)
+{
+    const struct libusb_control_setup *setup = (const void *)request->buffer;
+    const struct libusb_transfer *transfer = request->transfer;
+    struct pudomat_transaction t = { 0 };
+
+    strcpy(t.device, request->device->id);
+    t.submitted_us = request->submitted_us - recorder->start_us;
+    t.latency_us = latency_us;
+    t.request_type = setup->bmRequestType;
+    t.command = setup->bRequest;
+    t.length = libusb_le16_to_cpu(setup->wLength);
+    t.status = transfer->status;
+    t.actual_length = transfer->actual_length;
+    if(t.actual_length <= sizeof(t.data))
+        memcpy(t.data, request->buffer + LIBUSB_CONTROL_SETUP_SIZE, t.actual_length);
+
+    // the stream buffers, a write error shows up when it is closed
+    fwrite(&t, sizeof(t), 1, recorder->f);
+    recorder->transactions++;
+}
+
+void pudomat_record_stop(struct pudomat_recorder *recorder)
+{
+    if(fclose(recorder->f) != 0)
+        perror("zaznam prenosu");
+    free(recorder);
+}
+
+static void replay_stop(struct pudomat *pudomat)
+{
+    struct pudomat_replay *replay = pudomat->backend;
+
+    if(replay->transactions)
+        munmap((void *)((const struct pudomat_replay_header *)replay->transactions - 1),
+               replay->size);
+    if(replay->fd >= 0)
+        close(replay->fd);
+    free(replay);
+    pudomat->backend = NULL;
+}
+
+int pudomat_replay_init(struct pudomat *pudomat, const char *path)
+{
+    struct pudomat_replay *replay = calloc(1, sizeof(*replay));
+    const struct pudomat_replay_header *header;
+    struct stat st;
+
+    memset(pudomat, 0, sizeof(*pudomat));
+    if(!replay)
+        return 1;
+    pudomat->transport = &pudomat_replay_transport;
+    pudomat->backend = replay;
+
+    replay->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(replay->fd < 0 || fstat(replay->fd, &st) != 0)
+    {
+        perror(path);
+        goto err;
+    }
+    replay->size = st.st_size;
+    if(replay->size < sizeof(*header))
+        goto invalid;
+    header = mmap(NULL, replay->size, PROT_READ, MAP_SHARED, replay->fd, 0);
+    if(header == MAP_FAILED)
+    {
+        perror(path);
+        goto err;
+    }
+    replay->transactions = (const struct pudomat_transaction *)(header + 1);
+    replay->count = (replay->size - sizeof(*header)) / sizeof(*replay->transactions);
+    if(header->magic != PUDOMAT_REPLAY_MAGIC ||
+       header->version != PUDOMAT_REPLAY_VERSION ||
+       header->transaction_size != sizeof(*replay->transactions) || !replay->count)
+        goto invalid;
+
+    // the devices in the order they first show up
+    for(uint64_t i = 0; i < replay->count; i++)
+    {
+        const struct pudomat_transaction *t = &replay->transactions[i];
+        int d = 0;
+        if(t->command < CMD_DBG_READ || t->command >= PUDOMAT_CMD_COUNT)
+            goto invalid;
+        while(d < replay->id_count && strncmp(replay->ids[d], t->device, PUDOMAT_ID_LEN) != 0)
+            d++;
+        if(d == replay->id_count && d < PUDOMAT_MAX_DEVICES)
+        {
+            memcpy(replay->ids[d], t->device, PUDOMAT_ID_LEN - 1);
+            replay->id_count++;
+        }
+    }
+    return 0;
+
+invalid:
+    fprintf(stderr, "%s: neplatny zaznam prenosu\n", path);
+err:
+    pudomat_exit(pudomat);
+    return 1;
+}
+
+static int find_device(const struct pudomat_replay *replay, const char *id)
+{
+    for(int d = 0; d < replay->id_count; d++)
+        if(strcmp(replay->ids[d], id) == 0)
+            return d;
+    return -1;
+}
+
+// the first recorded device, or the one with the given identity
+static int replay_open(struct pudomat *pudomat, struct pudomat_device *device,
+                       const char *id)
+{
+    struct pudomat_replay *replay = pudomat->backend;
+    int d = id ? find_device(replay, id) : 0;
+
+    if(d < 0 || d >= replay->id_count)
+        return 1;
+    strcpy(device->id, replay->ids[d]);
+    device->pudomat = pudomat;
+    device->handle = NULL;
+    device->backend = replay;
+    device->cached = 0;
+    device->open_us = 0;
+    return 0;
+}
+
+static int replay_open_all(struct pudomat *pudomat, struct pudomat_device *devices,
+                           int max)
+{
+    struct pudomat_replay *replay = pudomat->backend;
+    int opened = 0;
+
+    for(int d = 0; d < replay->id_count && opened < max; d++)
+        if(replay_open(pudomat, &devices[opened], replay->ids[d]) == 0)
+            opened++;
+    return opened;
+}
+
+static void replay_close(struct pudomat_device *device)
+{
+    device->backend = NULL;
+}
+
+static int replay_reset(struct pudomat_device *device)
+{
+    return 0;
+}
+
+static int replay_submit(struct pudomat_request *request)
+{
+    struct pudomat_replay *replay = request->device->backend;
+    struct libusb_transfer *transfer = request->transfer;
+    int d = find_device(replay, request->device->id);
+    const struct pudomat_transaction *t = NULL;
+
+    if(d < 0)
+        return LIBUSB_ERROR_NO_DEVICE;
+
+    // the next transfer of the device and command, from the start again when
+    // there is none left
+    for(int pass = 0; pass < 2 && !t; pass++)
+    {
+        uint64_t *next = &replay->next[d][request->command];
+        for(; *next < replay->count; (*next)++)
+        {
+            const struct pudomat_transaction *candidate = &replay->transactions[*next];
+            if(candidate->command == request->command &&
+               strncmp(candidate->device, replay->ids[d], PUDOMAT_ID_LEN) == 0)
+            {
+                t = candidate;
+                (*next)++;
+                break;
+            }
+        }
+        if(!t)
+        {
+            *next = 0;
+            replay->wrapped += pass == 0;
+        }
+    }
+    if(!t)
+        return LIBUSB_ERROR_NOT_FOUND;
+
+    int64_t latency_us = t->latency_us;
+    int64_t timeout_us = (int64_t)transfer->timeout * 1000;
+    if(timeout_us && latency_us > timeout_us)
+    {
+        transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+        transfer->actual_length = 0;
+        latency_us = timeout_us;
+    }
+    else
+    {
+        transfer->status = t->status;
+        transfer->actual_length = t->actual_length;
+        if(t->actual_length <= sizeof(t->data) &&
+           (t->request_type & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+            memcpy(request->buffer + LIBUSB_CONTROL_SETUP_SIZE, t->data,
+                   t->actual_length);
+    }
+    replay->served++;
+    return pudomat_schedule(request, request->submitted_us + latency_us);
+}
+
+static void replay_report(const struct pudomat *pudomat)
+{
+    const struct pudomat_replay *replay = pudomat->backend;
+
+    fprintf(stderr, "Prehrano prenosu: %llu ze zaznamu s %llu, zaznam dosel %llu krat\n",
+            (unsigned long long)replay->served, (unsigned long long)replay->count,
+            (unsigned long long)replay->wrapped);
+}
+
+const struct pudomat_transport pudomat_replay_transport = {
+    .name = "prehravan ze zaznamu prenosu",
+    .open = replay_open,
+    .open_all = replay_open_all,
+    .close = replay_close,
+    .reset = replay_reset,
+    .submit = replay_submit,
+    .cancel = pudomat_scheduled_cancel,
+    .pollfds = pudomat_scheduled_pollfds,
+    .timeout = pudomat_scheduled_timeout,
+    .handle_events = pudomat_scheduled_handle_events,
+    .stop = replay_stop,
+    .report = replay_report,
+};
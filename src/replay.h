@@ -0,0 +1,75 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "pudomat.h"
+
+#define PUDOMAT_REPLAY_MAGIC 0x52545550 // "PUTR"
+#define PUDOMAT_REPLAY_VERSION 1
+
+#pragma pack(push, 1)
+
+// A recording is this header and one transaction per finished control
+// transfer, in the order they finished. Transfers that could not even be
+// submitted never reached the bus and are left out.
+struct pudomat_replay_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t transaction_size;
+    int64_t started;         // wall clock seconds
+    uint8_t padding[16];
+};
+
+struct pudomat_transaction {
+    char device[PUDOMAT_ID_LEN];
+    int64_t submitted_us;    // since the recording started
+    int32_t latency_us;
+    uint8_t request_type;    // bmRequestType
+    uint8_t command;         // bRequest, enum command
+    uint16_t length;         // wLength
+    uint8_t status;          // enum libusb_transfer_status
+    uint8_t padding;
+    uint16_t actual_length;
+    uint8_t data[PUDOMAT_MAX_RESPONSE];
+};
+
+#pragma pack(pop)
+
+struct pudomat_recorder {
+    FILE *f;
+    int64_t start_us;
+    uint64_t transactions;
+};
+
+struct pudomat_replay {
+    int fd;
+    size_t size;
+    const struct pudomat_transaction *transactions;
+    uint64_t count;
+    char ids[PUDOMAT_MAX_DEVICES][PUDOMAT_ID_LEN];
+    int id_count;
+    uint64_t next[PUDOMAT_MAX_DEVICES][PUDOMAT_CMD_COUNT];
+    uint64_t served;
+    uint64_t wrapped;        // times a device ran out of recorded transfers
+};
+
+extern const struct pudomat_transport pudomat_replay_transport;
+
+// Recording: every transfer that finishes is appended to path, whatever the
+// transport; set up after the pudomat is initialized, it ends with
+// pudomat_exit(). Replay, initialized instead of pudomat_init(): the devices
+// of the recording appear to be plugged in and each submitted request is
+// answered with the next recorded transfer of the same device and command,
+// after its recorded latency. A device that runs out of recorded transfers
+// starts over, so a short recording can drive a long benchmark. A response
+// slower than the timeout in use times out, as it would on the bus.
+int pudomat_record_start(struct pudomat *pudomat, const char *path);
+void pudomat_record_transfer(struct pudomat_recorder *recorder,
+                             const struct pudomat_request *request,
+                             int64_t latency_us);
+void pudomat_record_stop(struct pudomat_recorder *recorder);
+
+int pudomat_replay_init(struct pudomat *pudomat, const char *path);
+
+#endif
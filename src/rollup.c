@@ -0,0 +1,956 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "rollup.h"
+
+#define INITIAL_ROWS 1024
+#define RECOVER_ROWS 4096 // how far back open buckets are looked for
+
+const int64_t pudomat_tier_period[PUDOMAT_ROLLUP_TIERS] = { 60, 3600, 86400 };
+
+static const char *tier_names[PUDOMAT_ROLLUP_TIERS] = { "minute", "hour", "day" };
+
+static int64_t floor_to(int64_t t, int64_t period)
+{
+    int64_t r = t % period;
+    return r < 0 ? t - r - period : t - r;
+}
+
+static int64_t ceil_to(int64_t t, int64_t period)
+{
+    int64_t f = floor_to(t, period);
+    return f == t ? t : f + period;
+}
+
+static void row_from_record(struct pudomat_rollup *row,
+                            const struct pudomat_record *r, int64_t period)
+{
+    memset(row, 0, sizeof(*row));
+    row->start = floor_to(r->time, period);
+    row->rom = r->rom;
+    row->count = 1;
+    row->relay_on = r->relay != 0;
+    row->temp_min = row->temp_max = row->temp_sum = (int16_t)r->temperature;
+    row->volt_min = row->volt_max = row->volt_sum = r->voltage;
+    row->current_min = row->current_max = row->current_sum = r->current;
+}
+
+void pudomat_rollup_merge(struct pudomat_rollup *into,
+                          const struct pudomat_rollup *row)
+{
+    if(!row->count)
+        return;
+    if(!into->count)
+    {
+        int64_t start = into->start;
+        uint64_t rom = into->rom;
+        *into = *row;
+        into->start = start;
+        into->rom = rom;
+        return;
+    }
+
+    into->count += row->count;
+    into->relay_on += row->relay_on;
+    into->temp_sum += row->temp_sum;
+    into->volt_sum += row->volt_sum;
+    into->current_sum += row->current_sum;
+    if(row->temp_min < into->temp_min)
+        into->temp_min = row->temp_min;
+    if(row->temp_max > into->temp_max)
+        into->temp_max = row->temp_max;
+    if(row->volt_min < into->volt_min)
+        into->volt_min = row->volt_min;
+    if(row->volt_max > into->volt_max)
+        into->volt_max = row->volt_max;
+    if(row->current_min < into->current_min)
+        into->current_min = row->current_min;
+    if(row->current_max > into->current_max)
+        into->current_max = row->current_max;
+}
+
+static void unmap_file(struct pudomat_rollup_file *file)
+{
+    if(file->header)
+        munmap(file->header, file->size);
+    if(file->fd >= 0)
+        close(file->fd);
+    if(file->sketch_header)
+        munmap(file->sketch_header, file->sketch_size);
+    if(file->sketch_fd >= 0)
+        close(file->sketch_fd);
+    file->header = NULL;
+    file->rows = NULL;
+    file->fd = -1;
+    file->sketch_header = NULL;
+    file->sketches = NULL;
+    file->sketch_fd = -1;
+}
+
+// the sketch file follows the size of the rows file
+static int map_sketches(struct pudomat_rollup_file *file)
+{
+    struct stat st;
+    size_t size = sizeof(*file->sketch_header) + file->capacity * sizeof(*file->sketches);
+
+    if(fstat(file->sketch_fd, &st) != 0)
+        return 1;
+    if(file->writable && st.st_size < size)
+    {
+        st.st_size = size;
+        if(ftruncate(file->sketch_fd, st.st_size) != 0)
+            return 1;
+    }
+    if(st.st_size < sizeof(*file->sketch_header))
+    {
+        errno = EINVAL;
+        return 1;
+    }
+
+    void *p = mmap(NULL, st.st_size,
+                   file->writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                   MAP_SHARED, file->sketch_fd, 0);
+    if(p == MAP_FAILED)
+        return 1;
+
+    if(file->sketch_header)
+        munmap(file->sketch_header, file->sketch_size);
+    file->sketch_header = p;
+    file->sketches = (struct pudomat_sketch *)(file->sketch_header + 1);
+    file->sketch_size = st.st_size;
+
+    uint64_t capacity = (st.st_size - sizeof(*file->sketch_header)) / sizeof(*file->sketches);
+    if(capacity < file->capacity)
+        file->capacity = capacity;
+    return 0;
+}
+
+static int map_file(struct pudomat_rollup_file *file)
+{
+    struct stat st;
+
+    if(fstat(file->fd, &st) != 0)
+        return 1;
+    if(file->writable && st.st_size < sizeof(*file->header) + INITIAL_ROWS * sizeof(*file->rows))
+    {
+        st.st_size = sizeof(*file->header) + INITIAL_ROWS * sizeof(*file->rows);
+        if(ftruncate(file->fd, st.st_size) != 0)
+            return 1;
+    }
+    if(st.st_size < sizeof(*file->header))
+    {
+        errno = EINVAL;
+        return 1;
+    }
+
+    void *p = mmap(NULL, st.st_size,
+                   file->writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                   MAP_SHARED, file->fd, 0);
+    if(p == MAP_FAILED)
+        return 1;
+
+    if(file->header)
+        munmap(file->header, file->size);
+    file->header = p;
+    file->rows = (struct pudomat_rollup *)(file->header + 1);
+    file->size = st.st_size;
+    file->capacity = (st.st_size - sizeof(*file->header)) / sizeof(*file->rows);
+    if(file->sketch_fd >= 0)
+        return map_sketches(file);
+    return 0;
+}
+
+// hour.rup.new has its sketches in hour.rqs.new
+static void sketch_path(char *out, size_t size, const char *path)
+{
+    const char *ext = strstr(path, ".rup");
+    for(const char *p = ext; p; p = strstr(p + 1, ".rup"))
+        ext = p;
+    snprintf(out, size, "%.*s.rqs%s", (int)(ext - path), path, ext + 4);
+}
+
+static int check_header(struct pudomat_rollup_header *h, int writable,
+                        uint32_t magic, uint32_t row_size, int64_t period)
+{
+    if(writable && h->magic == 0)
+    {
+        h->version = PUDOMAT_ROLLUP_VERSION;
+        h->row_size = row_size;
+        h->period = period;
+        h->magic = magic;
+    }
+    return h->magic == magic && h->version == PUDOMAT_ROLLUP_VERSION &&
+           h->row_size == row_size && h->period == period ? 0 : 1;
+}
+
+// a read-only tier without its sketch file is still fine for the rollups
+static int open_sketches(struct pudomat_rollup_file *file, int64_t period)
+{
+    char path[sizeof(file->path)];
+
+    sketch_path(path, sizeof(path), file->path);
+    file->sketch_fd = open(path, file->writable ? O_RDWR | O_CREAT | O_CLOEXEC
+                                                : O_RDONLY | O_CLOEXEC, 0644);
+    if(file->sketch_fd < 0 && !file->writable && errno == ENOENT)
+        return 0;
+    if(file->sketch_fd < 0 || map_sketches(file) != 0)
+    {
+        perror(path);
+        return 1;
+    }
+    if(check_header(file->sketch_header, file->writable, PUDOMAT_SKETCH_MAGIC,
+                    sizeof(struct pudomat_sketch), period) != 0)
+    {
+        fprintf(stderr, "%s: neplatny soubor kvantilu\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+static int open_file(struct pudomat_rollup_file *file, const char *path,
+                     int writable, int64_t period)
+{
+    memset(file, 0, sizeof(*file));
+    file->fd = -1;
+    file->sketch_fd = -1;
+    file->writable = writable;
+    snprintf(file->path, sizeof(file->path), "%s", path);
+
+    file->fd = open(path, writable ? O_RDWR | O_CREAT | O_CLOEXEC
+                                   : O_RDONLY | O_CLOEXEC, 0644);
+    if(file->fd < 0 || map_file(file) != 0)
+        goto err;
+
+    if(check_header(file->header, writable, PUDOMAT_ROLLUP_MAGIC,
+                    sizeof(struct pudomat_rollup), period) != 0)
+    {
+        fprintf(stderr, "%s: neplatny soubor agregaci, spustte --rebuild-rollups\n", path);
+        unmap_file(file);
+        return 1;
+    }
+    if(period >= PUDOMAT_SKETCH_PERIOD && open_sketches(file, period) != 0)
+    {
+        unmap_file(file);
+        return 1;
+    }
+    file->open_seen = (uint64_t)-1;
+    return 0;
+
+err:
+    perror(path);
+    unmap_file(file);
+    return 1;
+}
+
+static uint64_t row_count(const struct pudomat_rollup_file *file)
+{
+    uint64_t count = __atomic_load_n(&file->header->count, __ATOMIC_ACQUIRE);
+    return count < file->capacity ? count : file->capacity;
+}
+
+// read after row_count(), so never more than it saw
+static uint64_t ordered_count(const struct pudomat_rollup_file *file,
+                              uint64_t count)
+{
+    uint64_t ordered = __atomic_load_n(&file->header->ordered, __ATOMIC_RELAXED);
+    return ordered < count ? ordered : count;
+}
+
+// the first of the ordered rows that may start at from or later
+static uint64_t first_row(const struct pudomat_rollup_file *file, int64_t from,
+                          uint64_t ordered)
+{
+    int64_t period = file->header->period;
+    uint64_t lo = 0, hi = ordered;
+
+    while(lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if(file->rows[mid].start < from - period)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// picks up what other writers did since our last update: a rebuilt file
+// replacing ours, a grown file or appended rows
+static int refresh(struct pudomat_rollup_file *file)
+{
+    struct stat path_st, fd_st;
+
+    if(stat(file->path, &path_st) == 0 && fstat(file->fd, &fd_st) == 0 &&
+       (path_st.st_ino != fd_st.st_ino || path_st.st_dev != fd_st.st_dev))
+    {
+        int64_t period = file->header->period;
+        char path[sizeof(file->path)];
+        strcpy(path, file->path);
+        unmap_file(file);
+        if(open_file(file, path, 1, period) != 0)
+            return 1;
+    }
+    else if(fstat(file->fd, &fd_st) == 0 && fd_st.st_size != file->size &&
+            map_file(file) != 0)
+        return 1;
+
+    uint64_t count = file->header->count;
+    if(count == file->open_seen)
+        return 0;
+
+    file->open_count = 0;
+    for(uint64_t i = count; i > 0 && count - i < RECOVER_ROWS; i--)
+    {
+        const struct pudomat_rollup *row = &file->rows[i - 1];
+        int known = 0;
+        for(int j = 0; j < file->open_count && !known; j++)
+            known = file->open[j].rom == row->rom;
+        if(!known && file->open_count < PUDOMAT_ROLLUP_OPEN)
+        {
+            file->open[file->open_count].rom = row->rom;
+            file->open[file->open_count].row = i - 1;
+            file->open_count++;
+        }
+    }
+    file->open_seen = count;
+    return 0;
+}
+
+static int append_row(struct pudomat_rollup_file *file,
+                      const struct pudomat_rollup *row,
+                      const struct pudomat_sketch *sketch)
+{
+    uint64_t count = file->header->count;
+
+    if(count == file->capacity)
+    {
+        if(file->fd < 0)
+            return 1;
+        size_t size = sizeof(*file->header) + 2 * file->capacity * sizeof(*row);
+        if(ftruncate(file->fd, size) != 0 || map_file(file) != 0)
+            return 1;
+    }
+
+    file->rows[count] = *row;
+    if(file->sketches && sketch)
+        file->sketches[count] = *sketch;
+    else if(file->sketches)
+        memset(&file->sketches[count], 0, sizeof(*sketch));
+
+    // a row more than a period older than the ones before is out of order
+    struct pudomat_rollup_header *h = file->header;
+    if(h->ordered == count && (!count || row->start >= h->ordered_start - (int64_t)h->period))
+    {
+        if(!count || row->start > h->ordered_start)
+            h->ordered_start = row->start;
+        __atomic_store_n(&h->ordered, count + 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&h->count, count + 1, __ATOMIC_RELEASE);
+    file->open_seen = count + 1;
+    return 0;
+}
+
+static void merge_row(struct pudomat_rollup_file *file, uint64_t index,
+                      const struct pudomat_rollup *row,
+                      const struct pudomat_sketch *sketch)
+{
+    pudomat_rollup_merge(&file->rows[index], row);
+    if(file->sketches && sketch)
+        pudomat_sketch_merge(&file->sketches[index], sketch);
+    file->header->samples += row->count;
+}
+
+// merges into the bucket of the same sensor and start, or opens a new one
+static void add_row(struct pudomat_rollup_file *file,
+                    const struct pudomat_rollup *row,
+                    const struct pudomat_sketch *sketch)
+{
+    int slot = -1;
+
+    for(int i = 0; i < file->open_count; i++)
+        if(file->open[i].rom == row->rom)
+            slot = i;
+
+    if(slot >= 0)
+    {
+        struct pudomat_rollup *open = &file->rows[file->open[slot].row];
+        if(open->start == row->start)
+        {
+            merge_row(file, file->open[slot].row, row, sketch);
+            return;
+        }
+
+        // a late sample of an older bucket
+        if(row->start < open->start)
+        {
+            uint64_t count = file->header->count;
+            for(uint64_t i = count; i > 0 && count - i < RECOVER_ROWS; i--)
+            {
+                struct pudomat_rollup *old = &file->rows[i - 1];
+                if(old->rom == row->rom && old->start == row->start)
+                {
+                    merge_row(file, i - 1, row, sketch);
+                    return;
+                }
+            }
+        }
+    }
+
+    uint64_t index = file->header->count;
+    if(append_row(file, row, sketch) != 0)
+        return;
+    file->header->samples += row->count;
+
+    if(slot < 0 && file->open_count < PUDOMAT_ROLLUP_OPEN)
+        slot = file->open_count++;
+    if(slot >= 0 && (file->open[slot].rom != row->rom ||
+                     file->rows[file->open[slot].row].start < row->start))
+    {
+        file->open[slot].rom = row->rom;
+        file->open[slot].row = index;
+    }
+}
+
+static void tier_path(char *path, size_t size, const char *dir, int tier,
+                      const char *suffix)
+{
+    snprintf(path, size, "%s/%s.rup%s", dir, tier_names[tier], suffix);
+}
+
+int pudomat_rollups_open(struct pudomat_rollups *rollups, const char *dir,
+                         int writable)
+{
+    for(int t = 0; t < PUDOMAT_ROLLUP_TIERS; t++)
+        rollups->tiers[t].fd = -1;
+
+    for(int t = 0; t < PUDOMAT_ROLLUP_TIERS; t++)
+    {
+        char path[300];
+        tier_path(path, sizeof(path), dir, t, "");
+        if(open_file(&rollups->tiers[t], path, writable, pudomat_tier_period[t]) != 0)
+        {
+            pudomat_rollups_close(rollups);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// called by the writer holding the store lock
+void pudomat_rollups_add(struct pudomat_rollups *rollups,
+                         const struct pudomat_record *records, int count)
+{
+    for(int t = 0; t < PUDOMAT_ROLLUP_TIERS; t++)
+    {
+        struct pudomat_rollup_file *file = &rollups->tiers[t];
+        if(!file->header || refresh(file) != 0)
+            continue;
+
+        for(int i = 0; i < count; i++)
+        {
+            struct pudomat_rollup row;
+            struct pudomat_sketch sketch;
+            row_from_record(&row, &records[i], pudomat_tier_period[t]);
+            if(file->sketches)
+                pudomat_sketch_init(&sketch, row.temp_min);
+            add_row(file, &row, file->sketches ? &sketch : NULL);
+        }
+    }
+}
+
+void pudomat_rollups_close(struct pudomat_rollups *rollups)
+{
+    for(int t = 0; t < PUDOMAT_ROLLUP_TIERS; t++)
+        unmap_file(&rollups->tiers[t]);
+}
+
+// The tiers stand for the whole history only with every record of it rolled
+// up; they miss some when they were created after it or an update failed.
+// Compared under the store lock, which writers hold across both.
+int pudomat_rollups_complete(const struct pudomat_rollups *rollups,
+                             const char *dir)
+{
+    char path[300];
+    uint32_t segments;
+    uint64_t records = 0;
+    int complete = 1;
+
+    snprintf(path, sizeof(path), "%s/lock", dir);
+    int lock_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(lock_fd >= 0)
+        flock(lock_fd, LOCK_SH);
+
+    pudomat_store_segments(dir, &segments);
+    for(uint32_t s = 0; s < segments && complete; s++)
+    {
+        struct pudomat_segment segment;
+        complete = pudomat_segment_map(&segment, dir, s) == 0;
+        if(complete)
+        {
+            records += pudomat_segment_count(&segment);
+            pudomat_segment_unmap(&segment);
+        }
+    }
+
+    for(int t = 0; t < PUDOMAT_ROLLUP_TIERS && complete; t++)
+    {
+        const struct pudomat_rollup_file *file = &rollups->tiers[t];
+        complete = file->header && file->header->samples == records;
+        if(!complete)
+            fprintf(stderr, "%s: agregace nepokryvaji celou historii, spustte --rebuild-rollups\n",
+                    file->path);
+    }
+
+    if(lock_fd >= 0)
+        close(lock_fd);
+    return complete;
+}
+
+// 0 once history older than the tiers was added, until they are rebuilt
+int pudomat_rollups_ordered(const struct pudomat_rollups *rollups)
+{
+    for(int t = 0; t < PUDOMAT_ROLLUP_TIERS; t++)
+    {
+        const struct pudomat_rollup_file *file = &rollups->tiers[t];
+        if(file->header && ordered_count(file, row_count(file)) != row_count(file))
+            return 0;
+    }
+    return 1;
+}
+
+// calls back with the rows of [from, to) of one tier
+static int scan_tier(const struct pudomat_rollup_file *file, uint64_t rom,
+                     int64_t from, int64_t to, pudomat_rollup_cb callback,
+                     void *arg)
+{
+    int64_t period = file->header->period;
+    uint64_t count = row_count(file), ordered = ordered_count(file, count);
+
+    for(uint64_t i = first_row(file, from, ordered); i < count; i++)
+    {
+        const struct pudomat_rollup *row = &file->rows[i];
+        // past the range among the ordered rows, on to those out of order
+        if(i < ordered && row->start >= to + period)
+        {
+            i = ordered - 1;
+            continue;
+        }
+        if((rom && row->rom != rom) || row->start < from || row->start >= to)
+            continue;
+        if(callback(row, arg) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+// whole periods of a tier come from that tier, the ragged ends from the
+// finer ones
+static int query_tier(const struct pudomat_rollups *rollups, int tier,
+                      uint64_t rom, int64_t from, int64_t to,
+                      pudomat_rollup_cb callback, void *arg)
+{
+    if(from >= to)
+        return 0;
+    if(tier == TIER_MINUTE)
+        return scan_tier(&rollups->tiers[tier], rom, from, to, callback, arg);
+
+    int64_t a = ceil_to(from, pudomat_tier_period[tier]);
+    int64_t b = floor_to(to, pudomat_tier_period[tier]);
+    if(a >= b)
+        return query_tier(rollups, tier - 1, rom, from, to, callback, arg);
+    return query_tier(rollups, tier - 1, rom, from, a, callback, arg) ||
+           scan_tier(&rollups->tiers[tier], rom, a, b, callback, arg) ||
+           query_tier(rollups, tier - 1, rom, b, to, callback, arg);
+}
+
+// Calls back with the rows of every sensor, or only rom, in [from, to), each
+// period from the coarsest tier that has it whole. The range is narrowed to
+// the whole minutes it contains, empty when there are none. Returns 1 when
+// the callback fails.
+int pudomat_rollup_query(const struct pudomat_rollups *rollups, uint64_t rom,
+                         int64_t *from, int64_t *to,
+                         pudomat_rollup_cb callback, void *arg)
+{
+    int64_t a = ceil_to(*from, pudomat_tier_period[TIER_MINUTE]);
+    int64_t b = floor_to(*to, pudomat_tier_period[TIER_MINUTE]);
+
+    if(a >= b)
+    {
+        *from = *to = a;
+        return 0;
+    }
+    *from = a;
+    *to = b;
+    return query_tier(rollups, TIER_DAY, rom, a, b, callback, arg);
+}
+
+static void remove_new(const char *dir, int tier)
+{
+    char path[300], sketch[300];
+
+    tier_path(path, sizeof(path), dir, tier, ".new");
+    sketch_path(sketch, sizeof(sketch), path);
+    unlink(path);
+    unlink(sketch);
+}
+
+// calls back with the rows of [from, to) of one tier
+static int sketch_tier(const struct pudomat_rollup_file *file, uint64_t rom,
+                       int64_t from, int64_t to, pudomat_sketch_cb callback,
+                       void *arg)
+{
+    int64_t period = file->header->period;
+    uint64_t count = row_count(file), ordered = ordered_count(file, count);
+
+    for(uint64_t i = first_row(file, from, ordered); i < count; i++)
+    {
+        const struct pudomat_rollup *row = &file->rows[i];
+        if(i < ordered && row->start >= to + period)
+        {
+            i = ordered - 1;
+            continue;
+        }
+        if((rom && row->rom != rom) || row->start < from || row->start >= to)
+            continue;
+        // rows from before the sketches existed
+        if(file->sketches[i].count != row->count)
+        {
+            fprintf(stderr, "%s: kvantily neodpovidaji agregacim, spustte --rebuild-rollups\n",
+                    file->path);
+            return 1;
+        }
+        if(callback(row, &file->sketches[i], arg) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Calls back with the sketch of every sensor, or only rom, and hour or day
+// in [from, to), whole days from the day tier. The range is narrowed to the
+// whole hours it contains, empty when there are none. Returns 1 when the
+// sketches are missing or the callback fails.
+int pudomat_rollup_sketches(const struct pudomat_rollups *rollups, uint64_t rom,
+                            int64_t *from, int64_t *to,
+                            pudomat_sketch_cb callback, void *arg)
+{
+    const struct pudomat_rollup_file *hours = &rollups->tiers[TIER_HOUR];
+    const struct pudomat_rollup_file *days = &rollups->tiers[TIER_DAY];
+    int64_t a = ceil_to(*from, pudomat_tier_period[TIER_HOUR]);
+    int64_t b = floor_to(*to, pudomat_tier_period[TIER_HOUR]);
+
+    if(a >= b)
+    {
+        *from = *to = a;
+        return 0;
+    }
+    *from = a;
+    *to = b;
+
+    for(int t = TIER_HOUR; t <= TIER_DAY; t++)
+    {
+        if(!rollups->tiers[t].sketches)
+        {
+            fprintf(stderr, "%s: chybi kvantily, spustte --rebuild-rollups\n",
+                    rollups->tiers[t].path);
+            return 1;
+        }
+    }
+
+    int64_t da = ceil_to(a, pudomat_tier_period[TIER_DAY]);
+    int64_t db = floor_to(b, pudomat_tier_period[TIER_DAY]);
+    if(da >= db)
+        return sketch_tier(hours, rom, a, b, callback, arg);
+    return sketch_tier(hours, rom, a, da, callback, arg) ||
+           sketch_tier(days, rom, da, db, callback, arg) ||
+           sketch_tier(hours, rom, db, b, callback, arg);
+}
+
+struct rebuild_job {
+    const char *dir;
+    uint32_t segment;
+    uint64_t first;   // records of the segment to take
+    uint64_t last;
+    uint64_t taken;   // segment count when it was read
+    struct pudomat_rollup_header headers[PUDOMAT_ROLLUP_TIERS];
+    struct pudomat_rollup_file files[PUDOMAT_ROLLUP_TIERS];
+    int rc;
+};
+
+static void build(struct pudomat_rollup_file *files,
+                  const struct pudomat_record *records, uint64_t count)
+{
+    for(int t = 0; t < PUDOMAT_ROLLUP_TIERS; t++)
+    {
+        for(uint64_t i = 0; i < count; i++)
+        {
+            struct pudomat_rollup row;
+            struct pudomat_sketch sketch;
+            row_from_record(&row, &records[i], pudomat_tier_period[t]);
+            if(files[t].sketches)
+                pudomat_sketch_init(&sketch, row.temp_min);
+            add_row(&files[t], &row, files[t].sketches ? &sketch : NULL);
+        }
+    }
+}
+
+// rolls one segment up into private in-memory tiers
+static void *rebuild_segment(void *arg)
+{
+    struct rebuild_job *job = arg;
+    struct pudomat_segment segment;
+
+    job->rc = 1;
+    if(pudomat_segment_map(&segment, job->dir, job->segment) != 0)
+        return NULL;
+
+    job->taken = pudomat_segment_count(&segment);
+    uint64_t last = job->last < job->taken ? job->last : job->taken;
+    uint64_t count = last > job->first ? last - job->first : 0;
+
+    for(int t = 0; t < PUDOMAT_ROLLUP_TIERS; t++)
+    {
+        struct pudomat_rollup_file *file = &job->files[t];
+        memset(file, 0, sizeof(*file));
+        file->fd = -1;
+        file->sketch_fd = -1;
+        file->header = &job->headers[t];
+        file->header->period = pudomat_tier_period[t];
+        file->header->count = 0;
+        file->capacity = count ? count : 1;
+        file->rows = malloc(file->capacity * sizeof(*file->rows));
+        if(!file->rows)
+            goto out;
+        if(pudomat_tier_period[t] >= PUDOMAT_SKETCH_PERIOD)
+        {
+            file->sketches = malloc(file->capacity * sizeof(*file->sketches));
+            if(!file->sketches)
+                goto out;
+        }
+    }
+
+    build(job->files, segment.records + job->first, count);
+    job->rc = 0;
+
+out:
+    pudomat_segment_unmap(&segment);
+    return NULL;
+}
+
+static void free_job(struct rebuild_job *job)
+{
+    for(int t = 0; t < PUDOMAT_ROLLUP_TIERS; t++)
+    {
+        free(job->files[t].rows);
+        free(job->files[t].sketches);
+        job->files[t].rows = NULL;
+        job->files[t].sketches = NULL;
+    }
+}
+
+static void merge_job(struct pudomat_rollups *out, const struct rebuild_job *job)
+{
+    for(int t = 0; t < PUDOMAT_ROLLUP_TIERS; t++)
+        for(uint64_t i = 0; i < job->files[t].header->count; i++)
+            add_row(&out->tiers[t], &job->files[t].rows[i],
+                    job->files[t].sketches ? &job->files[t].sketches[i] : NULL);
+}
+
+struct sort_key {
+    int64_t start;
+    uint64_t row;
+};
+
+static int compare_key(const void *a, const void *b)
+{
+    const struct sort_key *x = a, *y = b;
+    if(x->start != y->start)
+        return x->start < y->start ? -1 : 1;
+    return x->row < y->row ? -1 : x->row > y->row;
+}
+
+// history that was imported behind newer samples is rolled up in store
+// order too; the rebuilt tier is sorted by start before it replaces the old
+static int sort_tier(struct pudomat_rollup_file *file)
+{
+    struct pudomat_rollup_header *h = file->header;
+    uint64_t count = h->count;
+    int rc = 1;
+
+    if(h->ordered == count)
+        return 0;
+
+    struct sort_key *keys = malloc(count * sizeof(*keys));
+    struct pudomat_rollup *rows = malloc(count * sizeof(*rows));
+    struct pudomat_sketch *sketches = file->sketches ? malloc(count * sizeof(*sketches)) : NULL;
+    if(!keys || !rows || (file->sketches && !sketches))
+        goto out;
+
+    for(uint64_t i = 0; i < count; i++)
+        keys[i] = (struct sort_key){ file->rows[i].start, i };
+    qsort(keys, count, sizeof(*keys), compare_key);
+    for(uint64_t i = 0; i < count; i++)
+    {
+        rows[i] = file->rows[keys[i].row];
+        if(sketches)
+            sketches[i] = file->sketches[keys[i].row];
+    }
+    memcpy(file->rows, rows, count * sizeof(*rows));
+    if(sketches)
+        memcpy(file->sketches, sketches, count * sizeof(*sketches));
+    h->ordered = count;
+    h->ordered_start = rows[count - 1].start;
+    rc = 0;
+
+out:
+    free(keys);
+    free(rows);
+    free(sketches);
+    return rc;
+}
+
+static int run_jobs(struct pudomat_rollups *out, struct rebuild_job *jobs,
+                    int count)
+{
+    pthread_t threads[count];
+    int rc = 0;
+
+    int started[count];
+
+    for(int i = 0; i < count; i++)
+    {
+        started[i] = pthread_create(&threads[i], NULL, rebuild_segment, &jobs[i]) == 0;
+        if(!started[i])
+            rebuild_segment(&jobs[i]);
+    }
+    for(int i = 0; i < count; i++)
+        if(started[i])
+            pthread_join(threads[i], NULL);
+
+    // in segment order, so buckets split by a segment boundary merge again
+    for(int i = 0; i < count; i++)
+    {
+        if(jobs[i].rc != 0)
+            rc = 1;
+        else
+            merge_job(out, &jobs[i]);
+        free_job(&jobs[i]);
+    }
+    return rc;
+}
+
+// Rolls the whole raw history up again, each batch of segments in parallel,
+// into new files that replace the current ones once they caught up with
+// records appended in the meantime.
+int pudomat_rollups_rebuild(const char *dir, int threads)
+{
+    struct pudomat_rollups out;
+    struct rebuild_job *jobs = calloc(threads, sizeof(*jobs));
+    uint32_t segments, done = 0;
+    uint64_t taken = 0;
+    char path[300], final[300];
+    int lock_fd = -1, rc = 1;
+
+    if(!jobs)
+        return 1;
+
+    for(int t = 0; t < PUDOMAT_ROLLUP_TIERS; t++)
+    {
+        out.tiers[t].fd = -1;
+        out.tiers[t].sketch_fd = -1;
+        remove_new(dir, t);
+    }
+    for(int t = 0; t < PUDOMAT_ROLLUP_TIERS; t++)
+    {
+        tier_path(path, sizeof(path), dir, t, ".new");
+        if(open_file(&out.tiers[t], path, 1, pudomat_tier_period[t]) != 0)
+            goto err;
+        out.tiers[t].open_seen = 0;
+    }
+
+    pudomat_store_segments(dir, &segments);
+    while(done < segments)
+    {
+        int n = 0;
+        for(; n < threads && done + n < segments; n++)
+        {
+            jobs[n] = (struct rebuild_job){
+                .dir = dir, .segment = done + n, .first = 0, .last = (uint64_t)-1
+            };
+        }
+        if(run_jobs(&out, jobs, n) != 0)
+            goto err;
+        taken = jobs[n - 1].taken;
+        done += n;
+    }
+
+    snprintf(path, sizeof(path), "%s/lock", dir);
+    lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(lock_fd < 0)
+    {
+        perror(path);
+        goto err;
+    }
+    flock(lock_fd, LOCK_EX);
+
+    // catch up with what writers appended while we were busy
+    pudomat_store_segments(dir, &segments);
+    for(uint32_t s = done ? done - 1 : 0; s < segments; s++)
+    {
+        jobs[0] = (struct rebuild_job){
+            .dir = dir, .segment = s, .first = s + 1 == done ? taken : 0,
+            .last = (uint64_t)-1
+        };
+        if(run_jobs(&out, jobs, 1) != 0)
+            goto err;
+    }
+
+    for(int t = 0; t < PUDOMAT_ROLLUP_TIERS; t++)
+    {
+        if(sort_tier(&out.tiers[t]) != 0)
+        {
+            fprintf(stderr, "%s: nedostatek pameti\n", out.tiers[t].path);
+            goto err;
+        }
+    }
+
+    // sketches first, a writer notices the replaced rows file
+    for(int t = 0; t < PUDOMAT_ROLLUP_TIERS; t++)
+    {
+        tier_path(path, sizeof(path), dir, t, ".new");
+        tier_path(final, sizeof(final), dir, t, "");
+        if(pudomat_tier_period[t] >= PUDOMAT_SKETCH_PERIOD)
+        {
+            char sketch[300], sketch_final[300];
+            sketch_path(sketch, sizeof(sketch), path);
+            sketch_path(sketch_final, sizeof(sketch_final), final);
+            if(rename(sketch, sketch_final) != 0)
+            {
+                perror(sketch_final);
+                goto err;
+            }
+        }
+        if(rename(path, final) != 0)
+        {
+            perror(final);
+            goto err;
+        }
+    }
+    rc = 0;
+
+err:
+    if(lock_fd >= 0)
+        close(lock_fd);
+    pudomat_rollups_close(&out);
+    if(rc != 0)
+        for(int t = 0; t < PUDOMAT_ROLLUP_TIERS; t++)
+            remove_new(dir, t);
+    free(jobs);
+    return rc;
+}
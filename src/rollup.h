@@ -0,0 +1,112 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stdint.h>
+#include "sketch.h"
+#include "store.h"
+
+#define PUDOMAT_ROLLUP_MAGIC 0x52475550 // "PUGR"
+#define PUDOMAT_SKETCH_MAGIC 0x51475550 // "PUGQ"
+#define PUDOMAT_ROLLUP_VERSION 2
+#define PUDOMAT_ROLLUP_TIERS 3
+#define PUDOMAT_ROLLUP_OPEN 64 // sensors tracked per tier
+#define PUDOMAT_SKETCH_PERIOD 3600 // tiers this coarse keep temperature sketches
+
+enum pudomat_tier {
+    TIER_MINUTE,
+    TIER_HOUR,
+    TIER_DAY,
+};
+
+#pragma pack(push, 1)
+
+// aggregate of one sensor and its board channels over one period; raw units
+// as in struct pudomat_record, the relay duty is relay_on / count
+struct pudomat_rollup {
+    int64_t start;
+    uint64_t rom;
+    uint32_t count;
+    uint32_t relay_on;
+    int16_t temp_min;
+    int16_t temp_max;
+    uint16_t volt_min;
+    uint16_t volt_max;
+    uint16_t current_min;
+    uint16_t current_max;
+    int64_t temp_sum;
+    uint64_t volt_sum;
+    uint64_t current_sum;
+    uint32_t padding;
+};
+
+struct pudomat_rollup_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t row_size;
+    uint32_t period;
+    uint64_t count;
+    uint64_t ordered;      // leading rows sorted by start up to a period
+    int64_t ordered_start; // the latest start among them
+    uint64_t samples;      // records rolled up into the rows
+    uint8_t padding[16];
+};
+
+#pragma pack(pop)
+
+// One tier file and, for the hour and day tiers, a file of sketches with the
+// same header and one sketch per row. Rows follow the order their buckets
+// were opened in, which is the sample order and so sorted by start up to a
+// period, except for history imported behind newer samples: the header
+// counts the ordered rows, the rest is scanned whole until a rebuild sorts
+// the tier again.
+struct pudomat_rollup_file {
+    char path[300];
+    int fd;
+    uint8_t writable;
+    size_t size;
+    uint64_t capacity;
+    struct pudomat_rollup_header *header;
+    struct pudomat_rollup *rows;
+    struct {
+        uint64_t rom;
+        uint64_t row;
+    } open[PUDOMAT_ROLLUP_OPEN];
+    int open_count;
+    uint64_t open_seen; // header count the open rows were recovered at
+    int sketch_fd;
+    size_t sketch_size;
+    struct pudomat_rollup_header *sketch_header; // NULL without sketches
+    struct pudomat_sketch *sketches;
+};
+
+struct pudomat_rollups {
+    struct pudomat_rollup_file tiers[PUDOMAT_ROLLUP_TIERS];
+};
+
+extern const int64_t pudomat_tier_period[PUDOMAT_ROLLUP_TIERS];
+
+int pudomat_rollups_open(struct pudomat_rollups *rollups, const char *dir,
+                         int writable);
+void pudomat_rollups_add(struct pudomat_rollups *rollups,
+                         const struct pudomat_record *records, int count);
+void pudomat_rollups_close(struct pudomat_rollups *rollups);
+int pudomat_rollups_ordered(const struct pudomat_rollups *rollups);
+int pudomat_rollups_complete(const struct pudomat_rollups *rollups,
+                             const char *dir);
+int pudomat_rollups_rebuild(const char *dir, int threads);
+
+void pudomat_rollup_merge(struct pudomat_rollup *into,
+                          const struct pudomat_rollup *row);
+
+typedef int (*pudomat_rollup_cb)(const struct pudomat_rollup *row, void *arg);
+int pudomat_rollup_query(const struct pudomat_rollups *rollups, uint64_t rom,
+                         int64_t *from, int64_t *to,
+                         pudomat_rollup_cb callback, void *arg);
+
+typedef int (*pudomat_sketch_cb)(const struct pudomat_rollup *row,
+                                 const struct pudomat_sketch *sketch, void *arg);
+int pudomat_rollup_sketches(const struct pudomat_rollups *rollups, uint64_t rom,
+                            int64_t *from, int64_t *to,
+                            pudomat_sketch_cb callback, void *arg);
+
+#endif
@@ -13,12 +13,10 @@
 */
 
 
-#include <avr/io.h>
-#include <avr/interrupt.h>
 #include <inttypes.h>
 #include <string.h>
 #include <stddef.h>
-#include <util/delay.h>
+#include <hal.h>
 #include <onewire.h>
 #include <ds18b20.h>
 #include <romsearch.h>
@@ -0,0 +1,478 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "daemon.h"
+#include "server.h"
+
+#define HEADER sizeof(struct server_frame)
+
+static void drop_client(struct server_client *client)
+{
+    close(client->fd);
+    memset(client, 0, sizeof(*client));
+    client->fd = -1;
+}
+
+static void flush_client(struct server_client *client)
+{
+    while(client->out_len)
+    {
+        ssize_t n = send(client->fd, client->out, client->out_len,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                drop_client(client);
+            return;
+        }
+        client->out_len -= n;
+        memmove(client->out, client->out + n, client->out_len);
+    }
+}
+
+// queues one frame; a reader that falls behind loses samples instead of
+// stalling the daemon
+static int queue_frame(struct server_client *client, uint8_t type,
+                       enum command command, uint8_t status, uint8_t index,
+                       time_t time, const char *id, const void *data,
+                       uint16_t size)
+{
+    struct server_frame frame = {
+        .type = type, .command = command, .status = status, .index = index
+    };
+    struct server_sample sample = { .time = time, .id_len = id ? strlen(id) : 0 };
+
+    if(!data)
+        size = 0;
+    frame.length = sizeof(sample) + sample.id_len + size;
+    if(client->out_len + HEADER + frame.length > sizeof(client->out))
+        return 1;
+
+    uint8_t *p = client->out + client->out_len;
+    memcpy(p, &frame, HEADER);
+    p += HEADER;
+    memcpy(p, &sample, sizeof(sample));
+    p += sizeof(sample);
+    memcpy(p, id, sample.id_len);
+    p += sample.id_len;
+    memcpy(p, data, size);
+    client->out_len += HEADER + frame.length;
+    return 0;
+}
+
+static int device_index(struct server *server, struct daemon_device *dd)
+{
+    return dd ? (int)(dd - server->daemon->devices) : SERVER_ALL_DEVICES;
+}
+
+static int valid_command(uint8_t command)
+{
+    return command >= CMD_DBG_READ && command < PUDOMAT_CMD_COUNT;
+}
+
+static void reply(struct server *server, struct server_client *client,
+                  enum command command, uint8_t status,
+                  struct daemon_device *dd)
+{
+    time_t t = time(NULL);
+    const void *data = NULL;
+    uint16_t size = 0;
+
+    if(dd && status == SERVER_OK && valid_command(command) &&
+       command != CMD_CFG_WRITE)
+    {
+        t = dd->snapshot.time[command];
+        if(t)
+        {
+            data = daemon_snapshot_data(&dd->snapshot, command);
+            size = get_response_size(command);
+        }
+        else
+            status = SERVER_FAILED;
+    }
+
+    if(queue_frame(client, MSG_REPLY, command, status, device_index(server, dd), t,
+                   dd ? dd->device.id : NULL, data, size) != 0)
+        client->dropped++;
+}
+
+static void handle_frame(struct server *server, struct server_client *client,
+                         const struct server_frame *frame, const uint8_t *payload)
+{
+    char id[PUDOMAT_ID_LEN] = { 0 };
+    size_t id_offset = frame->type == MSG_CFG_WRITE ? sizeof(struct config) : 0;
+
+    if(frame->length < id_offset)
+    {
+        drop_client(client);
+        return;
+    }
+    size_t id_len = frame->length - id_offset;
+    if(id_len >= sizeof(id))
+        id_len = sizeof(id) - 1;
+    memcpy(id, payload + id_offset, id_len);
+
+    struct daemon_device *dd = NULL;
+    if(frame->type != MSG_SUBSCRIBE || id[0] || frame->index != SERVER_ALL_DEVICES)
+    {
+        dd = daemon_find_device(server->daemon, id, frame->index);
+        if(!dd)
+        {
+            reply(server, client, frame->command, SERVER_NO_DEVICE, NULL);
+            return;
+        }
+    }
+
+    switch(frame->type)
+    {
+    case MSG_GET:
+        if(!valid_command(frame->command) || frame->command == CMD_CFG_WRITE)
+            reply(server, client, frame->command, SERVER_FAILED, dd);
+        else
+            reply(server, client, frame->command, SERVER_OK, dd);
+        break;
+    case MSG_CFG_WRITE:
+        if(client->config_write ||
+           daemon_write_config(dd, (const struct config *)payload) != 0)
+            reply(server, client, CMD_CFG_WRITE, SERVER_FAILED, dd);
+        else
+            client->config_write = dd;
+        break;
+    case MSG_SUBSCRIBE:
+        if(dd)
+            client->masks[device_index(server, dd)] = frame->command;
+        else
+            client->all_mask = frame->command;
+        reply(server, client, 0, SERVER_OK, NULL);
+        break;
+    default:
+        drop_client(client);
+        break;
+    }
+}
+
+static void read_client(struct server *server, struct server_client *client)
+{
+    ssize_t n = recv(client->fd, client->in + client->in_len,
+                     sizeof(client->in) - client->in_len, MSG_DONTWAIT);
+    if(n <= 0)
+    {
+        if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            drop_client(client);
+        return;
+    }
+    client->in_len += n;
+
+    size_t used = 0;
+    while(client->in_len - used >= HEADER)
+    {
+        struct server_frame frame;
+        memcpy(&frame, client->in + used, HEADER);
+        if(HEADER + frame.length > sizeof(client->in))
+        {
+            drop_client(client);
+            return;
+        }
+        if(client->in_len - used < HEADER + frame.length)
+            break;
+
+        handle_frame(server, client, &frame, client->in + used + HEADER);
+        if(client->fd < 0)
+            return;
+        used += HEADER + frame.length;
+    }
+
+    client->in_len -= used;
+    memmove(client->in, client->in + used, client->in_len);
+    flush_client(client);
+}
+
+static void accept_client(struct server *server)
+{
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if(fd < 0)
+        return;
+
+    for(int i = 0; i < SERVER_MAX_CLIENTS; i++)
+    {
+        struct server_client *client = &server->clients[i];
+        if(client->fd < 0)
+        {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            client->fd = fd;
+            return;
+        }
+    }
+    close(fd);
+}
+
+int server_open(struct server *server, struct daemon *daemon,
+                const char *socket_path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd = -1;
+
+    server->daemon = daemon;
+    server->path = socket_path;
+    server->listen_fd = -1;
+    for(int i = 0; i < SERVER_MAX_CLIENTS; i++)
+        server->clients[i].fd = -1;
+
+    if(strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Prilis dlouha cesta k socketu\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    struct stat st;
+    if(lstat(socket_path, &st) == 0)
+    {
+        if(!S_ISSOCK(st.st_mode))
+        {
+            fprintf(stderr, "%s neni socket\n", socket_path);
+            return 1;
+        }
+        unlink(socket_path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        goto err;
+
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        goto err;
+    chmod(socket_path, 0666);
+
+    if(listen(fd, SERVER_MAX_CLIENTS) != 0)
+        goto err;
+
+    server->listen_fd = fd;
+    return 0;
+
+err:
+    perror(socket_path);
+    if(fd >= 0)
+        close(fd);
+    return 1;
+}
+
+void server_close(struct server *server)
+{
+    for(int i = 0; i < SERVER_MAX_CLIENTS; i++)
+        if(server->clients[i].fd >= 0)
+            drop_client(&server->clients[i]);
+
+    if(server->listen_fd >= 0)
+    {
+        close(server->listen_fd);
+        unlink(server->path);
+        server->listen_fd = -1;
+    }
+}
+
+int server_pollfds(struct server *server, struct pollfd *fds, int max)
+{
+    int count = 0;
+
+    if(max < 1)
+        return 0;
+    server->poll_slot[count] = -1;
+    fds[count++] = (struct pollfd){ .fd = server->listen_fd, .events = POLLIN };
+
+    for(int i = 0; i < SERVER_MAX_CLIENTS && count < max; i++)
+    {
+        struct server_client *client = &server->clients[i];
+        if(client->fd < 0)
+            continue;
+        server->poll_slot[count] = i;
+        fds[count++] = (struct pollfd){
+            .fd = client->fd,
+            .events = POLLIN | (client->out_len ? POLLOUT : 0)
+        };
+    }
+    return count;
+}
+
+void server_handle(struct server *server, const struct pollfd *fds, int count)
+{
+    for(int i = 1; i < count; i++)
+    {
+        struct server_client *client = &server->clients[server->poll_slot[i]];
+        if(client->fd != fds[i].fd)
+            continue;
+        if(fds[i].revents & POLLOUT)
+            flush_client(client);
+        if(client->fd >= 0 && fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            read_client(server, client);
+    }
+
+    if(count > 0 && fds[0].revents & POLLIN)
+        accept_client(server);
+}
+
+// one USB read fans out to every subscriber of that device and command
+void server_publish(struct server *server, struct daemon_device *dd,
+                    enum command command)
+{
+    int index = device_index(server, dd);
+
+    for(int i = 0; i < SERVER_MAX_CLIENTS; i++)
+    {
+        struct server_client *client = &server->clients[i];
+        if(client->fd < 0)
+            continue;
+        if(!((client->all_mask | client->masks[index]) & (1 << command)))
+            continue;
+
+        if(queue_frame(client, MSG_PUSH, command, SERVER_OK, index,
+                       dd->snapshot.time[command], dd->device.id,
+                       daemon_snapshot_data(&dd->snapshot, command),
+                       get_response_size(command)) != 0)
+            client->dropped++;
+        flush_client(client);
+    }
+}
+
+void server_config_written(struct server *server, struct daemon_device *dd,
+                           uint8_t status)
+{
+    for(int i = 0; i < SERVER_MAX_CLIENTS; i++)
+    {
+        struct server_client *client = &server->clients[i];
+        if(client->fd < 0 || client->config_write != dd)
+            continue;
+        client->config_write = NULL;
+        reply(server, client, CMD_CFG_WRITE, status, dd);
+        flush_client(client);
+    }
+}
+
+// a daemon that lost a reply must not block the CLI forever
+static int set_reply_timeout(int fd, int seconds)
+{
+    struct timeval tv = { .tv_sec = seconds };
+    return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+int server_connect(const char *socket_path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if(strlen(socket_path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -1;
+
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+       set_reply_timeout(fd, SERVER_REPLY_TIMEOUT) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_frame(int fd, uint8_t type, uint8_t command, int index,
+                      const char *id, const void *data, uint16_t size)
+{
+    uint8_t buffer[SERVER_MAX_FRAME];
+    struct server_frame frame = {
+        .type = type, .command = command, .index = index
+    };
+    size_t id_len = id ? strnlen(id, PUDOMAT_ID_LEN - 1) : 0;
+
+    frame.length = size + id_len;
+    memcpy(buffer, &frame, HEADER);
+    if(size)
+        memcpy(buffer + HEADER, data, size);
+    memcpy(buffer + HEADER + size, id, id_len);
+
+    ssize_t total = HEADER + frame.length;
+    return send(fd, buffer, total, MSG_NOSIGNAL) == total ? 0 : 1;
+}
+
+int server_receive(int fd, struct server_reading *reading)
+{
+    struct server_frame frame;
+    struct server_sample sample;
+    uint8_t payload[SERVER_MAX_FRAME];
+
+    if(recv(fd, &frame, HEADER, MSG_WAITALL) != HEADER)
+        return 1;
+    if(frame.length > sizeof(payload) || frame.length < sizeof(sample))
+        return 1;
+    if(recv(fd, payload, frame.length, MSG_WAITALL) != frame.length)
+        return 1;
+
+    memcpy(&sample, payload, sizeof(sample));
+    size_t data_len = frame.length - sizeof(sample);
+    if(sample.id_len >= PUDOMAT_ID_LEN || sample.id_len > data_len)
+        return 1;
+    data_len -= sample.id_len;
+    if(data_len > sizeof(reading->data))
+        return 1;
+
+    memset(reading, 0, sizeof(*reading));
+    reading->command = frame.command;
+    reading->status = frame.status;
+    reading->index = frame.index;
+    reading->push = frame.type == MSG_PUSH;
+    reading->time = sample.time;
+    memcpy(reading->id, payload + sizeof(sample), sample.id_len);
+    memcpy(reading->data, payload + sizeof(sample) + sample.id_len, data_len);
+    if(frame.status == SERVER_OK && frame.type == MSG_REPLY &&
+       valid_command(frame.command) && frame.command != CMD_CFG_WRITE &&
+       data_len != get_response_size(frame.command))
+        return 1;
+    return frame.type == MSG_REPLY || frame.type == MSG_PUSH ? 0 : 1;
+}
+
+// waits for the reply, pushes arriving in between are skipped
+static int receive_reply(int fd, struct server_reading *reading)
+{
+    do
+    {
+        if(server_receive(fd, reading) != 0)
+            return 1;
+    } while(reading->push);
+    return 0;
+}
+
+int server_request(int fd, const char *id, int index, enum command command,
+                   const struct config *config, struct server_reading *reading)
+{
+    int rc;
+
+    if(command == CMD_CFG_WRITE)
+        rc = send_frame(fd, MSG_CFG_WRITE, command, index, id, config,
+                        sizeof(*config));
+    else
+        rc = send_frame(fd, MSG_GET, command, index, id, NULL, 0);
+
+    if(rc != 0 || receive_reply(fd, reading) != 0)
+        return SERVER_FAILED;
+    return reading->status;
+}
+
+int server_subscribe(int fd, const char *id, int index, uint8_t mask)
+{
+    struct server_reading reading;
+
+    if(send_frame(fd, MSG_SUBSCRIBE, mask, index, id, NULL, 0) != 0)
+        return SERVER_FAILED;
+    if(receive_reply(fd, &reading) != 0)
+        return SERVER_FAILED;
+    if(reading.status == SERVER_OK && set_reply_timeout(fd, 0) != 0)
+        return SERVER_FAILED;
+    return reading.status;
+}
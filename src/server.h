@@ -0,0 +1,99 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "pudomat.h"
+
+#define SERVER_MAX_CLIENTS 32
+#define SERVER_MAX_FRAME 512
+#define SERVER_OUT_BUFFER 8192
+#define SERVER_ALL_DEVICES 0xff
+#define SERVER_REPLY_TIMEOUT 30 // seconds a client waits for a reply
+
+#define SERVER_OK 0
+#define SERVER_FAILED 1
+#define SERVER_NO_DEVICE 3
+
+enum server_message {
+    MSG_GET = 1,       // latest sample of one command, payload: device id
+    MSG_CFG_WRITE,     // payload: struct config followed by the device id
+    MSG_SUBSCRIBE,     // command is a mask of 1 << command, 0 cancels
+    MSG_REPLY = 0x81,  // payload: struct server_sample, device id, data
+    MSG_PUSH,          // same as MSG_REPLY, sent on every new sample
+};
+
+#pragma pack(push, 1)
+
+// every frame starts with this header, length counts the payload after it;
+// a device is selected by the id in the payload, or by index without one
+struct server_frame {
+    uint16_t length;
+    uint8_t type;
+    uint8_t command;
+    uint8_t status;
+    uint8_t index;
+};
+
+struct server_sample {
+    int64_t time;
+    uint8_t id_len;
+};
+
+#pragma pack(pop)
+
+struct daemon;
+struct daemon_device;
+
+struct server_client {
+    int fd;
+    uint8_t in[SERVER_MAX_FRAME];
+    size_t in_len;
+    uint8_t out[SERVER_OUT_BUFFER];
+    size_t out_len;
+    uint8_t all_mask;                     // subscriptions on every device
+    uint8_t masks[PUDOMAT_MAX_DEVICES];   // subscriptions per device slot
+    struct daemon_device *config_write;   // waiting for this acknowledgement
+    uint32_t dropped;                     // pushes that did not fit
+};
+
+struct server {
+    struct daemon *daemon;
+    const char *path;
+    int listen_fd;
+    struct server_client clients[SERVER_MAX_CLIENTS];
+    int poll_slot[SERVER_MAX_CLIENTS + 1];
+};
+
+// one reading as seen by a client
+struct server_reading {
+    enum command command;
+    uint8_t status;
+    uint8_t index;
+    uint8_t push;      // unsolicited, from a subscription
+    time_t time;
+    char id[PUDOMAT_ID_LEN];
+    uint8_t data[PUDOMAT_MAX_RESPONSE];
+};
+
+int server_open(struct server *server, struct daemon *daemon,
+                const char *socket_path);
+void server_close(struct server *server);
+int server_pollfds(struct server *server, struct pollfd *fds, int max);
+void server_handle(struct server *server, const struct pollfd *fds, int count);
+void server_publish(struct server *server, struct daemon_device *dd,
+                    enum command command);
+void server_config_written(struct server *server, struct daemon_device *dd,
+                           uint8_t status);
+
+// Replies are waited for at most SERVER_REPLY_TIMEOUT, pushes after a
+// subscription as long as it takes.
+int server_connect(const char *socket_path);
+int server_request(int fd, const char *id, int index, enum command command,
+                   const struct config *config, struct server_reading *reading);
+int server_subscribe(int fd, const char *id, int index, uint8_t mask);
+int server_receive(int fd, struct server_reading *reading);
+
+#endif
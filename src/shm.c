@@ -0,0 +1,179 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "shm.h"
+
+int pudomat_shm_create(struct pudomat_shm *shm, const char *name,
+                       unsigned interval)
+{
+    memset(shm, 0, sizeof(*shm));
+    shm->name = name;
+    shm->writer = 1;
+
+    // a stale segment of another layout must not be reused
+    shm_unlink(name);
+    shm->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if(shm->fd < 0)
+        goto err;
+    fchmod(shm->fd, 0644);
+
+    if(ftruncate(shm->fd, sizeof(*shm->segment)) != 0)
+        goto err;
+
+    shm->segment = mmap(NULL, sizeof(*shm->segment), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, shm->fd, 0);
+    if(shm->segment == MAP_FAILED)
+    {
+        shm->segment = NULL;
+        goto err;
+    }
+
+    shm->segment->version = PUDOMAT_SHM_VERSION;
+    shm->segment->size = sizeof(*shm->segment);
+    shm->segment->pid = getpid();
+    shm->segment->data.interval = interval;
+    __atomic_store_n(&shm->segment->magic, PUDOMAT_SHM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+
+err:
+    perror(name);
+    pudomat_shm_close(shm);
+    return 1;
+}
+
+void pudomat_shm_publish(struct pudomat_shm *shm, int index, const char *id,
+                         enum command command, const void *data, time_t time)
+{
+    struct pudomat_shm_segment *segment = shm->segment;
+    if(!segment || index >= PUDOMAT_MAX_DEVICES)
+        return;
+
+    struct pudomat_shm_device *device = &segment->data.devices[index];
+    void *target = NULL;
+    switch(command)
+    {
+    case CMD_TEMP:
+        target = &device->temp;
+        break;
+    case CMD_VOLT:
+        target = &device->volt;
+        break;
+    case CMD_DBG_READ:
+        target = &device->debug;
+        break;
+    case CMD_CFG_READ:
+        target = &device->config;
+        break;
+    default:
+        return;
+    }
+
+    uint32_t sequence = segment->sequence;
+    __atomic_store_n(&segment->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    strncpy(device->id, id, PUDOMAT_ID_LEN - 1);
+    memcpy(target, data, get_response_size(command));
+    device->time[command] = time;
+    device->generation++;
+    segment->data.generation++;
+    if(index >= segment->data.device_count)
+        segment->data.device_count = index + 1;
+
+    __atomic_store_n(&segment->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+int pudomat_shm_attach(struct pudomat_shm *shm, const char *name)
+{
+    struct stat st;
+
+    memset(shm, 0, sizeof(*shm));
+    shm->name = name;
+
+    shm->fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if(shm->fd < 0)
+        return 1;
+
+    if(fstat(shm->fd, &st) != 0 || st.st_size < sizeof(*shm->segment))
+        goto err;
+
+    shm->segment = mmap(NULL, sizeof(*shm->segment), PROT_READ, MAP_SHARED,
+                        shm->fd, 0);
+    if(shm->segment == MAP_FAILED)
+    {
+        shm->segment = NULL;
+        goto err;
+    }
+
+    if(__atomic_load_n(&shm->segment->magic, __ATOMIC_ACQUIRE) != PUDOMAT_SHM_MAGIC ||
+       shm->segment->version != PUDOMAT_SHM_VERSION ||
+       shm->segment->size != sizeof(*shm->segment))
+        goto err;
+    // EPERM still means the daemon runs, under another user
+    if(kill(shm->segment->pid, 0) != 0 && errno != EPERM)
+        goto err;
+    return 0;
+
+err:
+    pudomat_shm_close(shm);
+    return 1;
+}
+
+// cheap change check: an unchanged generation means a copy is not needed
+uint64_t pudomat_shm_generation(const struct pudomat_shm *shm)
+{
+    const struct pudomat_shm_segment *segment = shm->segment;
+    uint32_t before, after;
+    uint64_t generation;
+
+    do
+    {
+        before = __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
+        generation = segment->data.generation;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&segment->sequence, __ATOMIC_RELAXED);
+    } while((before & 1) || before != after);
+
+    return generation;
+}
+
+int pudomat_shm_read(const struct pudomat_shm *shm,
+                     struct pudomat_shm_data *data)
+{
+    const struct pudomat_shm_segment *segment = shm->segment;
+    uint32_t before, after;
+
+    if(!segment)
+        return 1;
+
+    do
+    {
+        before = __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
+        if(before & 1)
+            continue;
+        memcpy(data, (const void *)&segment->data, sizeof(*data));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&segment->sequence, __ATOMIC_RELAXED);
+    } while((before & 1) || before != after);
+
+    if(data->device_count > PUDOMAT_MAX_DEVICES)
+        return 1;
+    return 0;
+}
+
+void pudomat_shm_close(struct pudomat_shm *shm)
+{
+    if(shm->segment)
+        munmap(shm->segment, sizeof(*shm->segment));
+    if(shm->writer && shm->fd >= 0)
+        shm_unlink(shm->name);
+    if(shm->fd >= 0)
+        close(shm->fd);
+    shm->segment = NULL;
+    shm->fd = -1;
+}
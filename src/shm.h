@@ -0,0 +1,59 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <time.h>
+#include "pudomat.h"
+
+#define PUDOMAT_SHM "/pudomat"
+#define PUDOMAT_SHM_MAGIC 0x53445550 // "PUDS"
+#define PUDOMAT_SHM_VERSION 2
+
+struct pudomat_shm_device {
+    char id[PUDOMAT_ID_LEN];
+    uint64_t generation;             // bumped on every update of this device
+    int64_t time[PUDOMAT_CMD_COUNT]; // 0 until the first sample
+    struct temp_response temp;
+    struct volt_response volt;
+    struct debug_data debug;
+    struct config config;
+};
+
+struct pudomat_shm_data {
+    uint64_t generation; // bumped on every update of any device
+    uint32_t interval;   // seconds between the daemon's polls
+    uint32_t device_count;
+    struct pudomat_shm_device devices[PUDOMAT_MAX_DEVICES];
+};
+
+// Layout of the shared segment. The daemon is the only writer; sequence is
+// odd while it updates data, readers copy data and retry until they saw the
+// same even sequence before and after the copy. A segment whose writer is
+// gone is left behind by a crashed daemon and is not attached.
+struct pudomat_shm_segment {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t sequence;
+    int32_t pid; // the writing daemon
+    struct pudomat_shm_data data;
+};
+
+struct pudomat_shm {
+    const char *name;
+    int fd;
+    uint8_t writer;
+    struct pudomat_shm_segment *segment;
+};
+
+int pudomat_shm_create(struct pudomat_shm *shm, const char *name,
+                       unsigned interval);
+void pudomat_shm_publish(struct pudomat_shm *shm, int index, const char *id,
+                         enum command command, const void *data, time_t time);
+int pudomat_shm_attach(struct pudomat_shm *shm, const char *name);
+uint64_t pudomat_shm_generation(const struct pudomat_shm *shm);
+int pudomat_shm_read(const struct pudomat_shm *shm,
+                     struct pudomat_shm_data *data);
+void pudomat_shm_close(struct pudomat_shm *shm);
+
+#endif
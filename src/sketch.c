@@ -0,0 +1,190 @@
+#include <math.h>
+#include <string.h>
+#include "sketch.h"
+
+struct centroid {
+    double mean;
+    uint32_t weight;
+};
+
+// t-digest scale function k1: centroids stay small near the tails
+static double scale_k(double q, double delta)
+{
+    if(q > 1)
+        q = 1;
+    return delta / (2 * M_PI) * asin(2 * q - 1);
+}
+
+static double scale_q(double k, double delta)
+{
+    double x = k * 2 * M_PI / delta;
+    return x >= M_PI / 2 ? 1 : (sin(x) + 1) / 2;
+}
+
+// merges neighbours of the sorted list until it fits into the sketch
+static int compress(struct centroid *out, const struct centroid *in, int count,
+                    uint64_t total)
+{
+    double delta = PUDOMAT_SKETCH_CENTROIDS;
+    int used;
+
+    do
+    {
+        uint64_t done = 0;
+        double limit = scale_q(scale_k(0, delta) + 1, delta) * total;
+        struct centroid current = in[0];
+
+        used = 0;
+        for(int i = 1; i < count; i++)
+        {
+            if(done + current.weight + in[i].weight <= limit)
+            {
+                current.mean += (in[i].mean - current.mean) * in[i].weight /
+                                (current.weight + in[i].weight);
+                current.weight += in[i].weight;
+                continue;
+            }
+            out[used++] = current;
+            done += current.weight;
+            limit = scale_q(scale_k((double)done / total, delta) + 1, delta) * total;
+            current = in[i];
+        }
+        out[used++] = current;
+        delta *= 0.8;
+    } while(used > PUDOMAT_SKETCH_CENTROIDS);
+
+    return used;
+}
+
+void pudomat_sketch_init(struct pudomat_sketch *sketch, int16_t value)
+{
+    memset(sketch, 0, sizeof(*sketch));
+    sketch->count = 1;
+    sketch->used = 1;
+    sketch->min = sketch->max = value;
+    sketch->exact = 1;
+    sketch->centroids[0].mean = value;
+    sketch->centroids[0].weight = 1;
+}
+
+void pudomat_sketch_merge(struct pudomat_sketch *into,
+                          const struct pudomat_sketch *sketch)
+{
+    struct centroid merged[2 * PUDOMAT_SKETCH_CENTROIDS];
+    int count = 0, i = 0, j = 0;
+
+    if(!sketch->count)
+        return;
+    if(!into->count)
+    {
+        *into = *sketch;
+        return;
+    }
+
+    // both lists are sorted, equal means add up
+    while(i < into->used || j < sketch->used)
+    {
+        struct centroid next;
+        if(j == sketch->used ||
+           (i < into->used && into->centroids[i].mean <= sketch->centroids[j].mean))
+        {
+            next.mean = into->centroids[i].mean;
+            next.weight = into->centroids[i++].weight;
+        }
+        else
+        {
+            next.mean = sketch->centroids[j].mean;
+            next.weight = sketch->centroids[j++].weight;
+        }
+
+        if(count && merged[count - 1].mean == next.mean)
+            merged[count - 1].weight += next.weight;
+        else
+            merged[count++] = next;
+    }
+
+    into->count += sketch->count;
+    into->exact = into->exact && sketch->exact;
+    if(sketch->min < into->min)
+        into->min = sketch->min;
+    if(sketch->max > into->max)
+        into->max = sketch->max;
+
+    if(count > PUDOMAT_SKETCH_CENTROIDS)
+    {
+        struct centroid compressed[PUDOMAT_SKETCH_CENTROIDS];
+        count = compress(compressed, merged, count, into->count);
+        memcpy(merged, compressed, count * sizeof(*merged));
+        into->exact = 0;
+    }
+
+    into->used = count;
+    for(i = 0; i < count; i++)
+    {
+        into->centroids[i].mean = merged[i].mean;
+        into->centroids[i].weight = merged[i].weight;
+    }
+}
+
+// value below which the fraction q of the samples lies, in raw units; exact
+// sketches give the nearest rank, the others interpolate between centroids
+double pudomat_sketch_quantile(const struct pudomat_sketch *sketch, double q)
+{
+    const int n = sketch->used;
+    double target = q * sketch->count, done = 0, value;
+
+    if(!sketch->count)
+        return NAN;
+
+    if(sketch->exact)
+    {
+        double rank = ceil(target) < 1 ? 1 : ceil(target);
+        for(int i = 0; i < n - 1; i++)
+        {
+            done += sketch->centroids[i].weight;
+            if(done >= rank)
+                return sketch->centroids[i].mean;
+        }
+        return sketch->centroids[n - 1].mean;
+    }
+
+    if(target <= 0)
+        return sketch->min;
+    if(target >= sketch->count)
+        return sketch->max;
+
+    // each centroid stands for its weight spread around its mean, the tails
+    // reach to the extremes
+    double half = sketch->centroids[0].weight / 2.0;
+    if(target < half)
+        value = sketch->min + (sketch->centroids[0].mean - sketch->min) * target / half;
+    else
+    {
+        int i = 0;
+        while(i < n - 1 && target >= done + sketch->centroids[i].weight +
+                                      sketch->centroids[i + 1].weight / 2.0)
+            done += sketch->centroids[i++].weight;
+
+        double left = done + sketch->centroids[i].weight / 2.0;
+        if(i == n - 1)
+        {
+            half = sketch->centroids[i].weight / 2.0;
+            value = sketch->centroids[i].mean +
+                    (sketch->max - sketch->centroids[i].mean) * (target - left) / half;
+        }
+        else
+        {
+            double right = left + sketch->centroids[i].weight / 2.0 +
+                           sketch->centroids[i + 1].weight / 2.0;
+            value = sketch->centroids[i].mean +
+                    (sketch->centroids[i + 1].mean - sketch->centroids[i].mean) *
+                    (target - left) / (right - left);
+        }
+    }
+
+    if(value < sketch->min)
+        return sketch->min;
+    if(value > sketch->max)
+        return sketch->max;
+    return value;
+}
@@ -0,0 +1,33 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+
+#define PUDOMAT_SKETCH_CENTROIDS 30
+
+#pragma pack(push, 1)
+
+// Mergeable t-digest of temperatures in raw units, centroids sorted by mean.
+// While exact is set every centroid is one distinct value with its number of
+// samples, which is the usual case for a sensor over an hour or a day.
+struct pudomat_sketch {
+    uint32_t count;
+    uint16_t used;
+    int16_t min;
+    int16_t max;
+    uint8_t exact;
+    uint8_t padding[5];
+    struct {
+        float mean;
+        uint32_t weight;
+    } centroids[PUDOMAT_SKETCH_CENTROIDS];
+};
+
+#pragma pack(pop)
+
+void pudomat_sketch_init(struct pudomat_sketch *sketch, int16_t value);
+void pudomat_sketch_merge(struct pudomat_sketch *into,
+                          const struct pudomat_sketch *sketch);
+double pudomat_sketch_quantile(const struct pudomat_sketch *sketch, double q);
+
+#endif
@@ -0,0 +1,325 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "rollup.h"
+#include "store.h"
+
+#define SEGMENT_SIZE (sizeof(struct pudomat_segment_header) + \
+                      PUDOMAT_STORE_RECORDS * sizeof(struct pudomat_record))
+
+static void segment_path(char *path, size_t size, const char *dir,
+                         uint32_t number)
+{
+    snprintf(path, size, "%s/%08u.seg", dir, number);
+}
+
+static int segment_exists(const char *dir, uint32_t number)
+{
+    char path[300];
+    struct stat st;
+    segment_path(path, sizeof(path), dir, number);
+    return stat(path, &st) == 0;
+}
+
+// A new segment gets its name only once it is sized and has its header, so
+// a reader never maps a half made one. Called by writers holding the store
+// lock.
+static int create_segment(const char *path)
+{
+    struct pudomat_segment_header header = {
+        .magic = PUDOMAT_STORE_MAGIC,
+        .version = PUDOMAT_STORE_VERSION,
+        .record_size = sizeof(struct pudomat_record),
+        .capacity = PUDOMAT_STORE_RECORDS,
+    };
+    char tmp[320];
+
+    snprintf(tmp, sizeof(tmp), "%s.new", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+        goto err;
+    if(ftruncate(fd, SEGMENT_SIZE) != 0 ||
+       pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        close(fd);
+        goto err;
+    }
+    if(close(fd) != 0 || rename(tmp, path) != 0)
+        goto err;
+    return 0;
+
+err:
+    perror(tmp);
+    unlink(tmp);
+    return 1;
+}
+
+static int map_segment(struct pudomat_segment *segment, const char *dir,
+                       uint32_t number, int create)
+{
+    char path[300];
+    struct stat st;
+
+    memset(segment, 0, sizeof(*segment));
+    segment->number = number;
+    segment_path(path, sizeof(path), dir, number);
+
+    if(create && !segment_exists(dir, number) && create_segment(path) != 0)
+        return 1;
+
+    segment->fd = open(path, create ? O_RDWR | O_CLOEXEC : O_RDONLY | O_CLOEXEC);
+    if(segment->fd < 0)
+        goto err;
+
+    if(fstat(segment->fd, &st) != 0)
+        goto err;
+
+    // left empty by an older writer that died while creating it
+    if(create && st.st_size == 0)
+    {
+        if(ftruncate(segment->fd, SEGMENT_SIZE) != 0)
+            goto err;
+        st.st_size = SEGMENT_SIZE;
+    }
+
+    if(st.st_size < sizeof(struct pudomat_segment_header))
+    {
+        errno = EINVAL;
+        goto err;
+    }
+
+    segment->size = st.st_size;
+    segment->header = mmap(NULL, segment->size,
+                           create ? PROT_READ | PROT_WRITE : PROT_READ,
+                           MAP_SHARED, segment->fd, 0);
+    if(segment->header == MAP_FAILED)
+    {
+        segment->header = NULL;
+        goto err;
+    }
+    segment->records = (struct pudomat_record *)(segment->header + 1);
+
+    if(create && segment->header->magic == 0)
+    {
+        segment->header->version = PUDOMAT_STORE_VERSION;
+        segment->header->record_size = sizeof(struct pudomat_record);
+        segment->header->capacity = PUDOMAT_STORE_RECORDS;
+        segment->header->magic = PUDOMAT_STORE_MAGIC;
+    }
+
+    struct pudomat_segment_header *h = segment->header;
+    if(h->magic != PUDOMAT_STORE_MAGIC || h->version != PUDOMAT_STORE_VERSION ||
+       h->record_size != sizeof(struct pudomat_record) ||
+       segment->size < sizeof(*h) + (size_t)h->capacity * h->record_size)
+    {
+        fprintf(stderr, "%s: neplatny segment\n", path);
+        pudomat_segment_unmap(segment);
+        return 1;
+    }
+    return 0;
+
+err:
+    perror(path);
+    pudomat_segment_unmap(segment);
+    return 1;
+}
+
+int pudomat_store_open(struct pudomat_store *store, const char *dir)
+{
+    char path[300];
+    uint32_t count;
+
+    memset(store, 0, sizeof(*store));
+    store->segment.fd = -1;
+    if(strlen(dir) >= sizeof(store->dir))
+    {
+        fprintf(stderr, "Prilis dlouha cesta k ulozisti\n");
+        return 1;
+    }
+    strcpy(store->dir, dir);
+
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+        perror(dir);
+        return 1;
+    }
+
+    snprintf(path, sizeof(path), "%s/lock", dir);
+    store->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(store->lock_fd < 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    flock(store->lock_fd, LOCK_EX);
+    pudomat_store_segments(dir, &count);
+    int rc = map_segment(&store->segment, dir, count ? count - 1 : 0, 1);
+    flock(store->lock_fd, LOCK_UN);
+
+    if(rc != 0)
+    {
+        close(store->lock_fd);
+        store->lock_fd = -1;
+        return rc;
+    }
+
+    // history is still recorded without them, a rebuild restores them
+    store->rollups = malloc(sizeof(*store->rollups));
+    if(store->rollups && pudomat_rollups_open(store->rollups, dir, 1) != 0)
+    {
+        free(store->rollups);
+        store->rollups = NULL;
+    }
+    return 0;
+}
+
+// other writers may have filled the segment or started newer ones since
+static int next_segment(struct pudomat_store *store)
+{
+    struct pudomat_segment *segment = &store->segment;
+    uint32_t number = segment->number + 1;
+
+    while(segment_exists(store->dir, number + 1))
+        number++;
+
+    pudomat_segment_unmap(segment);
+    return map_segment(segment, store->dir, number, 1);
+}
+
+int pudomat_store_append(struct pudomat_store *store,
+                         const struct pudomat_record *records, int count)
+{
+    const struct pudomat_record *appended = records;
+    int rc = 0;
+
+    if(!store->segment.header)
+        return 1;
+
+    flock(store->lock_fd, LOCK_EX);
+
+    if(segment_exists(store->dir, store->segment.number + 1))
+        rc = next_segment(store);
+
+    while(rc == 0 && count > 0)
+    {
+        struct pudomat_segment_header *h = store->segment.header;
+        uint64_t used = h->count;
+
+        if(used == h->capacity)
+        {
+            rc = next_segment(store);
+            continue;
+        }
+
+        int n = h->capacity - used < count ? h->capacity - used : count;
+        memcpy(&store->segment.records[used], records, n * sizeof(*records));
+        if(!used)
+            h->first_time = records[0].time;
+        h->last_time = records[n - 1].time;
+        __atomic_store_n(&h->count, used + n, __ATOMIC_RELEASE);
+
+        records += n;
+        count -= n;
+    }
+
+    if(store->rollups)
+        pudomat_rollups_add(store->rollups, appended, records - appended);
+
+    flock(store->lock_fd, LOCK_UN);
+    return rc;
+}
+
+// one record per valid sensor, or a single one for a board without sensors
+int pudomat_sample_records(time_t time, const struct temp_response *temp,
+                           const struct volt_response *volt,
+                           struct pudomat_record *records)
+{
+    struct pudomat_record base = { .time = time };
+    int count = 0;
+
+    if(volt)
+    {
+        base.voltage = volt->voltage;
+        base.current = volt->current;
+        base.relay = volt->relay;
+    }
+
+    for(int i = 0; temp && i < MAX_TEMP_COUNT; i++)
+    {
+        if(!temp->data[i].valid)
+            continue;
+        records[count] = base;
+        records[count].rom = temp->data[i].id;
+        records[count].temperature = temp->data[i].temperature;
+        records[count].age = temp->data[i].age;
+        count++;
+    }
+
+    if(!count && volt)
+        records[count++] = base;
+    return count;
+}
+
+int pudomat_store_sample(struct pudomat_store *store, time_t time,
+                         const struct temp_response *temp,
+                         const struct volt_response *volt)
+{
+    struct pudomat_record records[MAX_TEMP_COUNT];
+    int count = pudomat_sample_records(time, temp, volt, records);
+
+    return count ? pudomat_store_append(store, records, count) : 0;
+}
+
+void pudomat_store_close(struct pudomat_store *store)
+{
+    if(store->rollups)
+    {
+        pudomat_rollups_close(store->rollups);
+        free(store->rollups);
+        store->rollups = NULL;
+    }
+    pudomat_segment_unmap(&store->segment);
+    if(store->lock_fd >= 0)
+        close(store->lock_fd);
+    store->lock_fd = -1;
+}
+
+int pudomat_store_segments(const char *dir, uint32_t *count)
+{
+    uint32_t n = 0;
+    while(segment_exists(dir, n))
+        n++;
+    *count = n;
+    return 0;
+}
+
+int pudomat_segment_map(struct pudomat_segment *segment, const char *dir,
+                        uint32_t number)
+{
+    return map_segment(segment, dir, number, 0);
+}
+
+// records below the returned count are complete and never change
+uint64_t pudomat_segment_count(const struct pudomat_segment *segment)
+{
+    uint64_t count = __atomic_load_n(&segment->header->count, __ATOMIC_ACQUIRE);
+    return count < segment->header->capacity ? count : segment->header->capacity;
+}
+
+void pudomat_segment_unmap(struct pudomat_segment *segment)
+{
+    if(segment->header)
+        munmap(segment->header, segment->size);
+    if(segment->fd >= 0)
+        close(segment->fd);
+    segment->header = NULL;
+    segment->records = NULL;
+    segment->fd = -1;
+}
@@ -0,0 +1,76 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include <time.h>
+#include "pudomat.h"
+
+#define PUDOMAT_STORE "/var/lib/pudomat"
+#define PUDOMAT_STORE_MAGIC 0x54535550 // "PUST"
+#define PUDOMAT_STORE_VERSION 1
+#define PUDOMAT_STORE_RECORDS 65536 // records per segment file
+
+#pragma pack(push, 1)
+
+// one sensor reading together with the voltmeter state of its board at that
+// time; boards without a sensor store rom 0
+struct pudomat_record {
+    int64_t time;
+    uint64_t rom;
+    uint16_t temperature; // raw DS18B20 value, degrees * 16
+    uint8_t age;
+    uint8_t relay;
+    uint16_t voltage;     // raw ADC values, see convert_voltage()
+    uint16_t current;
+};
+
+// count is only ever increased and is written after the records it covers
+struct pudomat_segment_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;
+    uint64_t count;
+    int64_t first_time;
+    int64_t last_time;
+    uint8_t padding[24];
+};
+
+#pragma pack(pop)
+
+struct pudomat_segment {
+    uint32_t number;
+    int fd;
+    size_t size;
+    struct pudomat_segment_header *header;
+    struct pudomat_record *records;
+};
+
+struct pudomat_rollups;
+
+struct pudomat_store {
+    char dir[256];
+    int lock_fd;
+    struct pudomat_segment segment;  // the one appended to
+    struct pudomat_rollups *rollups; // kept up to date on every append
+};
+
+int pudomat_store_open(struct pudomat_store *store, const char *dir);
+int pudomat_store_append(struct pudomat_store *store,
+                         const struct pudomat_record *records, int count);
+int pudomat_store_sample(struct pudomat_store *store, time_t time,
+                         const struct temp_response *temp,
+                         const struct volt_response *volt);
+void pudomat_store_close(struct pudomat_store *store);
+int pudomat_sample_records(time_t time, const struct temp_response *temp,
+                           const struct volt_response *volt,
+                           struct pudomat_record *records);
+
+// read side: segments are numbered from 0 without gaps
+int pudomat_store_segments(const char *dir, uint32_t *count);
+int pudomat_segment_map(struct pudomat_segment *segment, const char *dir,
+                        uint32_t number);
+uint64_t pudomat_segment_count(const struct pudomat_segment *segment);
+void pudomat_segment_unmap(struct pudomat_segment *segment);
+
+#endif
@@ -0,0 +1,197 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "aggregate.h"
+#include "import.h"
+#include "rollup.h"
+#include "store.h"
+
+// Checks of the history that need no device. A temporary store gets a few
+// samples of the daemon and then logs of older history through --import,
+// which puts that history behind them in the segments and the rollups.
+// Every read path must still find all of it, before and after a rebuild of
+// the rollups, and with rollups that started after it. Prints one line per
+// check and fails if any of them did.
+//
+//   store-check
+
+#define DAYS 3
+#define HISTORY 1735689600 // 2025-01-01 00:00 UTC, the imported logs
+#define LIVE 1790000000    // 2026-09-21, samples stored before the import
+
+static int failed;
+
+static void check(int ok, const char *name)
+{
+    printf("%s %s\n", ok ? "ok" : "FAIL", name);
+    failed |= !ok;
+}
+
+static void remove_store(const char *dir)
+{
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    char path[300];
+
+    while(d && (e = readdir(d)))
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        if(e->d_name[0] != '.')
+            unlink(path);
+    }
+    if(d)
+        closedir(d);
+    rmdir(dir);
+}
+
+static void remove_rollups(const char *dir)
+{
+    static const char *files[] = {
+        "minute.rup", "hour.rup", "hour.rqs", "day.rup", "day.rqs"
+    };
+    char path[300];
+
+    for(int i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        unlink(path);
+    }
+}
+
+// new empty rollups, as a store whose files were lost starts them
+static int drop_rollups(const char *dir)
+{
+    struct pudomat_store store;
+
+    remove_rollups(dir);
+    if(pudomat_store_open(&store, dir) != 0)
+        return 1;
+    pudomat_store_close(&store);
+    return 0;
+}
+
+static int fill(const char *dir)
+{
+    struct pudomat_store store;
+    struct pudomat_import_stats stats;
+    struct pudomat_record live[6];
+    char path[300], line[64];
+
+    if(pudomat_store_open(&store, dir) != 0)
+        return 1;
+    for(int i = 0; i < 6; i++)
+        live[i] = (struct pudomat_record){
+            .time = LIVE + i / 2 * 10, .rom = 1 + i % 2, .temperature = 25 * 16
+        };
+    pudomat_store_append(&store, live, 6);
+
+    // two sensors a minute as -t prints them, the first at 10 to 19 degrees
+    snprintf(path, sizeof(path), "%s/log.txt", dir);
+    FILE *log = fopen(path, "w");
+    if(!log)
+    {
+        perror(path);
+        pudomat_store_close(&store);
+        return 1;
+    }
+    for(int i = 0; i < DAYS * 1440; i++)
+    {
+        time_t t = HISTORY + i * 60;
+        strftime(line, sizeof(line), "%Y-%m-%d %H:%M", gmtime(&t));
+        fprintf(log, "%s %d 20\n", line, 10 + i % 10);
+    }
+    fclose(log);
+
+    int rc = pudomat_import_file(&store, path, 2, &stats);
+    check(rc == 0 && stats.records == DAYS * 1440 * 2, "import");
+    check(store.rollups && !pudomat_rollups_ordered(store.rollups),
+          "import_out_of_order");
+    pudomat_store_close(&store);
+    return rc;
+}
+
+// samples of the imported minutes from from to to, both included
+static uint32_t expected(int64_t from, int64_t to)
+{
+    from = from < HISTORY ? HISTORY : from;
+    to = to >= HISTORY + DAYS * 86400 ? HISTORY + DAYS * 86400 - 1 : to;
+    return from > to ? 0 : (to - HISTORY) / 60 - (from - HISTORY + 59) / 60 + 1;
+}
+
+static void read_back(const char *dir, const char *stage)
+{
+    // all of it, whole periods from the rollups with ragged ends, whole days
+    static const int64_t ranges[][2] = {
+        { HISTORY, HISTORY + DAYS * 86400 - 1 },
+        { HISTORY + 30, HISTORY + 86400 + 3630 },
+        { HISTORY + 86400, HISTORY + 2 * 86400 - 1 },
+    };
+    char name[64];
+
+    for(int r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++)
+    {
+        struct pudomat_aggregate aggregate;
+        struct pudomat_quantiles quantiles;
+        uint32_t count = expected(ranges[r][0], ranges[r][1]);
+
+        int rc = pudomat_store_aggregate(dir, 0, ranges[r][0], ranges[r][1], 2,
+                                         &aggregate);
+        snprintf(name, sizeof(name), "%s_aggregate_%d", stage, r);
+        check(rc == 0 && aggregate.count == 2 &&
+              aggregate.rows[0].count == count && aggregate.rows[1].count == count &&
+              aggregate.rows[0].temp_min == 10 * 16 && aggregate.rows[0].temp_max == 19 * 16 &&
+              aggregate.rows[1].temp_sum == (int64_t)count * 20 * 16, name);
+        if(rc == 0)
+            pudomat_aggregate_free(&aggregate);
+
+        rc = pudomat_store_quantiles(dir, 0, ranges[r][0], ranges[r][1], &quantiles);
+        snprintf(name, sizeof(name), "%s_quantiles_%d", stage, r);
+        check(rc == 0 && quantiles.count == 2 &&
+              quantiles.rows[0].sketch.count == count &&
+              quantiles.rows[1].sketch.count == count, name);
+        if(rc == 0)
+            pudomat_quantiles_free(&quantiles);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct pudomat_rollups rollups;
+    char dir[] = "/tmp/store-check.XXXXXX";
+
+    // the logs are read in local time
+    setenv("TZ", "UTC", 1);
+    tzset();
+    if(!mkdtemp(dir))
+    {
+        perror(dir);
+        return 1;
+    }
+
+    if(fill(dir) != 0)
+        failed = 1;
+    else
+    {
+        read_back(dir, "imported");
+        check(pudomat_rollups_rebuild(dir, 2) == 0, "rebuild");
+        check(pudomat_rollups_open(&rollups, dir, 0) == 0 &&
+              pudomat_rollups_ordered(&rollups), "rebuild_ordered");
+        pudomat_rollups_close(&rollups);
+        read_back(dir, "rebuilt");
+
+        check(drop_rollups(dir) == 0 && pudomat_rollups_open(&rollups, dir, 0) == 0 &&
+              !pudomat_rollups_complete(&rollups, dir), "incomplete");
+        pudomat_rollups_close(&rollups);
+        read_back(dir, "incomplete");
+
+        // until the next write to the store, which starts them again
+        remove_rollups(dir);
+        read_back(dir, "no_rollups");
+    }
+
+    remove_store(dir);
+    return failed;
+}
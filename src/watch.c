@@ -0,0 +1,220 @@
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include "watch.h"
+
+#define DEBOUNCE_MS 500 // counter changes this close belong to one update
+
+static volatile sig_atomic_t watch_stop;
+
+static void stop_handler(int sig) { watch_stop = 1; }
+
+static int64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+struct tracker {
+    int64_t period;       // 0 while learning
+    int64_t anchor;       // estimated time of the last update, 0 before one
+    int64_t expected;     // of the next update
+    int64_t last_poll;
+    uint8_t last_missed;
+    int misses;           // short retries since the expected update
+    int64_t precise;      // last update time known within a retry step
+    int64_t intervals[WATCH_LEARN];
+    int interval_count;
+};
+
+// the next poll after one at t that found nothing new
+static int64_t after_miss(struct tracker *tr, int64_t t)
+{
+    if(!tr->period)
+        return t + WATCH_PROBE_MS;
+    if(++tr->misses <= WATCH_RETRIES)
+        return t + WATCH_MARGIN_MS;
+    // the firmware skipped a step, e.g. for a sensor rescan
+    tr->misses = 0;
+    tr->expected += tr->period / 2;
+    return tr->expected + WATCH_MARGIN_MS;
+}
+
+// records an update seen by the poll at t, unless it is the tail of the
+// previous one
+static void update_seen(struct tracker *tr, int64_t t, struct watch_stats *stats)
+{
+    int precise = !tr->period || (tr->last_missed && t - tr->last_poll <= 2 * WATCH_MARGIN_MS);
+    int64_t seen = precise ? (tr->last_poll + t) / 2 : t - WATCH_MARGIN_MS - WATCH_NUDGE_MS;
+
+    if(tr->anchor && seen - tr->anchor < DEBOUNCE_MS)
+        return;
+
+    if(precise && tr->precise)
+    {
+        int64_t dt = seen - tr->precise;
+        if(!tr->period && tr->anchor == tr->precise)
+            tr->intervals[tr->interval_count++] = dt;
+        else if(tr->period)
+        {
+            // steps of half a period, a full one or more with rescans
+            double halves = 2.0 * dt / tr->period;
+            double steps = round(halves);
+            if(steps >= 1 && fabs(halves - steps) < 0.2)
+                tr->period += (2 * dt / steps - tr->period) / 8;
+        }
+    }
+    if(precise)
+        tr->precise = seen;
+
+    if(!tr->period && tr->interval_count == WATCH_LEARN)
+    {
+        tr->period = tr->intervals[0];
+        for(int i = 1; i < WATCH_LEARN; i++)
+            if(tr->intervals[i] < tr->period)
+                tr->period = tr->intervals[i];
+    }
+
+    if(tr->anchor)
+    {
+        stats->updates++;
+        stats->delay_ms += t - seen;
+    }
+    tr->anchor = seen;
+    tr->expected = seen + tr->period;
+    tr->misses = 0;
+}
+
+static int run(struct pudomat *pudomat, struct pudomat_request *requests, int count)
+{
+    for(int i = 0; i < count; i++)
+        requests[i].status = LIBUSB_TRANSFER_ERROR;
+    return pudomat_run(pudomat, requests, count);
+}
+
+static int read_data(struct pudomat *pudomat, struct pudomat_request *requests,
+                     int count, watch_cb callback, void *arg,
+                     struct watch_stats *stats)
+{
+    if(run(pudomat, requests, count) != 0)
+        return 1;
+    time_t now = time(NULL);
+    stats->reads += count;
+    for(int i = 0; i < count; i++)
+        callback(requests[i].command, (void *)pudomat_response(&requests[i]), now, arg);
+    return 0;
+}
+
+int watch_run(struct pudomat *pudomat, struct pudomat_device *device,
+              const enum command *commands, int count, watch_cb callback,
+              void *arg, struct watch_stats *stats)
+{
+    struct pudomat_request debug, requests[PUDOMAT_CMD_COUNT];
+    struct tracker tr = { 0 };
+    struct sigaction action = { .sa_handler = stop_handler };
+    uint32_t temp_reads = 0;
+    int initialized = 0, failures = 0, rc = 1;
+    int fd = -1;
+
+    memset(stats, 0, sizeof(*stats));
+    if(pudomat_request_init(&debug, device, CMD_DBG_READ, NULL, NULL) != 0)
+        return 1;
+    for(; initialized < count; initialized++)
+        if(pudomat_request_init(&requests[initialized], device, commands[initialized],
+                                NULL, NULL) != 0)
+            goto err;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if(fd < 0)
+    {
+        perror("timerfd");
+        goto err;
+    }
+
+    // without SA_RESTART, so that a signal ends the wait for the timer
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    int64_t start = now_ms();
+    if(run(pudomat, &debug, 1) != 0 ||
+       read_data(pudomat, requests, count, callback, arg, stats) != 0)
+        goto err;
+    temp_reads = ((const struct debug_data *)pudomat_response(&debug))->temp_reads;
+    stats->polls++;
+    tr.last_poll = start;
+    int64_t next = start + WATCH_PROBE_MS;
+
+    while(!watch_stop)
+    {
+        struct itimerspec deadline = {
+            .it_value = { .tv_sec = next / 1000, .tv_nsec = next % 1000 * 1000000 }
+        };
+        uint64_t expirations;
+
+        if(timerfd_settime(fd, TFD_TIMER_ABSTIME, &deadline, NULL) != 0)
+        {
+            perror("timerfd");
+            goto err;
+        }
+        if(read(fd, &expirations, sizeof(expirations)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("timerfd");
+            goto err;
+        }
+
+        int64_t t = now_ms();
+        stats->polls++;
+        if(run(pudomat, &debug, 1) != 0)
+        {
+            if(++failures == WATCH_FAILURES)
+                goto err;
+            next = after_miss(&tr, t);
+            tr.last_poll = t;
+            tr.last_missed = 1;
+            continue;
+        }
+        failures = 0;
+
+        uint32_t reads = ((const struct debug_data *)pudomat_response(&debug))->temp_reads;
+        int missed = reads == temp_reads;
+        if(missed)
+        {
+            stats->empty_polls++;
+            next = after_miss(&tr, t);
+        }
+        else
+        {
+            // the tail of an update still brings fresher data
+            temp_reads = reads;
+            update_seen(&tr, t, stats);
+            if(read_data(pudomat, requests, count, callback, arg, stats) != 0 &&
+               ++failures == WATCH_FAILURES)
+                goto err;
+            next = tr.period ? tr.expected + WATCH_MARGIN_MS : t + WATCH_PROBE_MS;
+        }
+        tr.last_poll = t;
+        tr.last_missed = missed;
+    }
+
+    stats->elapsed_ms = now_ms() - start;
+    stats->period_ms = tr.period;
+    // a fixed interval of twice the mean delay is as fresh on average
+    if(stats->updates && stats->delay_ms > 0)
+        stats->blind_reads = stats->elapsed_ms * stats->updates / (2 * stats->delay_ms) * count;
+    rc = 0;
+
+err:
+    if(fd >= 0)
+        close(fd);
+    pudomat_request_free(&debug);
+    for(int i = 0; i < initialized; i++)
+        pudomat_request_free(&requests[i]);
+    return rc;
+}
@@ -0,0 +1,39 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdint.h>
+#include <time.h>
+#include "pudomat.h"
+
+#define WATCH_PROBE_MS 100  // poll period while the cadence is unknown
+#define WATCH_MARGIN_MS 100 // polls aim this long after the expected update
+#define WATCH_NUDGE_MS 10   // how much earlier each hit moves the next poll
+#define WATCH_LEARN 4       // update intervals measured before locking
+#define WATCH_RETRIES 2     // short retries before skipping half a period
+#define WATCH_FAILURES 5    // failed polls in a row that end the watch
+
+typedef void (*watch_cb)(enum command command, void *data, time_t time,
+                         void *arg);
+
+struct watch_stats {
+    int64_t elapsed_ms;
+    uint64_t polls;         // debug reads, the cheap check for new data
+    uint64_t empty_polls;   // polls that found no update
+    uint64_t updates;
+    uint64_t reads;         // data reads after an update
+    int64_t delay_ms;       // summed estimated delay behind the updates
+    int64_t period_ms;      // learned update period, 0 if not locked
+    uint64_t blind_reads;   // reads of blind polling with the same mean delay
+};
+
+// The firmware refreshes its temperatures on its own clock. The watch probes
+// debug_data.temp_reads until it has seen the update period, then aims one
+// poll just after each expected update, on absolute timerfd deadlines. A
+// poll that comes too early is retried shortly, each hit moves the aim
+// slightly earlier, so the polls stay locked to the update phase. After
+// every update the commands are read and passed to the callback.
+int watch_run(struct pudomat *pudomat, struct pudomat_device *device,
+              const enum command *commands, int count, watch_cb callback,
+              void *arg, struct watch_stats *stats);
+
+#endif